@@ -0,0 +1,11 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com> */
+
+/*
+ * rseq/arch/templates/typed-reset.h
+ */
+
+#undef RSEQ_TEMPLATE_TYPED_IDENTIFIER
+#undef RSEQ_TEMPLATE_TYPED
+#undef RSEQ_TEMPLATE_TYPE_SUFFIX
+#undef RSEQ_TEMPLATE_TYPE
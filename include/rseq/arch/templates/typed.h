@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com> */
+
+/*
+ * rseq/arch/templates/typed.h
+ */
+
+#ifdef RSEQ_TEMPLATE_TYPE_U32
+# define RSEQ_TEMPLATE_TYPE		uint32_t
+# define RSEQ_TEMPLATE_TYPE_SUFFIX	__u32
+#elif defined (RSEQ_TEMPLATE_TYPE_U16)
+# define RSEQ_TEMPLATE_TYPE		uint16_t
+# define RSEQ_TEMPLATE_TYPE_SUFFIX	__u16
+#elif defined (RSEQ_TEMPLATE_TYPE_U8)
+# define RSEQ_TEMPLATE_TYPE		uint8_t
+# define RSEQ_TEMPLATE_TYPE_SUFFIX	__u8
+#else
+# error "Never use <rseq/arch/templates/typed.h> directly; include <rseq/rseq.h> instead."
+#endif
+
+/* Identifier of a helper operating on the template type. */
+#define RSEQ_TEMPLATE_TYPED(x)		RSEQ_COMBINE_TOKENS(x, RSEQ_TEMPLATE_TYPE_SUFFIX)
+
+/* Identifier of the template type, memory ordering and indexing variant. */
+#define RSEQ_TEMPLATE_TYPED_IDENTIFIER(x)	RSEQ_TEMPLATE_IDENTIFIER(RSEQ_TEMPLATE_TYPED(x))
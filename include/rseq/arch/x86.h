@@ -189,6 +189,22 @@ do {									\
 		"cmpl %[" __rseq_str(cpu_id) "], " __rseq_str(current_cpu_id) "\n\t" \
 		"jnz " __rseq_str(label) "\n\t"
 
+#ifdef RSEQ_ARCH_AMD64
+/*
+ * Load the address of the slot of the per-cpu array @base selected by
+ * @current_index with @stride into %%rbx. Jump to local label @label
+ * when the thread is not registered, as reported by a negative
+ * @current_cpu_id.
+ */
+#define RSEQ_ASM_LOAD_PERCPU_PTR(base, stride, current_cpu_id, current_index, label) \
+		RSEQ_INJECT_ASM(2)					\
+		"cmpl $0, " __rseq_str(current_cpu_id) "\n\t"		\
+		"jl " __rseq_str(label) "\n\t"				\
+		"movl " __rseq_str(current_index) ", %%ebx\n\t"		\
+		"imulq %[" __rseq_str(stride) "], %%rbx\n\t"		\
+		"addq %[" __rseq_str(base) "], %%rbx\n\t"
+#endif
+
 /* Per-cpu-id indexing. */
 
 #define RSEQ_TEMPLATE_INDEX_CPU_ID
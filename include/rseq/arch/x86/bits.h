@@ -205,6 +205,290 @@ error1:
 #endif
 }
 
+#define rseq_arch_has_load_add_store_load
+
+static inline __attribute__((always_inline))
+int RSEQ_TEMPLATE_IDENTIFIER(rseq_load_add_store_load__ptr)(intptr_t *v, intptr_t count,
+			       intptr_t *load, int cpu)
+{
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+#endif
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, RSEQ_ASM_TP_SEGMENT:RSEQ_ASM_CS_OFFSET(%[rseq_offset]))
+		RSEQ_ASM_CBNE_CPU_ID(cpu_id, RSEQ_ASM_TP_SEGMENT:RSEQ_TEMPLATE_INDEX_CPU_ID_OFFSET(%[rseq_offset]), 4f)
+		RSEQ_INJECT_ASM(3)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CBNE_CPU_ID(cpu_id, RSEQ_ASM_TP_SEGMENT:RSEQ_TEMPLATE_INDEX_CPU_ID_OFFSET(%[rseq_offset]), %l[error1])
+#endif
+		"movq %[v], %%rbx\n\t"
+		"movq %%rbx, %[load]\n\t"
+		"addq %[count], %%rbx\n\t"
+		RSEQ_INJECT_ASM(4)
+		/* final store */
+		"movq %%rbx, %[v]\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(5)
+		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [rseq_offset]		"r" ((long long int) rseq_offset),
+		  /* final store input */
+		  [v]			"m" (*v),
+		  [count]		"er" (count),
+		  [load]		"m" (*load)
+		: "memory", "cc", "rax", "rbx"
+		  RSEQ_INJECT_CLOBBER
+		: abort
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1
+#endif
+	);
+	rseq_after_asm_goto();
+	return 0;
+abort:
+	rseq_after_asm_goto();
+	RSEQ_INJECT_FAILED
+	return -1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_after_asm_goto();
+	rseq_bug("cpu_id comparison failed");
+#endif
+}
+
+#define rseq_arch_has_load_cbne_load_cbeq_store_add_load_store
+
+static inline __attribute__((always_inline))
+int RSEQ_TEMPLATE_IDENTIFIER(rseq_load_cbne_load_cbeq_store_add_load_store__ptr)(intptr_t *v, intptr_t expect,
+			       intptr_t *v2, intptr_t expectnot2, long voffp, intptr_t *load, int cpu)
+{
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[ne])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error2])
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error3])
+#endif
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, RSEQ_ASM_TP_SEGMENT:RSEQ_ASM_CS_OFFSET(%[rseq_offset]))
+		RSEQ_ASM_CBNE_CPU_ID(cpu_id, RSEQ_ASM_TP_SEGMENT:RSEQ_TEMPLATE_INDEX_CPU_ID_OFFSET(%[rseq_offset]), 4f)
+		RSEQ_INJECT_ASM(3)
+		"cmpq %[v], %[expect]\n\t"
+		"jne %l[ne]\n\t"
+		RSEQ_INJECT_ASM(4)
+		"movq %[v2], %%rbx\n\t"
+		"cmpq %%rbx, %[expectnot2]\n\t"
+		"je %l[ne]\n\t"
+		RSEQ_INJECT_ASM(5)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CBNE_CPU_ID(cpu_id, RSEQ_ASM_TP_SEGMENT:RSEQ_TEMPLATE_INDEX_CPU_ID_OFFSET(%[rseq_offset]), %l[error1])
+		"cmpq %[v], %[expect]\n\t"
+		"jne %l[error2]\n\t"
+		"movq %[v2], %%rbx\n\t"
+		"cmpq %%rbx, %[expectnot2]\n\t"
+		"je %l[error3]\n\t"
+#endif
+		"movq %%rbx, %[load]\n\t"
+		"addq %[voffp], %%rbx\n\t"
+		"movq (%%rbx), %%rbx\n\t"
+		/* final store */
+		"movq %%rbx, %[v2]\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(6)
+		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [rseq_offset]		"r" ((long long int) rseq_offset),
+		  /* cmp input */
+		  [v]			"m" (*v),
+		  [expect]		"r" (expect),
+		  /* final store input */
+		  [v2]			"m" (*v2),
+		  [expectnot2]		"r" (expectnot2),
+		  [voffp]		"er" (voffp),
+		  [load]		"m" (*load)
+		: "memory", "cc", "rax", "rbx"
+		  RSEQ_INJECT_CLOBBER
+		: abort, ne
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1, error2, error3
+#endif
+	);
+	rseq_after_asm_goto();
+	return 0;
+abort:
+	rseq_after_asm_goto();
+	RSEQ_INJECT_FAILED
+	return -1;
+ne:
+	rseq_after_asm_goto();
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_after_asm_goto();
+	rseq_bug("cpu_id comparison failed");
+error2:
+	rseq_after_asm_goto();
+	rseq_bug("1st expected value comparison failed");
+error3:
+	rseq_after_asm_goto();
+	rseq_bug("2nd expected value comparison failed");
+#endif
+}
+
+#define rseq_arch_has_percpu_stride_ops
+
+/*
+ * The rseq_percpu_*() helpers below derive the address of the per-cpu
+ * slot from the index loaded within the critical section, as @v +
+ * index * @stride. They abort if the current thread is not registered.
+ */
+static inline __attribute__((always_inline))
+int RSEQ_TEMPLATE_IDENTIFIER(rseq_percpu_load_add_store__ptr)(intptr_t *v, size_t stride, intptr_t count)
+{
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, RSEQ_ASM_TP_SEGMENT:RSEQ_ASM_CS_OFFSET(%[rseq_offset]))
+		RSEQ_ASM_LOAD_PERCPU_PTR(v, stride, RSEQ_ASM_TP_SEGMENT:RSEQ_ASM_CPU_ID_OFFSET(%[rseq_offset]), RSEQ_ASM_TP_SEGMENT:RSEQ_TEMPLATE_INDEX_CPU_ID_OFFSET(%[rseq_offset]), 4f)
+		RSEQ_INJECT_ASM(3)
+		/* final store */
+		"addq %[count], (%%rbx)\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(4)
+		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+		: /* gcc asm goto does not allow outputs */
+		: [rseq_offset]		"r" ((long long int) rseq_offset),
+		  /* final store input */
+		  [v]			"r" (v),
+		  [stride]		"r" ((uint64_t) stride),
+		  [count]		"er" (count)
+		: "memory", "cc", "rax", "rbx"
+		  RSEQ_INJECT_CLOBBER
+		: abort
+	);
+	rseq_after_asm_goto();
+	return 0;
+abort:
+	rseq_after_asm_goto();
+	RSEQ_INJECT_FAILED
+	return -1;
+}
+
+static inline __attribute__((always_inline))
+int RSEQ_TEMPLATE_IDENTIFIER(rseq_percpu_load_add_store_load__ptr)(intptr_t *v, size_t stride, intptr_t count,
+			       intptr_t *load)
+{
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, RSEQ_ASM_TP_SEGMENT:RSEQ_ASM_CS_OFFSET(%[rseq_offset]))
+		RSEQ_ASM_LOAD_PERCPU_PTR(v, stride, RSEQ_ASM_TP_SEGMENT:RSEQ_ASM_CPU_ID_OFFSET(%[rseq_offset]), RSEQ_ASM_TP_SEGMENT:RSEQ_TEMPLATE_INDEX_CPU_ID_OFFSET(%[rseq_offset]), 4f)
+		RSEQ_INJECT_ASM(3)
+		"movq (%%rbx), %%rcx\n\t"
+		"movq %%rcx, %[load]\n\t"
+		"addq %[count], %%rcx\n\t"
+		RSEQ_INJECT_ASM(4)
+		/* final store */
+		"movq %%rcx, (%%rbx)\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(5)
+		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+		: /* gcc asm goto does not allow outputs */
+		: [rseq_offset]		"r" ((long long int) rseq_offset),
+		  /* final store input */
+		  [v]			"r" (v),
+		  [stride]		"r" ((uint64_t) stride),
+		  [count]		"er" (count),
+		  [load]		"m" (*load)
+		: "memory", "cc", "rax", "rbx", "rcx"
+		  RSEQ_INJECT_CLOBBER
+		: abort
+	);
+	rseq_after_asm_goto();
+	return 0;
+abort:
+	rseq_after_asm_goto();
+	RSEQ_INJECT_FAILED
+	return -1;
+}
+
+static inline __attribute__((always_inline))
+int RSEQ_TEMPLATE_IDENTIFIER(rseq_percpu_load_cbeq_store_add_load_store__ptr)(intptr_t *v, size_t stride,
+			       intptr_t expectnot, long voffp, intptr_t *load)
+{
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[eq])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+#endif
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, RSEQ_ASM_TP_SEGMENT:RSEQ_ASM_CS_OFFSET(%[rseq_offset]))
+		RSEQ_ASM_LOAD_PERCPU_PTR(v, stride, RSEQ_ASM_TP_SEGMENT:RSEQ_ASM_CPU_ID_OFFSET(%[rseq_offset]), RSEQ_ASM_TP_SEGMENT:RSEQ_TEMPLATE_INDEX_CPU_ID_OFFSET(%[rseq_offset]), 4f)
+		RSEQ_INJECT_ASM(3)
+		"movq (%%rbx), %%rcx\n\t"
+		"cmpq %%rcx, %[expectnot]\n\t"
+		"je %l[eq]\n\t"
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		"movq (%%rbx), %%rcx\n\t"
+		"cmpq %%rcx, %[expectnot]\n\t"
+		"je %l[error1]\n\t"
+#endif
+		"movq %%rcx, %[load]\n\t"
+		"addq %[voffp], %%rcx\n\t"
+		"movq (%%rcx), %%rcx\n\t"
+		/* final store */
+		"movq %%rcx, (%%rbx)\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(5)
+		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+		: /* gcc asm goto does not allow outputs */
+		: [rseq_offset]		"r" ((long long int) rseq_offset),
+		  /* final store input */
+		  [v]			"r" (v),
+		  [stride]		"r" ((uint64_t) stride),
+		  [expectnot]		"r" (expectnot),
+		  [voffp]		"er" (voffp),
+		  [load]		"m" (*load)
+		: "memory", "cc", "rax", "rbx", "rcx"
+		  RSEQ_INJECT_CLOBBER
+		: abort, eq
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1
+#endif
+	);
+	rseq_after_asm_goto();
+	return 0;
+abort:
+	rseq_after_asm_goto();
+	RSEQ_INJECT_FAILED
+	return -1;
+eq:
+	rseq_after_asm_goto();
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_after_asm_goto();
+	rseq_bug("expected value comparison failed");
+#endif
+}
+
 #define rseq_arch_has_load_add_load_load_add_store
 
 static inline __attribute__((always_inline))
@@ -413,6 +697,102 @@ error2:
 #endif
 }
 
+#define rseq_arch_has_load_cbne_storev_store
+
+/*
+ * The speculative stores are unrolled up to RSEQ_STOREV_MAX, each
+ * loading its address and value from the struct rseq_store_pair array.
+ */
+static inline __attribute__((always_inline))
+int RSEQ_TEMPLATE_IDENTIFIER(rseq_load_cbne_storev_store__ptr)(intptr_t *v, intptr_t expect,
+				 const struct rseq_store_pair *stores, size_t nr_stores,
+				 intptr_t newv, int cpu)
+{
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[ne])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error2])
+#endif
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, RSEQ_ASM_TP_SEGMENT:RSEQ_ASM_CS_OFFSET(%[rseq_offset]))
+		RSEQ_ASM_CBNE_CPU_ID(cpu_id, RSEQ_ASM_TP_SEGMENT:RSEQ_TEMPLATE_INDEX_CPU_ID_OFFSET(%[rseq_offset]), 4f)
+		RSEQ_INJECT_ASM(3)
+		"cmpq %[v], %[expect]\n\t"
+		"jne %l[ne]\n\t"
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CBNE_CPU_ID(cpu_id, RSEQ_ASM_TP_SEGMENT:RSEQ_TEMPLATE_INDEX_CPU_ID_OFFSET(%[rseq_offset]), %l[error1])
+		"cmpq %[v], %[expect]\n\t"
+		"jne %l[error2]\n\t"
+#endif
+		/* try stores */
+		"cmpq $1, %[nr_stores]\n\t"
+		"jb 5f\n\t"
+		"movq 0(%[stores]), %%rbx\n\t"
+		"movq 8(%[stores]), %%rcx\n\t"
+		"movq %%rcx, (%%rbx)\n\t"
+		"cmpq $2, %[nr_stores]\n\t"
+		"jb 5f\n\t"
+		"movq 16(%[stores]), %%rbx\n\t"
+		"movq 24(%[stores]), %%rcx\n\t"
+		"movq %%rcx, (%%rbx)\n\t"
+		"cmpq $3, %[nr_stores]\n\t"
+		"jb 5f\n\t"
+		"movq 32(%[stores]), %%rbx\n\t"
+		"movq 40(%[stores]), %%rcx\n\t"
+		"movq %%rcx, (%%rbx)\n\t"
+		"cmpq $4, %[nr_stores]\n\t"
+		"jb 5f\n\t"
+		"movq 48(%[stores]), %%rbx\n\t"
+		"movq 56(%[stores]), %%rcx\n\t"
+		"movq %%rcx, (%%rbx)\n\t"
+		"5:\n\t"
+		RSEQ_INJECT_ASM(5)
+		/* final store */
+		"movq %[newv], %[v]\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(6)
+		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [rseq_offset]		"r" ((long long int) rseq_offset),
+		  /* try stores input */
+		  [stores]		"r" (stores),
+		  [nr_stores]		"r" ((uint64_t) nr_stores),
+		  /* final store input */
+		  [v]			"m" (*v),
+		  [expect]		"r" (expect),
+		  [newv]		"r" (newv)
+		: "memory", "cc", "rax", "rbx", "rcx"
+		  RSEQ_INJECT_CLOBBER
+		: abort, ne
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1, error2
+#endif
+	);
+	rseq_after_asm_goto();
+	return 0;
+abort:
+	rseq_after_asm_goto();
+	RSEQ_INJECT_FAILED
+	return -1;
+ne:
+	rseq_after_asm_goto();
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_after_asm_goto();
+	rseq_bug("cpu_id comparison failed");
+error2:
+	rseq_after_asm_goto();
+	rseq_bug("expected value comparison failed");
+#endif
+}
+
 static inline __attribute__((always_inline))
 int RSEQ_TEMPLATE_IDENTIFIER(rseq_load_cbne_memcpy_store__ptr)(intptr_t *v, intptr_t expect,
 				 void *dst, void *src, size_t len,
@@ -444,17 +824,46 @@ int RSEQ_TEMPLATE_IDENTIFIER(rseq_load_cbne_memcpy_store__ptr)(intptr_t *v, intp
 		"cmpq %[v], %[expect]\n\t"
 		"jne 7f\n\t"
 #endif
-		/* try memcpy */
-		"test %[len], %[len]\n\t" \
-		"je 333f\n\t" \
-		"222:\n\t" \
-		"movb (%[src]), %%al\n\t" \
-		"movb %%al, (%[dst])\n\t" \
-		"inc %[src]\n\t" \
-		"inc %[dst]\n\t" \
-		"dec %[len]\n\t" \
-		"jnz 222b\n\t" \
-		"333:\n\t" \
+		/*
+		 * try memcpy: copy 16-byte (SSE2) and 8-byte words with
+		 * unaligned accesses, and then the remaining bytes. The
+		 * registers are restored on abort, so the copy restarts from
+		 * the beginning.
+		 */
+#ifdef __SSE2__
+		"cmpq $16, %[len]\n\t"
+		"jb 221f\n\t"
+		"220:\n\t"
+		"movdqu (%[src]), %%xmm0\n\t"
+		"movdqu %%xmm0, (%[dst])\n\t"
+		"addq $16, %[src]\n\t"
+		"addq $16, %[dst]\n\t"
+		"subq $16, %[len]\n\t"
+		"cmpq $16, %[len]\n\t"
+		"jae 220b\n\t"
+		"221:\n\t"
+#endif
+		"cmpq $8, %[len]\n\t"
+		"jb 223f\n\t"
+		"222:\n\t"
+		"movq (%[src]), %%rax\n\t"
+		"movq %%rax, (%[dst])\n\t"
+		"addq $8, %[src]\n\t"
+		"addq $8, %[dst]\n\t"
+		"subq $8, %[len]\n\t"
+		"cmpq $8, %[len]\n\t"
+		"jae 222b\n\t"
+		"223:\n\t"
+		"test %[len], %[len]\n\t"
+		"je 333f\n\t"
+		"224:\n\t"
+		"movb (%[src]), %%al\n\t"
+		"movb %%al, (%[dst])\n\t"
+		"inc %[src]\n\t"
+		"inc %[dst]\n\t"
+		"dec %[len]\n\t"
+		"jnz 224b\n\t"
+		"333:\n\t"
 		RSEQ_INJECT_ASM(5)
 		/* final store */
 		"movq %[newv], %[v]\n\t"
@@ -501,6 +910,9 @@ int RSEQ_TEMPLATE_IDENTIFIER(rseq_load_cbne_memcpy_store__ptr)(intptr_t *v, intp
 		  [rseq_scratch1]	"m" (rseq_scratch[1]),
 		  [rseq_scratch2]	"m" (rseq_scratch[2])
 		: "memory", "cc", "rax"
+#ifdef __SSE2__
+		  , "xmm0"
+#endif
 		  RSEQ_INJECT_CLOBBER
 		: abort, ne
 #ifdef RSEQ_COMPARE_TWICE
@@ -529,6 +941,24 @@ error2:
 #endif /* #if (defined(RSEQ_TEMPLATE_MO_RELAXED) || defined(RSEQ_TEMPLATE_MO_RELEASE)) &&
 	(defined(RSEQ_TEMPLATE_INDEX_CPU_ID) || defined(RSEQ_TEMPLATE_INDEX_MM_CID)) */
 
+#if defined(RSEQ_TEMPLATE_INDEX_CPU_ID) || defined(RSEQ_TEMPLATE_INDEX_MM_CID)
+
+#define rseq_arch_has_typed_ops
+
+#define RSEQ_TEMPLATE_TYPE_U32
+#include "rseq/arch/x86/bits-typed.h"
+#undef RSEQ_TEMPLATE_TYPE_U32
+
+#define RSEQ_TEMPLATE_TYPE_U16
+#include "rseq/arch/x86/bits-typed.h"
+#undef RSEQ_TEMPLATE_TYPE_U16
+
+#define RSEQ_TEMPLATE_TYPE_U8
+#include "rseq/arch/x86/bits-typed.h"
+#undef RSEQ_TEMPLATE_TYPE_U8
+
+#endif
+
 #elif defined(__i386__)
 
 /*
@@ -688,6 +1118,111 @@ error2:
 #endif
 }
 
+#define rseq_arch_has_load_cbne_load_cbeq_store_add_load_store
+
+static inline __attribute__((always_inline))
+int RSEQ_TEMPLATE_IDENTIFIER(rseq_load_cbne_load_cbeq_store_add_load_store__ptr)(intptr_t *v, intptr_t expect,
+			       intptr_t *v2, intptr_t expectnot2, long voffp, intptr_t *load, int cpu)
+{
+	/*
+	 * ref_ip is used to store a reference instruction pointer
+	 * for ip-relative addressing.
+	 */
+	struct rseq_local {
+		uint32_t ref_ip;
+	} rseq_local;
+
+	RSEQ_INJECT_C(9)
+
+	/*
+	 * The pointers are loaded into %%eax from register or memory
+	 * operands, so only @cpu and rseq_offset need a register when
+	 * building without optimizations.
+	 */
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[ne])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error2])
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error3])
+#endif
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, RSEQ_ASM_TP_SEGMENT:RSEQ_ASM_CS_OFFSET(%[rseq_offset]), %[ref_ip], RSEQ_ASM_REF_LABEL)
+		RSEQ_ASM_CBNE_CPU_ID(cpu_id, RSEQ_ASM_TP_SEGMENT:RSEQ_TEMPLATE_INDEX_CPU_ID_OFFSET(%[rseq_offset]), 4f)
+		RSEQ_INJECT_ASM(3)
+		"movl %[v], %%eax\n\t"
+		"movl (%%eax), %%ebx\n\t"
+		"cmpl %[expect], %%ebx\n\t"
+		"jne %l[ne]\n\t"
+		RSEQ_INJECT_ASM(4)
+		"movl %[v2], %%eax\n\t"
+		"movl (%%eax), %%ebx\n\t"
+		"cmpl %%ebx, %[expectnot2]\n\t"
+		"je %l[ne]\n\t"
+		RSEQ_INJECT_ASM(5)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CBNE_CPU_ID(cpu_id, RSEQ_ASM_TP_SEGMENT:RSEQ_TEMPLATE_INDEX_CPU_ID_OFFSET(%[rseq_offset]), %l[error1])
+		"movl %[v], %%eax\n\t"
+		"movl (%%eax), %%ebx\n\t"
+		"cmpl %[expect], %%ebx\n\t"
+		"jne %l[error2]\n\t"
+		"movl %[v2], %%eax\n\t"
+		"movl (%%eax), %%ebx\n\t"
+		"cmpl %%ebx, %[expectnot2]\n\t"
+		"je %l[error3]\n\t"
+#endif
+		"movl %[load], %%eax\n\t"
+		"movl %%ebx, (%%eax)\n\t"
+		"addl %[voffp], %%ebx\n\t"
+		"movl (%%ebx), %%ebx\n\t"
+		/* final store */
+		"movl %[v2], %%eax\n\t"
+		"movl %%ebx, (%%eax)\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(6)
+		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [rseq_offset]		"r" (rseq_offset),
+		  /* cmp input */
+		  [v]			"rm" (v),
+		  [expect]		"rm" (expect),
+		  /* final store input */
+		  [v2]			"rm" (v2),
+		  [expectnot2]		"rm" (expectnot2),
+		  [voffp]		"irm" (voffp),
+		  [load]		"rm" (load),
+		  [ref_ip]		"m" (rseq_local.ref_ip)
+		: "memory", "cc", "eax", "ebx"
+		  RSEQ_INJECT_CLOBBER
+		: abort, ne
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1, error2, error3
+#endif
+	);
+	rseq_after_asm_goto();
+	return 0;
+abort:
+	rseq_after_asm_goto();
+	RSEQ_INJECT_FAILED
+	return -1;
+ne:
+	rseq_after_asm_goto();
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_after_asm_goto();
+	rseq_bug("cpu_id comparison failed");
+error2:
+	rseq_after_asm_goto();
+	rseq_bug("1st expected value comparison failed");
+error3:
+	rseq_after_asm_goto();
+	rseq_bug("2nd expected value comparison failed");
+#endif
+}
+
 static inline __attribute__((always_inline))
 int RSEQ_TEMPLATE_IDENTIFIER(rseq_load_add_store__ptr)(intptr_t *v, intptr_t count, int cpu)
 {
@@ -745,6 +1280,72 @@ error1:
 #endif
 }
 
+#define rseq_arch_has_load_add_store_load
+
+static inline __attribute__((always_inline))
+int RSEQ_TEMPLATE_IDENTIFIER(rseq_load_add_store_load__ptr)(intptr_t *v, intptr_t count,
+			       intptr_t *load, int cpu)
+{
+	/*
+	 * ref_ip is used to store a reference instruction pointer
+	 * for ip-relative addressing.
+	 */
+	struct rseq_local {
+		uint32_t ref_ip;
+	} rseq_local;
+
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+#endif
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, RSEQ_ASM_TP_SEGMENT:RSEQ_ASM_CS_OFFSET(%[rseq_offset]), %[ref_ip], RSEQ_ASM_REF_LABEL)
+		RSEQ_ASM_CBNE_CPU_ID(cpu_id, RSEQ_ASM_TP_SEGMENT:RSEQ_TEMPLATE_INDEX_CPU_ID_OFFSET(%[rseq_offset]), 4f)
+		RSEQ_INJECT_ASM(3)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CBNE_CPU_ID(cpu_id, RSEQ_ASM_TP_SEGMENT:RSEQ_TEMPLATE_INDEX_CPU_ID_OFFSET(%[rseq_offset]), %l[error1])
+#endif
+		/* eax is also used by the injection code: inject before loading. */
+		RSEQ_INJECT_ASM(4)
+		"movl %[v], %%eax\n\t"
+		"movl %%eax, %[load]\n\t"
+		"addl %[count], %%eax\n\t"
+		/* final store */
+		"movl %%eax, %[v]\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(5)
+		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [rseq_offset]		"r" (rseq_offset),
+		  /* final store input */
+		  [v]			"m" (*v),
+		  [count]		"im" (count),
+		  [load]		"m" (*load),
+		  [ref_ip]		"m" (rseq_local.ref_ip)
+		: "memory", "cc", "eax"
+		  RSEQ_INJECT_CLOBBER
+		: abort
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1
+#endif
+	);
+	rseq_after_asm_goto();
+	return 0;
+abort:
+	rseq_after_asm_goto();
+	RSEQ_INJECT_FAILED
+	return -1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_after_asm_goto();
+	rseq_bug("cpu_id comparison failed");
+#endif
+}
+
 static inline __attribute__((always_inline))
 int RSEQ_TEMPLATE_IDENTIFIER(rseq_load_cbne_load_cbne_store__ptr)(intptr_t *v, intptr_t expect,
 			      intptr_t *v2, intptr_t expect2,
@@ -977,15 +1578,27 @@ int RSEQ_TEMPLATE_IDENTIFIER(rseq_load_cbne_memcpy_store__ptr)(intptr_t *v, intp
 		"movl %[src], %%ecx\n\t"
 		/* load len into edx */
 		"movl %[len], %%edx\n\t"
+		/* copy 4-byte words, and then the remaining bytes */
+		"cmpl $4, %%edx\n\t"
+		"jb 223f\n\t"
+		"222:\n\t"
+		"movl (%%ecx), %%eax\n\t"
+		"movl %%eax, (%%ebx)\n\t"
+		"addl $4, %%ecx\n\t"
+		"addl $4, %%ebx\n\t"
+		"subl $4, %%edx\n\t"
+		"cmpl $4, %%edx\n\t"
+		"jae 222b\n\t"
+		"223:\n\t"
 		"test %%edx, %%edx\n\t"
 		"je 333f\n\t"
-		"222:\n\t"
+		"224:\n\t"
 		"movb (%%ecx), %%al\n\t"
 		"movb %%al, (%%ebx)\n\t"
 		"inc %%ecx\n\t"
 		"inc %%ebx\n\t"
 		"dec %%edx\n\t"
-		"jnz 222b\n\t"
+		"jnz 224b\n\t"
 		"333:\n\t"
 		RSEQ_INJECT_ASM(5)
 #ifdef RSEQ_TEMPLATE_MO_RELEASE
@@ -382,6 +382,43 @@ void __rseq_percpu *rseq_mempool_set_percpu_zmalloc(struct rseq_mempool_set *poo
 void __rseq_percpu *rseq_mempool_set_percpu_malloc_init(struct rseq_mempool_set *pool_set,
 		void *init_ptr, size_t len);
 
+/*
+ * rseq_mempool_set_percpu_realloc: Resize a per-cpu item within a pool set.
+ *
+ * Move the per-cpu item @ptr to an item of at least @len bytes
+ * allocated from @pool_set, copying the content of every CPU, and
+ * free @ptr. The content beyond the old item size is zeroed. If @ptr
+ * already belongs to the size class matching @len, it is returned
+ * unchanged. If @ptr is NULL, this is equivalent to
+ * rseq_mempool_set_percpu_zmalloc().
+ *
+ * The caller must unpublish @ptr before calling this function, so no
+ * new rseq critical section can start accessing it. In-flight rseq
+ * critical sections accessing @ptr are restarted with a membarrier
+ * MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ fence before the copy, so
+ * none of their stores to the old copy can be lost. The caller
+ * publishes the returned pointer afterwards.
+ *
+ * The @stride optional argument is a configurable stride, which must
+ * match the stride received by pool creation. If the argument is not
+ * present, use the default RSEQ_MEMPOOL_STRIDE.
+ *
+ * Returns the new "__rseq_percpu" encoded pointer on success. Returns
+ * NULL on error, in which case @ptr is left untouched, with errno set
+ * accordingly:
+ *
+ *   EINVAL: @ptr was not allocated from @pool_set.
+ *   ENOMEM: Not enough space left in the pool set.
+ *   ENOSYS: membarrier rseq fencing is not available.
+ *
+ * This API is MT-safe.
+ */
+void __rseq_percpu *librseq_mempool_set_percpu_realloc(struct rseq_mempool_set *pool_set,
+		void __rseq_percpu *ptr, size_t len, size_t stride);
+
+#define rseq_mempool_set_percpu_realloc(_pool_set, _ptr, _len, _stride...)	\
+	librseq_mempool_set_percpu_realloc(_pool_set, _ptr, _len, RSEQ_PARAM_SELECT_ARG1(_, ##_stride, RSEQ_MEMPOOL_STRIDE))
+
 /*
  * rseq_mempool_set_malloc: Allocate memory from a global pool set.
  *
@@ -475,6 +512,22 @@ int rseq_mempool_attr_set_init(struct rseq_mempool_attr *attr,
  */
 int rseq_mempool_attr_set_robust(struct rseq_mempool_attr *attr);
 
+/*
+ * rseq_mempool_attr_set_handles: Enable per-CPU indexes and handles.
+ *
+ * Allow encoding the items of the pool into 32-bit per-CPU indexes
+ * (see rseq_mempool_percpu_index()) and per-CPU handles (see
+ * rseq_mempool_percpu_handle()). The pool keeps a range table to
+ * decode them, and is assigned an id in a process-wide pool index.
+ * Pools created without this attribute have no id.
+ *
+ * At most 4095 pools with handles enabled can exist at once:
+ * rseq_mempool_create() fails with errno=ENOSPC beyond that.
+ *
+ * Returns 0 on success, -1 with errno=EINVAL if arguments are invalid.
+ */
+int rseq_mempool_attr_set_handles(struct rseq_mempool_attr *attr);
+
 /*
  * rseq_mempool_attr_set_percpu: Set pool type as percpu.
  *
@@ -558,6 +611,58 @@ enum rseq_mempool_populate_policy {
 int rseq_mempool_attr_set_populate_policy(struct rseq_mempool_attr *attr,
 		enum rseq_mempool_populate_policy policy);
 
+/*
+ * rseq_mempool_attr_set_max_bytes: Set pool memory quota.
+ *
+ * Set an upper-limit to the memory reserved by items allocated from
+ * the pool. Each allocated item reserves its item size (rounded to the
+ * next power of two) for each of the pool's max_nr_cpus. Allocations
+ * which would exceed the quota fail with errno=ENOMEM. A @max_bytes
+ * value of 0 means no limit (default).
+ *
+ * Returns 0 on success, -1 with errno=EINVAL if arguments are invalid.
+ */
+int rseq_mempool_attr_set_max_bytes(struct rseq_mempool_attr *attr,
+		size_t max_bytes);
+
+enum rseq_mempool_pressure {
+	/* Memory usage is below the high watermark (initial state). */
+	RSEQ_MEMPOOL_PRESSURE_NORMAL = 0,
+	/*
+	 * Memory usage has reached the high watermark, and has not
+	 * dropped to the low watermark since.
+	 */
+	RSEQ_MEMPOOL_PRESSURE_HIGH = 1,
+};
+
+/*
+ * rseq_mempool_attr_set_pressure: Set pool memory pressure callback.
+ *
+ * Set a @pressure_func callback invoked when the memory reserved by
+ * allocated items (as accounted for rseq_mempool_attr_set_max_bytes())
+ * crosses the pool watermarks. This allows the application to shed
+ * load or trim caches before allocations start failing.
+ *
+ * The callback is invoked with RSEQ_MEMPOOL_PRESSURE_HIGH when usage
+ * reaches @high_watermark bytes, and with RSEQ_MEMPOOL_PRESSURE_NORMAL
+ * when usage drops back to @low_watermark bytes or less. The callback
+ * receives @pressure_priv, the pool, the new pressure level, and the
+ * usage which triggered the transition.
+ *
+ * The callback is invoked from the allocating or freeing thread,
+ * outside of the pool lock, so it can allocate from and free to the
+ * pool. Transitions triggered concurrently by different threads may be
+ * reported out of order.
+ *
+ * Returns 0 on success, -1 with errno=EINVAL if arguments are invalid
+ * (NULL callback, or @low_watermark not below @high_watermark).
+ */
+int rseq_mempool_attr_set_pressure(struct rseq_mempool_attr *attr,
+		size_t low_watermark, size_t high_watermark,
+		void (*pressure_func)(void *priv, struct rseq_mempool *pool,
+			enum rseq_mempool_pressure pressure, size_t used_bytes),
+		void *pressure_priv);
+
 /*
  * rseq_mempool_range_init_numa: NUMA initialization helper for memory range.
  *
@@ -578,6 +683,157 @@ int rseq_mempool_range_init_numa(void *addr, size_t len, int cpu, int numa_flags
  */
 int rseq_mempool_get_max_nr_cpus(struct rseq_mempool *mempool);
 
+/*
+ * Compact per-CPU indexes and handles.
+ *
+ * A per-CPU index is a 32-bit number identifying an item within its
+ * pool. Structures holding many references to items of a single pool
+ * keep the pool pointer once and store rseq_percpu_index_t values,
+ * which halves their memory footprint compared to __rseq_percpu
+ * pointers on 64-bit architectures, and keeps them position
+ * independent (e.g. for shared memory layouts).
+ *
+ * A per-CPU handle combines the id of the pool with a per-CPU index,
+ * so it can be decoded without the pool as context. A handle is 64
+ * bits wide: on 64-bit architectures it is as large as a pointer and
+ * saves no memory. Only per-CPU indexes are smaller than pointers.
+ *
+ * Indexes and handles are only available for pools created with
+ * rseq_mempool_attr_set_handles(). An index value of
+ * RSEQ_PERCPU_INDEX_NULL (0) and a handle value of
+ * RSEQ_PERCPU_HANDLE_NULL (0) never refer to an item.
+ */
+typedef uint32_t rseq_percpu_index_t;
+typedef uint64_t rseq_percpu_handle_t;
+
+#define RSEQ_PERCPU_INDEX_NULL		((rseq_percpu_index_t) 0)
+#define RSEQ_PERCPU_HANDLE_NULL		((rseq_percpu_handle_t) 0)
+
+/*
+ * rseq_percpu_handle_make: Build a per-CPU handle.
+ *
+ * Build a per-CPU handle from a @pool_id returned by
+ * rseq_mempool_get_id() and an @index returned by
+ * rseq_mempool_percpu_index().
+ */
+static inline
+rseq_percpu_handle_t rseq_percpu_handle_make(uint32_t pool_id, rseq_percpu_index_t index)
+{
+	return ((rseq_percpu_handle_t) pool_id << 32) | index;
+}
+
+/*
+ * rseq_percpu_handle_pool_id: Get the pool id of a per-CPU handle.
+ */
+static inline
+uint32_t rseq_percpu_handle_pool_id(rseq_percpu_handle_t handle)
+{
+	return (uint32_t) (handle >> 32);
+}
+
+/*
+ * rseq_percpu_handle_index: Get the per-CPU index of a per-CPU handle.
+ */
+static inline
+rseq_percpu_index_t rseq_percpu_handle_index(rseq_percpu_handle_t handle)
+{
+	return (rseq_percpu_index_t) handle;
+}
+
+/*
+ * rseq_mempool_get_id: Get the id of a pool in the global pool index.
+ *
+ * Returns a pool id > 0. Returns 0, errno=EINVAL if the mempool is
+ * NULL or was created without rseq_mempool_attr_set_handles().
+ */
+uint32_t rseq_mempool_get_id(struct rseq_mempool *mempool);
+
+/*
+ * rseq_mempool_percpu_index: Get the per-CPU index of a pool item.
+ *
+ * Encode the __rseq_percpu pointer @ptr, allocated from @pool, into a
+ * 32-bit per-CPU index.
+ *
+ * Returns the index on success. Returns RSEQ_PERCPU_INDEX_NULL on
+ * error, with errno set accordingly:
+ *
+ *   EINVAL: Invalid argument, @ptr does not belong to @pool, or @pool
+ *           was created without rseq_mempool_attr_set_handles().
+ *   ERANGE: The item index does not fit in 32 bits, or the item is
+ *           in a range beyond the pool range table.
+ *
+ * This API is MT-safe.
+ */
+rseq_percpu_index_t rseq_mempool_percpu_index(struct rseq_mempool *pool,
+		void __rseq_percpu *ptr);
+
+/*
+ * rseq_mempool_index_to_percpu: Decode a per-CPU index.
+ *
+ * Returns the __rseq_percpu pointer encoded by @index within @pool.
+ * The decoding is O(1): it looks up the range in the pool range table.
+ * Returns NULL, errno=EINVAL for RSEQ_PERCPU_INDEX_NULL, or if @index
+ * does not belong to a range of @pool.
+ *
+ * This API is MT-safe.
+ */
+void __rseq_percpu *rseq_mempool_index_to_percpu(struct rseq_mempool *pool,
+		rseq_percpu_index_t index);
+
+/*
+ * rseq_mempool_index_ptr: Get the address of a per-CPU index for a given CPU.
+ *
+ * Equivalent to rseq_percpu_ptr() applied to the decoded @index for
+ * @cpu, using the stride of @pool. Returns NULL on error, like
+ * rseq_mempool_index_to_percpu().
+ *
+ * This API is MT-safe.
+ */
+void *rseq_mempool_index_ptr(struct rseq_mempool *pool, rseq_percpu_index_t index, int cpu);
+
+/*
+ * rseq_mempool_percpu_handle: Get the per-CPU handle of a pool item.
+ *
+ * Encode the __rseq_percpu pointer @ptr, allocated from @pool, into a
+ * per-CPU handle.
+ *
+ * Returns the handle on success. Returns RSEQ_PERCPU_HANDLE_NULL on
+ * error, with errno set as for rseq_mempool_percpu_index().
+ *
+ * This API is MT-safe.
+ */
+rseq_percpu_handle_t rseq_mempool_percpu_handle(struct rseq_mempool *pool,
+		void __rseq_percpu *ptr);
+
+/*
+ * rseq_percpu_handle_to_percpu: Decode a per-CPU handle.
+ *
+ * Returns the __rseq_percpu pointer encoded by @handle, or NULL for
+ * RSEQ_PERCPU_HANDLE_NULL. The decoding is O(1): it looks up the pool
+ * in the global pool index and the range in the pool range table.
+ * Returns NULL, errno=EINVAL if the pool id of @handle does not
+ * match a pool with handles enabled, or if its index is invalid.
+ *
+ * The pool associated with @handle must not be destroyed concurrently.
+ *
+ * This API is MT-safe.
+ */
+void __rseq_percpu *rseq_percpu_handle_to_percpu(rseq_percpu_handle_t handle);
+
+/*
+ * rseq_percpu_handle_ptr: Get the address of a per-CPU handle for a given CPU.
+ *
+ * Equivalent to rseq_percpu_ptr() applied to the decoded @handle for
+ * @cpu, using the stride of the pool associated with the handle.
+ * Returns NULL for RSEQ_PERCPU_HANDLE_NULL, or on error, like
+ * rseq_percpu_handle_to_percpu().
+ *
+ * The pool associated with @handle must not be destroyed concurrently.
+ *
+ * This API is MT-safe.
+ */
+void *rseq_percpu_handle_ptr(rseq_percpu_handle_t handle, int cpu);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,206 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com> */
+
+#ifndef _RSEQ_PERCPU_CACHE_H
+#define _RSEQ_PERCPU_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include <rseq/rseq.h>
+#include <rseq/mempool.h>
+
+/*
+ * rseq/percpu-cache.h: Per-CPU object caches.
+ *
+ * A per-CPU object cache keeps application objects (e.g. I/O buffers or
+ * request structures) allocated by a backing allocator for reuse. Each
+ * CPU has a magazine: a fixed-capacity stack of objects, in which
+ * objects are allocated and freed with a single rseq critical section,
+ * without atomic instructions.
+ *
+ * Behind the magazines, a shared depot protected by a mutex exchanges
+ * objects with them in batches: an empty magazine is refilled with a
+ * batch from the depot, which allocates from the backing allocator when
+ * it is empty, and a full magazine flushes a batch into the depot,
+ * which frees to the backing allocator when it is full.
+ *
+ * The magazines are allocated from a per-cpu rseq_mempool. Threads
+ * using a cache must be registered with rseq, as described at
+ * rseq_set_auto_register().
+ */
+
+/* Maximum number of objects moved between a magazine and the depot. */
+#define RSEQ_PERCPU_CACHE_BATCH_MAX	64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Magazine of a CPU: @count objects, followed by the magazine slots. */
+struct rseq_percpu_cache_cpu {
+	intptr_t count;
+};
+
+struct rseq_percpu_cache_depot {
+	pthread_mutex_t lock;
+	void **objects;
+	size_t nr_objects;
+	size_t capacity;
+};
+
+struct rseq_percpu_cache {
+	struct rseq_percpu_cache_cpu __rseq_percpu *cpus;
+	struct rseq_mempool *pool;
+	size_t capacity;		/* Capacity of a magazine. */
+	size_t batch;
+	size_t stride;			/* Stride of the pool. */
+	int max_nr_cpus;
+	struct rseq_percpu_cache_depot depot;
+	void *(*alloc_fn)(void *priv);
+	void (*free_fn)(void *object, void *priv);
+	void *priv;
+};
+
+/*
+ * rseq_percpu_cache_create: Create a per-CPU object cache.
+ *
+ * Create a cache with magazines of @capacity objects, exchanging
+ * batches of @batch objects with a depot of up to @capacity objects per
+ * possible CPU. Objects are allocated with @alloc_fn(@priv), which
+ * returns NULL on failure, and freed with @free_fn(object, @priv).
+ *
+ * Returns a pointer to the created cache, or NULL on error, with errno
+ * set to EINVAL if @batch is 0, larger than @capacity or larger than
+ * RSEQ_PERCPU_CACHE_BATCH_MAX, or if a callback is NULL, or ENOMEM if
+ * memory is not available.
+ *
+ * This API is MT-safe.
+ */
+struct rseq_percpu_cache *rseq_percpu_cache_create(size_t capacity, size_t batch,
+		void *(*alloc_fn)(void *priv),
+		void (*free_fn)(void *object, void *priv),
+		void *priv);
+
+/*
+ * rseq_percpu_cache_destroy: Destroy a per-CPU object cache.
+ *
+ * Free the objects held by the magazines and the depot with the backing
+ * allocator. No operation may be in progress on @cache.
+ *
+ * Returns 0 on success, -1 with errno set on error.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_cache_destroy(struct rseq_percpu_cache *cache);
+
+/*
+ * rseq_percpu_cache_trim: Free the objects of the depot.
+ *
+ * Free the objects held by the depot with the backing allocator. The
+ * magazines are not trimmed.
+ *
+ * This API is MT-safe.
+ */
+void rseq_percpu_cache_trim(struct rseq_percpu_cache *cache);
+
+/*
+ * rseq_percpu_cache_refill: Allocate an object when the magazine of
+ * the current CPU is empty.
+ *
+ * Used by rseq_percpu_cache_alloc(). Returns an object, or NULL with
+ * errno set to ENOMEM if the backing allocator fails.
+ *
+ * This API is MT-safe.
+ */
+void *rseq_percpu_cache_refill(struct rseq_percpu_cache *cache);
+
+/*
+ * rseq_percpu_cache_flush: Free an object when the magazine of the
+ * current CPU is full.
+ *
+ * Used by rseq_percpu_cache_free().
+ *
+ * This API is MT-safe.
+ */
+void rseq_percpu_cache_flush(struct rseq_percpu_cache *cache, void *object);
+
+static inline
+intptr_t *rseq_percpu_cache_slots(struct rseq_percpu_cache_cpu *cache_cpu)
+{
+	return (intptr_t *) (cache_cpu + 1);
+}
+
+/*
+ * rseq_percpu_cache_alloc: Allocate an object.
+ *
+ * Pop an object from the magazine of the current CPU, or refill the
+ * magazine if it is empty.
+ *
+ * Returns an object, or NULL with errno set to ENOMEM if the backing
+ * allocator fails.
+ *
+ * This API is MT-safe.
+ */
+static inline
+void *rseq_percpu_cache_alloc(struct rseq_percpu_cache *cache)
+{
+	for (;;) {
+		struct rseq_percpu_cache_cpu *cache_cpu;
+		intptr_t count, object, *slot;
+		int cpu, ret;
+
+		cpu = (int) rseq_current_cpu();
+		cache_cpu = rseq_percpu_ptr(cache->cpus, cpu);
+		count = RSEQ_READ_ONCE(cache_cpu->count);
+		if (rseq_unlikely(!count))
+			return rseq_percpu_cache_refill(cache);
+		slot = &rseq_percpu_cache_slots(cache_cpu)[count - 1];
+		object = RSEQ_READ_ONCE(*slot);
+		ret = rseq_load_cbne_load_cbne_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				&cache_cpu->count, count, slot, object, count - 1, cpu);
+		if (rseq_likely(!ret))
+			return (void *) object;
+		/* Retry if the comparison fails or rseq aborts. */
+	}
+}
+
+/*
+ * rseq_percpu_cache_free: Free an object.
+ *
+ * Push @object into the magazine of the current CPU, or flush the
+ * magazine if it is full.
+ *
+ * This API is MT-safe.
+ */
+static inline
+void rseq_percpu_cache_free(struct rseq_percpu_cache *cache, void *object)
+{
+	for (;;) {
+		struct rseq_percpu_cache_cpu *cache_cpu;
+		intptr_t count;
+		int cpu, ret;
+
+		cpu = (int) rseq_current_cpu();
+		cache_cpu = rseq_percpu_ptr(cache->cpus, cpu);
+		count = RSEQ_READ_ONCE(cache_cpu->count);
+		if (rseq_unlikely((size_t) count == cache->capacity)) {
+			rseq_percpu_cache_flush(cache, object);
+			return;
+		}
+		ret = rseq_load_cbne_store_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				&cache_cpu->count, count,
+				&rseq_percpu_cache_slots(cache_cpu)[count], (intptr_t) object,
+				count + 1, cpu);
+		if (rseq_likely(!ret))
+			return;
+		/* Retry if the comparison fails or rseq aborts. */
+	}
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RSEQ_PERCPU_CACHE_H */
@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com> */
+
+#ifndef _RSEQ_PERCPU_COUNTER_H
+#define _RSEQ_PERCPU_COUNTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <rseq/rseq.h>
+#include <rseq/mempool.h>
+
+/*
+ * rseq/percpu-counter.h: Per-CPU split counters.
+ *
+ * A counter group is a set of counters split across CPUs. The counters
+ * of a group are contiguous on each CPU, so counters updated together
+ * share cache lines, and no cache line is shared between CPUs. Adding
+ * to a counter is a single rseq critical section on the current CPU.
+ *
+ * rseq_percpu_counter_read() sums the values of all CPUs. For frequent
+ * reads, rseq_percpu_counter_read_approx() returns a sum cached for the
+ * whole group, refreshed when older than the refresh interval of the
+ * group. The caller passes the current time, so the read does not query
+ * the clock.
+ *
+ * The counters are allocated from per-cpu rseq_mempool pools. Threads
+ * updating counters must be registered with rseq, as described at
+ * rseq_set_auto_register().
+ */
+
+/* Maximum number of counters in a group. */
+#define RSEQ_PERCPU_COUNTER_GROUP_MAX		512
+
+/* Default refresh interval of the approximate sums: 10 ms. */
+#define RSEQ_PERCPU_COUNTER_REFRESH_DEFAULT_NS	10000000ULL
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rseq_percpu_counter_group {
+	intptr_t __rseq_percpu *values;
+	size_t nr_counters;
+	int max_nr_cpus;
+	uint64_t refresh_interval_ns;
+	uint64_t refresh_deadline_ns;	/* Monotonic time the cached sums go stale. */
+	intptr_t *cached;		/* Cached sums of the counters. */
+	int refreshing;			/* A reader is refreshing the cached sums. */
+};
+
+/*
+ * rseq_percpu_counter_group_create: Create a counter group.
+ *
+ * Create a group of @nr_counters counters initialized to 0, with
+ * approximate sums refreshed when older than @refresh_interval_ns
+ * nanoseconds (see RSEQ_PERCPU_COUNTER_REFRESH_DEFAULT_NS).
+ *
+ * Returns a pointer to the created group, or NULL on error, with errno
+ * set to EINVAL if @nr_counters is 0 or larger than
+ * RSEQ_PERCPU_COUNTER_GROUP_MAX, or ENOMEM if memory is not available.
+ *
+ * This API is MT-safe.
+ */
+struct rseq_percpu_counter_group *rseq_percpu_counter_group_create(size_t nr_counters,
+		uint64_t refresh_interval_ns);
+
+/*
+ * rseq_percpu_counter_group_destroy: Destroy a counter group.
+ *
+ * Returns 0 on success, -1 with errno set on error.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_counter_group_destroy(struct rseq_percpu_counter_group *group);
+
+/*
+ * rseq_percpu_counter_read: Read the exact sum of a counter.
+ *
+ * Sum the values of counter @index of @group over all CPUs. The sum
+ * is exact if no update is concurrent with the read. Its cost is
+ * linear in the number of possible CPUs.
+ *
+ * This API is MT-safe.
+ */
+intptr_t rseq_percpu_counter_read(struct rseq_percpu_counter_group *group, size_t index);
+
+/*
+ * rseq_percpu_counter_read_all: Read the exact sums of all counters.
+ *
+ * Sum the values of each counter of @group over all CPUs into @sums,
+ * an array of the number of counters of @group. Its cost is linear in
+ * the number of possible CPUs.
+ *
+ * This API is MT-safe.
+ */
+void rseq_percpu_counter_read_all(struct rseq_percpu_counter_group *group, intptr_t *sums);
+
+/*
+ * rseq_percpu_counter_read_approx: Read the approximate sum of a counter.
+ *
+ * Return the cached sum of counter @index of @group. @now_ns is the
+ * current CLOCK_MONOTONIC time in nanoseconds, which callers reading
+ * counters frequently usually have at hand. If the cached sums are
+ * older than the refresh interval of the group at @now_ns, the sums of
+ * all its counters are refreshed first, unless another reader is
+ * refreshing them. The first read always refreshes the sums.
+ *
+ * This API is MT-safe.
+ */
+intptr_t rseq_percpu_counter_read_approx(struct rseq_percpu_counter_group *group,
+		size_t index, uint64_t now_ns);
+
+/*
+ * rseq_percpu_counter_add: Add to a counter on the current CPU.
+ *
+ * Add @count to counter @index of @group.
+ *
+ * This API is MT-safe.
+ */
+static inline
+void rseq_percpu_counter_add(struct rseq_percpu_counter_group *group, size_t index,
+		intptr_t count)
+{
+#ifdef rseq_arch_has_percpu_stride_ops
+	/* The critical section derives the CPU slot from the stride. */
+	while (rseq_unlikely(rseq_percpu_load_add_store__ptr(RSEQ_MO_RELAXED,
+			RSEQ_PERCPU_CPU_ID, (intptr_t *) group->values + index,
+			RSEQ_MEMPOOL_STRIDE, count)))
+		;	/* Retry if rseq aborts. */
+#else
+	for (;;) {
+		int cpu = (int) rseq_current_cpu();
+
+		if (rseq_likely(!rseq_load_add_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				rseq_percpu_ptr(group->values, cpu) + index, count, cpu)))
+			break;
+		/* Retry if rseq aborts. */
+	}
+#endif
+}
+
+/*
+ * rseq_percpu_counter_inc: Increment a counter on the current CPU.
+ *
+ * This API is MT-safe.
+ */
+static inline
+void rseq_percpu_counter_inc(struct rseq_percpu_counter_group *group, size_t index)
+{
+	rseq_percpu_counter_add(group, index, 1);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RSEQ_PERCPU_COUNTER_H */
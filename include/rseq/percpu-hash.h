@@ -0,0 +1,201 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com> */
+
+#ifndef _RSEQ_PERCPU_HASH_H
+#define _RSEQ_PERCPU_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <rseq/rseq.h>
+#include <rseq/mempool.h>
+#include <rseq/percpu-lock.h>
+
+/*
+ * rseq/percpu-hash.h: Per-CPU sharded hash maps.
+ *
+ * A per-CPU hash map keeps one shard per CPU: a fixed-size table of
+ * buckets chaining intrusive nodes, keyed by an integer. Nodes are
+ * inserted into the shard of the current CPU, and are mostly expected
+ * to be looked up and deleted from that CPU.
+ *
+ * Each shard is protected by the mutex of its CPU in a per-CPU mutex
+ * (see rseq/percpu-lock.h). Local operations acquire the mutex of the
+ * current CPU with a rseq critical section, so they do not share any
+ * cache line with other CPUs. Remote lookups and deletes, and the
+ * global iteration, acquire the mutexes of other CPUs with membarrier
+ * rseq fences, which is much slower.
+ *
+ * The map does not manage the lifetime of its nodes: a node returned
+ * by a lookup may be concurrently deleted, so callers synchronize the
+ * lookups of a node with its reclamation, e.g. with a per-CPU reference
+ * counter (see rseq/percpu-ref.h).
+ *
+ * The shards are allocated from a per-cpu rseq_mempool. Threads using
+ * the local operations must be registered with rseq, as described at
+ * rseq_set_auto_register().
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rseq_percpu_hash_node {
+	struct rseq_percpu_hash_node *next;
+	uintptr_t key;
+};
+
+/* Shard of a CPU, followed by its buckets. */
+struct rseq_percpu_hash_shard {
+	size_t nr_nodes;
+};
+
+struct rseq_percpu_hash {
+	struct rseq_percpu_hash_shard __rseq_percpu *shards;
+	struct rseq_mempool *pool;
+	struct rseq_percpu_mutex *mutex;
+	size_t nr_buckets;		/* Power of two. */
+	size_t stride;			/* Stride of the pool. */
+	int max_nr_cpus;
+};
+
+/*
+ * rseq_percpu_hash_create: Create a per-CPU hash map.
+ *
+ * Create a map with shards of at least @nr_buckets buckets. The number
+ * of buckets is rounded up to the next power of two.
+ *
+ * Returns a pointer to the created map, or NULL on error, with errno
+ * set to EINVAL if @nr_buckets is 0 or too large, or ENOMEM if memory
+ * is not available.
+ *
+ * This API is MT-safe.
+ */
+struct rseq_percpu_hash *rseq_percpu_hash_create(size_t nr_buckets);
+
+/*
+ * rseq_percpu_hash_destroy: Destroy a per-CPU hash map.
+ *
+ * The nodes remaining in the map are not freed. No operation may be in
+ * progress on @hash.
+ *
+ * Returns 0 on success, -1 with errno set on error.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_hash_destroy(struct rseq_percpu_hash *hash);
+
+/*
+ * rseq_percpu_hash_insert: Insert a node into the shard of the current
+ * CPU.
+ *
+ * Insert @node with key @key, unless the shard of the current CPU
+ * already holds a node with that key. The shards of other CPUs are not
+ * checked.
+ *
+ * Returns the CPU number of the shard @node is inserted into, or -1
+ * with errno set to EEXIST if the key is already in that shard.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_hash_insert(struct rseq_percpu_hash *hash,
+		struct rseq_percpu_hash_node *node, uintptr_t key);
+
+/*
+ * rseq_percpu_hash_lookup: Look up a key in the shard of the current
+ * CPU.
+ *
+ * Returns the node with key @key, or NULL if the shard of the current
+ * CPU holds none. If @cpu is non-NULL, the CPU number of the shard is
+ * stored into *@cpu.
+ *
+ * This API is MT-safe.
+ */
+struct rseq_percpu_hash_node *rseq_percpu_hash_lookup(struct rseq_percpu_hash *hash,
+		uintptr_t key, int *cpu);
+
+/*
+ * rseq_percpu_hash_delete: Delete a key from the shard of the current
+ * CPU.
+ *
+ * Returns the node deleted, or NULL if the shard of the current CPU
+ * holds no node with key @key.
+ *
+ * This API is MT-safe.
+ */
+struct rseq_percpu_hash_node *rseq_percpu_hash_delete(struct rseq_percpu_hash *hash,
+		uintptr_t key);
+
+/*
+ * rseq_percpu_hash_lookup_cpu: Look up a key in the shard of a CPU.
+ *
+ * Store the node with key @key in the shard of @cpu, which can be
+ * another CPU than the current one, into *@node, or NULL if it holds
+ * none.
+ *
+ * Returns 0 on success, -1 with errno set on error: EINVAL if @cpu is
+ * out of range, ENOSYS if membarrier rseq fencing is unavailable.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_hash_lookup_cpu(struct rseq_percpu_hash *hash, int cpu,
+		uintptr_t key, struct rseq_percpu_hash_node **node);
+
+/*
+ * rseq_percpu_hash_delete_cpu: Delete a key from the shard of a CPU.
+ *
+ * Store the node deleted from the shard of @cpu, which can be another
+ * CPU than the current one, into *@node, or NULL if it holds no node
+ * with key @key.
+ *
+ * Returns 0 on success, -1 with errno set on error: EINVAL if @cpu is
+ * out of range, ENOSYS if membarrier rseq fencing is unavailable.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_hash_delete_cpu(struct rseq_percpu_hash *hash, int cpu,
+		uintptr_t key, struct rseq_percpu_hash_node **node);
+
+/*
+ * rseq_percpu_hash_lookup_global: Look up a key in all shards.
+ *
+ * Look up @key in the shard of the current CPU, then in the non-empty
+ * shards of the other CPUs. Store the first node found into *@node, or
+ * NULL if no shard holds the key. If a node is found and @cpu is
+ * non-NULL, the CPU number of its shard is stored into *@cpu.
+ *
+ * Searching a single other shard fences its CPU only. Searching
+ * several other shards locks all shards at once with
+ * rseq_percpu_mutex_lock_all(), which issues a single fence for all
+ * CPUs. Nodes inserted concurrently may or may not be found.
+ *
+ * Returns 0 on success, -1 with errno set on error: ENOSYS if
+ * membarrier rseq fencing is unavailable.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_hash_lookup_global(struct rseq_percpu_hash *hash, uintptr_t key,
+		struct rseq_percpu_hash_node **node, int *cpu);
+
+/*
+ * rseq_percpu_hash_for_each: Iterate over the nodes of all shards.
+ *
+ * Invoke @fn(@node, @cpu, @priv) for each node of each shard, with the
+ * mutex of the shard held. @fn must not operate on @hash. Iteration
+ * stops when @fn returns non-zero. Nodes inserted or deleted
+ * concurrently may or may not be visited.
+ *
+ * Returns 0 on success, -1 with errno set on error: ENOSYS if
+ * membarrier rseq fencing is unavailable.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_hash_for_each(struct rseq_percpu_hash *hash,
+		int (*fn)(struct rseq_percpu_hash_node *node, int cpu, void *priv),
+		void *priv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RSEQ_PERCPU_HASH_H */
@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com> */
+
+#ifndef _RSEQ_PERCPU_HISTOGRAM_H
+#define _RSEQ_PERCPU_HISTOGRAM_H
+
+#include <stdint.h>
+
+#include <rseq/percpu-counter.h>
+
+/*
+ * rseq/percpu-histogram.h: Per-CPU log-linear histograms.
+ *
+ * A per-CPU histogram records 64-bit values (e.g. latencies in
+ * nanoseconds) into log-linear buckets: values below
+ * RSEQ_PERCPU_HISTOGRAM_SUB_BUCKETS have a bucket each, and each
+ * following power of two range is split into
+ * RSEQ_PERCPU_HISTOGRAM_SUB_BUCKETS linear buckets, which bounds the
+ * relative error of a bucket to 1/RSEQ_PERCPU_HISTOGRAM_SUB_BUCKETS.
+ *
+ * The buckets are a per-CPU counter group: recording a value increments
+ * its bucket and adds it to the sum of the values on the current CPU,
+ * without atomic instructions. Snapshots reduce the buckets across
+ * CPUs into snapshots, which can be merged together.
+ */
+
+/* Log2 of the number of linear sub-buckets per power of two. */
+#define RSEQ_PERCPU_HISTOGRAM_SUB_BITS		3
+#define RSEQ_PERCPU_HISTOGRAM_SUB_BUCKETS	(1U << RSEQ_PERCPU_HISTOGRAM_SUB_BITS)
+
+/* Number of buckets covering all 64-bit values. */
+#define RSEQ_PERCPU_HISTOGRAM_NR_BUCKETS \
+	((64 - RSEQ_PERCPU_HISTOGRAM_SUB_BITS + 1) * RSEQ_PERCPU_HISTOGRAM_SUB_BUCKETS)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rseq_percpu_histogram {
+	/* Buckets, followed by the sum of the values. */
+	struct rseq_percpu_counter_group *group;
+};
+
+struct rseq_percpu_histogram_snapshot {
+	uint64_t buckets[RSEQ_PERCPU_HISTOGRAM_NR_BUCKETS];
+	uint64_t count;		/* Number of values. */
+	uint64_t sum;		/* Sum of the values, modulo 2^(word size). */
+};
+
+/*
+ * rseq_percpu_histogram_create: Create a per-CPU histogram.
+ *
+ * Returns a pointer to the created histogram, or NULL on error, with
+ * errno set to ENOMEM.
+ *
+ * This API is MT-safe.
+ */
+struct rseq_percpu_histogram *rseq_percpu_histogram_create(void);
+
+/*
+ * rseq_percpu_histogram_destroy: Destroy a per-CPU histogram.
+ *
+ * Returns 0 on success, -1 with errno set on error.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_histogram_destroy(struct rseq_percpu_histogram *histogram);
+
+/*
+ * rseq_percpu_histogram_read: Reduce a histogram across CPUs.
+ *
+ * Store the buckets, count and sum of the values of @histogram, summed
+ * over all CPUs, into @snapshot. The snapshot is exact if no value is
+ * recorded concurrently.
+ *
+ * This API is MT-safe.
+ */
+void rseq_percpu_histogram_read(struct rseq_percpu_histogram *histogram,
+		struct rseq_percpu_histogram_snapshot *snapshot);
+
+/*
+ * rseq_percpu_histogram_snapshot_merge: Merge snapshots.
+ *
+ * Add the values of @src into @dst.
+ *
+ * This API is MT-safe.
+ */
+void rseq_percpu_histogram_snapshot_merge(struct rseq_percpu_histogram_snapshot *dst,
+		const struct rseq_percpu_histogram_snapshot *src);
+
+/*
+ * rseq_percpu_histogram_snapshot_percentile: Value at a percentile.
+ *
+ * Returns the highest value of the bucket holding the value at
+ * @percentile (between 0 and 100) of @snapshot, or 0 if it is empty.
+ *
+ * This API is MT-safe.
+ */
+uint64_t rseq_percpu_histogram_snapshot_percentile(
+		const struct rseq_percpu_histogram_snapshot *snapshot, double percentile);
+
+/*
+ * rseq_percpu_histogram_bucket_index: Bucket of a value.
+ *
+ * This API is MT-safe.
+ */
+static inline
+unsigned int rseq_percpu_histogram_bucket_index(uint64_t value)
+{
+	unsigned int order;
+
+	if (value < RSEQ_PERCPU_HISTOGRAM_SUB_BUCKETS)
+		return (unsigned int) value;
+	order = 63 - (unsigned int) __builtin_clzll(value);
+	return (order - RSEQ_PERCPU_HISTOGRAM_SUB_BITS + 1) * RSEQ_PERCPU_HISTOGRAM_SUB_BUCKETS +
+		(unsigned int) ((value >> (order - RSEQ_PERCPU_HISTOGRAM_SUB_BITS)) &
+			(RSEQ_PERCPU_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/*
+ * rseq_percpu_histogram_bucket_lowest: Lowest value of bucket @index.
+ *
+ * This API is MT-safe.
+ */
+static inline
+uint64_t rseq_percpu_histogram_bucket_lowest(unsigned int index)
+{
+	unsigned int order;
+
+	if (index < RSEQ_PERCPU_HISTOGRAM_SUB_BUCKETS)
+		return index;
+	order = index / RSEQ_PERCPU_HISTOGRAM_SUB_BUCKETS + RSEQ_PERCPU_HISTOGRAM_SUB_BITS - 1;
+	return (uint64_t) (RSEQ_PERCPU_HISTOGRAM_SUB_BUCKETS +
+			index % RSEQ_PERCPU_HISTOGRAM_SUB_BUCKETS) <<
+		(order - RSEQ_PERCPU_HISTOGRAM_SUB_BITS);
+}
+
+/*
+ * rseq_percpu_histogram_bucket_highest: Highest value of bucket @index.
+ *
+ * This API is MT-safe.
+ */
+static inline
+uint64_t rseq_percpu_histogram_bucket_highest(unsigned int index)
+{
+	if (index == RSEQ_PERCPU_HISTOGRAM_NR_BUCKETS - 1)
+		return UINT64_MAX;
+	return rseq_percpu_histogram_bucket_lowest(index + 1) - 1;
+}
+
+/*
+ * rseq_percpu_histogram_record: Record a value on the current CPU.
+ *
+ * This API is MT-safe.
+ */
+static inline
+void rseq_percpu_histogram_record(struct rseq_percpu_histogram *histogram, uint64_t value)
+{
+	rseq_percpu_counter_inc(histogram->group, rseq_percpu_histogram_bucket_index(value));
+	rseq_percpu_counter_add(histogram->group, RSEQ_PERCPU_HISTOGRAM_NR_BUCKETS,
+			(intptr_t) value);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RSEQ_PERCPU_HISTOGRAM_H */
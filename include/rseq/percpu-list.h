@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com> */
+
+#ifndef _RSEQ_PERCPU_LIST_H
+#define _RSEQ_PERCPU_LIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <sched.h>
+
+#include <rseq/rseq.h>
+#include <rseq/mempool.h>
+
+/*
+ * rseq/percpu-list.h: Per-CPU LIFO lists.
+ *
+ * A per-CPU list keeps one LIFO list of nodes per CPU. Push and pop
+ * operate on the list of the current CPU within a rseq critical
+ * section, without atomic instructions. Nodes are embedded in the
+ * user's objects.
+ *
+ * The lists of other CPUs can be drained with
+ * rseq_percpu_list_pop_cpu() and rseq_percpu_list_pop_all(), which
+ * lock the remote list head and use a membarrier rseq fence to restart
+ * the critical sections in flight on that CPU. The local operations of
+ * that CPU spin while its list head is locked.
+ *
+ * The list heads are allocated from a per-cpu rseq_mempool. Threads
+ * using the local operations must be registered with rseq, as
+ * described at rseq_set_auto_register().
+ *
+ * Popping a node checks the lock of the list head within the critical
+ * section with rseq_load_cbne_load_cbeq_store_add_load_store__ptr(),
+ * which is only implemented on x86 (i386 and x86-64). On other
+ * architectures this header declares nothing: test
+ * rseq_arch_has_load_cbne_load_cbeq_store_add_load_store before use.
+ */
+
+#ifdef rseq_arch_has_load_cbne_load_cbeq_store_add_load_store
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rseq_percpu_list_node {
+	struct rseq_percpu_list_node *next;
+};
+
+/*
+ * List head of a CPU. @lock is non-zero while a remote operation owns
+ * @head.
+ */
+struct rseq_percpu_list_head {
+	struct rseq_percpu_list_node *head;
+	intptr_t lock;
+};
+
+struct rseq_percpu_list {
+	struct rseq_percpu_list_head __rseq_percpu *heads;
+	int max_nr_cpus;
+};
+
+/*
+ * rseq_percpu_list_create: Create a per-CPU list.
+ *
+ * Returns a pointer to the created list with all CPU lists empty.
+ * Returns NULL on error, with errno set to ENOMEM.
+ *
+ * This API is MT-safe.
+ */
+struct rseq_percpu_list *rseq_percpu_list_create(void);
+
+/*
+ * rseq_percpu_list_destroy: Destroy a per-CPU list.
+ *
+ * The nodes remaining in the list are not freed: they should be
+ * drained with rseq_percpu_list_pop_all() beforehand if needed. No
+ * operation may be in progress on @list.
+ *
+ * Returns 0 on success, -1 with errno set on error.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_list_destroy(struct rseq_percpu_list *list);
+
+/*
+ * rseq_percpu_list_pop_cpu: Pop a node from the list of a CPU.
+ *
+ * Pop the most recently pushed node of the list of @cpu, which can be
+ * another CPU than the current one, into *@node (NULL if the list is
+ * empty).
+ *
+ * Returns 0 on success, -1 with errno set on error: EINVAL if @cpu is
+ * out of range, ENOSYS if membarrier rseq fencing is unavailable.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_list_pop_cpu(struct rseq_percpu_list *list, int cpu,
+		struct rseq_percpu_list_node **node);
+
+/*
+ * rseq_percpu_list_pop_all: Detach all nodes from the list of a CPU.
+ *
+ * Detach the list of @cpu, which can be another CPU than the current
+ * one, and store its first node into *@nodes (NULL if the list is
+ * empty). The detached nodes are linked with their next pointer, in
+ * pop order.
+ *
+ * Returns 0 on success, -1 with errno set on error: EINVAL if @cpu is
+ * out of range, ENOSYS if membarrier rseq fencing is unavailable.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_list_pop_all(struct rseq_percpu_list *list, int cpu,
+		struct rseq_percpu_list_node **nodes);
+
+/*
+ * Wait for the remote operation owning the list head to complete. The
+ * owner may be preempted by the waiter on the same CPU, so yield.
+ */
+static inline
+void rseq_percpu_list_wait_unlock(struct rseq_percpu_list_head *head)
+{
+	while (RSEQ_READ_ONCE(head->lock))
+		sched_yield();
+}
+
+/*
+ * rseq_percpu_list_splice: Push a chain of nodes on the current CPU.
+ *
+ * Push the chain of nodes from @first to @last, linked with their next
+ * pointer, on the list of the current CPU. The next pointer of @last
+ * is overwritten.
+ *
+ * Returns the CPU number of the list the nodes were pushed on.
+ *
+ * This API is MT-safe.
+ */
+static inline
+int rseq_percpu_list_splice(struct rseq_percpu_list *list,
+		struct rseq_percpu_list_node *first,
+		struct rseq_percpu_list_node *last)
+{
+	for (;;) {
+		struct rseq_percpu_list_head *head;
+		intptr_t expect;
+		int ret, cpu;
+
+		cpu = (int) rseq_current_cpu();
+		head = rseq_percpu_ptr(list->heads, cpu);
+		expect = (intptr_t) RSEQ_READ_ONCE(head->head);
+		last->next = (struct rseq_percpu_list_node *) expect;
+		ret = rseq_load_cbne_load_cbne_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				(intptr_t *) &head->head, expect, &head->lock, 0,
+				(intptr_t) first, cpu);
+		if (rseq_likely(!ret))
+			return cpu;
+		if (ret > 0)
+			rseq_percpu_list_wait_unlock(head);
+		/* Retry if the comparison fails or rseq aborts. */
+	}
+}
+
+/*
+ * rseq_percpu_list_push: Push a node on the current CPU.
+ *
+ * Returns the CPU number of the list @node was pushed on.
+ *
+ * This API is MT-safe.
+ */
+static inline
+int rseq_percpu_list_push(struct rseq_percpu_list *list,
+		struct rseq_percpu_list_node *node)
+{
+	return rseq_percpu_list_splice(list, node, node);
+}
+
+/*
+ * rseq_percpu_list_pop: Pop a node from the current CPU.
+ *
+ * Returns the most recently pushed node of the list of the current
+ * CPU, or NULL if it is empty. If @cpu is non-NULL, the CPU number of
+ * that list is stored into *@cpu.
+ *
+ * This API is MT-safe.
+ */
+static inline
+struct rseq_percpu_list_node *rseq_percpu_list_pop(struct rseq_percpu_list *list,
+		int *cpu)
+{
+	for (;;) {
+		struct rseq_percpu_list_head *head;
+		struct rseq_percpu_list_node *node;
+		int ret, _cpu;
+
+		_cpu = (int) rseq_current_cpu();
+		head = rseq_percpu_ptr(list->heads, _cpu);
+		ret = rseq_load_cbne_load_cbeq_store_add_load_store__ptr(RSEQ_MO_RELAXED,
+				RSEQ_PERCPU_CPU_ID, &head->lock, 0,
+				(intptr_t *) &head->head, (intptr_t) NULL,
+				offsetof(struct rseq_percpu_list_node, next),
+				(intptr_t *) &node, _cpu);
+		if (rseq_likely(!ret)) {
+			if (cpu)
+				*cpu = _cpu;
+			return node;
+		}
+		if (ret > 0) {
+			if (RSEQ_READ_ONCE(head->lock))
+				rseq_percpu_list_wait_unlock(head);
+			else if (!RSEQ_READ_ONCE(head->head))
+				return NULL;
+		}
+		/* Retry if the list head was locked or rseq aborts. */
+	}
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* rseq_arch_has_load_cbne_load_cbeq_store_add_load_store */
+
+#endif /* _RSEQ_PERCPU_LIST_H */
@@ -0,0 +1,345 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com> */
+
+#ifndef _RSEQ_PERCPU_LOCK_H
+#define _RSEQ_PERCPU_LOCK_H
+
+#include <stdint.h>
+
+#include <rseq/rseq.h>
+#include <rseq/mempool.h>
+
+/*
+ * rseq/percpu-lock.h: Per-CPU mutexes and big reader locks.
+ *
+ * A per-CPU mutex is a set of mutexes, one per CPU. The mutex of the
+ * current CPU is acquired with a rseq critical section, without atomic
+ * instructions, which keeps its cache line local to that CPU. Contended
+ * lock operations spin for a short while, then sleep on a futex.
+ *
+ * The mutex of another CPU can be acquired with
+ * rseq_percpu_mutex_lock_cpu(), which claims it and uses a membarrier
+ * rseq fence to restart the critical sections in flight on that CPU.
+ *
+ * A big reader lock counts its readers per CPU: a reader increments the
+ * count of its current CPU with a rseq critical section which fails
+ * while a writer holds the lock, so readers on the same CPU do not
+ * exclude each other. A writer sets the writer flag, restarts the
+ * critical sections in flight with a membarrier rseq fence, and waits
+ * for the readers of each CPU to leave. It suits read-mostly data:
+ * readers on different CPUs only share the read-only writer flag.
+ *
+ * The mutexes and reader counts are allocated from per-cpu rseq_mempool.
+ * Threads using the local operations must be registered with rseq, as
+ * described at rseq_set_auto_register().
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Mutex of a CPU. @owner is 1 while the mutex is held. @remote is 1
+ * while a remote lock operation claims the mutex: local lock operations
+ * fail their critical section until it is cleared. @nr_waiters counts
+ * the threads sleeping on @owner.
+ */
+struct rseq_percpu_mutex_cpu {
+	intptr_t owner;
+	intptr_t remote;
+	int32_t nr_waiters;
+};
+
+struct rseq_percpu_mutex {
+	struct rseq_percpu_mutex_cpu __rseq_percpu *cpus;
+	int max_nr_cpus;
+};
+
+/*
+ * Reader counts of a CPU. @nr_locks is incremented by the read lock
+ * operations on that CPU, @nr_unlocks by the read unlock operations,
+ * which may run on another CPU. Their difference is the number of
+ * readers holding the lock which locked it on that CPU.
+ */
+struct rseq_percpu_brlock_cpu {
+	intptr_t nr_locks;
+	intptr_t nr_unlocks;
+};
+
+/*
+ * @writer is 1 while a writer holds or acquires the lock: read lock
+ * operations fail their critical section until it is cleared.
+ * @nr_waiters counts the threads sleeping on @writer.
+ */
+struct rseq_percpu_brlock {
+	struct rseq_percpu_brlock_cpu __rseq_percpu *cpus;
+	intptr_t writer;
+	int32_t nr_waiters;
+	int max_nr_cpus;
+};
+
+/*
+ * rseq_percpu_mutex_create: Create a per-CPU mutex.
+ *
+ * Returns a pointer to the created per-CPU mutex with all mutexes
+ * unlocked. Returns NULL on error, with errno set to ENOMEM.
+ *
+ * This API is MT-safe.
+ */
+struct rseq_percpu_mutex *rseq_percpu_mutex_create(void);
+
+/*
+ * rseq_percpu_mutex_destroy: Destroy a per-CPU mutex.
+ *
+ * No mutex of @mutex may be held.
+ *
+ * Returns 0 on success, -1 with errno set on error.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_mutex_destroy(struct rseq_percpu_mutex *mutex);
+
+/*
+ * rseq_percpu_mutex_wait: Wait for the mutex of @cpu to be released.
+ *
+ * Spin for a short while, then sleep until the mutex of @cpu is
+ * unlocked. Used by the lock operations on contention.
+ *
+ * This API is MT-safe.
+ */
+void rseq_percpu_mutex_wait(struct rseq_percpu_mutex *mutex, int cpu);
+
+/*
+ * rseq_percpu_mutex_wake: Wake up the waiters of the mutex of @cpu.
+ *
+ * Used by the unlock operation when the mutex has waiters.
+ *
+ * This API is MT-safe.
+ */
+void rseq_percpu_mutex_wake(struct rseq_percpu_mutex *mutex, int cpu);
+
+/*
+ * rseq_percpu_mutex_lock_cpu: Lock the mutex of a CPU.
+ *
+ * Lock the mutex of @cpu, which can be another CPU than the current
+ * one. Release it with rseq_percpu_mutex_unlock().
+ *
+ * Returns 0 on success, -1 with errno set on error: EINVAL if @cpu is
+ * out of range, ENOSYS if membarrier rseq fencing is unavailable.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_mutex_lock_cpu(struct rseq_percpu_mutex *mutex, int cpu);
+
+/*
+ * rseq_percpu_mutex_lock_all: Lock the mutexes of all CPUs.
+ *
+ * Lock the mutexes of all CPUs in increasing CPU number order, with a
+ * single membarrier rseq fence. Release them with
+ * rseq_percpu_mutex_unlock_all().
+ *
+ * Returns 0 on success, -1 with errno set on error: ENOSYS if
+ * membarrier rseq fencing is unavailable.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_mutex_lock_all(struct rseq_percpu_mutex *mutex);
+
+/*
+ * rseq_percpu_mutex_unlock_all: Unlock the mutexes of all CPUs.
+ *
+ * This API is MT-safe.
+ */
+void rseq_percpu_mutex_unlock_all(struct rseq_percpu_mutex *mutex);
+
+/*
+ * rseq_percpu_mutex_lock: Lock the mutex of the current CPU.
+ *
+ * Returns the CPU number of the mutex acquired, which must be passed
+ * to rseq_percpu_mutex_unlock().
+ *
+ * This API is MT-safe.
+ */
+static inline
+int rseq_percpu_mutex_lock(struct rseq_percpu_mutex *mutex)
+{
+	int cpu;
+
+	for (;;) {
+		struct rseq_percpu_mutex_cpu *mutex_cpu;
+		int ret;
+
+		cpu = (int) rseq_current_cpu();
+		mutex_cpu = rseq_percpu_ptr(mutex->cpus, cpu);
+		ret = rseq_load_cbne_load_cbne_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				&mutex_cpu->owner, 0, &mutex_cpu->remote, 0, 1, cpu);
+		if (rseq_likely(!ret))
+			break;
+		if (ret > 0)
+			rseq_percpu_mutex_wait(mutex, cpu);
+		/* Retry if the mutex was held or rseq aborts. */
+	}
+	/*
+	 * Acquire semantic when taking lock after control dependency.
+	 * Matches the release of rseq_percpu_mutex_unlock().
+	 */
+	rseq_smp_acquire__after_ctrl_dep();
+	return cpu;
+}
+
+/*
+ * rseq_percpu_mutex_unlock: Unlock the mutex of a CPU.
+ *
+ * Unlock the mutex of @cpu, as returned by rseq_percpu_mutex_lock() or
+ * passed to rseq_percpu_mutex_lock_cpu(). The thread may have migrated
+ * to another CPU in between.
+ *
+ * This API is MT-safe.
+ */
+static inline
+void rseq_percpu_mutex_unlock(struct rseq_percpu_mutex *mutex, int cpu)
+{
+	struct rseq_percpu_mutex_cpu *mutex_cpu = rseq_percpu_ptr(mutex->cpus, cpu);
+
+	__atomic_store_n(&mutex_cpu->owner, 0, __ATOMIC_RELEASE);
+	/* Order the release before loading the number of waiters. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (rseq_unlikely(__atomic_load_n(&mutex_cpu->nr_waiters, __ATOMIC_RELAXED)))
+		rseq_percpu_mutex_wake(mutex, cpu);
+}
+
+/*
+ * rseq_percpu_brlock_create: Create a big reader lock.
+ *
+ * Returns 0 on success, -1 with errno set to ENOMEM on error.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_brlock_create(struct rseq_percpu_brlock *brlock);
+
+/*
+ * rseq_percpu_brlock_destroy: Destroy a big reader lock.
+ *
+ * @brlock may not be held.
+ *
+ * Returns 0 on success, -1 with errno set on error.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_brlock_destroy(struct rseq_percpu_brlock *brlock);
+
+/*
+ * rseq_percpu_brlock_read_wait: Wait for the writer of a big reader
+ * lock to release it.
+ *
+ * Spin for a short while, then sleep until the writer unlocks
+ * @brlock. Used by the read lock operation on contention.
+ *
+ * This API is MT-safe.
+ */
+void rseq_percpu_brlock_read_wait(struct rseq_percpu_brlock *brlock);
+
+/*
+ * rseq_percpu_brlock_write_wake: Wake up the readers waiting for the
+ * writer of a big reader lock.
+ *
+ * Used by the write unlock operation when the lock has waiters.
+ *
+ * This API is MT-safe.
+ */
+void rseq_percpu_brlock_write_wake(struct rseq_percpu_brlock *brlock);
+
+/*
+ * rseq_percpu_brlock_read_lock: Lock a big reader lock for reading.
+ *
+ * Readers do not exclude each other, including on the same CPU.
+ *
+ * Returns the CPU number to pass to rseq_percpu_brlock_read_unlock().
+ *
+ * This API is MT-safe.
+ */
+static inline
+int rseq_percpu_brlock_read_lock(struct rseq_percpu_brlock *brlock)
+{
+	int cpu;
+
+	for (;;) {
+		struct rseq_percpu_brlock_cpu *brlock_cpu;
+		intptr_t nr_locks;
+		int ret;
+
+		cpu = (int) rseq_current_cpu();
+		brlock_cpu = rseq_percpu_ptr(brlock->cpus, cpu);
+		nr_locks = RSEQ_READ_ONCE(brlock_cpu->nr_locks);
+		ret = rseq_load_cbne_load_cbne_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				&brlock_cpu->nr_locks, nr_locks, &brlock->writer, 0,
+				(intptr_t) ((uintptr_t) nr_locks + 1), cpu);
+		if (rseq_likely(!ret))
+			break;
+		if (ret > 0 && RSEQ_READ_ONCE(brlock->writer))
+			rseq_percpu_brlock_read_wait(brlock);
+		/*
+		 * Retry if a writer held the lock, another reader of this
+		 * CPU changed the count, or rseq aborts.
+		 */
+	}
+	/*
+	 * Acquire semantic when taking lock after control dependency.
+	 * Matches the release of rseq_percpu_brlock_write_unlock().
+	 */
+	rseq_smp_acquire__after_ctrl_dep();
+	return cpu;
+}
+
+/*
+ * rseq_percpu_brlock_read_unlock: Unlock a big reader lock locked for
+ * reading on @cpu.
+ *
+ * The thread may have migrated to another CPU since
+ * rseq_percpu_brlock_read_lock() returned @cpu.
+ *
+ * This API is MT-safe.
+ */
+static inline
+void rseq_percpu_brlock_read_unlock(struct rseq_percpu_brlock *brlock, int cpu)
+{
+	struct rseq_percpu_brlock_cpu *brlock_cpu = rseq_percpu_ptr(brlock->cpus, cpu);
+
+	/* Matches the acquire of rseq_percpu_brlock_write_lock(). */
+	__atomic_add_fetch(&brlock_cpu->nr_unlocks, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * rseq_percpu_brlock_write_lock: Lock a big reader lock for writing.
+ *
+ * Wait for the other writers and for the readers of all CPUs to
+ * release the lock.
+ *
+ * Returns 0 on success, -1 with errno set on error: ENOSYS if
+ * membarrier rseq fencing is unavailable.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_brlock_write_lock(struct rseq_percpu_brlock *brlock);
+
+/*
+ * rseq_percpu_brlock_write_unlock: Unlock a big reader lock locked for
+ * writing.
+ *
+ * This API is MT-safe.
+ */
+static inline
+void rseq_percpu_brlock_write_unlock(struct rseq_percpu_brlock *brlock)
+{
+	__atomic_store_n(&brlock->writer, 0, __ATOMIC_RELEASE);
+	/* Order the release before loading the number of waiters. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (rseq_unlikely(__atomic_load_n(&brlock->nr_waiters, __ATOMIC_RELAXED)))
+		rseq_percpu_brlock_write_wake(brlock);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RSEQ_PERCPU_LOCK_H */
@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com> */
+
+#ifndef _RSEQ_PERCPU_REF_H
+#define _RSEQ_PERCPU_REF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <rseq/rseq.h>
+#include <rseq/mempool.h>
+
+/*
+ * rseq/percpu-ref.h: Per-CPU reference counters.
+ *
+ * A per-CPU reference counter starts in per-CPU mode: getting and
+ * putting a reference updates the count of the current CPU with a rseq
+ * critical section, so the reference count does not bounce between
+ * CPUs. The reference held by the creator keeps the count from reaching
+ * zero.
+ *
+ * Killing the reference counter switches it to atomic mode: a
+ * membarrier rseq fence on all CPUs ensures no per-CPU update is in
+ * flight, the per-CPU counts are summed into a single atomic count, and
+ * the initial reference is put. The release callback is invoked by the
+ * put bringing the count to zero.
+ *
+ * If rseq fences are unavailable (see rseq_fence_available()), the
+ * reference counter starts in atomic mode.
+ *
+ * The per-CPU counts are allocated from a per-cpu rseq_mempool. Threads
+ * getting or putting references must be registered with rseq, as
+ * described at rseq_set_auto_register().
+ */
+
+enum rseq_percpu_ref_mode {
+	RSEQ_PERCPU_REF_PERCPU = 0,
+	RSEQ_PERCPU_REF_ATOMIC = 1,
+	RSEQ_PERCPU_REF_DEAD = 2,	/* Atomic mode, after kill. */
+};
+
+/*
+ * Bias of the atomic count in per-CPU mode, so puts on the atomic count
+ * racing with the switch to atomic mode cannot bring it to zero before
+ * the per-CPU counts are summed into it.
+ */
+#define RSEQ_PERCPU_REF_BIAS	((intptr_t) 1 << (sizeof(intptr_t) * 8 - 2))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rseq_percpu_ref {
+	intptr_t __rseq_percpu *counts;
+	intptr_t count;			/* Atomic count. */
+	intptr_t mode;			/* enum rseq_percpu_ref_mode. */
+	void (*release)(struct rseq_percpu_ref *ref);
+	int max_nr_cpus;
+};
+
+/*
+ * rseq_percpu_ref_init: Initialize a per-CPU reference counter.
+ *
+ * Initialize @ref with a count of 1. @release is invoked when the count
+ * reaches zero after rseq_percpu_ref_kill().
+ *
+ * Returns 0 on success, -1 with errno set to ENOMEM on error.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_ref_init(struct rseq_percpu_ref *ref,
+		void (*release)(struct rseq_percpu_ref *ref));
+
+/*
+ * rseq_percpu_ref_exit: Free the per-CPU counts of a reference counter.
+ *
+ * May be called from the release callback.
+ *
+ * Returns 0 on success, -1 with errno set on error.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_ref_exit(struct rseq_percpu_ref *ref);
+
+/*
+ * rseq_percpu_ref_kill: Switch to atomic mode and put the initial
+ * reference.
+ *
+ * The release callback is invoked when the last reference is put,
+ * which may be by this call.
+ *
+ * Returns 0 on success, -1 with errno set on error: EINVAL if @ref is
+ * already killed, ENOSYS if rseq fences are unavailable.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_ref_kill(struct rseq_percpu_ref *ref);
+
+/*
+ * Add @count to the count of the current CPU if @ref is in per-CPU
+ * mode. Returns true on success, false if @ref is in atomic mode.
+ */
+static inline
+bool rseq_percpu_ref_add_percpu(struct rseq_percpu_ref *ref, intptr_t count)
+{
+	for (;;) {
+		intptr_t *cpu_count, old;
+		int cpu, ret;
+
+		if (RSEQ_READ_ONCE(ref->mode) != RSEQ_PERCPU_REF_PERCPU)
+			return false;
+		cpu = (int) rseq_current_cpu();
+		cpu_count = rseq_percpu_ptr(ref->counts, cpu);
+		old = RSEQ_READ_ONCE(*cpu_count);
+		/* Fails if the mode changes before the commit. */
+		ret = rseq_load_cbne_load_cbne_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				cpu_count, old, &ref->mode, RSEQ_PERCPU_REF_PERCPU,
+				old + count, cpu);
+		if (rseq_likely(!ret))
+			return true;
+		/* Retry if the comparison fails or rseq aborts. */
+	}
+}
+
+/*
+ * rseq_percpu_ref_get: Get a reference.
+ *
+ * This API is MT-safe.
+ */
+static inline
+void rseq_percpu_ref_get(struct rseq_percpu_ref *ref)
+{
+	if (rseq_likely(rseq_percpu_ref_add_percpu(ref, 1)))
+		return;
+	__atomic_add_fetch(&ref->count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * rseq_percpu_ref_tryget: Get a reference unless the count is zero.
+ *
+ * Returns true if a reference was taken, false if the count reached
+ * zero.
+ *
+ * This API is MT-safe.
+ */
+static inline
+bool rseq_percpu_ref_tryget(struct rseq_percpu_ref *ref)
+{
+	intptr_t old;
+
+	if (rseq_likely(rseq_percpu_ref_add_percpu(ref, 1)))
+		return true;
+	old = __atomic_load_n(&ref->count, __ATOMIC_RELAXED);
+	do {
+		if (!old)
+			return false;
+	} while (!__atomic_compare_exchange_n(&ref->count, &old, old + 1, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return true;
+}
+
+/*
+ * rseq_percpu_ref_put: Put a reference.
+ *
+ * Invoke the release callback of @ref if this puts the last reference.
+ *
+ * This API is MT-safe.
+ */
+static inline
+void rseq_percpu_ref_put(struct rseq_percpu_ref *ref)
+{
+	if (rseq_likely(rseq_percpu_ref_add_percpu(ref, -1)))
+		return;
+	if (__atomic_sub_fetch(&ref->count, 1, __ATOMIC_ACQ_REL) == 0)
+		ref->release(ref);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RSEQ_PERCPU_REF_H */
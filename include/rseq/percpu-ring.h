@@ -0,0 +1,247 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com> */
+
+#ifndef _RSEQ_PERCPU_RING_H
+#define _RSEQ_PERCPU_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/types.h>
+
+#include <rseq/rseq.h>
+#include <rseq/mempool.h>
+
+/*
+ * rseq/percpu-ring.h: Per-CPU bounded FIFO rings.
+ *
+ * A per-CPU ring keeps one bounded FIFO ring of fixed-size entries per
+ * CPU. Enqueue and dequeue operate on the ring of the current CPU: a
+ * batch of entries is copied into the ring and published by a single
+ * rseq critical section (two if the batch wraps around the end of the
+ * ring), without atomic instructions.
+ *
+ * The rings of other CPUs can be drained by an external consumer with
+ * rseq_percpu_ring_drain_cpu(), which locks the dequeue side of the
+ * remote ring and uses a membarrier rseq fence to restart the critical
+ * sections in flight on that CPU. Dequeue operations on that CPU spin
+ * while its ring is locked, enqueue operations are not blocked.
+ *
+ * The rings are allocated from a per-cpu rseq_mempool. Threads using the
+ * local operations must be registered with rseq, as described at
+ * rseq_set_auto_register().
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Ring of a CPU, followed by its entries. @head and @tail are free
+ * running entry counts. @lock is non-zero while a remote consumer owns
+ * the dequeue side.
+ */
+struct rseq_percpu_ring_cpu {
+	intptr_t head;
+	intptr_t lock;
+	intptr_t tail;
+};
+
+struct rseq_percpu_ring {
+	struct rseq_percpu_ring_cpu __rseq_percpu *cpus;
+	struct rseq_mempool *pool;
+	size_t entry_size;
+	size_t capacity;		/* Power of two. */
+	size_t stride;			/* Stride of the pool. */
+	int max_nr_cpus;
+};
+
+/*
+ * rseq_percpu_ring_create: Create a per-CPU ring.
+ *
+ * Create a ring of at least @capacity entries of @entry_size bytes for
+ * each possible CPU. The capacity is rounded up to the next power of
+ * two.
+ *
+ * Returns a pointer to the created ring, or NULL on error, with errno
+ * set to EINVAL if @entry_size or @capacity is 0 or too large, or
+ * ENOMEM if memory is not available.
+ *
+ * This API is MT-safe.
+ */
+struct rseq_percpu_ring *rseq_percpu_ring_create(size_t entry_size, size_t capacity);
+
+/*
+ * rseq_percpu_ring_destroy: Destroy a per-CPU ring.
+ *
+ * The entries remaining in the rings are discarded. No operation may
+ * be in progress on @ring.
+ *
+ * Returns 0 on success, -1 with errno set on error.
+ *
+ * This API is MT-safe.
+ */
+int rseq_percpu_ring_destroy(struct rseq_percpu_ring *ring);
+
+/*
+ * rseq_percpu_ring_drain_cpu: Dequeue entries from the ring of a CPU.
+ *
+ * Dequeue up to @nr of the oldest entries of the ring of @cpu, which
+ * can be another CPU than the current one, into @entries.
+ *
+ * Returns the number of entries dequeued, or -1 with errno set on
+ * error: EINVAL if @cpu is out of range, ENOSYS if membarrier rseq
+ * fencing is unavailable.
+ *
+ * This API is MT-safe.
+ */
+ssize_t rseq_percpu_ring_drain_cpu(struct rseq_percpu_ring *ring, int cpu,
+		void *entries, size_t nr);
+
+static inline
+struct rseq_percpu_ring_cpu *rseq_percpu_ring_cpu_ptr(struct rseq_percpu_ring *ring, int cpu)
+{
+	return rseq_percpu_ptr(ring->cpus, cpu);
+}
+
+static inline
+void *rseq_percpu_ring_entry(struct rseq_percpu_ring *ring,
+		struct rseq_percpu_ring_cpu *cpu_ring, uintptr_t index)
+{
+	return (char *) (cpu_ring + 1) + (index & (ring->capacity - 1)) * ring->entry_size;
+}
+
+/*
+ * rseq_percpu_ring_enqueue: Enqueue entries on the current CPU.
+ *
+ * Copy up to @nr entries from @entries at the tail of the ring of the
+ * current CPU, stopping when it is full. If the batch wraps around the
+ * end of the ring, it is published in two steps, which may happen on
+ * different CPUs if the thread migrates in between. If @cpu is
+ * non-NULL, the CPU number of the ring the last entry was enqueued on
+ * is stored into *@cpu.
+ *
+ * Returns the number of entries enqueued.
+ *
+ * This API is MT-safe.
+ */
+static inline
+size_t rseq_percpu_ring_enqueue(struct rseq_percpu_ring *ring,
+		const void *entries, size_t nr, int *cpu)
+{
+	const char *src = (const char *) entries;
+	size_t done = 0;
+
+	while (done < nr) {
+		struct rseq_percpu_ring_cpu *cpu_ring;
+		uintptr_t head, tail;
+		size_t n;
+		int ret, _cpu;
+
+		_cpu = (int) rseq_current_cpu();
+		cpu_ring = rseq_percpu_ring_cpu_ptr(ring, _cpu);
+		tail = (uintptr_t) RSEQ_READ_ONCE(cpu_ring->tail);
+		/* Pairs with the release of the slots by the consumers. */
+		head = (uintptr_t) rseq_smp_load_acquire(&cpu_ring->head);
+		/* The head moved past the tail: the tail is stale. */
+		if ((size_t) (tail - head) > ring->capacity)
+			continue;
+		n = ring->capacity - (size_t) (tail - head);
+		if (!n)
+			break;
+		if (n > nr - done)
+			n = nr - done;
+		if (n > ring->capacity - (tail & (ring->capacity - 1)))
+			n = ring->capacity - (tail & (ring->capacity - 1));
+		ret = rseq_load_cbne_memcpy_store__ptr(RSEQ_MO_RELEASE, RSEQ_PERCPU_CPU_ID,
+				&cpu_ring->tail, (intptr_t) tail,
+				rseq_percpu_ring_entry(ring, cpu_ring, tail),
+				(void *) (src + done * ring->entry_size),
+				n * ring->entry_size, (intptr_t) (tail + n), _cpu);
+		if (rseq_likely(!ret)) {
+			done += n;
+			if (cpu)
+				*cpu = _cpu;
+		}
+		/* Retry if the comparison fails or rseq aborts. */
+	}
+	return done;
+}
+
+/*
+ * Wait for the remote consumer owning the ring to complete. The owner
+ * may be preempted by the waiter on the same CPU, so yield.
+ */
+static inline
+void rseq_percpu_ring_wait_unlock(struct rseq_percpu_ring_cpu *cpu_ring)
+{
+	while (RSEQ_READ_ONCE(cpu_ring->lock))
+		sched_yield();
+}
+
+/*
+ * rseq_percpu_ring_dequeue: Dequeue entries from the current CPU.
+ *
+ * Copy up to @nr of the oldest entries of the ring of the current CPU
+ * into @entries, stopping when it is empty. If @cpu is non-NULL, the
+ * CPU number of the ring the last entry was dequeued from is stored
+ * into *@cpu.
+ *
+ * Returns the number of entries dequeued.
+ *
+ * This API is MT-safe.
+ */
+static inline
+size_t rseq_percpu_ring_dequeue(struct rseq_percpu_ring *ring,
+		void *entries, size_t nr, int *cpu)
+{
+	char *dst = (char *) entries;
+	size_t done = 0;
+
+	while (done < nr) {
+		struct rseq_percpu_ring_cpu *cpu_ring;
+		uintptr_t head, tail;
+		size_t n;
+		int ret, _cpu;
+
+		_cpu = (int) rseq_current_cpu();
+		cpu_ring = rseq_percpu_ring_cpu_ptr(ring, _cpu);
+		head = (uintptr_t) RSEQ_READ_ONCE(cpu_ring->head);
+		/* Pairs with the release of the entries by the producers. */
+		tail = (uintptr_t) rseq_smp_load_acquire(&cpu_ring->tail);
+		n = (size_t) (tail - head);
+		if (!n)
+			break;
+		if (n > nr - done)
+			n = nr - done;
+		if (n > ring->capacity - (head & (ring->capacity - 1)))
+			n = ring->capacity - (head & (ring->capacity - 1));
+		/*
+		 * The entries cannot be overwritten before the head moves,
+		 * which makes the commit fail if they were concurrently
+		 * dequeued.
+		 */
+		memcpy(dst + done * ring->entry_size,
+			rseq_percpu_ring_entry(ring, cpu_ring, head),
+			n * ring->entry_size);
+		ret = rseq_load_cbne_load_cbne_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				&cpu_ring->head, (intptr_t) head, &cpu_ring->lock, 0,
+				(intptr_t) (head + n), _cpu);
+		if (rseq_likely(!ret)) {
+			done += n;
+			if (cpu)
+				*cpu = _cpu;
+		} else if (ret > 0) {
+			rseq_percpu_ring_wait_unlock(cpu_ring);
+		}
+		/* Retry if the comparison fails or rseq aborts. */
+	}
+	return done;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RSEQ_PERCPU_RING_H */
@@ -59,6 +59,23 @@
  *   abort: -1
  */
 
+/*
+ * rseq_load_add_store_load(v, count, load)
+ *
+ * Fetch-and-add: the value of [v] before the addition is stored into
+ * [load], which is only meaningful on success.
+ *
+ * Pseudo-code:
+ *   load(r1, [v])
+ *   store(r1, [load])
+ *   add(r1, [count])
+ *   store(r1, [v])
+ *
+ * Return values:
+ *   success: 0
+ *   abort: -1
+ */
+
 /*
  * rseq_load_cbeq_store_add_load_store(v, expectnot, voffp, load)
  *
@@ -76,6 +93,28 @@
  *   abort: -1
  */
 
+/*
+ * rseq_load_cbne_load_cbeq_store_add_load_store(v, expect, v2, expectnot2, voffp, load)
+ *
+ * Same as rseq_load_cbeq_store_add_load_store() on [v2], conditional
+ * on [v] matching [expect], e.g. a lock word.
+ *
+ * Pseudo-code:
+ *   load(r1, [v])
+ *   cbne(r1, [expect], [ne])
+ *   load(r2, [v2])
+ *   cbeq(r2, [expectnot2], [ne])
+ *   store(r2, [load])
+ *   add(r2, [voffp])
+ *   load(r3, r2)
+ *   store(r3, [v2])
+ *
+ * Return values:
+ *   success: 0
+ *   ne: 1
+ *   abort: -1
+ */
+
 /*
  * rseq_load_add_load_load_add_store(ptr, off, inc)
  *
@@ -138,4 +177,59 @@
  *   abort: -1
  */
 
+/*
+ * rseq_load_cbne_storev_store(v, expect, stores, nr_stores, newv)
+ *
+ * Up to RSEQ_STOREV_MAX speculative stores described by the
+ * struct rseq_store_pair array [stores].
+ *
+ * Pseudo-code:
+ *   load(r1, [v])
+ *   cbne(r1, [expect], [ne])
+ *   for i in 0 .. [nr_stores] - 1:
+ *     store([stores][i].value, [stores][i].addr)  // Store attempt
+ *   store([newv], [v])                            // Final store
+ *
+ * Return values:
+ *   success: 0
+ *   ne: 1
+ *   abort: -1
+ *
+ * A [nr_stores] larger than RSEQ_STOREV_MAX aborts the program.
+ */
+
+/*
+ * rseq_load_cbne_store__u32(v, expect, newv)
+ * rseq_load_add_store__u32(v, count)
+ * rseq_load_cbne_store_store__u32(v, expect, v2, newv2, newv)
+ * rseq_load_cbne_load_cbne_store__u32(v, expect, v2, expect2, newv)
+ *
+ * And the same helpers with the __u16 and __u8 suffixes.
+ *
+ * Same as the __ptr helpers, with load, store, cbne and add operating
+ * on 32-bit (l), 16-bit (w) and 8-bit (b) fields. The add wraps
+ * around at the width of the field. Only available if the architecture
+ * defines rseq_arch_has_typed_ops.
+ *
+ * Return values: as the __ptr helpers.
+ */
+
+/*
+ * rseq_percpu_load_add_store(v, stride, count)
+ * rseq_percpu_load_add_store_load(v, stride, count, load)
+ * rseq_percpu_load_cbeq_store_add_load_store(v, stride, expectnot, voffp, load)
+ *
+ * Same as the helpers without the rseq_percpu_ prefix, operating on
+ * the per-cpu slot r0 derived from the current cpu_id (or mm_cid)
+ * instead of comparing it against a cpu argument.
+ *
+ * Pseudo-code of the slot derivation:
+ *   load(r0, [current cpu_id or mm_cid])
+ *   mul(r0, [stride])
+ *   add(r0, [v])
+ *
+ * Return values: as the helpers without the rseq_percpu_ prefix. Abort
+ * (-1) if the current thread is not registered.
+ */
+
 #endif  /* _RSEQ_PSEUDOCODE_H */
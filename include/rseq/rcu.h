@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com> */
+
+#ifndef _RSEQ_RCU_H
+#define _RSEQ_RCU_H
+
+#include <stddef.h>
+
+/*
+ * rseq/rcu.h: Grace periods and deferred reclamation over rseq critical
+ * sections.
+ *
+ * The read-side critical sections are the rseq critical sections
+ * themselves: every point outside of a rseq critical section is a
+ * quiescent state, so readers pay nothing beyond the critical section.
+ * A grace period is a membarrier rseq fence on all CPUs, which restarts
+ * the critical sections in flight. When the lock-based fallback is
+ * active, it waits for the fallback critical sections in flight
+ * instead.
+ *
+ * After an object is unpublished, rseq_rcu_synchronize() guarantees
+ * that no critical section still references it, unless a reference
+ * loaded within a critical section is used after its commit. Such
+ * references must be protected by other means.
+ *
+ * Writers defer the reclamation of unpublished objects with
+ * rseq_rcu_call(). Callbacks are queued, and run in batches sharing a
+ * single grace period, once RSEQ_RCU_BATCH callbacks are queued or the
+ * oldest one was queued RSEQ_RCU_DELAY_NS ago. The callbacks queued
+ * last run at the next rseq_rcu_call() or rseq_rcu_barrier().
+ */
+
+/* Number of queued callbacks triggering a grace period. */
+#define RSEQ_RCU_BATCH		64
+
+/* Age of the oldest queued callback triggering a grace period: 100 ms. */
+#define RSEQ_RCU_DELAY_NS	100000000ULL
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Deferred callback, to embed in the object to reclaim. */
+struct rseq_rcu_head {
+	struct rseq_rcu_head *next;
+	void (*func)(struct rseq_rcu_head *head);
+};
+
+/*
+ * rseq_rcu_synchronize: Wait for a grace period.
+ *
+ * Wait for the rseq critical sections in flight on all CPUs to either
+ * commit or abort.
+ *
+ * Returns 0 on success, -1 with errno set on error: ENOSYS if
+ * membarrier rseq fencing is unavailable.
+ *
+ * This API is MT-safe.
+ */
+int rseq_rcu_synchronize(void);
+
+/*
+ * rseq_rcu_call: Defer a callback after a grace period.
+ *
+ * Queue @head to invoke @func(@head) after a grace period. When
+ * RSEQ_RCU_BATCH callbacks are queued, or the oldest queued callback
+ * was queued at least RSEQ_RCU_DELAY_NS ago, the caller waits for a
+ * grace period and invokes the queued callbacks, unless they are
+ * already being invoked. Callbacks may call rseq_rcu_call(), but not
+ * rseq_rcu_barrier().
+ *
+ * No callback runs without a later call: callers which stop queueing
+ * callbacks call rseq_rcu_barrier() to reclaim the ones left queued.
+ *
+ * Returns 0 on success, -1 with errno set on error: ENOSYS if
+ * membarrier rseq fencing is unavailable. The callback stays queued on
+ * error.
+ *
+ * This API is MT-safe.
+ */
+int rseq_rcu_call(struct rseq_rcu_head *head, void (*func)(struct rseq_rcu_head *head));
+
+/*
+ * rseq_rcu_barrier: Invoke the queued callbacks.
+ *
+ * Wait for a grace period and invoke the callbacks queued by
+ * rseq_rcu_call() before this call.
+ *
+ * Returns 0 on success, -1 with errno set on error: ENOSYS if
+ * membarrier rseq fencing is unavailable. The callbacks stay queued on
+ * error.
+ *
+ * This API is MT-safe.
+ */
+int rseq_rcu_barrier(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RSEQ_RCU_H */
@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com> */
+
+/*
+ * rseq/retry.h
+ *
+ * Retry loop for the critical section helpers, with bounded retries,
+ * backoff and escalation to a fallback.
+ */
+
+#ifndef _RSEQ_RETRY_H
+#define _RSEQ_RETRY_H
+
+#include <sched.h>
+
+#include <rseq/compiler.h>
+
+struct rseq_retry_policy {
+	/*
+	 * Number of consecutive aborts after which the fallback is
+	 * invoked. 0 retries forever.
+	 */
+	unsigned int max_aborts;
+	/*
+	 * Number of consecutive aborts before backing off. Each
+	 * subsequent abort doubles the number of pause iterations,
+	 * up to max_pause_loops.
+	 */
+	unsigned int backoff_aborts;
+	/* Maximum number of pause iterations per backoff. */
+	unsigned int max_pause_loops;
+	/*
+	 * Number of consecutive aborts after which the CPU is yielded
+	 * instead of pausing. 0 never yields.
+	 */
+	unsigned int yield_aborts;
+};
+
+/*
+ * Retry up to 64 times, pause after 4 aborts and yield after 32
+ * aborts.
+ */
+#define RSEQ_RETRY_POLICY_DEFAULT	{ 64, 4, 256, 32 }
+
+static inline __attribute__((always_inline))
+void rseq_retry_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__ ("pause" : : : "memory");
+#elif defined(__aarch64__)
+	__asm__ __volatile__ ("yield" : : : "memory");
+#else
+	rseq_barrier();
+#endif
+}
+
+/*
+ * rseq_retry_backoff: Back off after the @nr_aborts consecutive abort
+ * according to @policy.
+ */
+static inline
+void rseq_retry_backoff(const struct rseq_retry_policy *policy, unsigned int nr_aborts)
+{
+	unsigned int i, loops, shift;
+
+	if (policy->yield_aborts && nr_aborts >= policy->yield_aborts) {
+		sched_yield();
+		return;
+	}
+	if (nr_aborts < policy->backoff_aborts)
+		return;
+	shift = nr_aborts - policy->backoff_aborts;
+	if (shift >= 31 || (1U << shift) > policy->max_pause_loops)
+		loops = policy->max_pause_loops;
+	else
+		loops = 1U << shift;
+	for (i = 0; i < loops; i++)
+		rseq_retry_pause();
+}
+
+/*
+ * rseq_retry: Execute a critical section until it does not abort.
+ *
+ * @policy: Pointer to a struct rseq_retry_policy.
+ * @prepare: Expression evaluated before each attempt, typically to
+ *           load the CPU number and the expected values, e.g.
+ *           "cpu = rseq_cpu_start()".
+ * @op: Expression invoking the critical section helper, returning
+ *      0 on success, a positive value on comparison failure, and -1
+ *      on abort.
+ * @fallback: Expression evaluated instead of @op after
+ *            policy->max_aborts consecutive aborts, e.g. performing the
+ *            operation under a lock. Its value is returned.
+ *
+ * Returns the value of the first @op which did not abort, or the value
+ * of @fallback. A comparison failure is returned to the caller without
+ * retrying, since the expected values usually need to be reloaded.
+ */
+#define rseq_retry(policy, prepare, op, fallback)				\
+	__extension__ ({							\
+		const struct rseq_retry_policy *__rseq_policy = (policy);	\
+		unsigned int __rseq_nr_aborts = 0;				\
+		int __rseq_ret;							\
+										\
+		for (;;) {							\
+			(void) (prepare);					\
+			__rseq_ret = (op);					\
+			if (rseq_likely(__rseq_ret >= 0))			\
+				break;						\
+			__rseq_nr_aborts++;					\
+			if (__rseq_policy->max_aborts &&			\
+					__rseq_nr_aborts >= __rseq_policy->max_aborts) { \
+				__rseq_ret = (fallback);			\
+				break;						\
+			}							\
+			rseq_retry_backoff(__rseq_policy, __rseq_nr_aborts);	\
+		}								\
+		__rseq_ret;							\
+	})
+
+#endif /* _RSEQ_RETRY_H */
@@ -44,6 +44,15 @@ enum rseq_available_query {
 	RSEQ_AVAILABLE_QUERY_LIBC = 1,
 };
 
+/* Maximum number of speculative stores of rseq_load_cbne_storev_store(). */
+#define RSEQ_STOREV_MAX	4
+
+/* Speculative store performed by rseq_load_cbne_storev_store(). */
+struct rseq_store_pair {
+	intptr_t *addr;
+	intptr_t value;
+};
+
 /*
  * User code can define RSEQ_GET_ABI_OVERRIDE to override the
  * rseq_get_abi() implementation, for instance to use glibc's symbols
@@ -128,11 +137,97 @@ int32_t rseq_fallback_current_cpu(void);
  */
 int32_t rseq_fallback_current_node(void);
 
+/*
+ * Restartable sequence fallback for reading the current node number,
+ * using a cache of the node of each CPU. @cpu is the current CPU
+ * number, or a negative value if unknown, in which case it is read
+ * with rseq_fallback_current_cpu(). The node of a CPU is cached the
+ * first time a thread observes it with getcpu. Returns -1 on error.
+ */
+int32_t rseq_fallback_current_node_cached(int32_t cpu);
+
 /*
  * Returns true if rseq is supported.
  */
 bool rseq_available(unsigned int query);
 
+enum rseq_fallback_mode {
+	RSEQ_FALLBACK_MODE_NONE = 0,	/* Critical sections abort when rseq is unavailable. */
+	RSEQ_FALLBACK_MODE_AUTO = 1,	/* Use the fallback if rseq is unavailable. */
+	RSEQ_FALLBACK_MODE_FORCE = 2,	/* Always use the fallback. */
+};
+
+/*
+ * rseq_set_fallback_mode: Select the behavior of the critical section
+ * helpers when rseq is unavailable.
+ *
+ * With RSEQ_FALLBACK_MODE_AUTO, if the rseq system call is unavailable
+ * (ENOSYS, or EPERM when denied by a seccomp filter), the critical
+ * section helpers declared below execute their operation under a
+ * spinlock associated with their @cpu argument rather than returning
+ * -1 forever. rseq_register_current_thread() then succeeds without
+ * registering the thread. The fallback is selected process-wide, so
+ * critical sections never mix rseq and lock-based execution.
+ *
+ * RSEQ_FALLBACK_MODE_FORCE selects the fallback even if rseq is
+ * available, which is mainly useful for testing and benchmarking. It
+ * requires that librseq owns the rseq registration and must be set
+ * before any thread is registered.
+ *
+ * When the fallback is active, the current thread is not registered,
+ * so rseq_cpu_start() always returns 0. Callers should use
+ * rseq_current_cpu() to select the per-CPU slot to operate on, so
+ * the slot locks are spread across CPUs.
+ *
+ * Once the fallback is active, it stays active for the lifetime of
+ * the process.
+ *
+ * Returns 0 on success, -1 with errno set on error: EINVAL for an
+ * invalid mode, EBUSY if the fallback is already active and @mode is
+ * RSEQ_FALLBACK_MODE_NONE, or if @mode is RSEQ_FALLBACK_MODE_FORCE and
+ * rseq is already registered.
+ *
+ * This API is MT-safe.
+ */
+int rseq_set_fallback_mode(enum rseq_fallback_mode mode);
+
+/*
+ * Returns true if the critical section helpers are executed by the
+ * lock-based fallback.
+ */
+bool rseq_fallback_active(void);
+
+/*
+ * rseq_set_auto_register: Enable or disable the automatic registration
+ * of threads.
+ *
+ * When enabled, a critical section helper aborting on a thread which
+ * is not registered yet registers the thread and returns -1, so the
+ * caller's retry loop starts over with a valid CPU number. Threads
+ * registered this way are unregistered when they exit. This allows
+ * library code to use the critical section helpers from threads it
+ * does not create.
+ *
+ * Automatic registration has no effect when the rseq registration is
+ * owned by libc, which registers all threads.
+ *
+ * The automatic registration of a thread arms its exit handler with
+ * pthread_setspecific(3), which is not async-signal-safe. The first
+ * critical section helper used by a thread which relies on automatic
+ * registration must therefore not run from a signal handler; register
+ * such threads explicitly if they use the helpers from signal handlers.
+ *
+ * The critical section helpers, and the per-CPU data structures built
+ * on them (rseq/percpu-*.h), can only be used by threads registered
+ * with rseq_register_current_thread() or automatically, unless the
+ * lock-based fallback is active.
+ *
+ * Returns 0 on success, -1 with errno set on error.
+ *
+ * This API is MT-safe.
+ */
+int rseq_set_auto_register(bool enable);
+
 /*
  * rseq_get_max_nr_cpus: Get the max_nr_cpus auto-detected value.
  *
@@ -141,6 +236,62 @@ bool rseq_available(unsigned int query);
  */
 int rseq_get_max_nr_cpus(void);
 
+/*
+ * rseq_fence_available: Query support for rseq fences.
+ *
+ * Returns true if the rseq fences below can be issued: either the
+ * membarrier rseq fencing commands are available and the process is
+ * registered for them, or the lock-based fallback is active. The
+ * capability query and registration are done on first use and cached
+ * for the lifetime of the process.
+ *
+ * This API is MT-safe.
+ */
+bool rseq_fence_available(void);
+
+/*
+ * rseq_fence_cpu: Restart the rseq critical sections in flight on a CPU.
+ *
+ * When this returns, the rseq critical sections of the process which
+ * were in flight on @cpu have either committed or aborted. When the
+ * lock-based fallback is active, wait for the fallback critical
+ * sections in flight on @cpu instead. Fencing a possible CPU which is
+ * offline succeeds.
+ *
+ * Returns 0 on success, -1 with errno set on error: EINVAL if @cpu is
+ * negative, ENOSYS if rseq fences are unavailable.
+ *
+ * This API is MT-safe.
+ */
+int rseq_fence_cpu(int cpu);
+
+/*
+ * rseq_fence_all: Restart the rseq critical sections in flight on all
+ * CPUs.
+ *
+ * Returns 0 on success, -1 with errno set on error: ENOSYS if rseq
+ * fences are unavailable.
+ *
+ * This API is MT-safe.
+ */
+int rseq_fence_all(void);
+
+/*
+ * rseq_fence_cpu_mask: Restart the rseq critical sections in flight on
+ * a set of CPUs.
+ *
+ * @mask is a bitmap of @nr_cpus bits, where bit (cpu % bits per long) of
+ * @mask[cpu / bits per long] selects @cpu (the layout of cpu_set_t).
+ * Sparse sets are fenced one CPU at a time, and dense sets with a
+ * single fence on all CPUs.
+ *
+ * Returns 0 on success, -1 with errno set on error: ENOSYS if rseq
+ * fences are unavailable.
+ *
+ * This API is MT-safe.
+ */
+int rseq_fence_cpu_mask(const unsigned long *mask, int nr_cpus);
+
 /*
  * Values returned can be either the current CPU number, -1 (rseq is
  * uninitialized), or -2 (rseq initialization has failed).
@@ -186,13 +337,20 @@ bool rseq_node_id_available(void)
 }
 
 /*
- * Current NUMA node number.
+ * Current NUMA node number. Falls back to a cached lookup of the node
+ * of the current CPU if the thread is not registered or the node_id
+ * field is not part of the active feature set. Returns -1 if the node
+ * number cannot be read.
  */
 static inline __attribute__((always_inline))
-uint32_t rseq_current_node_id(void)
+int32_t rseq_current_node_id(void)
 {
-	assert(rseq_node_id_available());
-	return RSEQ_READ_ONCE(rseq_get_abi()->node_id);
+	int32_t cpu;
+
+	cpu = rseq_current_cpu_raw();
+	if (rseq_likely(cpu >= 0 && rseq_node_id_available()))
+		return (int32_t) RSEQ_READ_ONCE(rseq_get_abi()->node_id);
+	return rseq_fallback_current_node_cached(cpu);
 }
 
 static inline __attribute__((always_inline))
@@ -236,21 +394,63 @@ void rseq_prepare_unload(void)
  */
 #include "rseq/pseudocode.h"
 
+/*
+ * Lock-based implementation of the critical section helpers, invoked
+ * by the helpers below when their critical section aborts. Those
+ * return -1 unless the fallback is active (see
+ * rseq_set_fallback_mode()), after registering the current thread if
+ * automatic registration is enabled (see rseq_set_auto_register()).
+ */
+int rseq_fallback_load_cbne_store__ptr(intptr_t *v, intptr_t expect,
+		intptr_t newv, int cpu);
+int rseq_fallback_load_cbeq_store_add_load_store__ptr(intptr_t *v,
+		intptr_t expectnot, long voffp, intptr_t *load, int cpu);
+int rseq_fallback_load_cbne_load_cbeq_store_add_load_store__ptr(intptr_t *v,
+		intptr_t expect, intptr_t *v2, intptr_t expectnot2, long voffp,
+		intptr_t *load, int cpu);
+int rseq_fallback_load_add_store__ptr(intptr_t *v, intptr_t count, int cpu);
+int rseq_fallback_load_add_store_load__ptr(intptr_t *v, intptr_t count,
+		intptr_t *load, int cpu);
+int rseq_fallback_load_add_load_load_add_store__ptr(intptr_t *ptr, long off,
+		intptr_t inc, int cpu);
+int rseq_fallback_load_cbne_store_store__ptr(intptr_t *v, intptr_t expect,
+		intptr_t *v2, intptr_t newv2, intptr_t newv, int cpu);
+int rseq_fallback_load_cbne_load_cbne_store__ptr(intptr_t *v, intptr_t expect,
+		intptr_t *v2, intptr_t expect2, intptr_t newv, int cpu);
+int rseq_fallback_load_cbne_memcpy_store__ptr(intptr_t *v, intptr_t expect,
+		void *dst, void *src, size_t len, intptr_t newv, int cpu);
+int rseq_fallback_load_cbne_storev_store__ptr(intptr_t *v, intptr_t expect,
+		const struct rseq_store_pair *stores, size_t nr_stores,
+		intptr_t newv, int cpu);
+int rseq_fallback_percpu_load_add_store__ptr(intptr_t *v, size_t stride,
+		intptr_t count);
+int rseq_fallback_percpu_load_add_store_load__ptr(intptr_t *v, size_t stride,
+		intptr_t count, intptr_t *load);
+int rseq_fallback_percpu_load_cbeq_store_add_load_store__ptr(intptr_t *v,
+		size_t stride, intptr_t expectnot, long voffp, intptr_t *load);
+
 static inline __attribute__((always_inline))
 int rseq_load_cbne_store__ptr(enum rseq_mo rseq_mo, enum rseq_percpu_mode percpu_mode,
 		       intptr_t *v, intptr_t expect,
 		       intptr_t newv, int cpu)
 {
+	int ret;
+
 	if (rseq_mo != RSEQ_MO_RELAXED)
 		return -1;
 	switch (percpu_mode) {
 	case RSEQ_PERCPU_CPU_ID:
-		return rseq_load_cbne_store__ptr_relaxed_cpu_id(v, expect, newv, cpu);
+		ret = rseq_load_cbne_store__ptr_relaxed_cpu_id(v, expect, newv, cpu);
+		break;
 	case RSEQ_PERCPU_MM_CID:
-		return rseq_load_cbne_store__ptr_relaxed_mm_cid(v, expect, newv, cpu);
+		ret = rseq_load_cbne_store__ptr_relaxed_mm_cid(v, expect, newv, cpu);
+		break;
 	default:
 		return -1;
 	}
+	if (rseq_unlikely(ret < 0))
+		ret = rseq_fallback_load_cbne_store__ptr(v, expect, newv, cpu);
+	return ret;
 }
 
 static inline __attribute__((always_inline))
@@ -258,49 +458,122 @@ int rseq_load_cbeq_store_add_load_store__ptr(enum rseq_mo rseq_mo, enum rseq_per
 			       intptr_t *v, intptr_t expectnot, long voffp, intptr_t *load,
 			       int cpu)
 {
+	int ret;
+
 	if (rseq_mo != RSEQ_MO_RELAXED)
 		return -1;
 	switch (percpu_mode) {
 	case RSEQ_PERCPU_CPU_ID:
-		return rseq_load_cbeq_store_add_load_store__ptr_relaxed_cpu_id(v, expectnot, voffp, load, cpu);
+		ret = rseq_load_cbeq_store_add_load_store__ptr_relaxed_cpu_id(v, expectnot, voffp, load, cpu);
+		break;
 	case RSEQ_PERCPU_MM_CID:
-		return rseq_load_cbeq_store_add_load_store__ptr_relaxed_mm_cid(v, expectnot, voffp, load, cpu);
+		ret = rseq_load_cbeq_store_add_load_store__ptr_relaxed_mm_cid(v, expectnot, voffp, load, cpu);
+		break;
 	default:
 		return -1;
 	}
+	if (rseq_unlikely(ret < 0))
+		ret = rseq_fallback_load_cbeq_store_add_load_store__ptr(v, expectnot, voffp, load, cpu);
+	return ret;
 }
 
+#ifdef rseq_arch_has_load_cbne_load_cbeq_store_add_load_store
+static inline __attribute__((always_inline))
+int rseq_load_cbne_load_cbeq_store_add_load_store__ptr(enum rseq_mo rseq_mo, enum rseq_percpu_mode percpu_mode,
+			       intptr_t *v, intptr_t expect,
+			       intptr_t *v2, intptr_t expectnot2, long voffp, intptr_t *load,
+			       int cpu)
+{
+	int ret;
+
+	if (rseq_mo != RSEQ_MO_RELAXED)
+		return -1;
+	switch (percpu_mode) {
+	case RSEQ_PERCPU_CPU_ID:
+		ret = rseq_load_cbne_load_cbeq_store_add_load_store__ptr_relaxed_cpu_id(v, expect, v2, expectnot2, voffp, load, cpu);
+		break;
+	case RSEQ_PERCPU_MM_CID:
+		ret = rseq_load_cbne_load_cbeq_store_add_load_store__ptr_relaxed_mm_cid(v, expect, v2, expectnot2, voffp, load, cpu);
+		break;
+	default:
+		return -1;
+	}
+	if (rseq_unlikely(ret < 0))
+		ret = rseq_fallback_load_cbne_load_cbeq_store_add_load_store__ptr(v, expect, v2, expectnot2, voffp, load, cpu);
+	return ret;
+}
+#endif
+
 static inline __attribute__((always_inline))
 int rseq_load_add_store__ptr(enum rseq_mo rseq_mo, enum rseq_percpu_mode percpu_mode,
 	      intptr_t *v, intptr_t count, int cpu)
 {
+	int ret;
+
+	if (rseq_mo != RSEQ_MO_RELAXED)
+		return -1;
+	switch (percpu_mode) {
+	case RSEQ_PERCPU_CPU_ID:
+		ret = rseq_load_add_store__ptr_relaxed_cpu_id(v, count, cpu);
+		break;
+	case RSEQ_PERCPU_MM_CID:
+		ret = rseq_load_add_store__ptr_relaxed_mm_cid(v, count, cpu);
+		break;
+	default:
+		return -1;
+	}
+	if (rseq_unlikely(ret < 0))
+		ret = rseq_fallback_load_add_store__ptr(v, count, cpu);
+	return ret;
+}
+
+#ifdef rseq_arch_has_load_add_store_load
+static inline __attribute__((always_inline))
+int rseq_load_add_store_load__ptr(enum rseq_mo rseq_mo, enum rseq_percpu_mode percpu_mode,
+	      intptr_t *v, intptr_t count, intptr_t *load, int cpu)
+{
+	int ret;
+
 	if (rseq_mo != RSEQ_MO_RELAXED)
 		return -1;
 	switch (percpu_mode) {
 	case RSEQ_PERCPU_CPU_ID:
-		return rseq_load_add_store__ptr_relaxed_cpu_id(v, count, cpu);
+		ret = rseq_load_add_store_load__ptr_relaxed_cpu_id(v, count, load, cpu);
+		break;
 	case RSEQ_PERCPU_MM_CID:
-		return rseq_load_add_store__ptr_relaxed_mm_cid(v, count, cpu);
+		ret = rseq_load_add_store_load__ptr_relaxed_mm_cid(v, count, load, cpu);
+		break;
 	default:
 		return -1;
 	}
+	if (rseq_unlikely(ret < 0))
+		ret = rseq_fallback_load_add_store_load__ptr(v, count, load, cpu);
+	return ret;
 }
+#endif
 
 #ifdef rseq_arch_has_load_add_load_load_add_store
 static inline __attribute__((always_inline))
 int rseq_load_add_load_load_add_store__ptr(enum rseq_mo rseq_mo, enum rseq_percpu_mode percpu_mode,
 			   intptr_t *ptr, long off, intptr_t inc, int cpu)
 {
+	int ret;
+
 	if (rseq_mo != RSEQ_MO_RELAXED)
 		return -1;
 	switch (percpu_mode) {
 	case RSEQ_PERCPU_CPU_ID:
-		return rseq_load_add_load_load_add_store__ptr_relaxed_cpu_id(ptr, off, inc, cpu);
+		ret = rseq_load_add_load_load_add_store__ptr_relaxed_cpu_id(ptr, off, inc, cpu);
+		break;
 	case RSEQ_PERCPU_MM_CID:
-		return rseq_load_add_load_load_add_store__ptr_relaxed_mm_cid(ptr, off, inc, cpu);
+		ret = rseq_load_add_load_load_add_store__ptr_relaxed_mm_cid(ptr, off, inc, cpu);
+		break;
 	default:
 		return -1;
 	}
+	if (rseq_unlikely(ret < 0))
+		ret = rseq_fallback_load_add_load_load_add_store__ptr(ptr, off, inc, cpu);
+	return ret;
 }
 #endif
 
@@ -310,25 +583,33 @@ int rseq_load_cbne_store_store__ptr(enum rseq_mo rseq_mo, enum rseq_percpu_mode
 				 intptr_t *v2, intptr_t newv2,
 				 intptr_t newv, int cpu)
 {
+	int ret;
+
 	switch (rseq_mo) {
 	case RSEQ_MO_RELAXED:
 		switch (percpu_mode) {
 		case RSEQ_PERCPU_CPU_ID:
-			return rseq_load_cbne_store_store__ptr_relaxed_cpu_id(v, expect, v2, newv2, newv, cpu);
+			ret = rseq_load_cbne_store_store__ptr_relaxed_cpu_id(v, expect, v2, newv2, newv, cpu);
+			break;
 		case RSEQ_PERCPU_MM_CID:
-			return rseq_load_cbne_store_store__ptr_relaxed_mm_cid(v, expect, v2, newv2, newv, cpu);
+			ret = rseq_load_cbne_store_store__ptr_relaxed_mm_cid(v, expect, v2, newv2, newv, cpu);
+			break;
 		default:
 			return -1;
 		}
+		break;
 	case RSEQ_MO_RELEASE:
 		switch (percpu_mode) {
 		case RSEQ_PERCPU_CPU_ID:
-			return rseq_load_cbne_store_store__ptr_release_cpu_id(v, expect, v2, newv2, newv, cpu);
+			ret = rseq_load_cbne_store_store__ptr_release_cpu_id(v, expect, v2, newv2, newv, cpu);
+			break;
 		case RSEQ_PERCPU_MM_CID:
-			return rseq_load_cbne_store_store__ptr_release_mm_cid(v, expect, v2, newv2, newv, cpu);
+			ret = rseq_load_cbne_store_store__ptr_release_mm_cid(v, expect, v2, newv2, newv, cpu);
+			break;
 		default:
 			return -1;
 		}
+		break;
 	case RSEQ_MO_ACQUIRE:	/* Fallthrough */
 	case RSEQ_MO_ACQ_REL:	/* Fallthrough */
 	case RSEQ_MO_CONSUME:	/* Fallthrough */
@@ -336,6 +617,9 @@ int rseq_load_cbne_store_store__ptr(enum rseq_mo rseq_mo, enum rseq_percpu_mode
 	default:
 		return -1;
 	}
+	if (rseq_unlikely(ret < 0))
+		ret = rseq_fallback_load_cbne_store_store__ptr(v, expect, v2, newv2, newv, cpu);
+	return ret;
 }
 
 static inline __attribute__((always_inline))
@@ -344,16 +628,23 @@ int rseq_load_cbne_load_cbne_store__ptr(enum rseq_mo rseq_mo, enum rseq_percpu_m
 			      intptr_t *v2, intptr_t expect2,
 			      intptr_t newv, int cpu)
 {
+	int ret;
+
 	if (rseq_mo != RSEQ_MO_RELAXED)
 		return -1;
 	switch (percpu_mode) {
 	case RSEQ_PERCPU_CPU_ID:
-		return rseq_load_cbne_load_cbne_store__ptr_relaxed_cpu_id(v, expect, v2, expect2, newv, cpu);
+		ret = rseq_load_cbne_load_cbne_store__ptr_relaxed_cpu_id(v, expect, v2, expect2, newv, cpu);
+		break;
 	case RSEQ_PERCPU_MM_CID:
-		return rseq_load_cbne_load_cbne_store__ptr_relaxed_mm_cid(v, expect, v2, expect2, newv, cpu);
+		ret = rseq_load_cbne_load_cbne_store__ptr_relaxed_mm_cid(v, expect, v2, expect2, newv, cpu);
+		break;
 	default:
 		return -1;
 	}
+	if (rseq_unlikely(ret < 0))
+		ret = rseq_fallback_load_cbne_load_cbne_store__ptr(v, expect, v2, expect2, newv, cpu);
+	return ret;
 }
 
 static inline __attribute__((always_inline))
@@ -362,25 +653,33 @@ int rseq_load_cbne_memcpy_store__ptr(enum rseq_mo rseq_mo, enum rseq_percpu_mode
 				 void *dst, void *src, size_t len,
 				 intptr_t newv, int cpu)
 {
+	int ret;
+
 	switch (rseq_mo) {
 	case RSEQ_MO_RELAXED:
 		switch (percpu_mode) {
 		case RSEQ_PERCPU_CPU_ID:
-			return rseq_load_cbne_memcpy_store__ptr_relaxed_cpu_id(v, expect, dst, src, len, newv, cpu);
+			ret = rseq_load_cbne_memcpy_store__ptr_relaxed_cpu_id(v, expect, dst, src, len, newv, cpu);
+			break;
 		case RSEQ_PERCPU_MM_CID:
-			return rseq_load_cbne_memcpy_store__ptr_relaxed_mm_cid(v, expect, dst, src, len, newv, cpu);
+			ret = rseq_load_cbne_memcpy_store__ptr_relaxed_mm_cid(v, expect, dst, src, len, newv, cpu);
+			break;
 		default:
 			return -1;
 		}
+		break;
 	case RSEQ_MO_RELEASE:
 		switch (percpu_mode) {
 		case RSEQ_PERCPU_CPU_ID:
-			return rseq_load_cbne_memcpy_store__ptr_release_cpu_id(v, expect, dst, src, len, newv, cpu);
+			ret = rseq_load_cbne_memcpy_store__ptr_release_cpu_id(v, expect, dst, src, len, newv, cpu);
+			break;
 		case RSEQ_PERCPU_MM_CID:
-			return rseq_load_cbne_memcpy_store__ptr_release_mm_cid(v, expect, dst, src, len, newv, cpu);
+			ret = rseq_load_cbne_memcpy_store__ptr_release_mm_cid(v, expect, dst, src, len, newv, cpu);
+			break;
 		default:
 			return -1;
 		}
+		break;
 	case RSEQ_MO_ACQUIRE:	/* Fallthrough */
 	case RSEQ_MO_ACQ_REL:	/* Fallthrough */
 	case RSEQ_MO_CONSUME:	/* Fallthrough */
@@ -388,10 +687,187 @@ int rseq_load_cbne_memcpy_store__ptr(enum rseq_mo rseq_mo, enum rseq_percpu_mode
 	default:
 		return -1;
 	}
+	if (rseq_unlikely(ret < 0))
+		ret = rseq_fallback_load_cbne_memcpy_store__ptr(v, expect, dst, src, len, newv, cpu);
+	return ret;
 }
 
+#ifdef rseq_arch_has_load_cbne_storev_store
+#if defined(__has_attribute)
+# if __has_attribute(__error__)
+void rseq_storev_nr_stores_too_large(void)
+	__attribute__((__error__("nr_stores is larger than RSEQ_STOREV_MAX")));
+#  define rseq_storev_check_nr_stores(nr_stores)				\
+	do {									\
+		if (__builtin_constant_p(nr_stores) && (nr_stores) > RSEQ_STOREV_MAX) \
+			rseq_storev_nr_stores_too_large();			\
+	} while (0)
+# endif
+#endif
+#ifndef rseq_storev_check_nr_stores
+# define rseq_storev_check_nr_stores(nr_stores)	do { } while (0)
+#endif
+
+/*
+ * A constant nr_stores larger than RSEQ_STOREV_MAX is rejected at
+ * compile time when optimizing. Otherwise, a nr_stores larger than
+ * RSEQ_STOREV_MAX is a bug which aborts the program, since callers
+ * retry on both comparison failure and abort.
+ */
+static inline __attribute__((always_inline))
+int rseq_load_cbne_storev_store__ptr(enum rseq_mo rseq_mo, enum rseq_percpu_mode percpu_mode,
+				 intptr_t *v, intptr_t expect,
+				 const struct rseq_store_pair *stores, size_t nr_stores,
+				 intptr_t newv, int cpu)
+{
+	int ret;
+
+	rseq_storev_check_nr_stores(nr_stores);
+	if (rseq_unlikely(nr_stores > RSEQ_STOREV_MAX))
+		rseq_bug("nr_stores is larger than RSEQ_STOREV_MAX");
+	switch (rseq_mo) {
+	case RSEQ_MO_RELAXED:
+		switch (percpu_mode) {
+		case RSEQ_PERCPU_CPU_ID:
+			ret = rseq_load_cbne_storev_store__ptr_relaxed_cpu_id(v, expect, stores, nr_stores, newv, cpu);
+			break;
+		case RSEQ_PERCPU_MM_CID:
+			ret = rseq_load_cbne_storev_store__ptr_relaxed_mm_cid(v, expect, stores, nr_stores, newv, cpu);
+			break;
+		default:
+			return -1;
+		}
+		break;
+	case RSEQ_MO_RELEASE:
+		switch (percpu_mode) {
+		case RSEQ_PERCPU_CPU_ID:
+			ret = rseq_load_cbne_storev_store__ptr_release_cpu_id(v, expect, stores, nr_stores, newv, cpu);
+			break;
+		case RSEQ_PERCPU_MM_CID:
+			ret = rseq_load_cbne_storev_store__ptr_release_mm_cid(v, expect, stores, nr_stores, newv, cpu);
+			break;
+		default:
+			return -1;
+		}
+		break;
+	case RSEQ_MO_ACQUIRE:	/* Fallthrough */
+	case RSEQ_MO_ACQ_REL:	/* Fallthrough */
+	case RSEQ_MO_CONSUME:	/* Fallthrough */
+	case RSEQ_MO_SEQ_CST:	/* Fallthrough */
+	default:
+		return -1;
+	}
+	if (rseq_unlikely(ret < 0))
+		ret = rseq_fallback_load_cbne_storev_store__ptr(v, expect, stores, nr_stores, newv, cpu);
+	return ret;
+}
+#endif
+
+#ifdef rseq_arch_has_percpu_stride_ops
+/*
+ * Variants of rseq_load_add_store__ptr(),
+ * rseq_load_add_store_load__ptr() and
+ * rseq_load_cbeq_store_add_load_store__ptr() operating on the slot of
+ * the current CPU (or mm_cid) within a per-cpu array, at @v + index *
+ * @stride. The index is loaded within the critical section, so the
+ * caller does not need to read it beforehand. @v and @stride are
+ * typically a __rseq_percpu pointer and the stride of its pool.
+ */
+static inline __attribute__((always_inline))
+int rseq_percpu_load_add_store__ptr(enum rseq_mo rseq_mo, enum rseq_percpu_mode percpu_mode,
+	      intptr_t *v, size_t stride, intptr_t count)
+{
+	int ret;
+
+	if (rseq_mo != RSEQ_MO_RELAXED)
+		return -1;
+	switch (percpu_mode) {
+	case RSEQ_PERCPU_CPU_ID:
+		ret = rseq_percpu_load_add_store__ptr_relaxed_cpu_id(v, stride, count);
+		break;
+	case RSEQ_PERCPU_MM_CID:
+		ret = rseq_percpu_load_add_store__ptr_relaxed_mm_cid(v, stride, count);
+		break;
+	default:
+		return -1;
+	}
+	if (rseq_unlikely(ret < 0))
+		ret = rseq_fallback_percpu_load_add_store__ptr(v, stride, count);
+	return ret;
+}
+
+static inline __attribute__((always_inline))
+int rseq_percpu_load_add_store_load__ptr(enum rseq_mo rseq_mo, enum rseq_percpu_mode percpu_mode,
+	      intptr_t *v, size_t stride, intptr_t count, intptr_t *load)
+{
+	int ret;
+
+	if (rseq_mo != RSEQ_MO_RELAXED)
+		return -1;
+	switch (percpu_mode) {
+	case RSEQ_PERCPU_CPU_ID:
+		ret = rseq_percpu_load_add_store_load__ptr_relaxed_cpu_id(v, stride, count, load);
+		break;
+	case RSEQ_PERCPU_MM_CID:
+		ret = rseq_percpu_load_add_store_load__ptr_relaxed_mm_cid(v, stride, count, load);
+		break;
+	default:
+		return -1;
+	}
+	if (rseq_unlikely(ret < 0))
+		ret = rseq_fallback_percpu_load_add_store_load__ptr(v, stride, count, load);
+	return ret;
+}
+
+static inline __attribute__((always_inline))
+int rseq_percpu_load_cbeq_store_add_load_store__ptr(enum rseq_mo rseq_mo, enum rseq_percpu_mode percpu_mode,
+			       intptr_t *v, size_t stride, intptr_t expectnot,
+			       long voffp, intptr_t *load)
+{
+	int ret;
+
+	if (rseq_mo != RSEQ_MO_RELAXED)
+		return -1;
+	switch (percpu_mode) {
+	case RSEQ_PERCPU_CPU_ID:
+		ret = rseq_percpu_load_cbeq_store_add_load_store__ptr_relaxed_cpu_id(v, stride, expectnot, voffp, load);
+		break;
+	case RSEQ_PERCPU_MM_CID:
+		ret = rseq_percpu_load_cbeq_store_add_load_store__ptr_relaxed_mm_cid(v, stride, expectnot, voffp, load);
+		break;
+	default:
+		return -1;
+	}
+	if (rseq_unlikely(ret < 0))
+		ret = rseq_fallback_percpu_load_cbeq_store_add_load_store__ptr(v, stride, expectnot, voffp, load);
+	return ret;
+}
+#endif
+
+/*
+ * Variants of the critical section helpers operating on 32-bit, 16-bit
+ * and 8-bit fields, e.g. rseq_load_cbne_store__u32().
+ */
+#define RSEQ_TEMPLATE_TYPE_U32
+#include "rseq/typed.h"
+#undef RSEQ_TEMPLATE_TYPE_U32
+
+#define RSEQ_TEMPLATE_TYPE_U16
+#include "rseq/typed.h"
+#undef RSEQ_TEMPLATE_TYPE_U16
+
+#define RSEQ_TEMPLATE_TYPE_U8
+#include "rseq/typed.h"
+#undef RSEQ_TEMPLATE_TYPE_U8
+
 #ifdef __cplusplus
 }
 #endif
 
+/*
+ * Outcome accounting of the critical section helpers when built with
+ * RSEQ_STATS defined.
+ */
+#include <rseq/stats.h>
+
 #endif  /* _RSEQ_RSEQ_H */
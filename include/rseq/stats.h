@@ -0,0 +1,210 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com> */
+
+/*
+ * rseq/stats.h
+ *
+ * Critical section outcome accounting.
+ *
+ * When a compile unit is built with RSEQ_STATS defined, each call to a
+ * critical section helper declared in rseq/rseq.h records its outcome
+ * (commit, ne/eq comparison failure or abort) in counters specific to
+ * its call site. The counters are sharded by CPU number to limit
+ * cache line bouncing between CPUs. Call sites register themselves
+ * the first time they are executed, and rseq_stats_dump() prints the
+ * counters of all registered call sites.
+ *
+ * Without RSEQ_STATS, the helpers are not instrumented and this header
+ * only declares the dump and reset functions.
+ *
+ * Call sites are static variables of the instrumented module, and stay
+ * registered for the lifetime of the process. A shared object built
+ * with RSEQ_STATS must therefore not be unloaded with dlclose() once
+ * its critical sections have executed: its call sites would dangle in
+ * the list of registered call sites, and the next rseq_stats_dump() or
+ * rseq_stats_reset() would access unmapped memory.
+ */
+
+#ifndef _RSEQ_STATS_H
+#define _RSEQ_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <rseq/compiler.h>
+
+/* Number of counter shards per call site, power of 2. */
+#define RSEQ_STATS_NR_SHARDS	16
+
+enum rseq_stats_outcome {
+	RSEQ_STATS_COMMIT = 0,
+	RSEQ_STATS_NE = 1,	/* ne/eq comparison failed. */
+	RSEQ_STATS_ABORT = 2,
+	RSEQ_STATS_NR_OUTCOMES = 3,
+};
+
+struct rseq_stats_shard {
+	uint64_t count[RSEQ_STATS_NR_OUTCOMES];
+} __attribute__((aligned(64)));
+
+struct rseq_stats_site {
+	const char *op;
+	const char *file;
+	const char *func;
+	int line;
+	int registered;
+	struct rseq_stats_site *next;
+	struct rseq_stats_shard shards[RSEQ_STATS_NR_SHARDS];
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * rseq_stats_register_site: Add a call site to the list of call sites
+ * printed by rseq_stats_dump(). Invoked on first execution of the call
+ * site.
+ *
+ * This API is MT-safe.
+ */
+void rseq_stats_register_site(struct rseq_stats_site *site);
+
+/*
+ * rseq_stats_dump: Print the counters of all registered call sites to
+ * @stream, one line per call site.
+ *
+ * Returns 0 on success, -1 with errno set on error.
+ *
+ * This API is MT-safe.
+ */
+int rseq_stats_dump(FILE *stream);
+
+/*
+ * rseq_stats_reset: Clear the counters of all registered call sites.
+ * Outcomes recorded concurrently may be lost.
+ *
+ * This API is MT-safe.
+ */
+void rseq_stats_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define RSEQ_STATS_SITE_INIT(_op)	{ _op, __FILE__, __func__, __LINE__, 0, NULL, { { { 0 } } } }
+
+static inline __attribute__((always_inline))
+int rseq_stats_record(struct rseq_stats_site *site, unsigned int cpu, int ret)
+{
+	struct rseq_stats_shard *shard;
+	enum rseq_stats_outcome outcome;
+
+	if (rseq_unlikely(!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE)))
+		rseq_stats_register_site(site);
+	if (ret < 0)
+		outcome = RSEQ_STATS_ABORT;
+	else if (ret > 0)
+		outcome = RSEQ_STATS_NE;
+	else
+		outcome = RSEQ_STATS_COMMIT;
+	shard = &site->shards[cpu & (RSEQ_STATS_NR_SHARDS - 1)];
+	__atomic_fetch_add(&shard->count[outcome], 1, __ATOMIC_RELAXED);
+	return ret;
+}
+
+#ifdef RSEQ_STATS
+
+/*
+ * Wrap a critical section helper invocation with the accounting of its
+ * outcome. The parenthesized helper name prevents macro recursion.
+ */
+#define RSEQ_STATS_CALL(_op, _func, ...)						\
+	__extension__ ({								\
+		static struct rseq_stats_site __rseq_stats_site = RSEQ_STATS_SITE_INIT(_op); \
+		rseq_stats_record(&__rseq_stats_site, rseq_cpu_start(),		\
+				(_func)(__VA_ARGS__));					\
+	})
+
+#define rseq_load_cbne_store__ptr(...)						\
+	RSEQ_STATS_CALL("load_cbne_store", rseq_load_cbne_store__ptr, __VA_ARGS__)
+#define rseq_load_cbeq_store_add_load_store__ptr(...)				\
+	RSEQ_STATS_CALL("load_cbeq_store_add_load_store",			\
+			rseq_load_cbeq_store_add_load_store__ptr, __VA_ARGS__)
+#ifdef rseq_arch_has_load_cbne_load_cbeq_store_add_load_store
+#define rseq_load_cbne_load_cbeq_store_add_load_store__ptr(...)			\
+	RSEQ_STATS_CALL("load_cbne_load_cbeq_store_add_load_store",		\
+			rseq_load_cbne_load_cbeq_store_add_load_store__ptr, __VA_ARGS__)
+#endif
+#define rseq_load_add_store__ptr(...)						\
+	RSEQ_STATS_CALL("load_add_store", rseq_load_add_store__ptr, __VA_ARGS__)
+#ifdef rseq_arch_has_load_add_store_load
+#define rseq_load_add_store_load__ptr(...)					\
+	RSEQ_STATS_CALL("load_add_store_load", rseq_load_add_store_load__ptr, __VA_ARGS__)
+#endif
+#ifdef rseq_arch_has_load_add_load_load_add_store
+#define rseq_load_add_load_load_add_store__ptr(...)				\
+	RSEQ_STATS_CALL("load_add_load_load_add_store",				\
+			rseq_load_add_load_load_add_store__ptr, __VA_ARGS__)
+#endif
+#define rseq_load_cbne_store_store__ptr(...)					\
+	RSEQ_STATS_CALL("load_cbne_store_store", rseq_load_cbne_store_store__ptr, __VA_ARGS__)
+#define rseq_load_cbne_load_cbne_store__ptr(...)					\
+	RSEQ_STATS_CALL("load_cbne_load_cbne_store",				\
+			rseq_load_cbne_load_cbne_store__ptr, __VA_ARGS__)
+#define rseq_load_cbne_memcpy_store__ptr(...)					\
+	RSEQ_STATS_CALL("load_cbne_memcpy_store",				\
+			rseq_load_cbne_memcpy_store__ptr, __VA_ARGS__)
+#ifdef rseq_arch_has_load_cbne_storev_store
+#define rseq_load_cbne_storev_store__ptr(...)					\
+	RSEQ_STATS_CALL("load_cbne_storev_store",				\
+			rseq_load_cbne_storev_store__ptr, __VA_ARGS__)
+#endif
+
+#ifdef rseq_arch_has_percpu_stride_ops
+#define rseq_percpu_load_add_store__ptr(...)					\
+	RSEQ_STATS_CALL("percpu_load_add_store",				\
+			rseq_percpu_load_add_store__ptr, __VA_ARGS__)
+#define rseq_percpu_load_add_store_load__ptr(...)				\
+	RSEQ_STATS_CALL("percpu_load_add_store_load",				\
+			rseq_percpu_load_add_store_load__ptr, __VA_ARGS__)
+#define rseq_percpu_load_cbeq_store_add_load_store__ptr(...)			\
+	RSEQ_STATS_CALL("percpu_load_cbeq_store_add_load_store",		\
+			rseq_percpu_load_cbeq_store_add_load_store__ptr, __VA_ARGS__)
+#endif
+#ifdef rseq_arch_has_typed_ops
+#define rseq_load_cbne_store__u32(...)						\
+	RSEQ_STATS_CALL("load_cbne_store__u32", rseq_load_cbne_store__u32, __VA_ARGS__)
+#define rseq_load_add_store__u32(...)						\
+	RSEQ_STATS_CALL("load_add_store__u32", rseq_load_add_store__u32, __VA_ARGS__)
+#define rseq_load_cbne_store_store__u32(...)					\
+	RSEQ_STATS_CALL("load_cbne_store_store__u32",				\
+			rseq_load_cbne_store_store__u32, __VA_ARGS__)
+#define rseq_load_cbne_load_cbne_store__u32(...)				\
+	RSEQ_STATS_CALL("load_cbne_load_cbne_store__u32",			\
+			rseq_load_cbne_load_cbne_store__u32, __VA_ARGS__)
+#define rseq_load_cbne_store__u16(...)						\
+	RSEQ_STATS_CALL("load_cbne_store__u16", rseq_load_cbne_store__u16, __VA_ARGS__)
+#define rseq_load_add_store__u16(...)						\
+	RSEQ_STATS_CALL("load_add_store__u16", rseq_load_add_store__u16, __VA_ARGS__)
+#define rseq_load_cbne_store_store__u16(...)					\
+	RSEQ_STATS_CALL("load_cbne_store_store__u16",				\
+			rseq_load_cbne_store_store__u16, __VA_ARGS__)
+#define rseq_load_cbne_load_cbne_store__u16(...)				\
+	RSEQ_STATS_CALL("load_cbne_load_cbne_store__u16",			\
+			rseq_load_cbne_load_cbne_store__u16, __VA_ARGS__)
+#define rseq_load_cbne_store__u8(...)						\
+	RSEQ_STATS_CALL("load_cbne_store__u8", rseq_load_cbne_store__u8, __VA_ARGS__)
+#define rseq_load_add_store__u8(...)						\
+	RSEQ_STATS_CALL("load_add_store__u8", rseq_load_add_store__u8, __VA_ARGS__)
+#define rseq_load_cbne_store_store__u8(...)					\
+	RSEQ_STATS_CALL("load_cbne_store_store__u8",				\
+			rseq_load_cbne_store_store__u8, __VA_ARGS__)
+#define rseq_load_cbne_load_cbne_store__u8(...)					\
+	RSEQ_STATS_CALL("load_cbne_load_cbne_store__u8",			\
+			rseq_load_cbne_load_cbne_store__u8, __VA_ARGS__)
+#endif
+
+#endif /* RSEQ_STATS */
+
+#endif /* _RSEQ_STATS_H */
@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com> */
+
+/*
+ * rseq/typed.h
+ *
+ * Critical section helpers operating on 32-bit, 16-bit and 8-bit
+ * fields. Included from rseq/rseq.h for each type.
+ *
+ * Those helpers only exist on architectures defining
+ * rseq_arch_has_typed_ops, currently x86-64: callers must check that
+ * macro before using them. Where they exist, they behave as the
+ * intptr_t helpers documented in rseq/pseudocode.h with loads and
+ * stores of the width of the type, and only support RSEQ_MO_RELAXED.
+ */
+
+#include "rseq/arch/templates/typed.h"
+
+#define RSEQ_TYPED_VARIANT(x, suffix)	RSEQ_COMBINE_TOKENS(RSEQ_TEMPLATE_TYPED(x), suffix)
+
+int RSEQ_TEMPLATE_TYPED(rseq_fallback_load_cbne_store)(RSEQ_TEMPLATE_TYPE *v,
+		RSEQ_TEMPLATE_TYPE expect, RSEQ_TEMPLATE_TYPE newv, int cpu);
+int RSEQ_TEMPLATE_TYPED(rseq_fallback_load_add_store)(RSEQ_TEMPLATE_TYPE *v,
+		RSEQ_TEMPLATE_TYPE count, int cpu);
+int RSEQ_TEMPLATE_TYPED(rseq_fallback_load_cbne_store_store)(RSEQ_TEMPLATE_TYPE *v,
+		RSEQ_TEMPLATE_TYPE expect, RSEQ_TEMPLATE_TYPE *v2,
+		RSEQ_TEMPLATE_TYPE newv2, RSEQ_TEMPLATE_TYPE newv, int cpu);
+int RSEQ_TEMPLATE_TYPED(rseq_fallback_load_cbne_load_cbne_store)(RSEQ_TEMPLATE_TYPE *v,
+		RSEQ_TEMPLATE_TYPE expect, RSEQ_TEMPLATE_TYPE *v2,
+		RSEQ_TEMPLATE_TYPE expect2, RSEQ_TEMPLATE_TYPE newv, int cpu);
+
+#ifdef rseq_arch_has_typed_ops
+
+static inline __attribute__((always_inline))
+int RSEQ_TEMPLATE_TYPED(rseq_load_cbne_store)(enum rseq_mo rseq_mo, enum rseq_percpu_mode percpu_mode,
+		RSEQ_TEMPLATE_TYPE *v, RSEQ_TEMPLATE_TYPE expect,
+		RSEQ_TEMPLATE_TYPE newv, int cpu)
+{
+	int ret;
+
+	if (rseq_mo != RSEQ_MO_RELAXED)
+		return -1;
+	switch (percpu_mode) {
+	case RSEQ_PERCPU_CPU_ID:
+		ret = RSEQ_TYPED_VARIANT(rseq_load_cbne_store, _relaxed_cpu_id)(v, expect, newv, cpu);
+		break;
+	case RSEQ_PERCPU_MM_CID:
+		ret = RSEQ_TYPED_VARIANT(rseq_load_cbne_store, _relaxed_mm_cid)(v, expect, newv, cpu);
+		break;
+	default:
+		return -1;
+	}
+	if (rseq_unlikely(ret < 0))
+		ret = RSEQ_TEMPLATE_TYPED(rseq_fallback_load_cbne_store)(v, expect, newv, cpu);
+	return ret;
+}
+
+static inline __attribute__((always_inline))
+int RSEQ_TEMPLATE_TYPED(rseq_load_add_store)(enum rseq_mo rseq_mo, enum rseq_percpu_mode percpu_mode,
+		RSEQ_TEMPLATE_TYPE *v, RSEQ_TEMPLATE_TYPE count, int cpu)
+{
+	int ret;
+
+	if (rseq_mo != RSEQ_MO_RELAXED)
+		return -1;
+	switch (percpu_mode) {
+	case RSEQ_PERCPU_CPU_ID:
+		ret = RSEQ_TYPED_VARIANT(rseq_load_add_store, _relaxed_cpu_id)(v, count, cpu);
+		break;
+	case RSEQ_PERCPU_MM_CID:
+		ret = RSEQ_TYPED_VARIANT(rseq_load_add_store, _relaxed_mm_cid)(v, count, cpu);
+		break;
+	default:
+		return -1;
+	}
+	if (rseq_unlikely(ret < 0))
+		ret = RSEQ_TEMPLATE_TYPED(rseq_fallback_load_add_store)(v, count, cpu);
+	return ret;
+}
+
+static inline __attribute__((always_inline))
+int RSEQ_TEMPLATE_TYPED(rseq_load_cbne_store_store)(enum rseq_mo rseq_mo, enum rseq_percpu_mode percpu_mode,
+		RSEQ_TEMPLATE_TYPE *v, RSEQ_TEMPLATE_TYPE expect,
+		RSEQ_TEMPLATE_TYPE *v2, RSEQ_TEMPLATE_TYPE newv2,
+		RSEQ_TEMPLATE_TYPE newv, int cpu)
+{
+	int ret;
+
+	switch (rseq_mo) {
+	case RSEQ_MO_RELAXED:
+		switch (percpu_mode) {
+		case RSEQ_PERCPU_CPU_ID:
+			ret = RSEQ_TYPED_VARIANT(rseq_load_cbne_store_store, _relaxed_cpu_id)(v, expect, v2, newv2, newv, cpu);
+			break;
+		case RSEQ_PERCPU_MM_CID:
+			ret = RSEQ_TYPED_VARIANT(rseq_load_cbne_store_store, _relaxed_mm_cid)(v, expect, v2, newv2, newv, cpu);
+			break;
+		default:
+			return -1;
+		}
+		break;
+	case RSEQ_MO_RELEASE:
+		switch (percpu_mode) {
+		case RSEQ_PERCPU_CPU_ID:
+			ret = RSEQ_TYPED_VARIANT(rseq_load_cbne_store_store, _release_cpu_id)(v, expect, v2, newv2, newv, cpu);
+			break;
+		case RSEQ_PERCPU_MM_CID:
+			ret = RSEQ_TYPED_VARIANT(rseq_load_cbne_store_store, _release_mm_cid)(v, expect, v2, newv2, newv, cpu);
+			break;
+		default:
+			return -1;
+		}
+		break;
+	case RSEQ_MO_ACQUIRE:	/* Fallthrough */
+	case RSEQ_MO_ACQ_REL:	/* Fallthrough */
+	case RSEQ_MO_CONSUME:	/* Fallthrough */
+	case RSEQ_MO_SEQ_CST:	/* Fallthrough */
+	default:
+		return -1;
+	}
+	if (rseq_unlikely(ret < 0))
+		ret = RSEQ_TEMPLATE_TYPED(rseq_fallback_load_cbne_store_store)(v, expect, v2, newv2, newv, cpu);
+	return ret;
+}
+
+static inline __attribute__((always_inline))
+int RSEQ_TEMPLATE_TYPED(rseq_load_cbne_load_cbne_store)(enum rseq_mo rseq_mo, enum rseq_percpu_mode percpu_mode,
+		RSEQ_TEMPLATE_TYPE *v, RSEQ_TEMPLATE_TYPE expect,
+		RSEQ_TEMPLATE_TYPE *v2, RSEQ_TEMPLATE_TYPE expect2,
+		RSEQ_TEMPLATE_TYPE newv, int cpu)
+{
+	int ret;
+
+	if (rseq_mo != RSEQ_MO_RELAXED)
+		return -1;
+	switch (percpu_mode) {
+	case RSEQ_PERCPU_CPU_ID:
+		ret = RSEQ_TYPED_VARIANT(rseq_load_cbne_load_cbne_store, _relaxed_cpu_id)(v, expect, v2, expect2, newv, cpu);
+		break;
+	case RSEQ_PERCPU_MM_CID:
+		ret = RSEQ_TYPED_VARIANT(rseq_load_cbne_load_cbne_store, _relaxed_mm_cid)(v, expect, v2, expect2, newv, cpu);
+		break;
+	default:
+		return -1;
+	}
+	if (rseq_unlikely(ret < 0))
+		ret = RSEQ_TEMPLATE_TYPED(rseq_fallback_load_cbne_load_cbne_store)(v, expect, v2, expect2, newv, cpu);
+	return ret;
+}
+
+#endif /* #ifdef rseq_arch_has_typed_ops */
+
+#undef RSEQ_TYPED_VARIANT
+
+#include "rseq/arch/templates/typed-reset.h"
@@ -0,0 +1,436 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+
+#include "rseq-fallback.h"
+
+/*
+ * Lock-based execution of the critical section helpers, used when rseq
+ * is unavailable. Each helper takes the spinlock associated with its
+ * cpu argument, which serializes it against all other helpers
+ * operating on the same per-CPU data. Because the fallback is selected
+ * process-wide, no critical section can run concurrently with rseq.
+ *
+ * The number of locks is fixed: CPU numbers beyond FALLBACK_NR_LOCKS
+ * share locks, which only affects scalability.
+ */
+#define FALLBACK_NR_LOCKS	512
+
+/* Number of busy-wait iterations before yielding the CPU. */
+#define FALLBACK_SPIN_LOOPS	128
+
+struct fallback_lock {
+	int v;
+} __attribute__((aligned(128)));
+
+static struct fallback_lock fallback_locks[FALLBACK_NR_LOCKS];
+
+static int fallback_enabled;
+
+void rseq_fallback_activate(void)
+{
+	__atomic_store_n(&fallback_enabled, 1, __ATOMIC_RELAXED);
+}
+
+bool rseq_fallback_active(void)
+{
+	return __atomic_load_n(&fallback_enabled, __ATOMIC_RELAXED);
+}
+
+/*
+ * Handle an aborted critical section. Returns true if the operation
+ * must be executed by the fallback, false if the abort is reported to
+ * the caller.
+ */
+static
+bool fallback_abort(void)
+{
+	if (rseq_fallback_active())
+		return true;
+	rseq_auto_register_current_thread();
+	return false;
+}
+
+static inline
+void fallback_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__ ("pause" : : : "memory");
+#else
+	rseq_barrier();
+#endif
+}
+
+static
+struct fallback_lock *fallback_lock(int cpu)
+{
+	struct fallback_lock *lock = &fallback_locks[(unsigned int) cpu % FALLBACK_NR_LOCKS];
+	unsigned int loops = 0;
+
+	for (;;) {
+		if (!__atomic_load_n(&lock->v, __ATOMIC_RELAXED) &&
+				!__atomic_exchange_n(&lock->v, 1, __ATOMIC_ACQUIRE))
+			return lock;
+		if (++loops < FALLBACK_SPIN_LOOPS) {
+			fallback_cpu_relax();
+		} else {
+			/* The lock holder may have been preempted. */
+			sched_yield();
+			loops = 0;
+		}
+	}
+}
+
+static
+void fallback_unlock(struct fallback_lock *lock)
+{
+	__atomic_store_n(&lock->v, 0, __ATOMIC_RELEASE);
+}
+
+void rseq_fallback_fence(int cpu)
+{
+	int i;
+
+	if (cpu >= 0) {
+		fallback_unlock(fallback_lock(cpu));
+		return;
+	}
+	for (i = 0; i < FALLBACK_NR_LOCKS; i++)
+		fallback_unlock(fallback_lock(i));
+}
+
+int rseq_fallback_load_cbne_store__ptr(intptr_t *v, intptr_t expect,
+		intptr_t newv, int cpu)
+{
+	struct fallback_lock *lock;
+	int ret = 0;
+
+	if (!fallback_abort())
+		return -1;
+	lock = fallback_lock(cpu);
+	if (RSEQ_READ_ONCE(*v) != expect)
+		ret = 1;
+	else
+		RSEQ_WRITE_ONCE(*v, newv);
+	fallback_unlock(lock);
+	return ret;
+}
+
+int rseq_fallback_load_cbeq_store_add_load_store__ptr(intptr_t *v,
+		intptr_t expectnot, long voffp, intptr_t *load, int cpu)
+{
+	struct fallback_lock *lock;
+	intptr_t r1;
+	int ret = 0;
+
+	if (!fallback_abort())
+		return -1;
+	lock = fallback_lock(cpu);
+	r1 = RSEQ_READ_ONCE(*v);
+	if (r1 == expectnot) {
+		ret = 1;
+	} else {
+		*load = r1;
+		RSEQ_WRITE_ONCE(*v, RSEQ_READ_ONCE(*(intptr_t *) (r1 + voffp)));
+	}
+	fallback_unlock(lock);
+	return ret;
+}
+
+int rseq_fallback_load_cbne_load_cbeq_store_add_load_store__ptr(intptr_t *v,
+		intptr_t expect, intptr_t *v2, intptr_t expectnot2, long voffp,
+		intptr_t *load, int cpu)
+{
+	struct fallback_lock *lock;
+	intptr_t r2;
+	int ret = 0;
+
+	if (!fallback_abort())
+		return -1;
+	lock = fallback_lock(cpu);
+	r2 = RSEQ_READ_ONCE(*v2);
+	if (RSEQ_READ_ONCE(*v) != expect || r2 == expectnot2) {
+		ret = 1;
+	} else {
+		*load = r2;
+		RSEQ_WRITE_ONCE(*v2, RSEQ_READ_ONCE(*(intptr_t *) (r2 + voffp)));
+	}
+	fallback_unlock(lock);
+	return ret;
+}
+
+int rseq_fallback_load_add_store__ptr(intptr_t *v, intptr_t count, int cpu)
+{
+	struct fallback_lock *lock;
+
+	if (!fallback_abort())
+		return -1;
+	lock = fallback_lock(cpu);
+	RSEQ_WRITE_ONCE(*v, RSEQ_READ_ONCE(*v) + count);
+	fallback_unlock(lock);
+	return 0;
+}
+
+int rseq_fallback_load_add_store_load__ptr(intptr_t *v, intptr_t count,
+		intptr_t *load, int cpu)
+{
+	struct fallback_lock *lock;
+	intptr_t r1;
+
+	if (!fallback_abort())
+		return -1;
+	lock = fallback_lock(cpu);
+	r1 = RSEQ_READ_ONCE(*v);
+	*load = r1;
+	RSEQ_WRITE_ONCE(*v, r1 + count);
+	fallback_unlock(lock);
+	return 0;
+}
+
+int rseq_fallback_load_add_load_load_add_store__ptr(intptr_t *ptr, long off,
+		intptr_t inc, int cpu)
+{
+	struct fallback_lock *lock;
+	intptr_t *r2;
+
+	if (!fallback_abort())
+		return -1;
+	lock = fallback_lock(cpu);
+	r2 = (intptr_t *) RSEQ_READ_ONCE(*(intptr_t *) (RSEQ_READ_ONCE(*ptr) + off));
+	RSEQ_WRITE_ONCE(*r2, RSEQ_READ_ONCE(*r2) + inc);
+	fallback_unlock(lock);
+	return 0;
+}
+
+int rseq_fallback_load_cbne_store_store__ptr(intptr_t *v, intptr_t expect,
+		intptr_t *v2, intptr_t newv2, intptr_t newv, int cpu)
+{
+	struct fallback_lock *lock;
+	int ret = 0;
+
+	if (!fallback_abort())
+		return -1;
+	lock = fallback_lock(cpu);
+	if (RSEQ_READ_ONCE(*v) != expect) {
+		ret = 1;
+	} else {
+		RSEQ_WRITE_ONCE(*v2, newv2);
+		/* Final store with release semantic covers both memory orders. */
+		__atomic_store_n(v, newv, __ATOMIC_RELEASE);
+	}
+	fallback_unlock(lock);
+	return ret;
+}
+
+int rseq_fallback_load_cbne_load_cbne_store__ptr(intptr_t *v, intptr_t expect,
+		intptr_t *v2, intptr_t expect2, intptr_t newv, int cpu)
+{
+	struct fallback_lock *lock;
+	int ret = 0;
+
+	if (!fallback_abort())
+		return -1;
+	lock = fallback_lock(cpu);
+	if (RSEQ_READ_ONCE(*v) != expect || RSEQ_READ_ONCE(*v2) != expect2)
+		ret = 1;
+	else
+		RSEQ_WRITE_ONCE(*v, newv);
+	fallback_unlock(lock);
+	return ret;
+}
+
+int rseq_fallback_load_cbne_memcpy_store__ptr(intptr_t *v, intptr_t expect,
+		void *dst, void *src, size_t len, intptr_t newv, int cpu)
+{
+	struct fallback_lock *lock;
+	int ret = 0;
+
+	if (!fallback_abort())
+		return -1;
+	lock = fallback_lock(cpu);
+	if (RSEQ_READ_ONCE(*v) != expect) {
+		ret = 1;
+	} else {
+		memcpy(dst, src, len);
+		/* Final store with release semantic covers both memory orders. */
+		__atomic_store_n(v, newv, __ATOMIC_RELEASE);
+	}
+	fallback_unlock(lock);
+	return ret;
+}
+
+int rseq_fallback_load_cbne_storev_store__ptr(intptr_t *v, intptr_t expect,
+		const struct rseq_store_pair *stores, size_t nr_stores,
+		intptr_t newv, int cpu)
+{
+	struct fallback_lock *lock;
+	int ret = 0;
+	size_t i;
+
+	if (nr_stores > RSEQ_STOREV_MAX)
+		rseq_bug("nr_stores is larger than RSEQ_STOREV_MAX");
+	if (!fallback_abort())
+		return -1;
+	lock = fallback_lock(cpu);
+	if (RSEQ_READ_ONCE(*v) != expect) {
+		ret = 1;
+	} else {
+		for (i = 0; i < nr_stores; i++)
+			RSEQ_WRITE_ONCE(*stores[i].addr, stores[i].value);
+		/* Final store with release semantic covers both memory orders. */
+		__atomic_store_n(v, newv, __ATOMIC_RELEASE);
+	}
+	fallback_unlock(lock);
+	return ret;
+}
+
+/*
+ * The per-cpu slot of the stride helpers is selected with the current
+ * CPU number, since the mm_cid is not available without rseq.
+ */
+static
+intptr_t *fallback_percpu_ptr(intptr_t *v, size_t stride, int *cpu)
+{
+	*cpu = (int) rseq_current_cpu();
+	return (intptr_t *) ((uintptr_t) v + (unsigned int) *cpu * (uintptr_t) stride);
+}
+
+int rseq_fallback_percpu_load_add_store__ptr(intptr_t *v, size_t stride,
+		intptr_t count)
+{
+	struct fallback_lock *lock;
+	intptr_t *p;
+	int cpu;
+
+	if (!fallback_abort())
+		return -1;
+	p = fallback_percpu_ptr(v, stride, &cpu);
+	lock = fallback_lock(cpu);
+	RSEQ_WRITE_ONCE(*p, RSEQ_READ_ONCE(*p) + count);
+	fallback_unlock(lock);
+	return 0;
+}
+
+int rseq_fallback_percpu_load_add_store_load__ptr(intptr_t *v, size_t stride,
+		intptr_t count, intptr_t *load)
+{
+	struct fallback_lock *lock;
+	intptr_t *p, r1;
+	int cpu;
+
+	if (!fallback_abort())
+		return -1;
+	p = fallback_percpu_ptr(v, stride, &cpu);
+	lock = fallback_lock(cpu);
+	r1 = RSEQ_READ_ONCE(*p);
+	*load = r1;
+	RSEQ_WRITE_ONCE(*p, r1 + count);
+	fallback_unlock(lock);
+	return 0;
+}
+
+int rseq_fallback_percpu_load_cbeq_store_add_load_store__ptr(intptr_t *v,
+		size_t stride, intptr_t expectnot, long voffp, intptr_t *load)
+{
+	struct fallback_lock *lock;
+	intptr_t *p, r1;
+	int ret = 0, cpu;
+
+	if (!fallback_abort())
+		return -1;
+	p = fallback_percpu_ptr(v, stride, &cpu);
+	lock = fallback_lock(cpu);
+	r1 = RSEQ_READ_ONCE(*p);
+	if (r1 == expectnot) {
+		ret = 1;
+	} else {
+		*load = r1;
+		RSEQ_WRITE_ONCE(*p, RSEQ_READ_ONCE(*(intptr_t *) (r1 + voffp)));
+	}
+	fallback_unlock(lock);
+	return ret;
+}
+
+/*
+ * Fallback of the critical section helpers operating on 32-bit, 16-bit
+ * and 8-bit fields (see rseq/typed.h).
+ */
+#define FALLBACK_TYPED_OPS(_type, _suffix)					\
+int RSEQ_COMBINE_TOKENS(rseq_fallback_load_cbne_store, _suffix)(_type *v,	\
+		_type expect, _type newv, int cpu)				\
+{										\
+	struct fallback_lock *lock;						\
+	int ret = 0;								\
+										\
+	if (!fallback_abort())							\
+		return -1;							\
+	lock = fallback_lock(cpu);						\
+	if (RSEQ_READ_ONCE(*v) != expect)					\
+		ret = 1;							\
+	else									\
+		RSEQ_WRITE_ONCE(*v, newv);					\
+	fallback_unlock(lock);							\
+	return ret;								\
+}										\
+										\
+int RSEQ_COMBINE_TOKENS(rseq_fallback_load_add_store, _suffix)(_type *v,	\
+		_type count, int cpu)						\
+{										\
+	struct fallback_lock *lock;						\
+										\
+	if (!fallback_abort())							\
+		return -1;							\
+	lock = fallback_lock(cpu);						\
+	RSEQ_WRITE_ONCE(*v, (_type) (RSEQ_READ_ONCE(*v) + count));		\
+	fallback_unlock(lock);							\
+	return 0;								\
+}										\
+										\
+int RSEQ_COMBINE_TOKENS(rseq_fallback_load_cbne_store_store, _suffix)(_type *v,	\
+		_type expect, _type *v2, _type newv2, _type newv, int cpu)	\
+{										\
+	struct fallback_lock *lock;						\
+	int ret = 0;								\
+										\
+	if (!fallback_abort())							\
+		return -1;							\
+	lock = fallback_lock(cpu);						\
+	if (RSEQ_READ_ONCE(*v) != expect) {					\
+		ret = 1;							\
+	} else {								\
+		RSEQ_WRITE_ONCE(*v2, newv2);					\
+		__atomic_store_n(v, newv, __ATOMIC_RELEASE);			\
+	}									\
+	fallback_unlock(lock);							\
+	return ret;								\
+}										\
+										\
+int RSEQ_COMBINE_TOKENS(rseq_fallback_load_cbne_load_cbne_store, _suffix)(_type *v, \
+		_type expect, _type *v2, _type expect2, _type newv, int cpu)	\
+{										\
+	struct fallback_lock *lock;						\
+	int ret = 0;								\
+										\
+	if (!fallback_abort())							\
+		return -1;							\
+	lock = fallback_lock(cpu);						\
+	if (RSEQ_READ_ONCE(*v) != expect || RSEQ_READ_ONCE(*v2) != expect2)	\
+		ret = 1;							\
+	else									\
+		RSEQ_WRITE_ONCE(*v, newv);					\
+	fallback_unlock(lock);							\
+	return ret;								\
+}
+
+FALLBACK_TYPED_OPS(uint32_t, __u32)
+FALLBACK_TYPED_OPS(uint16_t, __u16)
+FALLBACK_TYPED_OPS(uint8_t, __u8)
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+
+#ifndef _RSEQ_FALLBACK_H
+#define _RSEQ_FALLBACK_H
+
+/*
+ * Make the critical section helpers use the lock-based fallback for
+ * the rest of the process lifetime.
+ */
+void rseq_fallback_activate(void) __attribute__((visibility("hidden")));
+
+/*
+ * Register the current thread if automatic registration is enabled and
+ * the thread is not registered yet.
+ */
+void rseq_auto_register_current_thread(void) __attribute__((visibility("hidden")));
+
+/*
+ * Wait for the fallback critical sections in flight on @cpu, or on all
+ * CPUs if @cpu is negative, to complete.
+ */
+void rseq_fallback_fence(int cpu) __attribute__((visibility("hidden")));
+
+#endif /* _RSEQ_FALLBACK_H */
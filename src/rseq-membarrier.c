@@ -0,0 +1,153 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <syscall.h>
+#include <unistd.h>
+#include <linux/version.h>
+#include <linux/membarrier.h>
+
+#include <rseq/rseq.h>
+
+#include "rseq-fallback.h"
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,10,0)
+enum {
+	MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ			= (1 << 7),
+	MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ		= (1 << 8),
+};
+
+enum {
+	MEMBARRIER_CMD_FLAG_CPU		= (1 << 0),
+};
+#endif
+
+enum membarrier_state {
+	MEMBARRIER_STATE_UNKNOWN = 0,
+	MEMBARRIER_STATE_REGISTERED,
+	MEMBARRIER_STATE_UNAVAILABLE,
+};
+
+/* Fence all CPUs when more than 1/MASK_FENCE_ALL_RATIO of them are set. */
+#define MASK_FENCE_ALL_RATIO	4
+
+#define BITS_PER_LONG		(sizeof(unsigned long) * CHAR_BIT)
+
+static pthread_mutex_t membarrier_lock = PTHREAD_MUTEX_INITIALIZER;
+static enum membarrier_state membarrier_state;
+
+static
+int sys_membarrier(int cmd, unsigned int flags, int cpu_id)
+{
+	return syscall(__NR_membarrier, cmd, flags, cpu_id);
+}
+
+static
+bool mask_test(const unsigned long *mask, int cpu)
+{
+	return mask[cpu / BITS_PER_LONG] & (1UL << (cpu % BITS_PER_LONG));
+}
+
+/*
+ * Query support for rseq fencing and register the process for it on
+ * first use. The outcome is cached for the lifetime of the process.
+ */
+static
+enum membarrier_state membarrier_get_state(void)
+{
+	enum membarrier_state state;
+	int mask;
+
+	state = __atomic_load_n(&membarrier_state, __ATOMIC_ACQUIRE);
+	if (state != MEMBARRIER_STATE_UNKNOWN)
+		return state;
+	pthread_mutex_lock(&membarrier_lock);
+	state = membarrier_state;
+	if (state != MEMBARRIER_STATE_UNKNOWN)
+		goto end;
+	state = MEMBARRIER_STATE_UNAVAILABLE;
+	mask = sys_membarrier(MEMBARRIER_CMD_QUERY, 0, 0);
+	if (mask < 0 || !(mask & MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ))
+		goto publish;
+	if (sys_membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0))
+		goto publish;
+	state = MEMBARRIER_STATE_REGISTERED;
+publish:
+	__atomic_store_n(&membarrier_state, state, __ATOMIC_RELEASE);
+end:
+	pthread_mutex_unlock(&membarrier_lock);
+	return state;
+}
+
+bool rseq_fence_available(void)
+{
+	return rseq_fallback_active() ||
+		membarrier_get_state() == MEMBARRIER_STATE_REGISTERED;
+}
+
+/* Fence @cpu, or all CPUs if @cpu is negative. */
+static
+int fence(int cpu)
+{
+	int ret;
+
+	/* Without rseq, critical sections are serialized by the fallback locks. */
+	if (rseq_fallback_active()) {
+		rseq_fallback_fence(cpu);
+		return 0;
+	}
+	if (membarrier_get_state() != MEMBARRIER_STATE_REGISTERED) {
+		errno = ENOSYS;
+		return -1;
+	}
+	if (cpu < 0)
+		return sys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0);
+	ret = sys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ,
+			MEMBARRIER_CMD_FLAG_CPU, cpu);
+	/* No critical section can be in flight on a missing CPU. */
+	if (ret && errno == ENXIO)
+		ret = 0;
+	return ret;
+}
+
+int rseq_fence_cpu(int cpu)
+{
+	if (cpu < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return fence(cpu);
+}
+
+int rseq_fence_all(void)
+{
+	return fence(-1);
+}
+
+int rseq_fence_cpu_mask(const unsigned long *mask, int nr_cpus)
+{
+	int cpu, nr_set = 0;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (mask_test(mask, cpu))
+			nr_set++;
+	}
+	if (!nr_set)
+		return 0;
+	/*
+	 * Each CPU fence is a system call: fence all CPUs at once when
+	 * more than a quarter of the possible CPUs are set.
+	 */
+	if (nr_set > 1 && nr_set > rseq_get_max_nr_cpus() / MASK_FENCE_ALL_RATIO)
+		return fence(-1);
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (mask_test(mask, cpu) && fence(cpu))
+			return -1;
+	}
+	return 0;
+}
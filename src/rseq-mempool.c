@@ -21,6 +21,10 @@
 # include <numaif.h>
 #endif
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 #include "rseq-utils.h"
 #include "list.h"
 #include <rseq/rseq.h>
@@ -69,6 +73,39 @@
  */
 #define DEFAULT_COW_ZERO_POISON_VALUE	0x0
 
+/*
+ * Maximum number of pools with handles enabled in the global pool
+ * index. Pool index 0 is reserved so a zeroed per-CPU handle never
+ * resolves to an item, and is used by pools without handles.
+ */
+#define POOL_INDEX_MAX_NR_POOLS		4096
+
+/*
+ * Upper bound on the number of ranges reachable through per-CPU
+ * handles, which sizes the per-pool range table.
+ */
+#define POOL_HANDLE_MAX_NR_RANGES	(1UL << 16)
+
+/*
+ * The range table is split in chunks of entries allocated when the
+ * first range they describe is created, so pools with few ranges only
+ * pay for a small chunk directory.
+ */
+#define RANGE_TABLE_CHUNK_ORDER		8
+#define RANGE_TABLE_CHUNK_LEN		(1UL << RANGE_TABLE_CHUNK_ORDER)
+
+/*
+ * Zeroing or initializing an item on all CPUs writes item_len *
+ * max_nr_cpus bytes. When this total reaches ITEM_NT_STORE_MIN_TOTAL_LEN
+ * (and items span whole cache lines), use non-temporal stores so the
+ * per-CPU copies, which are meant to be used by other CPUs, do not
+ * evict the caller's working set. Otherwise, prefetch the item of the
+ * next CPU ITEM_PREFETCH_DISTANCE CPUs ahead to overlap cache misses.
+ */
+#define ITEM_NT_STORE_MIN_TOTAL_LEN	(256 * 1024)
+#define ITEM_NT_STORE_MIN_LEN		64
+#define ITEM_PREFETCH_DISTANCE		2
+
 struct free_list_node;
 
 struct free_list_node {
@@ -97,6 +134,17 @@ struct rseq_mempool_attr {
 	uintptr_t poison;
 
 	enum rseq_mempool_populate_policy populate_policy;
+
+	size_t max_bytes;
+
+	bool handles_set;
+
+	bool pressure_set;
+	void (*pressure_func)(void *priv, struct rseq_mempool *pool,
+			enum rseq_mempool_pressure pressure, size_t used_bytes);
+	void *pressure_priv;
+	size_t pressure_low;
+	size_t pressure_high;
 };
 
 struct rseq_mempool_range;
@@ -140,6 +188,9 @@ struct rseq_mempool_range {
 
 	/* Track alloc/free. */
 	unsigned long *alloc_bitmap;
+
+	/* Index of the range within its pool, in creation order. */
+	unsigned long index;
 };
 
 struct rseq_mempool {
@@ -173,6 +224,31 @@ struct rseq_mempool {
 
 	struct rseq_mempool_attr attr;
 	char *name;
+
+	/*
+	 * Index of the pool in the global pool index, or 0 if handles
+	 * are not enabled.
+	 */
+	uint32_t id;
+
+	/*
+	 * Bytes reserved by allocated items on all CPUs, and current
+	 * pressure level. Protected by the pool lock.
+	 */
+	size_t used_bytes;
+	enum rseq_mempool_pressure pressure;
+
+	/*
+	 * Range table mapping range indexes to range base addresses,
+	 * used to decode per-CPU indexes and handles. Only allocated if
+	 * handles are enabled, as a directory of chunks of
+	 * RANGE_TABLE_CHUNK_LEN entries. Chunks and entries are populated
+	 * when ranges are created, and never change afterwards.
+	 */
+	void ***range_table;
+	unsigned long range_table_len;
+	/* Number of items per range, as a power of two. */
+	int range_items_order;
 };
 
 /*
@@ -186,6 +262,14 @@ struct rseq_mempool_set {
 	struct rseq_mempool *entries[POOL_SET_NR_ENTRIES];
 };
 
+/*
+ * Global pool index, used to resolve per-CPU handles to pools. Updates
+ * are protected by pool_index_lock. Lookups are lock-free: a pool is
+ * published before any of its items can be handed out.
+ */
+static pthread_mutex_t pool_index_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rseq_mempool *pool_index[POOL_INDEX_MAX_NR_POOLS];
+
 static
 const char *get_pool_name(const struct rseq_mempool *pool)
 {
@@ -266,10 +350,122 @@ intptr_t rseq_cmp_item(void *p, size_t item_len, intptr_t cmp_value, intptr_t *u
 	return res;
 }
 
+#ifdef __SSE2__
+/*
+ * Non-temporal stores bypass the cache hierarchy. @dst must be aligned
+ * on 16 bytes. Issue rseq_nt_store_fence() before publishing the
+ * stored data.
+ */
+static
+void rseq_nt_bzero(void *dst, size_t len)
+{
+	__m128i zero = _mm_setzero_si128();
+	char *p = (char *) dst;
+	size_t offset;
+
+	for (offset = 0; offset + 16 <= len; offset += 16)
+		_mm_stream_si128((__m128i *) (p + offset), zero);
+	if (offset < len)
+		memset(p + offset, 0, len - offset);
+}
+
+static
+void rseq_nt_memcpy(void *dst, const void *src, size_t len)
+{
+	const char *s = (const char *) src;
+	char *d = (char *) dst;
+	size_t offset;
+
+	for (offset = 0; offset + 16 <= len; offset += 16)
+		_mm_stream_si128((__m128i *) (d + offset),
+			_mm_loadu_si128((const __m128i *) (s + offset)));
+	if (offset < len)
+		memcpy(d + offset, s + offset, len - offset);
+}
+
+static
+void rseq_nt_store_fence(void)
+{
+	_mm_sfence();
+}
+
+static
+bool item_use_nt_store(const struct rseq_mempool *pool)
+{
+	return pool->item_len >= ITEM_NT_STORE_MIN_LEN &&
+		pool->item_len * pool->attr.max_nr_cpus >= ITEM_NT_STORE_MIN_TOTAL_LEN;
+}
+#else
+static
+void rseq_nt_bzero(void *dst, size_t len)
+{
+	memset(dst, 0, len);
+}
+
+static
+void rseq_nt_memcpy(void *dst, const void *src, size_t len)
+{
+	memcpy(dst, src, len);
+}
+
+static
+void rseq_nt_store_fence(void)
+{
+}
+
+static
+bool item_use_nt_store(const struct rseq_mempool *pool __attribute__((unused)))
+{
+	return false;
+}
+#endif
+
+static
+void rseq_percpu_prefetch_item(struct rseq_mempool *pool,
+		struct rseq_mempool_range *range, uintptr_t item_offset, int cpu)
+{
+	if (cpu >= pool->attr.max_nr_cpus)
+		return;
+	__builtin_prefetch(__rseq_pool_range_percpu_ptr(range, cpu,
+			item_offset, pool->attr.stride), 1, 3);
+}
+
+/*
+ * Compare-before-write for the non-temporal store path. Reading the
+ * whole item of each CPU would bring it into the cache, which is what
+ * non-temporal stores avoid. Only compare the first cache line: an item
+ * differing there is written without further reads. An item matching
+ * there is most likely still backed by the page shared by all CPUs
+ * (zero page or init page), whose lines are shared by all CPUs, so
+ * comparing the rest of it avoids a COW page fault without polluting
+ * the cache with per-CPU lines.
+ */
+static
+bool nt_item_matches(const void *p, const void *expect, size_t len)
+{
+	if (memcmp(p, expect, ITEM_NT_STORE_MIN_LEN))
+		return false;
+	return !memcmp((const char *) p + ITEM_NT_STORE_MIN_LEN,
+			(const char *) expect + ITEM_NT_STORE_MIN_LEN,
+			len - ITEM_NT_STORE_MIN_LEN);
+}
+
+static
+bool nt_item_is_zero(const void *p, size_t len)
+{
+	static const char zero[ITEM_NT_STORE_MIN_LEN];
+
+	if (memcmp(p, zero, ITEM_NT_STORE_MIN_LEN))
+		return false;
+	return !rseq_cmp_item((char *) p + ITEM_NT_STORE_MIN_LEN,
+			len - ITEM_NT_STORE_MIN_LEN, 0, NULL);
+}
+
 static
 void rseq_percpu_zero_item(struct rseq_mempool *pool,
 		struct rseq_mempool_range *range, uintptr_t item_offset)
 {
+	bool nt_store = item_use_nt_store(pool);
 	char *init_p = NULL;
 	int i;
 
@@ -280,6 +476,9 @@ void rseq_percpu_zero_item(struct rseq_mempool *pool,
 		char *p = __rseq_pool_range_percpu_ptr(range, i,
 				item_offset, pool->attr.stride);
 
+		if (!nt_store)
+			rseq_percpu_prefetch_item(pool, range, item_offset,
+					i + ITEM_PREFETCH_DISTANCE);
 		/*
 		 * If item is already zeroed, either because the
 		 * init range update has propagated or because the
@@ -293,10 +492,18 @@ void rseq_percpu_zero_item(struct rseq_mempool *pool,
 		 * malloc_init() in populate-all pools if it populates
 		 * non-zero content.
 		 */
-		if (!rseq_cmp_item(p, pool->item_len, 0, NULL))
-			continue;
-		bzero(p, pool->item_len);
+		if (nt_store) {
+			if (nt_item_is_zero(p, pool->item_len))
+				continue;
+			rseq_nt_bzero(p, pool->item_len);
+		} else {
+			if (!rseq_cmp_item(p, pool->item_len, 0, NULL))
+				continue;
+			bzero(p, pool->item_len);
+		}
 	}
+	if (nt_store)
+		rseq_nt_store_fence();
 }
 
 static
@@ -304,6 +511,7 @@ void rseq_percpu_init_item(struct rseq_mempool *pool,
 		struct rseq_mempool_range *range, uintptr_t item_offset,
 		void *init_ptr, size_t init_len)
 {
+	bool nt_store = item_use_nt_store(pool);
 	char *init_p = NULL;
 	int i;
 
@@ -314,16 +522,27 @@ void rseq_percpu_init_item(struct rseq_mempool *pool,
 		char *p = __rseq_pool_range_percpu_ptr(range, i,
 				item_offset, pool->attr.stride);
 
+		if (!nt_store)
+			rseq_percpu_prefetch_item(pool, range, item_offset,
+					i + ITEM_PREFETCH_DISTANCE);
 		/*
 		 * If the update propagated through a shared mapping,
 		 * or the item already has the correct content, skip
 		 * writing it into the cpu item to eliminate useless
 		 * COW of the page.
 		 */
-		if (!memcmp(init_ptr, p, init_len))
-			continue;
-		memcpy(p, init_ptr, init_len);
+		if (nt_store && init_len >= ITEM_NT_STORE_MIN_LEN) {
+			if (nt_item_matches(p, init_ptr, init_len))
+				continue;
+			rseq_nt_memcpy(p, init_ptr, init_len);
+		} else {
+			if (!memcmp(init_ptr, p, init_len))
+				continue;
+			memcpy(p, init_ptr, init_len);
+		}
 	}
+	if (nt_store)
+		rseq_nt_store_fence();
 }
 
 static
@@ -736,6 +955,77 @@ void rseq_memfd_close(int fd)
 		perror("close");
 }
 
+static
+int create_range_table(struct rseq_mempool *pool)
+{
+	unsigned long len = POOL_HANDLE_MAX_NR_RANGES;
+
+	/*
+	 * Handle indexes are 32-bit: the range index uses the bits left
+	 * over by the item index within the range.
+	 */
+	if (pool->range_items_order >= 32)
+		len = 1;
+	else if (32 - pool->range_items_order < RSEQ_BITS_PER_LONG &&
+			len > (1UL << (32 - pool->range_items_order)))
+		len = 1UL << (32 - pool->range_items_order);
+	if (pool->attr.max_nr_ranges && len > pool->attr.max_nr_ranges)
+		len = pool->attr.max_nr_ranges;
+	pool->range_table = (void ***) calloc((len + RANGE_TABLE_CHUNK_LEN - 1) >> RANGE_TABLE_CHUNK_ORDER,
+			sizeof(void **));
+	if (!pool->range_table)
+		return -1;
+	pool->range_table_len = len;
+	return 0;
+}
+
+static
+void destroy_range_table(struct rseq_mempool *pool)
+{
+	unsigned long i;
+
+	if (!pool->range_table)
+		return;
+	for (i = 0; i < (pool->range_table_len + RANGE_TABLE_CHUNK_LEN - 1) >> RANGE_TABLE_CHUNK_ORDER; i++)
+		free(pool->range_table[i]);
+	free(pool->range_table);
+}
+
+/*
+ * Set the base address of range @index, allocating its chunk on first
+ * use. Called with the pool lock held.
+ */
+static
+int range_table_set(struct rseq_mempool *pool, unsigned long index, void *base)
+{
+	void ***chunk = &pool->range_table[index >> RANGE_TABLE_CHUNK_ORDER];
+
+	if (!*chunk) {
+		void **entries = (void **) calloc(RANGE_TABLE_CHUNK_LEN, sizeof(void *));
+
+		if (!entries)
+			return -1;
+		__atomic_store_n(chunk, entries, __ATOMIC_RELEASE);
+	}
+	RSEQ_WRITE_ONCE((*chunk)[index & (RANGE_TABLE_CHUNK_LEN - 1)], base);
+	return 0;
+}
+
+/* Get the base address of range @index, or NULL if it does not exist. */
+static
+void *range_table_get(struct rseq_mempool *pool, unsigned long index)
+{
+	void **entries;
+
+	if (index >= pool->range_table_len)
+		return NULL;
+	entries = __atomic_load_n(&pool->range_table[index >> RANGE_TABLE_CHUNK_ORDER],
+			__ATOMIC_ACQUIRE);
+	if (!entries)
+		return NULL;
+	return RSEQ_READ_ONCE(entries[index & (RANGE_TABLE_CHUNK_LEN - 1)]);
+}
+
 static
 struct rseq_mempool_range *rseq_mempool_range_create(struct rseq_mempool *pool)
 {
@@ -828,6 +1118,10 @@ struct rseq_mempool_range *rseq_mempool_range_create(struct rseq_mempool *pool)
 		if (create_alloc_bitmap(pool, range))
 			goto error_alloc;
 	}
+	range->index = pool->nr_ranges;
+	if (range->index < pool->range_table_len &&
+			range_table_set(pool, range->index, base))
+		goto error_alloc;
 	if (pool->attr.init_set) {
 		switch (pool->attr.type) {
 		case MEMPOOL_TYPE_GLOBAL:
@@ -887,6 +1181,36 @@ bool pool_mappings_accessible(struct rseq_mempool *pool)
 	return true;
 }
 
+static
+int pool_index_add(struct rseq_mempool *pool)
+{
+	uint32_t id;
+	int ret = -1;
+
+	pthread_mutex_lock(&pool_index_lock);
+	for (id = 1; id < POOL_INDEX_MAX_NR_POOLS; id++) {
+		if (pool_index[id])
+			continue;
+		pool->id = id;
+		__atomic_store_n(&pool_index[id], pool, __ATOMIC_RELEASE);
+		ret = 0;
+		break;
+	}
+	pthread_mutex_unlock(&pool_index_lock);
+	return ret;
+}
+
+static
+void pool_index_remove(struct rseq_mempool *pool)
+{
+	if (!pool->id)
+		return;
+	pthread_mutex_lock(&pool_index_lock);
+	pool_index[pool->id] = NULL;
+	pthread_mutex_unlock(&pool_index_lock);
+	pool->id = 0;
+}
+
 int rseq_mempool_destroy(struct rseq_mempool *pool)
 {
 	struct rseq_mempool_range *range, *tmp_range;
@@ -916,7 +1240,9 @@ int rseq_mempool_destroy(struct rseq_mempool *pool)
 			goto end;
 		}
 	}
+	pool_index_remove(pool);
 	pthread_mutex_destroy(&pool->lock);
+	destroy_range_table(pool);
 	free(pool->name);
 	free(pool);
 end:
@@ -1005,8 +1331,11 @@ struct rseq_mempool *rseq_mempool_create(const char *pool_name,
 	pthread_mutex_init(&pool->lock, NULL);
 	pool->item_len = item_len;
 	pool->item_order = order;
+	pool->range_items_order = rseq_get_count_order_ulong(attr.stride) - order;
 	INIT_LIST_HEAD(&pool->range_list);
 
+	if (attr.handles_set && create_range_table(pool))
+		goto error_alloc;
 	range = rseq_mempool_range_create(pool);
 	if (!range)
 		goto error_alloc;
@@ -1017,6 +1346,11 @@ struct rseq_mempool *rseq_mempool_create(const char *pool_name,
 		if (!pool->name)
 			goto error_alloc;
 	}
+	if (attr.handles_set && pool_index_add(pool)) {
+		rseq_mempool_destroy(pool);
+		errno = ENOSPC;
+		return NULL;
+	}
 	return pool;
 
 error_alloc:
@@ -1049,20 +1383,65 @@ void set_alloc_slot(struct rseq_mempool *pool, struct rseq_mempool_range *range,
 	bitmap[k] |= mask;
 }
 
+/*
+ * Memory reserved by an item: its copy for each CPU.
+ */
+static
+size_t item_reserved_bytes(const struct rseq_mempool *pool)
+{
+	return pool->item_len * pool->attr.max_nr_cpus;
+}
+
+/*
+ * Update the pressure level after a change of used_bytes. Returns true
+ * if the level changed, in which case the pressure callback needs to
+ * be invoked after releasing the pool lock. Called with the pool lock
+ * held.
+ */
+static
+bool update_pressure(struct rseq_mempool *pool)
+{
+	if (!pool->attr.pressure_set)
+		return false;
+	switch (pool->pressure) {
+	case RSEQ_MEMPOOL_PRESSURE_NORMAL:
+		if (pool->used_bytes < pool->attr.pressure_high)
+			return false;
+		pool->pressure = RSEQ_MEMPOOL_PRESSURE_HIGH;
+		return true;
+	case RSEQ_MEMPOOL_PRESSURE_HIGH:
+		if (pool->used_bytes > pool->attr.pressure_low)
+			return false;
+		pool->pressure = RSEQ_MEMPOOL_PRESSURE_NORMAL;
+		return true;
+	default:
+		abort();
+	}
+}
+
 static
 void __rseq_percpu *__rseq_percpu_malloc(struct rseq_mempool *pool,
 		bool zeroed, void *init_ptr, size_t init_len)
 {
 	struct rseq_mempool_range *range;
 	struct free_list_node *node;
+	enum rseq_mempool_pressure pressure;
+	bool pressure_changed = false, known_zero = false;
 	uintptr_t item_offset;
 	void __rseq_percpu *addr;
+	size_t used_bytes;
 
 	if (init_len > pool->item_len) {
 		errno = EINVAL;
 		return NULL;
 	}
 	pthread_mutex_lock(&pool->lock);
+	if (pool->attr.max_bytes &&
+			pool->used_bytes + item_reserved_bytes(pool) > pool->attr.max_bytes) {
+		errno = ENOMEM;
+		addr = NULL;
+		goto end;
+	}
 	/* Get first entry from free list. */
 	node = pool->free_list_head;
 	if (node != NULL) {
@@ -1075,6 +1454,12 @@ void __rseq_percpu *__rseq_percpu_malloc(struct rseq_mempool *pool,
 		pool->free_list_head = node->next;
 		item_offset = (uintptr_t) (ptr - range_base);
 		rseq_percpu_check_poison_item(pool, range, item_offset);
+		/*
+		 * Robust pools validate that the content of freed items
+		 * still matches the poison value on all CPUs.
+		 */
+		if (pool->attr.robust_set && pool->attr.poison == 0)
+			known_zero = true;
 		addr = __rseq_free_list_to_percpu_ptr(pool, node);
 		goto end;
 	}
@@ -1104,14 +1489,35 @@ room_left:
 	item_offset = range->next_unused;
 	addr = (void __rseq_percpu *) (range->base + item_offset);
 	range->next_unused += pool->item_len;
+	/*
+	 * Memory beyond the range next_unused high-water mark has never
+	 * been handed out: it is still zero (zero page or zeroed memfd
+	 * pages) unless the pool init callback populated it.
+	 */
+	if (!pool->attr.init_set)
+		known_zero = true;
 end:
-	if (addr)
+	if (addr) {
 		set_alloc_slot(pool, range, item_offset);
+		pool->used_bytes += item_reserved_bytes(pool);
+		pressure_changed = update_pressure(pool);
+	}
+	pressure = pool->pressure;
+	used_bytes = pool->used_bytes;
 	pthread_mutex_unlock(&pool->lock);
+	if (pressure_changed)
+		pool->attr.pressure_func(pool->attr.pressure_priv, pool,
+				pressure, used_bytes);
 	if (addr) {
-		if (zeroed)
-			rseq_percpu_zero_item(pool, range, item_offset);
-		else if (init_ptr) {
+		/*
+		 * Skip zeroing items known to be zero: reading their
+		 * per-CPU copies to compare them against zero would
+		 * fault in zero pages on every CPU.
+		 */
+		if (zeroed) {
+			if (!known_zero)
+				rseq_percpu_zero_item(pool, range, item_offset);
+		} else if (init_ptr) {
 			rseq_percpu_init_item(pool, range, item_offset,
 					init_ptr, init_len);
 		}
@@ -1168,6 +1574,9 @@ void librseq_mempool_percpu_free(void __rseq_percpu *_ptr, size_t stride)
 	struct rseq_mempool *pool = range->pool;
 	uintptr_t item_offset = ptr & (stride - 1);
 	struct free_list_node *head, *item;
+	enum rseq_mempool_pressure pressure;
+	bool pressure_changed;
+	size_t used_bytes;
 
 	pthread_mutex_lock(&pool->lock);
 	clear_alloc_slot(pool, range, item_offset);
@@ -1183,7 +1592,14 @@ void librseq_mempool_percpu_free(void __rseq_percpu *_ptr, size_t stride)
 	 */
 	item->next = head;
 	pool->free_list_head = item;
+	pool->used_bytes -= item_reserved_bytes(pool);
+	pressure_changed = update_pressure(pool);
+	pressure = pool->pressure;
+	used_bytes = pool->used_bytes;
 	pthread_mutex_unlock(&pool->lock);
+	if (pressure_changed)
+		pool->attr.pressure_func(pool->attr.pressure_priv, pool,
+				pressure, used_bytes);
 }
 
 struct rseq_mempool_set *rseq_mempool_set_create(void)
@@ -1293,6 +1709,98 @@ void __rseq_percpu *rseq_mempool_set_percpu_malloc_init(struct rseq_mempool_set
 	return __rseq_mempool_set_malloc(pool_set, init_ptr, len, true);
 }
 
+/* Return the pool of @pool_set which allocated @ptr, or NULL. */
+static
+struct rseq_mempool *pool_set_find_pool(struct rseq_mempool_set *pool_set,
+		void __rseq_percpu *ptr)
+{
+	struct rseq_mempool *pool = NULL;
+	int order;
+
+	pthread_mutex_lock(&pool_set->lock);
+	for (order = POOL_SET_MIN_ENTRY; order < POOL_SET_NR_ENTRIES; order++) {
+		bool found;
+
+		pool = pool_set->entries[order];
+		if (!pool)
+			continue;
+		pthread_mutex_lock(&pool->lock);
+		found = percpu_addr_in_pool(pool, ptr);
+		pthread_mutex_unlock(&pool->lock);
+		if (found)
+			goto end;
+	}
+	pool = NULL;
+end:
+	pthread_mutex_unlock(&pool_set->lock);
+	return pool;
+}
+
+void __rseq_percpu *librseq_mempool_set_percpu_realloc(struct rseq_mempool_set *pool_set,
+		void __rseq_percpu *ptr, size_t len, size_t stride)
+{
+	uintptr_t old_offset = (uintptr_t) ptr & (stride - 1);
+	struct rseq_mempool_range *old_range, *new_range;
+	struct rseq_mempool *old_pool, *new_pool;
+	void __rseq_percpu *new_ptr;
+	uintptr_t new_offset;
+	size_t copy_len;
+	int cpu, nr_cpus;
+
+	if (!ptr)
+		return __rseq_mempool_set_malloc(pool_set, NULL, len, true);
+	/* Check ownership before trusting the range header of @ptr. */
+	old_pool = pool_set_find_pool(pool_set, ptr);
+	if (!old_pool) {
+		errno = EINVAL;
+		return NULL;
+	}
+	old_range = (struct rseq_mempool_range *) ((void *) ((uintptr_t) ptr & (~(stride - 1)))
+			- RANGE_HEADER_OFFSET);
+	/* Keep the item if it is already in the right size class. */
+	if (len <= old_pool->item_len &&
+			(len > (old_pool->item_len >> 1) || old_pool->item_order <= POOL_SET_MIN_ENTRY))
+		return ptr;
+	new_ptr = __rseq_mempool_set_malloc(pool_set, NULL, len, true);
+	if (!new_ptr)
+		return NULL;
+	/*
+	 * The caller has unpublished @ptr, so new critical sections
+	 * cannot start using it. Restart the critical sections which may
+	 * still be in flight on the old item before copying it, so
+	 * no store to the old copy can be lost.
+	 */
+	if (rseq_fence_all()) {
+		int saved_errno = errno;
+
+		librseq_mempool_percpu_free(new_ptr, stride);
+		errno = saved_errno;
+		return NULL;
+	}
+	new_range = (struct rseq_mempool_range *) ((void *) ((uintptr_t) new_ptr & (~(stride - 1)))
+			- RANGE_HEADER_OFFSET);
+	new_pool = new_range->pool;
+	new_offset = (uintptr_t) new_ptr & (stride - 1);
+	copy_len = old_pool->item_len;
+	if (new_pool->item_len < copy_len)
+		copy_len = new_pool->item_len;
+	nr_cpus = old_pool->attr.max_nr_cpus;
+	if (new_pool->attr.max_nr_cpus < nr_cpus)
+		nr_cpus = new_pool->attr.max_nr_cpus;
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		void *src = __rseq_pool_range_percpu_ptr(old_range, cpu,
+				old_offset, old_pool->attr.stride);
+
+		/* The new item is zeroed: don't trigger COW for zeroes. */
+		if (!rseq_cmp_item(src, copy_len, 0, NULL))
+			continue;
+		memcpy(__rseq_pool_range_percpu_ptr(new_range, cpu,
+				new_offset, new_pool->attr.stride), src, copy_len);
+	}
+	librseq_mempool_percpu_free(ptr, stride);
+	return new_ptr;
+}
+
 struct rseq_mempool_attr *rseq_mempool_attr_create(void)
 {
 	return calloc(1, sizeof(struct rseq_mempool_attr));
@@ -1328,6 +1836,16 @@ int rseq_mempool_attr_set_robust(struct rseq_mempool_attr *attr)
 	return 0;
 }
 
+int rseq_mempool_attr_set_handles(struct rseq_mempool_attr *attr)
+{
+	if (!attr) {
+		errno = EINVAL;
+		return -1;
+	}
+	attr->handles_set = true;
+	return 0;
+}
+
 int rseq_mempool_attr_set_percpu(struct rseq_mempool_attr *attr,
 		size_t stride, int max_nr_cpus)
 {
@@ -1388,6 +1906,35 @@ int rseq_mempool_attr_set_populate_policy(struct rseq_mempool_attr *attr,
 	return 0;
 }
 
+int rseq_mempool_attr_set_max_bytes(struct rseq_mempool_attr *attr,
+		size_t max_bytes)
+{
+	if (!attr) {
+		errno = EINVAL;
+		return -1;
+	}
+	attr->max_bytes = max_bytes;
+	return 0;
+}
+
+int rseq_mempool_attr_set_pressure(struct rseq_mempool_attr *attr,
+		size_t low_watermark, size_t high_watermark,
+		void (*pressure_func)(void *priv, struct rseq_mempool *pool,
+			enum rseq_mempool_pressure pressure, size_t used_bytes),
+		void *pressure_priv)
+{
+	if (!attr || !pressure_func || low_watermark >= high_watermark) {
+		errno = EINVAL;
+		return -1;
+	}
+	attr->pressure_set = true;
+	attr->pressure_func = pressure_func;
+	attr->pressure_priv = pressure_priv;
+	attr->pressure_low = low_watermark;
+	attr->pressure_high = high_watermark;
+	return 0;
+}
+
 int rseq_mempool_get_max_nr_cpus(struct rseq_mempool *mempool)
 {
 	if (!mempool || mempool->attr.type != MEMPOOL_TYPE_PERCPU) {
@@ -1396,3 +1943,128 @@ int rseq_mempool_get_max_nr_cpus(struct rseq_mempool *mempool)
 	}
 	return mempool->attr.max_nr_cpus;
 }
+
+uint32_t rseq_mempool_get_id(struct rseq_mempool *mempool)
+{
+	if (!mempool || !mempool->id) {
+		errno = EINVAL;
+		return 0;
+	}
+	return mempool->id;
+}
+
+rseq_percpu_index_t rseq_mempool_percpu_index(struct rseq_mempool *pool,
+		void __rseq_percpu *_ptr)
+{
+	uintptr_t ptr = (uintptr_t) _ptr;
+	size_t stride;
+	void *range_base;
+	struct rseq_mempool_range *range;
+	uint64_t item;
+
+	if (!pool || !pool->range_table || !_ptr) {
+		errno = EINVAL;
+		return RSEQ_PERCPU_INDEX_NULL;
+	}
+	stride = pool->attr.stride;
+	range_base = (void *) (ptr & (~(stride - 1)));
+	range = (struct rseq_mempool_range *) (range_base - RANGE_HEADER_OFFSET);
+	if (range->pool != pool) {
+		errno = EINVAL;
+		return RSEQ_PERCPU_INDEX_NULL;
+	}
+	item = ((uint64_t) range->index << pool->range_items_order) |
+		((ptr & (stride - 1)) >> pool->item_order);
+	/* Index 0 is RSEQ_PERCPU_INDEX_NULL: items are numbered from 1. */
+	if (range->index >= pool->range_table_len || item >= UINT32_MAX) {
+		errno = ERANGE;
+		return RSEQ_PERCPU_INDEX_NULL;
+	}
+	return (rseq_percpu_index_t) (item + 1);
+}
+
+void __rseq_percpu *rseq_mempool_index_to_percpu(struct rseq_mempool *pool,
+		rseq_percpu_index_t index)
+{
+	unsigned long range_index = 0;
+	uintptr_t item = index - 1;
+	void *range_base;
+
+	if (!pool || !pool->range_table || index == RSEQ_PERCPU_INDEX_NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (pool->range_items_order < 32) {
+		range_index = item >> pool->range_items_order;
+		item &= (1UL << pool->range_items_order) - 1;
+	}
+	range_base = range_table_get(pool, range_index);
+	if (!range_base) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return (void __rseq_percpu *) (range_base + (item << pool->item_order));
+}
+
+void *rseq_mempool_index_ptr(struct rseq_mempool *pool, rseq_percpu_index_t index, int cpu)
+{
+	void *base;
+
+	base = (void *) rseq_mempool_index_to_percpu(pool, index);
+	if (!base)
+		return NULL;
+	return base + (pool->attr.stride * (unsigned int) cpu);
+}
+
+rseq_percpu_handle_t rseq_mempool_percpu_handle(struct rseq_mempool *pool,
+		void __rseq_percpu *ptr)
+{
+	rseq_percpu_index_t index;
+
+	index = rseq_mempool_percpu_index(pool, ptr);
+	if (index == RSEQ_PERCPU_INDEX_NULL)
+		return RSEQ_PERCPU_HANDLE_NULL;
+	return rseq_percpu_handle_make(pool->id, index);
+}
+
+/*
+ * Look up the pool of @handle in the global pool index. Returns NULL
+ * with errno=EINVAL if the pool id is out of range or if no pool with
+ * handles enabled holds it.
+ */
+static
+struct rseq_mempool *handle_pool(rseq_percpu_handle_t handle)
+{
+	uint32_t pool_id = rseq_percpu_handle_pool_id(handle);
+	struct rseq_mempool *pool = NULL;
+
+	if (pool_id < POOL_INDEX_MAX_NR_POOLS)
+		pool = __atomic_load_n(&pool_index[pool_id], __ATOMIC_ACQUIRE);
+	if (!pool)
+		errno = EINVAL;
+	return pool;
+}
+
+void __rseq_percpu *rseq_percpu_handle_to_percpu(rseq_percpu_handle_t handle)
+{
+	struct rseq_mempool *pool;
+
+	if (handle == RSEQ_PERCPU_HANDLE_NULL)
+		return NULL;
+	pool = handle_pool(handle);
+	if (!pool)
+		return NULL;
+	return rseq_mempool_index_to_percpu(pool, rseq_percpu_handle_index(handle));
+}
+
+void *rseq_percpu_handle_ptr(rseq_percpu_handle_t handle, int cpu)
+{
+	struct rseq_mempool *pool;
+
+	if (handle == RSEQ_PERCPU_HANDLE_NULL)
+		return NULL;
+	pool = handle_pool(handle);
+	if (!pool)
+		return NULL;
+	return rseq_mempool_index_ptr(pool, rseq_percpu_handle_index(handle), cpu);
+}
@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/percpu-cache.h>
+
+#include "rseq-percpu-internal.h"
+#include "rseq-utils.h"
+
+struct rseq_percpu_cache *rseq_percpu_cache_create(size_t capacity, size_t batch,
+		void *(*alloc_fn)(void *priv),
+		void (*free_fn)(void *object, void *priv),
+		void *priv)
+{
+	struct rseq_percpu_cache *cache;
+	size_t item_len;
+
+	if (!batch || batch > capacity || batch > RSEQ_PERCPU_CACHE_BATCH_MAX ||
+			!alloc_fn || !free_fn ||
+			capacity > (SIZE_MAX / 2 - sizeof(struct rseq_percpu_cache_cpu)) / sizeof(intptr_t)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	item_len = sizeof(struct rseq_percpu_cache_cpu) + capacity * sizeof(intptr_t);
+	cache = (struct rseq_percpu_cache *) calloc(1, sizeof(*cache));
+	if (!cache) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	cache->capacity = capacity;
+	cache->batch = batch;
+	cache->alloc_fn = alloc_fn;
+	cache->free_fn = free_fn;
+	cache->priv = priv;
+	/* The magazine of a CPU is a single pool item. */
+	cache->pool = rseq_internal_percpu_item_pool("rseq-percpu-cache", item_len, &cache->stride);
+	if (!cache->pool)
+		goto error_alloc;
+	cache->cpus = (struct rseq_percpu_cache_cpu __rseq_percpu *)
+		rseq_mempool_percpu_zmalloc(cache->pool);
+	if (!cache->cpus)
+		goto error_pool;
+	cache->max_nr_cpus = rseq_mempool_get_max_nr_cpus(cache->pool);
+	/* The depot holds as many objects as all magazines. */
+	if (capacity > SIZE_MAX / sizeof(void *) / (size_t) cache->max_nr_cpus)
+		goto error_percpu;
+	cache->depot.capacity = capacity * (size_t) cache->max_nr_cpus;
+	cache->depot.objects = (void **) calloc(cache->depot.capacity, sizeof(void *));
+	if (!cache->depot.objects)
+		goto error_percpu;
+	if (pthread_mutex_init(&cache->depot.lock, NULL))
+		goto error_depot;
+	return cache;
+
+error_depot:
+	free(cache->depot.objects);
+error_percpu:
+	rseq_mempool_percpu_free(cache->cpus, cache->stride);
+error_pool:
+	(void) rseq_mempool_destroy(cache->pool);
+error_alloc:
+	free(cache);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/* Free the objects of the depot. The depot lock is held. */
+static
+void depot_trim(struct rseq_percpu_cache *cache)
+{
+	struct rseq_percpu_cache_depot *depot = &cache->depot;
+
+	while (depot->nr_objects)
+		cache->free_fn(depot->objects[--depot->nr_objects], cache->priv);
+}
+
+int rseq_percpu_cache_destroy(struct rseq_percpu_cache *cache)
+{
+	int cpu;
+
+	if (!cache) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (cpu = 0; cpu < cache->max_nr_cpus; cpu++) {
+		struct rseq_percpu_cache_cpu *cache_cpu = rseq_percpu_ptr(cache->cpus, cpu);
+		intptr_t *slots = rseq_percpu_cache_slots(cache_cpu);
+
+		while (cache_cpu->count)
+			cache->free_fn((void *) slots[--cache_cpu->count], cache->priv);
+	}
+	depot_trim(cache);
+	rseq_mempool_percpu_free(cache->cpus, cache->stride);
+	if (rseq_mempool_destroy(cache->pool))
+		return -1;
+	pthread_mutex_destroy(&cache->depot.lock);
+	free(cache->depot.objects);
+	free(cache);
+	return 0;
+}
+
+void rseq_percpu_cache_trim(struct rseq_percpu_cache *cache)
+{
+	pthread_mutex_lock(&cache->depot.lock);
+	depot_trim(cache);
+	pthread_mutex_unlock(&cache->depot.lock);
+}
+
+/*
+ * Move up to @nr objects from the depot into @objects. Returns the
+ * number of objects moved.
+ */
+static
+size_t depot_get(struct rseq_percpu_cache *cache, void **objects, size_t nr)
+{
+	struct rseq_percpu_cache_depot *depot = &cache->depot;
+
+	pthread_mutex_lock(&depot->lock);
+	if (nr > depot->nr_objects)
+		nr = depot->nr_objects;
+	depot->nr_objects -= nr;
+	memcpy(objects, &depot->objects[depot->nr_objects], nr * sizeof(void *));
+	pthread_mutex_unlock(&depot->lock);
+	return nr;
+}
+
+/*
+ * Move @nr objects from @objects into the depot. The objects which do
+ * not fit are freed with the backing allocator.
+ */
+static
+void depot_put(struct rseq_percpu_cache *cache, void **objects, size_t nr)
+{
+	struct rseq_percpu_cache_depot *depot = &cache->depot;
+	size_t nr_put;
+
+	pthread_mutex_lock(&depot->lock);
+	nr_put = depot->capacity - depot->nr_objects;
+	if (nr_put > nr)
+		nr_put = nr;
+	memcpy(&depot->objects[depot->nr_objects], objects, nr_put * sizeof(void *));
+	depot->nr_objects += nr_put;
+	pthread_mutex_unlock(&depot->lock);
+	for (; nr_put < nr; nr_put++)
+		cache->free_fn(objects[nr_put], cache->priv);
+}
+
+void *rseq_percpu_cache_refill(struct rseq_percpu_cache *cache)
+{
+	void *objects[RSEQ_PERCPU_CACHE_BATCH_MAX], *object;
+	size_t nr;
+
+	nr = depot_get(cache, objects, cache->batch);
+	for (; nr < cache->batch; nr++) {
+		objects[nr] = cache->alloc_fn(cache->priv);
+		if (!objects[nr])
+			break;
+	}
+	if (!nr) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	object = objects[--nr];
+	/*
+	 * Copy the rest of the batch into the free slots of the magazine of
+	 * the current CPU, and publish them by updating its count.
+	 */
+	while (nr) {
+		struct rseq_percpu_cache_cpu *cache_cpu;
+		intptr_t count;
+		size_t nr_copy;
+		int cpu, ret;
+
+		cpu = (int) rseq_current_cpu();
+		cache_cpu = rseq_percpu_ptr(cache->cpus, cpu);
+		count = RSEQ_READ_ONCE(cache_cpu->count);
+		nr_copy = cache->capacity - (size_t) count;
+		if (nr_copy > nr)
+			nr_copy = nr;
+		if (!nr_copy)
+			break;
+		ret = rseq_load_cbne_memcpy_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				&cache_cpu->count, count,
+				&rseq_percpu_cache_slots(cache_cpu)[count],
+				&objects[nr - nr_copy], nr_copy * sizeof(void *),
+				count + (intptr_t) nr_copy, cpu);
+		if (rseq_likely(!ret))
+			nr -= nr_copy;
+		/* Retry if the comparison fails or rseq aborts. */
+	}
+	/* The magazine was refilled concurrently. */
+	if (nr)
+		depot_put(cache, objects, nr);
+	return object;
+}
+
+void rseq_percpu_cache_flush(struct rseq_percpu_cache *cache, void *object)
+{
+	void *objects[RSEQ_PERCPU_CACHE_BATCH_MAX];
+	size_t nr = 0;
+
+	/* Move a batch from the top of the magazine of the current CPU. */
+	for (;;) {
+		struct rseq_percpu_cache_cpu *cache_cpu;
+		intptr_t count;
+		int cpu, ret;
+
+		cpu = (int) rseq_current_cpu();
+		cache_cpu = rseq_percpu_ptr(cache->cpus, cpu);
+		count = RSEQ_READ_ONCE(cache_cpu->count);
+		nr = cache->batch;
+		if (nr > (size_t) count)
+			nr = (size_t) count;
+		if (!nr)
+			break;
+		ret = rseq_load_cbne_memcpy_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				&cache_cpu->count, count,
+				objects, &rseq_percpu_cache_slots(cache_cpu)[count - (intptr_t) nr],
+				nr * sizeof(void *), count - (intptr_t) nr, cpu);
+		if (rseq_likely(!ret))
+			break;
+		/* Retry if the comparison fails or rseq aborts. */
+	}
+	if (nr)
+		depot_put(cache, objects, nr);
+	rseq_percpu_cache_free(cache, object);
+}
@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/percpu-counter.h>
+
+/* Item sizes of the pools, from one word to the largest group. */
+#define COUNTER_POOL_MIN_ORDER	3
+#define COUNTER_POOL_MAX_ORDER	12
+
+static pthread_mutex_t counter_pool_set_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Per-cpu pool set shared by all counter groups. */
+static struct rseq_mempool_set *counter_pool_set;
+
+static
+struct rseq_mempool_set *get_counter_pool_set(void)
+{
+	struct rseq_mempool_set *pool_set;
+	struct rseq_mempool_attr *attr;
+	int order;
+
+	pool_set = __atomic_load_n(&counter_pool_set, __ATOMIC_ACQUIRE);
+	if (pool_set)
+		return pool_set;
+	pthread_mutex_lock(&counter_pool_set_lock);
+	pool_set = counter_pool_set;
+	if (pool_set)
+		goto end;
+	attr = rseq_mempool_attr_create();
+	if (!attr)
+		goto end;
+	if (rseq_mempool_attr_set_percpu(attr, RSEQ_MEMPOOL_STRIDE, 0))
+		goto end_attr;
+	pool_set = rseq_mempool_set_create();
+	if (!pool_set)
+		goto end_attr;
+	for (order = COUNTER_POOL_MIN_ORDER; order <= COUNTER_POOL_MAX_ORDER; order++) {
+		struct rseq_mempool *pool;
+
+		pool = rseq_mempool_create("rseq-percpu-counter", 1UL << order, attr);
+		if (!pool || rseq_mempool_set_add_pool(pool_set, pool)) {
+			if (pool)
+				(void) rseq_mempool_destroy(pool);
+			(void) rseq_mempool_set_destroy(pool_set);
+			pool_set = NULL;
+			goto end_attr;
+		}
+	}
+	__atomic_store_n(&counter_pool_set, pool_set, __ATOMIC_RELEASE);
+end_attr:
+	rseq_mempool_attr_destroy(attr);
+end:
+	pthread_mutex_unlock(&counter_pool_set_lock);
+	return pool_set;
+}
+
+struct rseq_percpu_counter_group *rseq_percpu_counter_group_create(size_t nr_counters,
+		uint64_t refresh_interval_ns)
+{
+	struct rseq_percpu_counter_group *group;
+	struct rseq_mempool_set *pool_set;
+
+	if (!nr_counters || nr_counters > RSEQ_PERCPU_COUNTER_GROUP_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	pool_set = get_counter_pool_set();
+	if (!pool_set) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	group = (struct rseq_percpu_counter_group *) calloc(1, sizeof(*group));
+	if (!group)
+		goto error_alloc;
+	group->cached = (intptr_t *) calloc(nr_counters, sizeof(intptr_t));
+	if (!group->cached)
+		goto error_cached;
+	group->values = (intptr_t __rseq_percpu *)
+		rseq_mempool_set_percpu_zmalloc(pool_set, nr_counters * sizeof(intptr_t));
+	if (!group->values)
+		goto error_values;
+	group->nr_counters = nr_counters;
+	group->max_nr_cpus = rseq_get_max_nr_cpus();
+	group->refresh_interval_ns = refresh_interval_ns;
+	return group;
+
+error_values:
+	free(group->cached);
+error_cached:
+	free(group);
+error_alloc:
+	errno = ENOMEM;
+	return NULL;
+}
+
+int rseq_percpu_counter_group_destroy(struct rseq_percpu_counter_group *group)
+{
+	if (!group) {
+		errno = EINVAL;
+		return -1;
+	}
+	rseq_mempool_percpu_free(group->values);
+	free(group->cached);
+	free(group);
+	return 0;
+}
+
+intptr_t rseq_percpu_counter_read(struct rseq_percpu_counter_group *group, size_t index)
+{
+	intptr_t sum = 0;
+	int cpu;
+
+	for (cpu = 0; cpu < group->max_nr_cpus; cpu++)
+		sum += RSEQ_READ_ONCE(rseq_percpu_ptr(group->values, cpu)[index]);
+	return sum;
+}
+
+void rseq_percpu_counter_read_all(struct rseq_percpu_counter_group *group, intptr_t *sums)
+{
+	size_t i;
+	int cpu;
+
+	memset(sums, 0, group->nr_counters * sizeof(intptr_t));
+	/* Sum one CPU at a time, so each CPU's counters are read in order. */
+	for (cpu = 0; cpu < group->max_nr_cpus; cpu++) {
+		intptr_t *values = rseq_percpu_ptr(group->values, cpu);
+
+		for (i = 0; i < group->nr_counters; i++)
+			sums[i] += RSEQ_READ_ONCE(values[i]);
+	}
+}
+
+static
+void refresh_cached(struct rseq_percpu_counter_group *group)
+{
+	intptr_t sums[RSEQ_PERCPU_COUNTER_GROUP_MAX];
+	size_t i;
+
+	rseq_percpu_counter_read_all(group, sums);
+	for (i = 0; i < group->nr_counters; i++)
+		__atomic_store_n(&group->cached[i], sums[i], __ATOMIC_RELAXED);
+}
+
+intptr_t rseq_percpu_counter_read_approx(struct rseq_percpu_counter_group *group,
+		size_t index, uint64_t now_ns)
+{
+	/* The deadline starts at 0, so the first read refreshes the sums. */
+	if (now_ns >= __atomic_load_n(&group->refresh_deadline_ns, __ATOMIC_ACQUIRE) &&
+			!__atomic_exchange_n(&group->refreshing, 1, __ATOMIC_ACQUIRE)) {
+		refresh_cached(group);
+		__atomic_store_n(&group->refresh_deadline_ns,
+				now_ns + group->refresh_interval_ns, __ATOMIC_RELEASE);
+		__atomic_store_n(&group->refreshing, 0, __ATOMIC_RELEASE);
+	}
+	return __atomic_load_n(&group->cached[index], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,289 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <rseq/percpu-hash.h>
+
+#include "rseq-percpu-internal.h"
+#include "rseq-utils.h"
+
+struct rseq_percpu_hash *rseq_percpu_hash_create(size_t nr_buckets)
+{
+	struct rseq_percpu_hash *hash;
+	size_t item_len;
+	int order;
+
+	if (!nr_buckets) {
+		errno = EINVAL;
+		return NULL;
+	}
+	order = rseq_get_count_order_ulong(nr_buckets);
+	if (order < 0 || order >= (int) (sizeof(size_t) * CHAR_BIT - 1) ||
+			sizeof(struct rseq_percpu_hash_node *) >
+				(SIZE_MAX / 2 - sizeof(struct rseq_percpu_hash_shard)) >> order) {
+		errno = EINVAL;
+		return NULL;
+	}
+	nr_buckets = (size_t) 1 << order;
+	item_len = sizeof(struct rseq_percpu_hash_shard) +
+		nr_buckets * sizeof(struct rseq_percpu_hash_node *);
+	hash = (struct rseq_percpu_hash *) calloc(1, sizeof(*hash));
+	if (!hash) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	hash->nr_buckets = nr_buckets;
+	hash->mutex = rseq_percpu_mutex_create();
+	if (!hash->mutex)
+		goto error_alloc;
+	/* The shard of a CPU is a single pool item. */
+	hash->pool = rseq_internal_percpu_item_pool("rseq-percpu-hash", item_len, &hash->stride);
+	if (!hash->pool)
+		goto error_mutex;
+	hash->shards = (struct rseq_percpu_hash_shard __rseq_percpu *)
+		rseq_mempool_percpu_zmalloc(hash->pool);
+	if (!hash->shards)
+		goto error_pool;
+	hash->max_nr_cpus = rseq_mempool_get_max_nr_cpus(hash->pool);
+	return hash;
+
+error_pool:
+	(void) rseq_mempool_destroy(hash->pool);
+error_mutex:
+	(void) rseq_percpu_mutex_destroy(hash->mutex);
+error_alloc:
+	free(hash);
+	errno = ENOMEM;
+	return NULL;
+}
+
+int rseq_percpu_hash_destroy(struct rseq_percpu_hash *hash)
+{
+	if (!hash) {
+		errno = EINVAL;
+		return -1;
+	}
+	rseq_mempool_percpu_free(hash->shards, hash->stride);
+	if (rseq_mempool_destroy(hash->pool))
+		return -1;
+	if (rseq_percpu_mutex_destroy(hash->mutex))
+		return -1;
+	free(hash);
+	return 0;
+}
+
+/* Bucket of @key in the shard of @cpu. */
+static
+struct rseq_percpu_hash_node **shard_bucket(struct rseq_percpu_hash *hash, int cpu,
+		uintptr_t key)
+{
+	struct rseq_percpu_hash_shard *shard = rseq_percpu_ptr(hash->shards, cpu);
+	uint64_t h = (uint64_t) key * 0x9e3779b97f4a7c15ULL;
+
+	/* Fibonacci hashing: mix the high bits into the low bits. */
+	h ^= h >> 32;
+	return (struct rseq_percpu_hash_node **) (shard + 1) + (h & (hash->nr_buckets - 1));
+}
+
+/*
+ * Link to the node with key @key in the shard of @cpu, or to the NULL
+ * terminating the chain of its bucket. The mutex of @cpu is held.
+ */
+static
+struct rseq_percpu_hash_node **shard_find(struct rseq_percpu_hash *hash, int cpu,
+		uintptr_t key)
+{
+	struct rseq_percpu_hash_node **link = shard_bucket(hash, cpu, key);
+
+	while (*link && (*link)->key != key)
+		link = &(*link)->next;
+	return link;
+}
+
+/* Unlink the node with key @key from the shard of @cpu, if any. */
+static
+struct rseq_percpu_hash_node *shard_delete(struct rseq_percpu_hash *hash, int cpu,
+		uintptr_t key)
+{
+	struct rseq_percpu_hash_node **link = shard_find(hash, cpu, key), *node;
+
+	node = *link;
+	if (node) {
+		*link = node->next;
+		rseq_percpu_ptr(hash->shards, cpu)->nr_nodes--;
+	}
+	return node;
+}
+
+int rseq_percpu_hash_insert(struct rseq_percpu_hash *hash,
+		struct rseq_percpu_hash_node *node, uintptr_t key)
+{
+	struct rseq_percpu_hash_node **link;
+	int cpu;
+
+	cpu = rseq_percpu_mutex_lock(hash->mutex);
+	link = shard_find(hash, cpu, key);
+	if (*link) {
+		rseq_percpu_mutex_unlock(hash->mutex, cpu);
+		errno = EEXIST;
+		return -1;
+	}
+	node->key = key;
+	node->next = NULL;
+	*link = node;
+	rseq_percpu_ptr(hash->shards, cpu)->nr_nodes++;
+	rseq_percpu_mutex_unlock(hash->mutex, cpu);
+	return cpu;
+}
+
+struct rseq_percpu_hash_node *rseq_percpu_hash_lookup(struct rseq_percpu_hash *hash,
+		uintptr_t key, int *cpu)
+{
+	struct rseq_percpu_hash_node *node;
+	int _cpu;
+
+	_cpu = rseq_percpu_mutex_lock(hash->mutex);
+	node = *shard_find(hash, _cpu, key);
+	rseq_percpu_mutex_unlock(hash->mutex, _cpu);
+	if (cpu)
+		*cpu = _cpu;
+	return node;
+}
+
+struct rseq_percpu_hash_node *rseq_percpu_hash_delete(struct rseq_percpu_hash *hash,
+		uintptr_t key)
+{
+	struct rseq_percpu_hash_node *node;
+	int cpu;
+
+	cpu = rseq_percpu_mutex_lock(hash->mutex);
+	node = shard_delete(hash, cpu, key);
+	rseq_percpu_mutex_unlock(hash->mutex, cpu);
+	return node;
+}
+
+int rseq_percpu_hash_lookup_cpu(struct rseq_percpu_hash *hash, int cpu,
+		uintptr_t key, struct rseq_percpu_hash_node **node)
+{
+	if (!hash || cpu < 0 || cpu >= hash->max_nr_cpus) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (rseq_percpu_mutex_lock_cpu(hash->mutex, cpu))
+		return -1;
+	*node = *shard_find(hash, cpu, key);
+	rseq_percpu_mutex_unlock(hash->mutex, cpu);
+	return 0;
+}
+
+int rseq_percpu_hash_delete_cpu(struct rseq_percpu_hash *hash, int cpu,
+		uintptr_t key, struct rseq_percpu_hash_node **node)
+{
+	if (!hash || cpu < 0 || cpu >= hash->max_nr_cpus) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (rseq_percpu_mutex_lock_cpu(hash->mutex, cpu))
+		return -1;
+	*node = shard_delete(hash, cpu, key);
+	rseq_percpu_mutex_unlock(hash->mutex, cpu);
+	return 0;
+}
+
+/* Number of shards of CPUs other than @cpu holding nodes. */
+static
+int nr_remote_shards(struct rseq_percpu_hash *hash, int cpu)
+{
+	int nr = 0, i;
+
+	for (i = 0; i < hash->max_nr_cpus; i++) {
+		if (i != cpu && RSEQ_READ_ONCE(rseq_percpu_ptr(hash->shards, i)->nr_nodes))
+			nr++;
+	}
+	return nr;
+}
+
+int rseq_percpu_hash_lookup_global(struct rseq_percpu_hash *hash, uintptr_t key,
+		struct rseq_percpu_hash_node **node, int *cpu)
+{
+	int local_cpu, nr_shards, i;
+
+	/* Fast path: the node is in the shard of the current CPU. */
+	*node = rseq_percpu_hash_lookup(hash, key, &local_cpu);
+	if (*node) {
+		if (cpu)
+			*cpu = local_cpu;
+		return 0;
+	}
+	/* Skip empty shards without fencing their CPU. */
+	nr_shards = nr_remote_shards(hash, local_cpu);
+	if (!nr_shards)
+		return 0;
+	if (nr_shards == 1) {
+		for (i = 0; i < hash->max_nr_cpus; i++) {
+			if (i == local_cpu || !RSEQ_READ_ONCE(rseq_percpu_ptr(hash->shards, i)->nr_nodes))
+				continue;
+			if (rseq_percpu_hash_lookup_cpu(hash, i, key, node))
+				return -1;
+			if (*node)
+				goto found;
+		}
+		return 0;
+	}
+	/* Lock all shards with a single fence rather than one per CPU. */
+	if (rseq_percpu_mutex_lock_all(hash->mutex))
+		return -1;
+	for (i = 0; i < hash->max_nr_cpus; i++) {
+		if (i == local_cpu)
+			continue;
+		*node = *shard_find(hash, i, key);
+		if (*node)
+			break;
+	}
+	rseq_percpu_mutex_unlock_all(hash->mutex);
+	if (!*node)
+		return 0;
+found:
+	if (cpu)
+		*cpu = i;
+	return 0;
+}
+
+int rseq_percpu_hash_for_each(struct rseq_percpu_hash *hash,
+		int (*fn)(struct rseq_percpu_hash_node *node, int cpu, void *priv),
+		void *priv)
+{
+	int cpu;
+
+	if (!hash || !fn) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (cpu = 0; cpu < hash->max_nr_cpus; cpu++) {
+		struct rseq_percpu_hash_node **bucket, *node;
+		size_t i;
+		int stop = 0;
+
+		/* Skip empty shards without fencing their CPU. */
+		if (!RSEQ_READ_ONCE(rseq_percpu_ptr(hash->shards, cpu)->nr_nodes))
+			continue;
+		if (rseq_percpu_mutex_lock_cpu(hash->mutex, cpu))
+			return -1;
+		bucket = (struct rseq_percpu_hash_node **) (rseq_percpu_ptr(hash->shards, cpu) + 1);
+		for (i = 0; i < hash->nr_buckets && !stop; i++) {
+			for (node = bucket[i]; node && !stop; node = node->next)
+				stop = fn(node, cpu, priv);
+		}
+		rseq_percpu_mutex_unlock(hash->mutex, cpu);
+		if (stop)
+			break;
+	}
+	return 0;
+}
@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdlib.h>
+
+#include <rseq/percpu-histogram.h>
+
+struct rseq_percpu_histogram *rseq_percpu_histogram_create(void)
+{
+	struct rseq_percpu_histogram *histogram;
+
+	histogram = (struct rseq_percpu_histogram *) calloc(1, sizeof(*histogram));
+	if (!histogram) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	/* Approximate reads are not used: no refresh interval. */
+	histogram->group = rseq_percpu_counter_group_create(RSEQ_PERCPU_HISTOGRAM_NR_BUCKETS + 1, 0);
+	if (!histogram->group) {
+		free(histogram);
+		return NULL;
+	}
+	return histogram;
+}
+
+int rseq_percpu_histogram_destroy(struct rseq_percpu_histogram *histogram)
+{
+	if (!histogram) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (rseq_percpu_counter_group_destroy(histogram->group))
+		return -1;
+	free(histogram);
+	return 0;
+}
+
+void rseq_percpu_histogram_read(struct rseq_percpu_histogram *histogram,
+		struct rseq_percpu_histogram_snapshot *snapshot)
+{
+	intptr_t sums[RSEQ_PERCPU_HISTOGRAM_NR_BUCKETS + 1];
+	unsigned int i;
+
+	rseq_percpu_counter_read_all(histogram->group, sums);
+	snapshot->count = 0;
+	for (i = 0; i < RSEQ_PERCPU_HISTOGRAM_NR_BUCKETS; i++) {
+		snapshot->buckets[i] = (uintptr_t) sums[i];
+		snapshot->count += snapshot->buckets[i];
+	}
+	snapshot->sum = (uintptr_t) sums[RSEQ_PERCPU_HISTOGRAM_NR_BUCKETS];
+}
+
+void rseq_percpu_histogram_snapshot_merge(struct rseq_percpu_histogram_snapshot *dst,
+		const struct rseq_percpu_histogram_snapshot *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < RSEQ_PERCPU_HISTOGRAM_NR_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+}
+
+uint64_t rseq_percpu_histogram_snapshot_percentile(
+		const struct rseq_percpu_histogram_snapshot *snapshot, double percentile)
+{
+	uint64_t rank, cumulative = 0;
+	unsigned int i;
+
+	if (!snapshot->count)
+		return 0;
+	if (percentile < 0.0)
+		percentile = 0.0;
+	if (percentile > 100.0)
+		percentile = 100.0;
+	/* Rank of the value, starting at 1. */
+	rank = (uint64_t) (percentile / 100.0 * (double) snapshot->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > snapshot->count)
+		rank = snapshot->count;
+	for (i = 0; i < RSEQ_PERCPU_HISTOGRAM_NR_BUCKETS; i++) {
+		cumulative += snapshot->buckets[i];
+		if (cumulative >= rank)
+			return rseq_percpu_histogram_bucket_highest(i);
+	}
+	return UINT64_MAX;
+}
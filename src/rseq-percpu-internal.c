@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <sched.h>
+
+#include <rseq/rseq.h>
+
+#include "rseq-percpu-internal.h"
+
+struct rseq_mempool *rseq_internal_percpu_pool(struct rseq_internal_pool *internal_pool)
+{
+	struct rseq_mempool_attr *attr;
+	struct rseq_mempool *pool;
+
+	pool = __atomic_load_n(&internal_pool->pool, __ATOMIC_ACQUIRE);
+	if (pool)
+		return pool;
+	pthread_mutex_lock(&internal_pool->lock);
+	pool = internal_pool->pool;
+	if (pool)
+		goto end;
+	attr = rseq_mempool_attr_create();
+	if (!attr)
+		goto end;
+	if (!rseq_mempool_attr_set_percpu(attr, RSEQ_MEMPOOL_STRIDE, 0))
+		pool = rseq_mempool_create(internal_pool->name, internal_pool->item_len, attr);
+	rseq_mempool_attr_destroy(attr);
+	if (pool)
+		__atomic_store_n(&internal_pool->pool, pool, __ATOMIC_RELEASE);
+end:
+	pthread_mutex_unlock(&internal_pool->lock);
+	return pool;
+}
+
+struct rseq_mempool *rseq_internal_percpu_item_pool(const char *name, size_t item_len,
+		size_t *stride)
+{
+	struct rseq_mempool_attr *attr;
+	struct rseq_mempool *pool = NULL;
+	size_t item_stride = RSEQ_MEMPOOL_STRIDE;
+
+	while (item_stride < item_len)
+		item_stride <<= 1;
+	attr = rseq_mempool_attr_create();
+	if (!attr)
+		return NULL;
+	if (!rseq_mempool_attr_set_percpu(attr, item_stride, 0))
+		pool = rseq_mempool_create(name, item_len, attr);
+	rseq_mempool_attr_destroy(attr);
+	if (pool)
+		*stride = item_stride;
+	return pool;
+}
+
+void rseq_internal_claim(intptr_t *claim)
+{
+	intptr_t expect;
+
+	for (;;) {
+		expect = 0;
+		if (__atomic_compare_exchange_n(claim, &expect, 1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			break;
+		sched_yield();
+	}
+}
+
+int rseq_internal_claim_cpu(intptr_t *claim, int cpu)
+{
+	rseq_internal_claim(claim);
+	if (rseq_fence_cpu(cpu)) {
+		int saved_errno = errno;
+
+		__atomic_store_n(claim, 0, __ATOMIC_RELEASE);
+		errno = saved_errno;
+		return -1;
+	}
+	return 0;
+}
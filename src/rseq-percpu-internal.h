@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+
+#ifndef _RSEQ_PERCPU_INTERNAL_H
+#define _RSEQ_PERCPU_INTERNAL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <rseq/mempool.h>
+
+/*
+ * Per-cpu pool of fixed-size items shared by all objects of a per-CPU
+ * data structure, created on first use.
+ */
+struct rseq_internal_pool {
+	pthread_mutex_t lock;
+	struct rseq_mempool *pool;
+	const char *name;
+	size_t item_len;
+};
+
+#define RSEQ_INTERNAL_POOL_INIT(_name, _item_len) \
+	{ PTHREAD_MUTEX_INITIALIZER, NULL, _name, _item_len }
+
+/*
+ * Return the pool of @internal_pool, creating it on first use. Returns
+ * NULL on error.
+ */
+struct rseq_mempool *rseq_internal_percpu_pool(struct rseq_internal_pool *internal_pool)
+	__attribute__((visibility("hidden")));
+
+/*
+ * Create a per-cpu pool of items of @item_len bytes, with the smallest
+ * power of two stride which fits an item, so each CPU uses a single
+ * item of each range. Store the stride into *@stride. Returns NULL on
+ * error.
+ */
+struct rseq_mempool *rseq_internal_percpu_item_pool(const char *name, size_t item_len,
+		size_t *stride) __attribute__((visibility("hidden")));
+
+/*
+ * Set @claim from 0 to 1, waiting for a concurrent claim to be
+ * released. The claim is released by storing 0 with release semantic.
+ */
+void rseq_internal_claim(intptr_t *claim) __attribute__((visibility("hidden")));
+
+/*
+ * Set @claim, then restart the critical sections in flight on @cpu:
+ * they may have observed the claim unset, and new ones will observe it
+ * set. Returns 0 on success, or -1 with errno set with @claim released
+ * if the fence fails.
+ */
+int rseq_internal_claim_cpu(intptr_t *claim, int cpu) __attribute__((visibility("hidden")));
+
+#endif /* _RSEQ_PERCPU_INTERNAL_H */
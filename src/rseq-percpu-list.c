@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdlib.h>
+
+#include <rseq/percpu-list.h>
+
+#include "rseq-percpu-internal.h"
+
+#ifdef rseq_arch_has_load_cbne_load_cbeq_store_add_load_store
+
+/* Per-cpu pool shared by the list heads of all lists. */
+static struct rseq_internal_pool heads_pool =
+	RSEQ_INTERNAL_POOL_INIT("rseq-percpu-list", sizeof(struct rseq_percpu_list_head));
+
+struct rseq_percpu_list *rseq_percpu_list_create(void)
+{
+	struct rseq_percpu_list *list;
+	struct rseq_mempool *pool;
+
+	pool = rseq_internal_percpu_pool(&heads_pool);
+	if (!pool)
+		return NULL;
+	list = (struct rseq_percpu_list *) calloc(1, sizeof(*list));
+	if (!list) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	list->heads = (struct rseq_percpu_list_head __rseq_percpu *)
+		rseq_mempool_percpu_zmalloc(pool);
+	if (!list->heads) {
+		free(list);
+		errno = ENOMEM;
+		return NULL;
+	}
+	list->max_nr_cpus = rseq_mempool_get_max_nr_cpus(pool);
+	return list;
+}
+
+int rseq_percpu_list_destroy(struct rseq_percpu_list *list)
+{
+	if (!list) {
+		errno = EINVAL;
+		return -1;
+	}
+	rseq_mempool_percpu_free(list->heads);
+	free(list);
+	return 0;
+}
+
+/*
+ * Take ownership of the list head of @cpu. Once the lock is visible,
+ * restart the critical sections in flight on @cpu: they may have
+ * observed the lock unset, and new ones will observe it set.
+ */
+static
+struct rseq_percpu_list_head *remote_lock(struct rseq_percpu_list *list, int cpu)
+{
+	struct rseq_percpu_list_head *head;
+
+	if (!list || cpu < 0 || cpu >= list->max_nr_cpus) {
+		errno = EINVAL;
+		return NULL;
+	}
+	head = rseq_percpu_ptr(list->heads, cpu);
+	if (rseq_internal_claim_cpu(&head->lock, cpu))
+		return NULL;
+	return head;
+}
+
+static
+void remote_unlock(struct rseq_percpu_list_head *head)
+{
+	__atomic_store_n(&head->lock, 0, __ATOMIC_RELEASE);
+}
+
+int rseq_percpu_list_pop_cpu(struct rseq_percpu_list *list, int cpu,
+		struct rseq_percpu_list_node **node)
+{
+	struct rseq_percpu_list_head *head;
+	struct rseq_percpu_list_node *first;
+
+	head = remote_lock(list, cpu);
+	if (!head)
+		return -1;
+	first = head->head;
+	if (first)
+		RSEQ_WRITE_ONCE(head->head, first->next);
+	remote_unlock(head);
+	*node = first;
+	return 0;
+}
+
+int rseq_percpu_list_pop_all(struct rseq_percpu_list *list, int cpu,
+		struct rseq_percpu_list_node **nodes)
+{
+	struct rseq_percpu_list_head *head;
+
+	head = remote_lock(list, cpu);
+	if (!head)
+		return -1;
+	*nodes = head->head;
+	RSEQ_WRITE_ONCE(head->head, NULL);
+	remote_unlock(head);
+	return 0;
+}
+
+#endif /* rseq_arch_has_load_cbne_load_cbeq_store_add_load_store */
@@ -0,0 +1,300 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include <unistd.h>
+#include <linux/futex.h>
+
+#include <rseq/percpu-lock.h>
+#include <rseq/retry.h>
+
+#include "rseq-percpu-internal.h"
+
+/* Number of pause iterations before sleeping on a held mutex. */
+#define MUTEX_SPIN_LOOPS	1000
+
+/* Per-cpu pool shared by the mutexes of all per-CPU mutexes. */
+static struct rseq_internal_pool mutex_pool =
+	RSEQ_INTERNAL_POOL_INIT("rseq-percpu-mutex", sizeof(struct rseq_percpu_mutex_cpu));
+
+/* Per-cpu pool shared by the reader counts of all big reader locks. */
+static struct rseq_internal_pool brlock_pool =
+	RSEQ_INTERNAL_POOL_INIT("rseq-percpu-brlock", sizeof(struct rseq_percpu_brlock_cpu));
+
+/* The futex is the 32-bit half of @word holding its value. */
+static
+uint32_t *word_futex(intptr_t *word)
+{
+	uint32_t *futex = (uint32_t *) word;
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	futex += sizeof(intptr_t) / sizeof(uint32_t) - 1;
+#endif
+	return futex;
+}
+
+/* Sleep while @word is 1. */
+static
+void word_sleep(intptr_t *word, int32_t *nr_waiters)
+{
+	__atomic_add_fetch(nr_waiters, 1, __ATOMIC_SEQ_CST);
+	/*
+	 * The wait fails with EAGAIN if @word was cleared after the
+	 * waiter was accounted for: the unlock either sees the waiter or
+	 * the futex sees the cleared value.
+	 */
+	(void) syscall(__NR_futex, word_futex(word), FUTEX_WAIT_PRIVATE, 1,
+			NULL, NULL, 0);
+	__atomic_sub_fetch(nr_waiters, 1, __ATOMIC_RELAXED);
+}
+
+/* Wake up all the threads sleeping on @word. */
+static
+void word_wake(intptr_t *word)
+{
+	(void) syscall(__NR_futex, word_futex(word), FUTEX_WAKE_PRIVATE, INT_MAX,
+			NULL, NULL, 0);
+}
+
+/* Sleep while the mutex is held. */
+static
+void owner_sleep(struct rseq_percpu_mutex_cpu *mutex_cpu)
+{
+	word_sleep(&mutex_cpu->owner, &mutex_cpu->nr_waiters);
+}
+
+struct rseq_percpu_mutex *rseq_percpu_mutex_create(void)
+{
+	struct rseq_percpu_mutex *mutex;
+	struct rseq_mempool *pool;
+
+	pool = rseq_internal_percpu_pool(&mutex_pool);
+	if (!pool)
+		return NULL;
+	mutex = (struct rseq_percpu_mutex *) calloc(1, sizeof(*mutex));
+	if (!mutex) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	mutex->cpus = (struct rseq_percpu_mutex_cpu __rseq_percpu *)
+		rseq_mempool_percpu_zmalloc(pool);
+	if (!mutex->cpus) {
+		free(mutex);
+		errno = ENOMEM;
+		return NULL;
+	}
+	mutex->max_nr_cpus = rseq_mempool_get_max_nr_cpus(pool);
+	return mutex;
+}
+
+int rseq_percpu_mutex_destroy(struct rseq_percpu_mutex *mutex)
+{
+	if (!mutex) {
+		errno = EINVAL;
+		return -1;
+	}
+	rseq_mempool_percpu_free(mutex->cpus);
+	free(mutex);
+	return 0;
+}
+
+void rseq_percpu_mutex_wait(struct rseq_percpu_mutex *mutex, int cpu)
+{
+	struct rseq_percpu_mutex_cpu *mutex_cpu = rseq_percpu_ptr(mutex->cpus, cpu);
+	int i;
+
+	/* Adaptive spinning: the owner is likely running on another CPU. */
+	for (i = 0; i < MUTEX_SPIN_LOOPS; i++) {
+		if (!RSEQ_READ_ONCE(mutex_cpu->owner) && !RSEQ_READ_ONCE(mutex_cpu->remote))
+			return;
+		rseq_retry_pause();
+	}
+	if (RSEQ_READ_ONCE(mutex_cpu->owner))
+		owner_sleep(mutex_cpu);
+	else
+		sched_yield();	/* A remote lock operation is in progress. */
+}
+
+void rseq_percpu_mutex_wake(struct rseq_percpu_mutex *mutex, int cpu)
+{
+	struct rseq_percpu_mutex_cpu *mutex_cpu = rseq_percpu_ptr(mutex->cpus, cpu);
+
+	/*
+	 * Wake up all waiters: a waiter which migrated retries on the
+	 * mutex of another CPU, and must not leave the others asleep.
+	 */
+	word_wake(&mutex_cpu->owner);
+}
+
+/*
+ * Acquire the mutex once claimed and fenced: local lock operations can
+ * no longer succeed, so wait for the owner to unlock it.
+ */
+static
+void remote_acquire(struct rseq_percpu_mutex_cpu *mutex_cpu)
+{
+	intptr_t expect;
+
+	for (;;) {
+		expect = 0;
+		if (__atomic_compare_exchange_n(&mutex_cpu->owner, &expect, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+		owner_sleep(mutex_cpu);
+	}
+	__atomic_store_n(&mutex_cpu->remote, 0, __ATOMIC_RELEASE);
+}
+
+int rseq_percpu_mutex_lock_cpu(struct rseq_percpu_mutex *mutex, int cpu)
+{
+	struct rseq_percpu_mutex_cpu *mutex_cpu;
+
+	if (!mutex || cpu < 0 || cpu >= mutex->max_nr_cpus) {
+		errno = EINVAL;
+		return -1;
+	}
+	mutex_cpu = rseq_percpu_ptr(mutex->cpus, cpu);
+	/* Prevent the local lock operations from succeeding. */
+	if (rseq_internal_claim_cpu(&mutex_cpu->remote, cpu))
+		return -1;
+	remote_acquire(mutex_cpu);
+	return 0;
+}
+
+int rseq_percpu_mutex_lock_all(struct rseq_percpu_mutex *mutex)
+{
+	int cpu;
+
+	if (!mutex) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (cpu = 0; cpu < mutex->max_nr_cpus; cpu++)
+		rseq_internal_claim(&rseq_percpu_ptr(mutex->cpus, cpu)->remote);
+	if (rseq_fence_all()) {
+		int saved_errno = errno;
+
+		for (cpu = 0; cpu < mutex->max_nr_cpus; cpu++)
+			__atomic_store_n(&rseq_percpu_ptr(mutex->cpus, cpu)->remote, 0,
+					__ATOMIC_RELEASE);
+		errno = saved_errno;
+		return -1;
+	}
+	for (cpu = 0; cpu < mutex->max_nr_cpus; cpu++)
+		remote_acquire(rseq_percpu_ptr(mutex->cpus, cpu));
+	return 0;
+}
+
+void rseq_percpu_mutex_unlock_all(struct rseq_percpu_mutex *mutex)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < mutex->max_nr_cpus; cpu++)
+		rseq_percpu_mutex_unlock(mutex, cpu);
+}
+
+int rseq_percpu_brlock_create(struct rseq_percpu_brlock *brlock)
+{
+	struct rseq_mempool *pool;
+
+	pool = rseq_internal_percpu_pool(&brlock_pool);
+	if (!pool)
+		return -1;
+	brlock->cpus = (struct rseq_percpu_brlock_cpu __rseq_percpu *)
+		rseq_mempool_percpu_zmalloc(pool);
+	if (!brlock->cpus) {
+		errno = ENOMEM;
+		return -1;
+	}
+	brlock->writer = 0;
+	brlock->nr_waiters = 0;
+	brlock->max_nr_cpus = rseq_mempool_get_max_nr_cpus(pool);
+	return 0;
+}
+
+int rseq_percpu_brlock_destroy(struct rseq_percpu_brlock *brlock)
+{
+	if (!brlock || !brlock->cpus) {
+		errno = EINVAL;
+		return -1;
+	}
+	rseq_mempool_percpu_free(brlock->cpus);
+	brlock->cpus = NULL;
+	return 0;
+}
+
+void rseq_percpu_brlock_read_wait(struct rseq_percpu_brlock *brlock)
+{
+	int i;
+
+	/* Adaptive spinning: write-side critical sections are short. */
+	for (i = 0; i < MUTEX_SPIN_LOOPS; i++) {
+		if (!RSEQ_READ_ONCE(brlock->writer))
+			return;
+		rseq_retry_pause();
+	}
+	word_sleep(&brlock->writer, &brlock->nr_waiters);
+}
+
+void rseq_percpu_brlock_write_wake(struct rseq_percpu_brlock *brlock)
+{
+	word_wake(&brlock->writer);
+}
+
+/* Wait for the readers which locked @brlock on @cpu to unlock it. */
+static
+void brlock_drain_cpu(struct rseq_percpu_brlock *brlock, int cpu)
+{
+	struct rseq_percpu_brlock_cpu *brlock_cpu = rseq_percpu_ptr(brlock->cpus, cpu);
+	/* Stable: the read lock operations fail while the writer flag is set. */
+	intptr_t nr_locks = RSEQ_READ_ONCE(brlock_cpu->nr_locks);
+	int i = 0;
+
+	while (__atomic_load_n(&brlock_cpu->nr_unlocks, __ATOMIC_ACQUIRE) != nr_locks) {
+		if (i++ < MUTEX_SPIN_LOOPS)
+			rseq_retry_pause();
+		else
+			sched_yield();
+	}
+}
+
+int rseq_percpu_brlock_write_lock(struct rseq_percpu_brlock *brlock)
+{
+	intptr_t expect;
+	int cpu;
+
+	if (!brlock) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* Exclude the other writers, and prevent new readers. */
+	for (;;) {
+		expect = 0;
+		if (__atomic_compare_exchange_n(&brlock->writer, &expect, 1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			break;
+		word_sleep(&brlock->writer, &brlock->nr_waiters);
+	}
+	/*
+	 * Restart the read lock critical sections in flight, which may
+	 * have observed the writer flag unset. Readers which incremented
+	 * their count before the fence are visible to the writer.
+	 */
+	if (rseq_fence_all()) {
+		int saved_errno = errno;
+
+		rseq_percpu_brlock_write_unlock(brlock);
+		errno = saved_errno;
+		return -1;
+	}
+	for (cpu = 0; cpu < brlock->max_nr_cpus; cpu++)
+		brlock_drain_cpu(brlock, cpu);
+	return 0;
+}
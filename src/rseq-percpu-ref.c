@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdlib.h>
+
+#include <rseq/percpu-ref.h>
+
+#include "rseq-percpu-internal.h"
+
+/* Per-cpu pool shared by the counts of all reference counters. */
+static struct rseq_internal_pool counts_pool =
+	RSEQ_INTERNAL_POOL_INIT("rseq-percpu-ref", sizeof(intptr_t));
+
+int rseq_percpu_ref_init(struct rseq_percpu_ref *ref,
+		void (*release)(struct rseq_percpu_ref *ref))
+{
+	struct rseq_mempool *pool;
+
+	pool = rseq_internal_percpu_pool(&counts_pool);
+	if (!pool) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ref->counts = (intptr_t __rseq_percpu *) rseq_mempool_percpu_zmalloc(pool);
+	if (!ref->counts) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ref->max_nr_cpus = rseq_mempool_get_max_nr_cpus(pool);
+	ref->release = release;
+	/* Switching to atomic mode requires rseq fences. */
+	if (rseq_fence_available()) {
+		ref->count = 1 + RSEQ_PERCPU_REF_BIAS;
+		ref->mode = RSEQ_PERCPU_REF_PERCPU;
+	} else {
+		ref->count = 1;
+		ref->mode = RSEQ_PERCPU_REF_ATOMIC;
+	}
+	return 0;
+}
+
+int rseq_percpu_ref_exit(struct rseq_percpu_ref *ref)
+{
+	if (!ref->counts) {
+		errno = EINVAL;
+		return -1;
+	}
+	rseq_mempool_percpu_free(ref->counts);
+	ref->counts = NULL;
+	return 0;
+}
+
+int rseq_percpu_ref_kill(struct rseq_percpu_ref *ref)
+{
+	intptr_t mode, sum = 0;
+	int cpu;
+
+	mode = __atomic_load_n(&ref->mode, __ATOMIC_RELAXED);
+	do {
+		if (mode == RSEQ_PERCPU_REF_DEAD) {
+			errno = EINVAL;
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&ref->mode, &mode, RSEQ_PERCPU_REF_DEAD, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	if (mode == RSEQ_PERCPU_REF_PERCPU) {
+		/*
+		 * Wait for the per-CPU updates in flight. The updates
+		 * committed from now on see the atomic mode and fail.
+		 */
+		if (rseq_fence_all()) {
+			int saved_errno = errno;
+
+			/*
+			 * The updates of the atomic count done meanwhile
+			 * stay valid in per-CPU mode.
+			 */
+			__atomic_store_n(&ref->mode, RSEQ_PERCPU_REF_PERCPU, __ATOMIC_SEQ_CST);
+			errno = saved_errno;
+			return -1;
+		}
+		for (cpu = 0; cpu < ref->max_nr_cpus; cpu++)
+			sum += RSEQ_READ_ONCE(*rseq_percpu_ptr(ref->counts, cpu));
+		__atomic_add_fetch(&ref->count, sum - RSEQ_PERCPU_REF_BIAS, __ATOMIC_SEQ_CST);
+	}
+	/* Put the initial reference. */
+	rseq_percpu_ref_put(ref);
+	return 0;
+}
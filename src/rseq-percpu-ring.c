@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/percpu-ring.h>
+
+#include "rseq-percpu-internal.h"
+#include "rseq-utils.h"
+
+struct rseq_percpu_ring *rseq_percpu_ring_create(size_t entry_size, size_t capacity)
+{
+	struct rseq_percpu_ring *ring;
+	size_t item_len;
+	int order;
+
+	if (!entry_size || !capacity) {
+		errno = EINVAL;
+		return NULL;
+	}
+	order = rseq_get_count_order_ulong(capacity);
+	if (order < 0 || order >= (int) (sizeof(size_t) * CHAR_BIT - 1) ||
+			entry_size > (SIZE_MAX / 2 - sizeof(struct rseq_percpu_ring_cpu)) >> order) {
+		errno = EINVAL;
+		return NULL;
+	}
+	capacity = (size_t) 1 << order;
+	item_len = sizeof(struct rseq_percpu_ring_cpu) + entry_size * capacity;
+	ring = (struct rseq_percpu_ring *) calloc(1, sizeof(*ring));
+	if (!ring) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	ring->entry_size = entry_size;
+	ring->capacity = capacity;
+	/* The ring of a CPU is a single pool item. */
+	ring->pool = rseq_internal_percpu_item_pool("rseq-percpu-ring", item_len, &ring->stride);
+	if (!ring->pool)
+		goto error_alloc;
+	ring->cpus = (struct rseq_percpu_ring_cpu __rseq_percpu *)
+		rseq_mempool_percpu_zmalloc(ring->pool);
+	if (!ring->cpus)
+		goto error_pool;
+	ring->max_nr_cpus = rseq_mempool_get_max_nr_cpus(ring->pool);
+	return ring;
+
+error_pool:
+	(void) rseq_mempool_destroy(ring->pool);
+error_alloc:
+	free(ring);
+	errno = ENOMEM;
+	return NULL;
+}
+
+int rseq_percpu_ring_destroy(struct rseq_percpu_ring *ring)
+{
+	if (!ring) {
+		errno = EINVAL;
+		return -1;
+	}
+	rseq_mempool_percpu_free(ring->cpus, ring->stride);
+	if (rseq_mempool_destroy(ring->pool))
+		return -1;
+	free(ring);
+	return 0;
+}
+
+ssize_t rseq_percpu_ring_drain_cpu(struct rseq_percpu_ring *ring, int cpu,
+		void *entries, size_t nr)
+{
+	struct rseq_percpu_ring_cpu *cpu_ring;
+	uintptr_t head, tail;
+	size_t n, first;
+
+	if (!ring || cpu < 0 || cpu >= ring->max_nr_cpus) {
+		errno = EINVAL;
+		return -1;
+	}
+	cpu_ring = rseq_percpu_ring_cpu_ptr(ring, cpu);
+	/*
+	 * Take ownership of the dequeue side. Once the lock is visible,
+	 * restart the critical sections in flight on @cpu: they may have
+	 * observed the lock unset, and new ones will observe it set.
+	 */
+	if (rseq_internal_claim_cpu(&cpu_ring->lock, cpu))
+		return -1;
+	head = (uintptr_t) cpu_ring->head;
+	tail = (uintptr_t) __atomic_load_n(&cpu_ring->tail, __ATOMIC_ACQUIRE);
+	n = (size_t) (tail - head);
+	if (n > nr)
+		n = nr;
+	first = ring->capacity - (head & (ring->capacity - 1));
+	if (first > n)
+		first = n;
+	memcpy(entries, rseq_percpu_ring_entry(ring, cpu_ring, head),
+		first * ring->entry_size);
+	memcpy((char *) entries + first * ring->entry_size,
+		rseq_percpu_ring_entry(ring, cpu_ring, head + first),
+		(n - first) * ring->entry_size);
+	/* Release the slots to the producers. */
+	__atomic_store_n(&cpu_ring->head, (intptr_t) (head + n), __ATOMIC_RELEASE);
+	__atomic_store_n(&cpu_ring->lock, 0, __ATOMIC_RELEASE);
+	return (ssize_t) n;
+}
@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <rseq/rseq.h>
+#include <rseq/rcu.h>
+
+/* Stack of the queued callbacks, most recent first. */
+static struct rseq_rcu_head *rcu_queue;
+static unsigned long rcu_queue_len;
+/* Monotonic time at which the oldest queued callback was queued. */
+static uint64_t rcu_queue_time_ns;
+
+/*
+ * Serialize the flushes, so a barrier returns after the callbacks taken
+ * by a concurrent flush are invoked.
+ */
+static pthread_mutex_t rcu_barrier_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static
+void rcu_queue_push(struct rseq_rcu_head *first, struct rseq_rcu_head *last)
+{
+	struct rseq_rcu_head *old = __atomic_load_n(&rcu_queue, __ATOMIC_RELAXED);
+
+	do {
+		last->next = old;
+	} while (!__atomic_compare_exchange_n(&rcu_queue, &old, first, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static
+uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		abort();
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+int rseq_rcu_synchronize(void)
+{
+	int ret;
+
+	/* Order the unpublication before the fence. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	ret = rseq_fence_all();
+	/* Order the fence before the reclamation. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return ret;
+}
+
+/* Invoke the queued callbacks after a grace period, with the lock held. */
+static
+int rcu_flush(void)
+{
+	struct rseq_rcu_head *batch, *last, *next;
+	unsigned long len = 0;
+
+	batch = __atomic_exchange_n(&rcu_queue, NULL, __ATOMIC_ACQUIRE);
+	if (!batch)
+		return 0;
+	for (last = batch; ; last = last->next) {
+		len++;
+		if (!last->next)
+			break;
+	}
+	__atomic_sub_fetch(&rcu_queue_len, len, __ATOMIC_RELAXED);
+	if (rseq_rcu_synchronize()) {
+		int saved_errno = errno;
+
+		__atomic_add_fetch(&rcu_queue_len, len, __ATOMIC_RELAXED);
+		rcu_queue_push(batch, last);
+		errno = saved_errno;
+		return -1;
+	}
+	for (; batch; batch = next) {
+		next = batch->next;
+		batch->func(batch);
+	}
+	return 0;
+}
+
+int rseq_rcu_barrier(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&rcu_barrier_lock);
+	ret = rcu_flush();
+	pthread_mutex_unlock(&rcu_barrier_lock);
+	return ret;
+}
+
+int rseq_rcu_call(struct rseq_rcu_head *head, void (*func)(struct rseq_rcu_head *head))
+{
+	uint64_t now = monotonic_ns();
+	unsigned long len;
+	int ret;
+
+	head->func = func;
+	rcu_queue_push(head, head);
+	len = __atomic_add_fetch(&rcu_queue_len, 1, __ATOMIC_RELAXED);
+	if (len == 1) {
+		/* First callback of a batch. */
+		__atomic_store_n(&rcu_queue_time_ns, now, __ATOMIC_RELAXED);
+		return 0;
+	}
+	if (len < RSEQ_RCU_BATCH &&
+			now - __atomic_load_n(&rcu_queue_time_ns, __ATOMIC_RELAXED) <
+				RSEQ_RCU_DELAY_NS)
+		return 0;
+	/*
+	 * Leave the batch to a concurrent flush, which may be invoking
+	 * the callback calling this function.
+	 */
+	if (pthread_mutex_trylock(&rcu_barrier_lock))
+		return 0;
+	ret = rcu_flush();
+	pthread_mutex_unlock(&rcu_barrier_lock);
+	return ret;
+}
@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <rseq/stats.h>
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * List of registered call sites, most recently registered first. Call
+ * sites are never removed: they belong to the instrumented modules,
+ * which must not be unloaded (see rseq/stats.h).
+ */
+static struct rseq_stats_site *stats_sites;
+
+void rseq_stats_register_site(struct rseq_stats_site *site)
+{
+	pthread_mutex_lock(&stats_lock);
+	if (!site->registered) {
+		site->next = stats_sites;
+		stats_sites = site;
+		__atomic_store_n(&site->registered, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static
+void stats_site_sum(struct rseq_stats_site *site, uint64_t *count)
+{
+	int i, j;
+
+	for (j = 0; j < RSEQ_STATS_NR_OUTCOMES; j++)
+		count[j] = 0;
+	for (i = 0; i < RSEQ_STATS_NR_SHARDS; i++) {
+		for (j = 0; j < RSEQ_STATS_NR_OUTCOMES; j++)
+			count[j] += __atomic_load_n(&site->shards[i].count[j], __ATOMIC_RELAXED);
+	}
+}
+
+int rseq_stats_dump(FILE *stream)
+{
+	struct rseq_stats_site *site;
+	int ret = 0;
+
+	if (!stream) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&stats_lock);
+	if (fprintf(stream, "%-32s %20s %20s %20s %20s %8s  %s\n",
+			"op", "attempts", "commits", "ne/eq", "aborts", "abort%",
+			"call site") < 0) {
+		ret = -1;
+		goto end;
+	}
+	for (site = stats_sites; site; site = site->next) {
+		uint64_t count[RSEQ_STATS_NR_OUTCOMES], attempts;
+
+		stats_site_sum(site, count);
+		attempts = count[RSEQ_STATS_COMMIT] + count[RSEQ_STATS_NE] +
+			count[RSEQ_STATS_ABORT];
+		if (fprintf(stream, "%-32s %20" PRIu64 " %20" PRIu64 " %20" PRIu64
+				" %20" PRIu64 " %7.3f%%  %s:%d (%s)\n",
+				site->op, attempts, count[RSEQ_STATS_COMMIT],
+				count[RSEQ_STATS_NE], count[RSEQ_STATS_ABORT],
+				attempts ? 100.0 * (double) count[RSEQ_STATS_ABORT] / (double) attempts : 0.0,
+				site->file, site->line, site->func) < 0) {
+			ret = -1;
+			goto end;
+		}
+	}
+	if (fflush(stream))
+		ret = -1;
+end:
+	pthread_mutex_unlock(&stats_lock);
+	return ret;
+}
+
+void rseq_stats_reset(void)
+{
+	struct rseq_stats_site *site;
+	int i, j;
+
+	pthread_mutex_lock(&stats_lock);
+	for (site = stats_sites; site; site = site->next) {
+		for (i = 0; i < RSEQ_STATS_NR_SHARDS; i++) {
+			for (j = 0; j < RSEQ_STATS_NR_OUTCOMES; j++)
+				__atomic_store_n(&site->shards[i].count[j], 0, __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
@@ -21,6 +21,7 @@
 #include <linux/auxvec.h>
 
 #include <rseq/rseq.h>
+#include "rseq-fallback.h"
 #include "smp.h"
 
 #ifndef AT_RSEQ_FEATURE_SIZE
@@ -55,6 +56,26 @@ unsigned int rseq_flags;
 
 static int rseq_ownership;
 
+typedef long (*vdso_getcpu_func_t)(unsigned int *cpu, unsigned int *node, void *cache);
+
+/* getcpu from the vDSO, NULL if unavailable. */
+static vdso_getcpu_func_t vdso_getcpu;
+
+/* Node of each possible CPU plus one, 0 if not cached yet. */
+static int32_t *cpu_node_cache;
+static int cpu_node_cache_len;
+
+static enum rseq_fallback_mode fallback_mode;
+
+static int auto_register;
+/* Created at library initialization, before any lazy registration. */
+static pthread_key_t auto_register_key;
+/* Error returned by pthread_key_create(), 0 on success. */
+static int auto_register_key_error;
+
+/* The current thread has been registered automatically. */
+static __thread int rseq_auto_registered __attribute__((tls_model("initial-exec")));
+
 /* Allocate a large area for the TLS. */
 #define RSEQ_THREAD_AREA_ALLOC_SIZE	1024
 
@@ -86,6 +107,45 @@ static int sys_getcpu(unsigned int *cpu, unsigned int *node)
 	return syscall(__NR_getcpu, cpu, node, NULL);
 }
 
+static int rseq_getcpu(unsigned int *cpu, unsigned int *node)
+{
+	if (vdso_getcpu && !vdso_getcpu(cpu, node, NULL))
+		return 0;
+	return sys_getcpu(cpu, node);
+}
+
+/*
+ * Resolve getcpu from the vDSO so the CPU and node number fallbacks do
+ * not need a system call. The vDSO is always loaded, so this does not
+ * load anything.
+ */
+static
+void init_vdso_getcpu(void)
+{
+	void *handle;
+
+	handle = dlopen("linux-vdso.so.1", RTLD_LAZY | RTLD_LOCAL | RTLD_NOLOAD);
+	if (!handle)
+		return;
+	vdso_getcpu = (vdso_getcpu_func_t) dlsym(handle, "__vdso_getcpu");
+	if (!vdso_getcpu)
+		vdso_getcpu = (vdso_getcpu_func_t) dlsym(handle, "__kernel_getcpu");
+	/* The vDSO stays mapped, drop the reference. */
+	dlclose(handle);
+}
+
+static
+void init_cpu_node_cache(void)
+{
+	int len = get_possible_cpus_array_len();
+
+	if (len <= 0)
+		return;
+	cpu_node_cache = (int32_t *) calloc(len, sizeof(int32_t));
+	if (cpu_node_cache)
+		cpu_node_cache_len = len;
+}
+
 bool rseq_available(unsigned int query)
 {
 	int rc;
@@ -161,6 +221,14 @@ int rseq_register_current_thread(void)
 		/* Treat libc's ownership as a successful registration. */
 		return 0;
 	}
+	if (rseq_fallback_active()) {
+		/* Critical sections are executed by the fallback. */
+		return 0;
+	}
+	if (rseq_auto_registered) {
+		/* Already registered automatically. */
+		return 0;
+	}
 	rc = sys_rseq(&__rseq_abi, get_rseq_min_alloc_size(), 0, RSEQ_SIG);
 	if (rc) {
 		/*
@@ -172,6 +240,11 @@ int rseq_register_current_thread(void)
 			/* Incoherent success/failure within process. */
 			abort();
 		}
+		if ((errno == ENOSYS || errno == EPERM) &&
+				RSEQ_READ_ONCE(fallback_mode) != RSEQ_FALLBACK_MODE_NONE) {
+			rseq_fallback_activate();
+			return 0;
+		}
 		return -1;
 	}
 	assert(rseq_current_cpu_raw() >= 0);
@@ -191,13 +264,56 @@ int rseq_unregister_current_thread(void)
 {
 	int rc;
 
-	if (!rseq_ownership) {
-		/* Treat libc's ownership as a successful unregistration. */
+	if (!rseq_ownership || rseq_fallback_active()) {
+		/*
+		 * Treat libc's ownership and the fallback as a successful
+		 * unregistration.
+		 */
 		return 0;
 	}
 	rc = sys_rseq(&__rseq_abi, get_rseq_min_alloc_size(), RSEQ_ABI_FLAG_UNREGISTER, RSEQ_SIG);
 	if (rc)
 		return -1;
+	rseq_auto_registered = 0;
+	return 0;
+}
+
+static
+void auto_unregister_thread(void *arg __attribute__((unused)))
+{
+	if (rseq_auto_registered)
+		(void) rseq_unregister_current_thread();
+}
+
+void rseq_auto_register_current_thread(void)
+{
+	if (!RSEQ_READ_ONCE(auto_register) || !rseq_ownership)
+		return;
+	if ((int32_t) RSEQ_READ_ONCE(__rseq_abi.cpu_id) != RSEQ_ABI_CPU_ID_UNINITIALIZED)
+		return;
+	if (rseq_register_current_thread()) {
+		/* Do not retry on each abort. */
+		RSEQ_WRITE_ONCE(__rseq_abi.cpu_id, RSEQ_ABI_CPU_ID_REGISTRATION_FAILED);
+		return;
+	}
+	rseq_auto_registered = 1;
+	/*
+	 * Any non-NULL value triggers the destructor on thread exit. This
+	 * is the only call which is not async-signal-safe on this path,
+	 * see rseq_set_auto_register().
+	 */
+	(void) pthread_setspecific(auto_register_key, &rseq_auto_registered);
+}
+
+int rseq_set_auto_register(bool enable)
+{
+	rseq_init();
+
+	if (enable && rseq_ownership && auto_register_key_error) {
+		errno = auto_register_key_error;
+		return -1;
+	}
+	RSEQ_WRITE_ONCE(auto_register, enable);
 	return 0;
 }
 
@@ -225,6 +341,9 @@ void rseq_init(void)
 	if (init_done)
 		goto unlock;
 
+	init_vdso_getcpu();
+	init_cpu_node_cache();
+
 	/*
 	 * Check for glibc rseq support, if the 3 public symbols are found and
 	 * the rseq_size is not zero, glibc owns the registration.
@@ -278,6 +397,14 @@ void rseq_init(void)
 	/* librseq owns the registration */
 	rseq_ownership = 1;
 
+	/*
+	 * Create the key used to unregister automatically registered
+	 * threads on exit here rather than on the lazy registration path,
+	 * which can be reached from signal handlers.
+	 */
+	auto_register_key_error = pthread_key_create(&auto_register_key,
+			auto_unregister_thread);
+
 	/* Calculate the offset of the rseq area from the thread pointer. */
 	rseq_offset = (uintptr_t)&__rseq_abi - (uintptr_t)rseq_thread_pointer();
 
@@ -300,6 +427,58 @@ unlock:
 	pthread_mutex_unlock(&init_lock);
 }
 
+int rseq_set_fallback_mode(enum rseq_fallback_mode mode)
+{
+	int ret = 0, rc;
+
+	switch (mode) {
+	case RSEQ_FALLBACK_MODE_NONE:
+	case RSEQ_FALLBACK_MODE_AUTO:
+	case RSEQ_FALLBACK_MODE_FORCE:
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	rseq_init();
+
+	pthread_mutex_lock(&init_lock);
+	switch (mode) {
+	case RSEQ_FALLBACK_MODE_NONE:
+		if (rseq_fallback_active()) {
+			errno = EBUSY;
+			ret = -1;
+			goto unlock;
+		}
+		break;
+	case RSEQ_FALLBACK_MODE_AUTO:
+		/*
+		 * The fallback is only needed if no thread can register,
+		 * which is known if the system call is unavailable.
+		 * Otherwise it is activated if a registration fails.
+		 */
+		if (!rseq_ownership || RSEQ_READ_ONCE(rseq_size) > 0)
+			break;
+		rc = sys_rseq(NULL, 0, 0, 0);
+		if (rc == -1 && (errno == ENOSYS || errno == EPERM))
+			rseq_fallback_activate();
+		break;
+	case RSEQ_FALLBACK_MODE_FORCE:
+		if (!rseq_ownership || RSEQ_READ_ONCE(rseq_size) > 0) {
+			errno = EBUSY;
+			ret = -1;
+			goto unlock;
+		}
+		rseq_fallback_activate();
+		break;
+	}
+	RSEQ_WRITE_ONCE(fallback_mode, mode);
+unlock:
+	pthread_mutex_unlock(&init_lock);
+	return ret;
+}
+
 static __attribute__((destructor))
 void rseq_exit(void)
 {
@@ -312,8 +491,12 @@ void rseq_exit(void)
 
 int32_t rseq_fallback_current_cpu(void)
 {
+	unsigned int cpu_id;
 	int32_t cpu;
 
+	rseq_init();
+	if (vdso_getcpu && !vdso_getcpu(&cpu_id, NULL, NULL))
+		return (int32_t) cpu_id;
 	cpu = sched_getcpu();
 	if (cpu < 0) {
 		perror("sched_getcpu()");
@@ -327,7 +510,8 @@ int32_t rseq_fallback_current_node(void)
 	uint32_t cpu_id, node_id;
 	int ret;
 
-	ret = sys_getcpu(&cpu_id, &node_id);
+	rseq_init();
+	ret = rseq_getcpu(&cpu_id, &node_id);
 	if (ret) {
 		perror("sys_getcpu()");
 		return ret;
@@ -335,6 +519,33 @@ int32_t rseq_fallback_current_node(void)
 	return (int32_t) node_id;
 }
 
+int32_t rseq_fallback_current_node_cached(int32_t cpu)
+{
+	uint32_t cpu_id, node_id;
+	int32_t node;
+
+	rseq_init();
+	/* Key the cache on the current CPU even if the thread is not registered. */
+	if (cpu < 0)
+		cpu = rseq_fallback_current_cpu();
+	if (cpu < cpu_node_cache_len) {
+		node = __atomic_load_n(&cpu_node_cache[cpu], __ATOMIC_RELAXED);
+		if (node)
+			return node - 1;
+	}
+	if (rseq_getcpu(&cpu_id, &node_id)) {
+		perror("sys_getcpu()");
+		return -1;
+	}
+	/*
+	 * Cache the node of the CPU returned by getcpu, which may differ
+	 * from @cpu if the thread migrated.
+	 */
+	if ((int32_t) cpu_id < cpu_node_cache_len)
+		__atomic_store_n(&cpu_node_cache[cpu_id], (int32_t) node_id + 1, __ATOMIC_RELAXED);
+	return (int32_t) node_id;
+}
+
 int rseq_get_max_nr_cpus(void)
 {
 	return get_possible_cpus_array_len();
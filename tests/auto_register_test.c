@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+
+#include "tap.h"
+
+/*
+ * Check the automatic registration of threads which use the critical
+ * section helpers without registering.
+ *
+ * This test must be run without glibc owning the rseq registration
+ * (glibc.pthread.rseq=0 tunable).
+ */
+
+#define NR_TESTS 6
+
+#define NR_REPS	1000
+
+struct thread_result {
+	int32_t cpu_id_before;
+	int32_t cpu_id_after;
+	int nr_aborts;
+	intptr_t count;
+};
+
+static void *test_thread(void *arg)
+{
+	struct thread_result *result = (struct thread_result *) arg;
+	int i;
+
+	result->cpu_id_before = rseq_current_cpu_raw();
+	for (i = 0; i < NR_REPS; i++) {
+		int cpu, ret;
+
+		for (;;) {
+			cpu = rseq_cpu_start();
+			ret = rseq_load_add_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+					&result->count, 1, cpu);
+			if (rseq_likely(!ret))
+				break;
+			result->nr_aborts++;
+			/* Give up if the thread is never registered. */
+			if (result->nr_aborts > NR_REPS)
+				goto end;
+		}
+	}
+end:
+	result->cpu_id_after = rseq_current_cpu_raw();
+	return NULL;
+}
+
+static void run_thread(struct thread_result *result)
+{
+	pthread_t thread;
+
+	memset(result, 0, sizeof(*result));
+	pthread_create(&thread, NULL, test_thread, result);
+	pthread_join(thread, NULL);
+}
+
+int main(void)
+{
+	struct thread_result result;
+
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+	if (rseq_available(RSEQ_AVAILABLE_QUERY_LIBC)) {
+		skip(NR_TESTS, "glibc owns the rseq registration");
+		goto end;
+	}
+
+	run_thread(&result);
+	ok(result.count == 0 && result.cpu_id_after == RSEQ_ABI_CPU_ID_UNINITIALIZED,
+		"Unregistered thread aborts without automatic registration");
+
+	ok(rseq_set_auto_register(true) == 0, "Enable automatic registration");
+	run_thread(&result);
+	ok(result.cpu_id_before == RSEQ_ABI_CPU_ID_UNINITIALIZED && result.cpu_id_after >= 0,
+		"Thread registered on first abort (cpu_id %d -> %d)",
+		result.cpu_id_before, result.cpu_id_after);
+	ok(result.count == NR_REPS, "All increments committed after registration (%ld, %d aborts)",
+		(long) result.count, result.nr_aborts);
+
+	/* Automatic registration must not break explicit registration. */
+	ok(rseq_register_current_thread() == 0 && rseq_unregister_current_thread() == 0,
+		"Explicit registration with automatic registration enabled");
+
+	ok(rseq_set_auto_register(false) == 0, "Disable automatic registration");
+end:
+	exit(exit_status());
+}
@@ -0,0 +1,4 @@
+/* SPDX-License-Identifier: MIT */
+// SPDX-FileCopyrightText: 2024 EfficiOS Inc.
+
+#include "auto_register_test.c"
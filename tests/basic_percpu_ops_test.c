@@ -17,7 +17,11 @@
 
 #include "tap.h"
 
-#define NR_TESTS 4
+#ifdef RSEQ_STATS
+# define NR_TESTS 10
+#else
+# define NR_TESTS 8
+#endif
 
 #define ARRAY_SIZE(arr)	(sizeof(arr) / sizeof((arr)[0]))
 
@@ -65,6 +69,36 @@ struct spinlock_test_data {
 	int reps;
 };
 
+struct typed_test_data_entry {
+	uint32_t count32;
+	uint16_t count16;
+	uint8_t count8;
+	uint8_t guard;
+} __attribute__((aligned(128)));
+
+struct typed_test_data {
+	struct typed_test_data_entry c[CPU_SETSIZE];
+	int reps;
+};
+
+struct ticket_test_data {
+	struct test_data_entry c[CPU_SETSIZE];
+	uint64_t ticket_sum;
+	int reps;
+};
+
+struct storev_test_data_entry {
+	intptr_t seq;
+	intptr_t head;
+	intptr_t tail;
+	intptr_t count;
+} __attribute__((aligned(128)));
+
+struct storev_test_data {
+	struct storev_test_data_entry c[CPU_SETSIZE];
+	int reps;
+};
+
 struct percpu_list_node {
 	intptr_t data;
 	struct percpu_list_node *next;
@@ -322,6 +356,465 @@ static void test_percpu_list(void)
 	ok(sum == expected_sum, "percpu_list - sum (%" PRIu64 " == %" PRIu64 ")", sum, expected_sum);
 }
 
+#ifdef rseq_arch_has_load_add_store_load
+static void *test_percpu_ticket_thread(void *arg)
+{
+	struct ticket_test_data *data = (struct ticket_test_data *) arg;
+	uint64_t sum = 0;
+	int i;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+	for (i = 0; i < data->reps; i++) {
+		intptr_t ticket;
+		int cpu;
+
+		do {
+			cpu = get_current_cpu_id();
+		} while (rseq_load_add_store_load__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU,
+				&data->c[cpu].count, 1, &ticket, cpu));
+		sum += (uint64_t) ticket;
+	}
+	__atomic_add_fetch(&data->ticket_sum, sum, __ATOMIC_RELAXED);
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+#endif
+
+/*
+ * Per-cpu ticket counters handed out with fetch-and-add. Each cpu
+ * hands out tickets 0 .. count - 1 exactly once, so the sum of the
+ * tickets is known from the final counts.
+ */
+static void test_percpu_ticket(void)
+{
+#ifdef rseq_arch_has_load_add_store_load
+	const int num_threads = 20;
+	pthread_t test_threads[num_threads];
+	struct ticket_test_data *data;
+	uint64_t count = 0, expected_sum = 0;
+	int i;
+
+	diag("ticket");
+
+	data = (struct ticket_test_data *) calloc(1, sizeof(*data));
+	if (!data)
+		abort();
+	data->reps = 5000;
+
+	for (i = 0; i < num_threads; i++)
+		pthread_create(&test_threads[i], NULL,
+			       test_percpu_ticket_thread, data);
+
+	for (i = 0; i < num_threads; i++)
+		pthread_join(test_threads[i], NULL);
+
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		uint64_t n = (uint64_t) data->c[i].count;
+
+		count += n;
+		expected_sum += n * (n - 1) / 2;
+	}
+
+	ok(count == (uint64_t) data->reps * num_threads && data->ticket_sum == expected_sum,
+		"ticket - sum (%" PRIu64 " == %" PRIu64 ")", data->ticket_sum, expected_sum);
+	free(data);
+#else
+	skip(1, "Fetch-and-add critical section helper unavailable on this architecture");
+#endif
+}
+
+#ifdef rseq_arch_has_percpu_stride_ops
+static void *test_percpu_stride_thread(void *arg)
+{
+	struct spinlock_test_data *data = (struct spinlock_test_data *) arg;
+	int i;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+	for (i = 0; i < data->reps; i++) {
+		while (rseq_percpu_load_add_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU,
+				&data->c[0].count, sizeof(data->c[0]), 1)) {
+			/* Retry if rseq aborts. */
+		}
+	}
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+#endif
+
+/*
+ * Sharded counter where the per-cpu slot is derived from the cpu index
+ * loaded within the critical section.
+ */
+static void test_percpu_stride(void)
+{
+#ifdef rseq_arch_has_percpu_stride_ops
+	const int num_threads = 20;
+	pthread_t test_threads[num_threads];
+	struct spinlock_test_data *data;
+	uint64_t sum = 0, expected_sum;
+	int i;
+
+	diag("stride");
+
+	data = (struct spinlock_test_data *) calloc(1, sizeof(*data));
+	if (!data)
+		abort();
+	data->reps = 5000;
+
+	for (i = 0; i < num_threads; i++)
+		pthread_create(&test_threads[i], NULL,
+			       test_percpu_stride_thread, data);
+
+	for (i = 0; i < num_threads; i++)
+		pthread_join(test_threads[i], NULL);
+
+	for (i = 0; i < CPU_SETSIZE; i++)
+		sum += data->c[i].count;
+
+	expected_sum = (uint64_t) data->reps * num_threads;
+
+	ok(sum == expected_sum, "stride - sum (%" PRIu64 " == %" PRIu64 ")", sum, expected_sum);
+	free(data);
+#else
+	skip(1, "Stride critical section helpers unavailable on this architecture");
+#endif
+}
+
+#ifdef rseq_arch_has_load_cbne_storev_store
+static void *test_percpu_storev_thread(void *arg)
+{
+	struct storev_test_data *data = (struct storev_test_data *) arg;
+	int i;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+	for (i = 0; i < data->reps; i++) {
+		for (;;) {
+			struct storev_test_data_entry *entry;
+			struct rseq_store_pair stores[3];
+			intptr_t seq;
+			int ret, cpu;
+
+			cpu = get_current_cpu_id();
+			entry = &data->c[cpu];
+			seq = RSEQ_READ_ONCE(entry->seq);
+			stores[0].addr = &entry->head;
+			stores[0].value = seq + 1;
+			stores[1].addr = &entry->tail;
+			stores[1].value = seq + 1;
+			stores[2].addr = &entry->count;
+			stores[2].value = seq + 1;
+			ret = rseq_load_cbne_storev_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU,
+					&entry->seq, seq, stores, ARRAY_SIZE(stores), seq + 1, cpu);
+			if (rseq_likely(!ret))
+				break;
+			/* Retry if comparison fails or rseq aborts. */
+		}
+	}
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+#endif
+
+/*
+ * Per-cpu structures of several fields updated along with their
+ * sequence number in a single critical section. Each field must match
+ * the sequence number once all threads are done.
+ */
+static void test_percpu_storev(void)
+{
+#ifdef rseq_arch_has_load_cbne_storev_store
+	const int num_threads = 20;
+	pthread_t test_threads[num_threads];
+	struct storev_test_data *data;
+	uint64_t sum = 0, expected_sum;
+	bool consistent = true;
+	int i;
+
+	diag("storev");
+
+	data = (struct storev_test_data *) calloc(1, sizeof(*data));
+	if (!data)
+		abort();
+	data->reps = 5000;
+
+	for (i = 0; i < num_threads; i++)
+		pthread_create(&test_threads[i], NULL,
+			       test_percpu_storev_thread, data);
+
+	for (i = 0; i < num_threads; i++)
+		pthread_join(test_threads[i], NULL);
+
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		struct storev_test_data_entry *entry = &data->c[i];
+
+		sum += (uint64_t) entry->seq;
+		if (entry->head != entry->seq || entry->tail != entry->seq ||
+				entry->count != entry->seq)
+			consistent = false;
+	}
+
+	expected_sum = (uint64_t) data->reps * num_threads;
+
+	ok(sum == expected_sum && consistent,
+		"storev - sum (%" PRIu64 " == %" PRIu64 "), fields %s", sum, expected_sum,
+		consistent ? "consistent" : "inconsistent");
+	free(data);
+#else
+	skip(1, "Multi-store critical section helper unavailable on this architecture");
+#endif
+}
+
+#ifdef rseq_arch_has_typed_ops
+static void *test_percpu_typed_thread(void *arg)
+{
+	struct typed_test_data *data = (struct typed_test_data *) arg;
+	int i;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+	for (i = 0; i < data->reps; i++) {
+		struct typed_test_data_entry *entry;
+		int cpu;
+
+		do {
+			cpu = get_current_cpu_id();
+			entry = &data->c[cpu];
+		} while (rseq_load_add_store__u32(RSEQ_MO_RELAXED, RSEQ_PERCPU,
+				&entry->count32, 1, cpu));
+		do {
+			cpu = get_current_cpu_id();
+			entry = &data->c[cpu];
+		} while (rseq_load_add_store__u16(RSEQ_MO_RELAXED, RSEQ_PERCPU,
+				&entry->count16, 1, cpu));
+		for (;;) {
+			uint8_t expect;
+			int ret;
+
+			cpu = get_current_cpu_id();
+			entry = &data->c[cpu];
+			expect = RSEQ_READ_ONCE(entry->count8);
+			ret = rseq_load_cbne_store__u8(RSEQ_MO_RELAXED, RSEQ_PERCPU,
+					&entry->count8, expect, (uint8_t) (expect + 1), cpu);
+			if (rseq_likely(!ret))
+				break;
+			/* Retry if comparison fails or rseq aborts. */
+		}
+	}
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+#endif
+
+/*
+ * Sharded counters of 32-bit, 16-bit and 8-bit widths, checking that
+ * the narrow stores do not clobber the adjacent fields.
+ */
+static void test_percpu_typed(void)
+{
+#ifdef rseq_arch_has_typed_ops
+	const int num_threads = 20;
+	pthread_t test_threads[num_threads];
+	struct typed_test_data *data;
+	uint64_t sum32 = 0, sum16 = 0, sum8 = 0, expected_sum;
+	bool guard_ok = true;
+	int i;
+
+	diag("typed");
+
+	data = (struct typed_test_data *) calloc(1, sizeof(*data));
+	if (!data)
+		abort();
+	data->reps = 5000;
+	for (i = 0; i < CPU_SETSIZE; i++)
+		data->c[i].guard = 0xA5;
+
+	for (i = 0; i < num_threads; i++)
+		pthread_create(&test_threads[i], NULL,
+			       test_percpu_typed_thread, data);
+
+	for (i = 0; i < num_threads; i++)
+		pthread_join(test_threads[i], NULL);
+
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		sum32 += data->c[i].count32;
+		sum16 += data->c[i].count16;
+		sum8 += data->c[i].count8;
+		if (data->c[i].guard != 0xA5)
+			guard_ok = false;
+	}
+
+	expected_sum = (uint64_t) data->reps * num_threads;
+
+	/* Narrow per-cpu counters wrap around independently. */
+	ok(sum32 == expected_sum && (uint16_t) sum16 == (uint16_t) expected_sum &&
+		(uint8_t) sum8 == (uint8_t) expected_sum && guard_ok,
+		"typed - sums (%" PRIu64 ", %" PRIu64 ", %" PRIu64 " for %" PRIu64 ")",
+		sum32, sum16, sum8, expected_sum);
+	free(data);
+#else
+	skip(1, "Typed critical section helpers unavailable on this architecture");
+#endif
+}
+
+#ifdef RSEQ_STATS
+/* Check that both critical sections of the tests have been accounted. */
+static void test_stats(void)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *stream;
+	int ret;
+
+	diag("stats");
+
+	stream = open_memstream(&buf, &len);
+	if (!stream)
+		abort();
+	ret = rseq_stats_dump(stream);
+	fclose(stream);
+	ok(ret == 0 && buf && strstr(buf, "load_cbne_store ") &&
+		strstr(buf, "load_cbeq_store_add_load_store "),
+		"stats - call sites accounted");
+	if (buf) {
+		char *line, *saveptr;
+
+		for (line = strtok_r(buf, "\n", &saveptr); line;
+				line = strtok_r(NULL, "\n", &saveptr))
+			diag("%s", line);
+	}
+	free(buf);
+}
+
+#define STATS_NR_REPS	1000
+
+/*
+ * Find the counters of the call site of @op in function @func in the
+ * output of rseq_stats_dump().
+ */
+static bool stats_get_site(const char *op, const char *func, uint64_t *commits,
+		uint64_t *ne, uint64_t *aborts)
+{
+	char *buf = NULL, *line, *saveptr, func_suffix[64];
+	size_t len = 0;
+	FILE *stream;
+	bool found = false;
+
+	stream = open_memstream(&buf, &len);
+	if (!stream)
+		abort();
+	if (rseq_stats_dump(stream))
+		abort();
+	fclose(stream);
+	snprintf(func_suffix, sizeof(func_suffix), "(%s)", func);
+	for (line = strtok_r(buf, "\n", &saveptr); line && !found;
+			line = strtok_r(NULL, "\n", &saveptr)) {
+		char line_op[64];
+		uint64_t attempts;
+
+		if (!strstr(line, func_suffix))
+			continue;
+		if (sscanf(line, "%63s %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+				line_op, &attempts, commits, ne, aborts) != 5)
+			continue;
+		found = !strcmp(line_op, op) && attempts == *commits + *ne + *aborts;
+	}
+	free(buf);
+	return found;
+}
+
+/*
+ * Perform a known sequence of commits, comparison failures and aborts
+ * (critical sections started with a CPU number other than the current
+ * one always abort), and check the counters of the call site match the
+ * outcomes returned.
+ */
+static void test_stats_counts(void)
+{
+	uint64_t expect[RSEQ_STATS_NR_OUTCOMES] = { 0 }, commits, ne, aborts;
+	cpu_set_t saved_mask, mask;
+	intptr_t v = 0;
+	int i, nr_forced_aborts = 0;
+
+	diag("stats counts");
+
+	/* Pin the thread so forced aborts cannot commit after a migration. */
+	if (sched_getaffinity(0, sizeof(saved_mask), &saved_mask))
+		abort();
+	CPU_ZERO(&mask);
+	CPU_SET(rseq_current_cpu(), &mask);
+	if (sched_setaffinity(0, sizeof(mask), &mask))
+		abort();
+	rseq_stats_reset();
+	for (i = 0; i < 3 * STATS_NR_REPS; i++) {
+		int cpu = get_current_cpu_id(), ret;
+		intptr_t expected = v;
+
+		switch (i % 3) {
+		case 1:
+			expected = v + 1;	/* Comparison fails. */
+			break;
+		case 2:
+			cpu++;			/* Aborts. */
+			break;
+		}
+		ret = rseq_load_cbne_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU,
+				&v, expected, v + 1, cpu);
+		if (ret < 0) {
+			expect[RSEQ_STATS_ABORT]++;
+			if (i % 3 == 2)
+				nr_forced_aborts++;
+		} else if (ret > 0) {
+			expect[RSEQ_STATS_NE]++;
+		} else {
+			expect[RSEQ_STATS_COMMIT]++;
+		}
+	}
+	if (sched_setaffinity(0, sizeof(saved_mask), &saved_mask))
+		abort();
+	ok(stats_get_site("load_cbne_store", __func__, &commits, &ne, &aborts) &&
+		commits == expect[RSEQ_STATS_COMMIT] && ne == expect[RSEQ_STATS_NE] &&
+		aborts == expect[RSEQ_STATS_ABORT] &&
+		nr_forced_aborts == STATS_NR_REPS && (uint64_t) v == commits,
+		"stats - counts (%" PRIu64 " commits, %" PRIu64 " ne, %" PRIu64 " aborts)",
+		commits, ne, aborts);
+}
+#endif
+
 int main(void)
 {
 	plan_tests(NR_TESTS);
@@ -344,6 +837,14 @@ int main(void)
 	}
 	test_percpu_spinlock();
 	test_percpu_list();
+	test_percpu_ticket();
+	test_percpu_storev();
+	test_percpu_stride();
+	test_percpu_typed();
+#ifdef RSEQ_STATS
+	test_stats();
+	test_stats_counts();
+#endif
 
 	if (rseq_unregister_current_thread()) {
 		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
@@ -67,6 +67,13 @@ static void test_cpu_pointer(void)
 			ok(rseq_cpu_start() == (unsigned int) i, "rseq_cpu_start returns CPU %d", i);
 			node = rseq_fallback_current_node();
 			ok(rseq_fallback_current_node() == node, "rseq_fallback_current_node returns node %d", node);
+			ok(rseq_current_node_id() == node, "rseq_current_node_id returns node %d", node);
+			ok(rseq_fallback_current_node_cached(i) == node,
+				"rseq_fallback_current_node_cached returns node %d", node);
+			ok(rseq_fallback_current_node_cached(i) == node,
+				"rseq_fallback_current_node_cached returns cached node %d", node);
+			ok(rseq_fallback_current_node_cached(-1) == node,
+				"rseq_fallback_current_node_cached of an unknown CPU returns node %d", node);
 			CPU_CLR(i, &test_affinity);
 		}
 	}
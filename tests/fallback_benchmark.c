@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+/*
+ * rseq fallback benchmark.
+ *
+ * Compare the cost of a per-CPU counter increment with
+ * rseq_load_add_store__ptr() executed natively with rseq and executed
+ * by the lock-based fallback, with one thread and with one thread per
+ * CPU. Each mode runs in its own child process since the fallback is
+ * selected process-wide.
+ *
+ * Forcing the fallback requires that librseq owns the rseq
+ * registration: run with GLIBC_TUNABLES=glibc.pthread.rseq=0 to
+ * measure it.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <rseq/rseq.h>
+#include "tap.h"
+
+#define NR_TESTS	2
+#define NR_LOOPS	10000000
+
+/* Exit status of a child process which cannot run its benchmark. */
+#define CHILD_SKIP	2
+
+struct test_data_entry {
+	intptr_t count;
+} __attribute__((aligned(128)));
+
+static struct test_data_entry counters[CPU_SETSIZE];
+
+static int use_fallback;
+
+static int64_t difftimespec_ns(const struct timespec after, const struct timespec before)
+{
+	return ((after.tv_sec - before.tv_sec) * 1000000000LL)
+		+ after.tv_nsec - before.tv_nsec;
+}
+
+static void *benchmark_thread(void *arg)
+{
+	int64_t *ns = (int64_t *) arg;
+	struct timespec t1, t2;
+	int i;
+
+	if (rseq_register_current_thread())
+		abort();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < NR_LOOPS; i++) {
+		int cpu;
+
+		do {
+			/* The fallback needs the current CPU to spread the locks. */
+			cpu = use_fallback ? rseq_current_cpu() : rseq_cpu_start();
+		} while (rseq_load_add_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				&counters[cpu].count, 1, cpu));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	*ns = difftimespec_ns(t2, t1);
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+static void benchmark(const char *mode, int nr_threads)
+{
+	pthread_t *threads;
+	int64_t *ns, total_ns = 0;
+	int i;
+
+	threads = (pthread_t *) calloc(nr_threads, sizeof(*threads));
+	ns = (int64_t *) calloc(nr_threads, sizeof(*ns));
+	if (!threads || !ns)
+		abort();
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&threads[i], NULL, benchmark_thread, &ns[i]);
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+		total_ns += ns[i];
+	}
+	diag("%s: %d thread(s): %.2f ns per increment", mode, nr_threads,
+		(double) total_ns / ((double) nr_threads * NR_LOOPS));
+	free(threads);
+	free(ns);
+}
+
+static int run_child(int fallback)
+{
+	cpu_set_t allowed_cpus;
+	const char *mode = fallback ? "fallback" : "rseq";
+
+	if (fallback) {
+		if (rseq_set_fallback_mode(RSEQ_FALLBACK_MODE_FORCE)) {
+			diag("Cannot force the fallback (%s), run with GLIBC_TUNABLES=glibc.pthread.rseq=0",
+				strerror(errno));
+			return CHILD_SKIP;
+		}
+		use_fallback = 1;
+	} else if (!rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+		diag("The rseq syscall is unavailable");
+		return CHILD_SKIP;
+	}
+	if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus))
+		abort();
+	benchmark(mode, 1);
+	benchmark(mode, CPU_COUNT(&allowed_cpus));
+	return 0;
+}
+
+int main(void)
+{
+	int fallback;
+
+	plan_tests(NR_TESTS);
+
+	for (fallback = 0; fallback < 2; fallback++) {
+		pid_t pid;
+		int status;
+
+		fflush(stdout);
+		pid = fork();
+		if (pid < 0)
+			abort();
+		if (!pid)
+			_exit(run_child(fallback));
+		if (waitpid(pid, &status, 0) < 0)
+			abort();
+		if (WIFEXITED(status) && WEXITSTATUS(status) == CHILD_SKIP)
+			skip(1, "%s benchmark unavailable", fallback ? "Fallback" : "rseq");
+		else
+			ok(WIFEXITED(status) && !WEXITSTATUS(status), "%s benchmark",
+				fallback ? "Fallback" : "rseq");
+	}
+	exit(exit_status());
+}
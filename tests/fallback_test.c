@@ -0,0 +1,410 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <rseq/rseq.h>
+#include <rseq/percpu-list.h>
+#include <rseq/percpu-lock.h>
+#include <rseq/percpu-ref.h>
+#include <rseq/percpu-ring.h>
+#include <rseq/rcu.h>
+
+#include "tap.h"
+
+/*
+ * Exercise the lock-based fallback of the critical section helpers.
+ *
+ * This test must be run without glibc owning the rseq registration
+ * (glibc.pthread.rseq=0 tunable), so the fallback can be forced.
+ *
+ * With the "-a" argument, the fallback is not forced: the test expects
+ * the automatic fallback to activate because the rseq syscall is
+ * denied, and must be used with an LD_PRELOAD library to deny access
+ * to the syscall.
+ */
+
+#define NR_TESTS 23
+
+#define NR_THREADS	16
+#define NR_REPS		20000
+
+struct test_data_entry {
+	intptr_t count;
+} __attribute__((aligned(128)));
+
+struct percpu_list_node {
+	intptr_t data;
+	struct percpu_list_node *next;
+};
+
+struct percpu_list_entry {
+	struct percpu_list_node *head;
+} __attribute__((aligned(128)));
+
+static struct test_data_entry counters[CPU_SETSIZE];
+static struct percpu_list_entry list[CPU_SETSIZE];
+
+static void *test_counter_thread(void *arg __attribute__((unused)))
+{
+	int i;
+
+	if (rseq_register_current_thread())
+		abort();
+	for (i = 0; i < NR_REPS; i++) {
+		int cpu = rseq_current_cpu();
+
+		if (rseq_load_add_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				&counters[cpu].count, 1, cpu))
+			abort();
+	}
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+static void test_counter(void)
+{
+	pthread_t test_threads[NR_THREADS];
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_create(&test_threads[i], NULL, test_counter_thread, NULL);
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_join(test_threads[i], NULL);
+	for (i = 0; i < CPU_SETSIZE; i++)
+		sum += counters[i].count;
+	ok(sum == (uint64_t) NR_THREADS * NR_REPS,
+		"Fallback per-CPU counter sum (%" PRIu64 " == %" PRIu64 ")",
+		sum, (uint64_t) NR_THREADS * NR_REPS);
+}
+
+static void list_push(struct percpu_list_node *node)
+{
+	for (;;) {
+		int cpu = rseq_current_cpu();
+		intptr_t expect;
+
+		expect = (intptr_t) RSEQ_READ_ONCE(list[cpu].head);
+		node->next = (struct percpu_list_node *) expect;
+		if (!rseq_load_cbne_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				(intptr_t *) &list[cpu].head, expect, (intptr_t) node, cpu))
+			return;
+	}
+}
+
+static struct percpu_list_node *list_pop(void)
+{
+	struct percpu_list_node *head;
+	int cpu = rseq_current_cpu();
+
+	if (rseq_load_cbeq_store_add_load_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+			(intptr_t *) &list[cpu].head, (intptr_t) NULL,
+			offsetof(struct percpu_list_node, next), (intptr_t *) &head, cpu))
+		return NULL;
+	return head;
+}
+
+static void *test_list_thread(void *arg __attribute__((unused)))
+{
+	int i;
+
+	for (i = 0; i < NR_REPS; i++) {
+		struct percpu_list_node *node;
+
+		node = list_pop();
+		sched_yield();	/* encourage shuffling */
+		if (node)
+			list_push(node);
+	}
+	return NULL;
+}
+
+static void test_list(void)
+{
+	pthread_t test_threads[NR_THREADS];
+	uint64_t sum = 0, expected_sum = 0;
+	int i;
+
+	for (i = 1; i <= 1000; i++) {
+		struct percpu_list_node *node;
+
+		node = (struct percpu_list_node *) malloc(sizeof(*node));
+		assert(node);
+		node->data = i;
+		node->next = list[i % CPU_SETSIZE].head;
+		list[i % CPU_SETSIZE].head = node;
+		expected_sum += i;
+	}
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_create(&test_threads[i], NULL, test_list_thread, NULL);
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_join(test_threads[i], NULL);
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		struct percpu_list_node *node;
+
+		while ((node = list[i].head)) {
+			list[i].head = node->next;
+			sum += node->data;
+			free(node);
+		}
+	}
+	ok(sum == expected_sum, "Fallback per-CPU list sum (%" PRIu64 " == %" PRIu64 ")",
+		sum, expected_sum);
+}
+
+static int nr_ref_released;
+
+static void ref_release(struct rseq_percpu_ref *ref __attribute__((unused)))
+{
+	nr_ref_released++;
+}
+
+static void test_ops(void)
+{
+	intptr_t v = 1, v2 = 2, load = 0;
+	char src[16] = "fallback", dst[16] = "";
+	int ret;
+
+	ret = rseq_load_cbne_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID, &v, 0, 3, 0);
+	ok(ret == 1 && v == 1, "Fallback load_cbne_store mismatch");
+
+	ret = rseq_load_cbne_store_store__ptr(RSEQ_MO_RELEASE, RSEQ_PERCPU_CPU_ID,
+			&v, 1, &v2, 5, 4, 0);
+	ok(ret == 0 && v == 4 && v2 == 5, "Fallback load_cbne_store_store");
+
+	ret = rseq_load_cbne_load_cbne_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+			&v, 4, &v2, 6, 7, 0);
+	ok(ret == 1 && v == 4, "Fallback load_cbne_load_cbne_store mismatch");
+
+	ret = rseq_load_cbne_memcpy_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+			&v, 4, dst, src, sizeof(src), 8, 0);
+	ok(ret == 0 && v == 8 && !strcmp(dst, "fallback"), "Fallback load_cbne_memcpy_store");
+
+	ret = rseq_load_cbeq_store_add_load_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+			&v, 8, 0, &load, 0);
+	ok(ret == 1 && load == 0, "Fallback load_cbeq_store_add_load_store match");
+
+#ifdef rseq_arch_has_load_add_store_load
+	ret = rseq_load_add_store_load__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+			&v, 2, &load, 0);
+	ok(ret == 0 && load == 8 && v == 10, "Fallback load_add_store_load");
+#else
+	skip(1, "Fetch-and-add critical section helper unavailable on this architecture");
+#endif
+
+#ifdef rseq_arch_has_load_cbne_storev_store
+	{
+		intptr_t a = 0, b = 0;
+		struct rseq_store_pair stores[2] = { { &a, 11 }, { &b, 12 } };
+		volatile size_t nr_stores = RSEQ_STOREV_MAX + 1;
+
+		pid_t pid;
+		int status = 0;
+
+		ret = rseq_load_cbne_storev_store__ptr(RSEQ_MO_RELEASE, RSEQ_PERCPU_CPU_ID,
+				&v2, 5, stores, 2, 13, 0);
+		/* Too many stores is a bug which aborts rather than being retried. */
+		pid = fork();
+		if (pid == 0) {
+			(void) rseq_load_cbne_storev_store__ptr(RSEQ_MO_RELEASE, RSEQ_PERCPU_CPU_ID,
+				&v2, 13, stores, nr_stores, 14, 0);
+			_exit(EXIT_SUCCESS);
+		}
+		if (pid > 0)
+			waitpid(pid, &status, 0);
+		ok(ret == 0 && a == 11 && b == 12 && v2 == 13 &&
+			pid > 0 && WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT,
+			"Fallback load_cbne_storev_store");
+	}
+#else
+	skip(1, "Multi-store critical section helper unavailable on this architecture");
+#endif
+
+#ifdef rseq_arch_has_percpu_stride_ops
+	{
+		intptr_t sum = 0;
+		int i;
+
+		load = -1;
+		ret = rseq_percpu_load_add_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				&counters[0].count, sizeof(counters[0]), 3);
+		ret |= rseq_percpu_load_add_store_load__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				&counters[0].count, sizeof(counters[0]), 1, &load);
+		for (i = 0; i < CPU_SETSIZE; i++)
+			sum += counters[i].count;
+		/* The thread may migrate between the helpers. */
+		ok(ret == 0 && sum == 4 && (load == 0 || load == 3), "Fallback stride helpers");
+		memset(counters, 0, sizeof(counters));
+	}
+#else
+	skip(1, "Stride critical section helpers unavailable on this architecture");
+#endif
+
+#ifdef rseq_arch_has_typed_ops
+	{
+		uint8_t b[2] = { 0xff, 0xa5 };
+		uint16_t h = 1, h2 = 0;
+
+		ret = rseq_load_add_store__u8(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID, &b[0], 1, 0);
+		ret |= rseq_load_cbne_store_store__u16(RSEQ_MO_RELEASE, RSEQ_PERCPU_CPU_ID,
+				&h, 1, &h2, 9, 2, 0);
+		ok(ret == 0 && b[0] == 0 && b[1] == 0xa5 && h == 2 && h2 == 9,
+			"Fallback typed helpers");
+	}
+#else
+	skip(1, "Typed critical section helpers unavailable on this architecture");
+#endif
+
+#ifdef rseq_arch_has_load_cbne_load_cbeq_store_add_load_store
+	{
+		struct rseq_percpu_list_node a, b, *first;
+		struct rseq_percpu_list *plist;
+		int cpu, count = 0;
+
+		plist = rseq_percpu_list_create();
+		ret = plist ? 0 : -1;
+		if (plist) {
+			rseq_percpu_list_push(plist, &a);
+			rseq_percpu_list_push(plist, &b);
+			/* Remote pops are fenced by the fallback locks. */
+			for (cpu = 0; cpu < plist->max_nr_cpus; cpu++) {
+				if (rseq_percpu_list_pop_all(plist, cpu, &first))
+					ret = -1;
+				for (; first; first = first->next)
+					count++;
+			}
+			if (rseq_percpu_list_pop(plist, NULL))
+				ret = -1;
+			ret |= rseq_percpu_list_destroy(plist);
+		}
+		ok(ret == 0 && count == 2,
+			"Fallback per-CPU list");
+	}
+#else
+	skip(1, "Per-CPU list unavailable on this architecture");
+#endif
+
+	{
+		intptr_t in[3] = { 1, 2, 3 }, out[3] = { 0, 0, 0 };
+		struct rseq_percpu_ring *ring;
+		size_t enqueued = 0, dequeued = 0;
+		int cpu;
+
+		ring = rseq_percpu_ring_create(sizeof(intptr_t), 4);
+		ret = ring ? 0 : -1;
+		if (ring) {
+			enqueued = rseq_percpu_ring_enqueue(ring, in, 3, NULL);
+			/* Remote drains are fenced by the fallback locks. */
+			for (cpu = 0; cpu < ring->max_nr_cpus; cpu++) {
+				ssize_t n = rseq_percpu_ring_drain_cpu(ring, cpu, &out[dequeued],
+						3 - dequeued);
+
+				if (n < 0)
+					ret = -1;
+				else
+					dequeued += (size_t) n;
+			}
+			ret |= rseq_percpu_ring_destroy(ring);
+		}
+		/* The thread may migrate between the batches. */
+		ok(ret == 0 && enqueued == 3 && dequeued == 3 &&
+			out[0] + out[1] + out[2] == 6, "Fallback per-CPU ring");
+	}
+
+	{
+		struct rseq_percpu_brlock brlock;
+		int cpu;
+
+		ret = rseq_percpu_brlock_create(&brlock);
+		if (!ret) {
+			cpu = rseq_percpu_brlock_read_lock(&brlock);
+			rseq_percpu_brlock_read_unlock(&brlock, cpu);
+			/* Writers are fenced by the fallback locks. */
+			ret = rseq_percpu_brlock_write_lock(&brlock);
+			if (!ret)
+				rseq_percpu_brlock_write_unlock(&brlock);
+			ret |= rseq_percpu_brlock_destroy(&brlock);
+		}
+		ok(ret == 0, "Fallback big reader lock");
+	}
+
+	{
+		struct rseq_percpu_ref ref;
+
+		ret = rseq_percpu_ref_init(&ref, ref_release);
+		if (!ret) {
+			rseq_percpu_ref_get(&ref);
+			/* The switch to atomic mode is fenced by the fallback locks. */
+			ret = rseq_percpu_ref_kill(&ref);
+			if (nr_ref_released)
+				ret = -1;
+			rseq_percpu_ref_put(&ref);
+			ret |= rseq_percpu_ref_exit(&ref);
+		}
+		ok(ret == 0 && nr_ref_released == 1, "Fallback per-CPU reference counter");
+	}
+
+	/* Grace periods wait for the fallback critical sections. */
+	ok(rseq_rcu_synchronize() == 0 && rseq_rcu_barrier() == 0, "Fallback grace period");
+}
+
+int main(int argc, char **argv)
+{
+	bool auto_mode = argc > 1 && !strcmp(argv[1], "-a");
+
+	plan_tests(NR_TESTS);
+
+	ok(rseq_set_fallback_mode((enum rseq_fallback_mode) 42) == -1 && errno == EINVAL,
+		"Invalid fallback mode is refused");
+	if (rseq_set_fallback_mode(RSEQ_FALLBACK_MODE_AUTO)) {
+		fail("rseq_set_fallback_mode(AUTO) failed(%d): %s", errno, strerror(errno));
+		goto end;
+	}
+	ok(rseq_fallback_active() == !rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL),
+		"Automatic fallback only active if the rseq syscall is unavailable");
+
+	if (rseq_available(RSEQ_AVAILABLE_QUERY_LIBC)) {
+		skip(NR_TESTS - 2, "glibc owns the rseq registration");
+		goto end;
+	}
+	if (auto_mode) {
+		if (rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+			fail("The rseq syscall should be unavailable");
+			goto end;
+		}
+		pass("Automatic fallback mode with the rseq syscall unavailable");
+	} else if (rseq_set_fallback_mode(RSEQ_FALLBACK_MODE_FORCE)) {
+		fail("rseq_set_fallback_mode(FORCE) failed(%d): %s", errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Forced fallback mode");
+	}
+	ok(rseq_fallback_active(), "Fallback is active");
+	ok(rseq_register_current_thread() == 0 && rseq_current_cpu_raw() < 0,
+		"Registration succeeds without registering rseq");
+	ok(rseq_set_fallback_mode(RSEQ_FALLBACK_MODE_NONE) == -1 && errno == EBUSY,
+		"Active fallback cannot be disabled");
+
+	test_ops();
+	test_counter();
+	test_list();
+
+	ok(rseq_unregister_current_thread() == 0, "Unregistration succeeds");
+end:
+	exit(exit_status());
+}
@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+/*
+ * Test the rseq fences restarting the critical sections in flight.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+
+#include "tap.h"
+
+#define NR_TESTS 6
+
+static void test_fence_cpu_mask(void)
+{
+	cpu_set_t mask;
+	int cpu, ok = 1;
+
+	/* Empty and sparse sets. */
+	CPU_ZERO(&mask);
+	if (rseq_fence_cpu_mask((const unsigned long *) &mask, CPU_SETSIZE))
+		ok = 0;
+	CPU_SET(rseq_current_cpu(), &mask);
+	if (rseq_fence_cpu_mask((const unsigned long *) &mask, CPU_SETSIZE))
+		ok = 0;
+	/* Dense set, including CPUs which are not possible. */
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		CPU_SET(cpu, &mask);
+	if (rseq_fence_cpu_mask((const unsigned long *) &mask, CPU_SETSIZE))
+		ok = 0;
+	ok(ok, "Fence empty, sparse and dense CPU sets");
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+
+	if (!rseq_fence_available()) {
+		skip(NR_TESTS - 1, "Membarrier rseq fences are unavailable");
+		goto unregister;
+	}
+	pass("Membarrier rseq fences are available");
+
+	ok(rseq_fence_cpu(rseq_current_cpu()) == 0, "Fence the current CPU");
+	errno = 0;
+	ok(rseq_fence_cpu(-1) == -1 && errno == EINVAL, "Fence on a negative CPU fails with EINVAL");
+	ok(rseq_fence_all() == 0, "Fence all CPUs");
+	test_fence_cpu_mask();
+
+unregister:
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+	}
+end:
+	exit(exit_status());
+}
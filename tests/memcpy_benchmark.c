@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+/*
+ * rseq memcpy benchmark.
+ *
+ * Measure the cost of rseq_load_cbne_memcpy_store__ptr() for payload
+ * sizes typical of per-CPU buffers, with aligned and misaligned
+ * source and destination, and compare it with a plain memcpy() of the
+ * same size.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <rseq/rseq.h>
+#include "tap.h"
+
+#define NR_LOOPS	2000000
+#define BUF_LEN		1024
+
+static const size_t sizes[] = { 8, 15, 64, 128, 256, 512 };
+
+#define ARRAY_SIZE(arr)	(sizeof(arr) / sizeof((arr)[0]))
+
+#define NR_TESTS	(2 * ARRAY_SIZE(sizes))
+
+static char src_buf[BUF_LEN] __attribute__((aligned(64)));
+static char dst_buf[BUF_LEN] __attribute__((aligned(64)));
+
+static int64_t difftimespec_ns(const struct timespec after, const struct timespec before)
+{
+	return ((after.tv_sec - before.tv_sec) * 1000000000LL)
+		+ after.tv_nsec - before.tv_nsec;
+}
+
+static void benchmark(size_t len, size_t misalign)
+{
+	char *src = src_buf + misalign, *dst = dst_buf + 2 * misalign;
+	struct timespec t1, t2;
+	intptr_t v = 0;
+	int64_t rseq_ns, memcpy_ns;
+	int i;
+
+	memset(src_buf, 0x5a, sizeof(src_buf));
+	memset(dst_buf, 0, sizeof(dst_buf));
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < NR_LOOPS; i++) {
+		int cpu;
+
+		do {
+			cpu = rseq_cpu_start();
+		} while (rseq_load_cbne_memcpy_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+				&v, i, dst, src, len, i + 1, cpu));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	rseq_ns = difftimespec_ns(t2, t1);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < NR_LOOPS; i++) {
+		memcpy(dst, src, len);
+		/* Prevent the compiler from eliding the copies. */
+		__asm__ __volatile__ ("" : : "r" (dst) : "memory");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	memcpy_ns = difftimespec_ns(t2, t1);
+
+	ok(v == NR_LOOPS && !memcmp(dst, src, len),
+		"%3zu bytes, %s: rseq %.2f ns, memcpy %.2f ns", len,
+		misalign ? "misaligned" : "aligned",
+		(double) rseq_ns / NR_LOOPS, (double) memcpy_ns / NR_LOOPS);
+}
+
+int main(void)
+{
+	size_t i;
+
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+	if (rseq_register_current_thread()) {
+		skip(NR_TESTS, "rseq_register_current_thread(...) failed(%d): %s",
+			errno, strerror(errno));
+		goto end;
+	}
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		benchmark(sizes[i], 0);
+		benchmark(sizes[i], 3);
+	}
+	if (rseq_unregister_current_thread())
+		abort();
+end:
+	exit(exit_status());
+}
@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+/*
+ * rseq memory pool benchmark.
+ *
+ * Measure the cost of zmalloc for items which per-CPU copies are dirty
+ * (and therefore need to be zeroed on all CPUs), and its effect on the
+ * cache footprint of the caller: after each allocation, the time to
+ * read back a working set which was hot before the allocation shows
+ * how much of it was evicted by the zeroing. Zeroing the per-CPU copies
+ * with memset() from the caller is measured as a reference.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <rseq/mempool.h>
+#include "tap.h"
+
+#define NR_CPUS			256
+#define NR_LOOPS		50
+#define WORKING_SET_LEN		(256 * 1024)
+
+static const size_t item_lens[] = { 64, 512, 4096, 16384 };
+
+#define NR_TESTS	(sizeof(item_lens) / sizeof(item_lens[0]))
+
+static char working_set[WORKING_SET_LEN];
+
+static int64_t difftimespec_ns(const struct timespec after, const struct timespec before)
+{
+	return ((after.tv_sec - before.tv_sec) * 1000000000LL)
+		+ after.tv_nsec - before.tv_nsec;
+}
+
+static uint64_t read_working_set(void)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < WORKING_SET_LEN; i += 64)
+		sum += RSEQ_READ_ONCE(working_set[i]);
+	return sum;
+}
+
+static void dirty_item(char __rseq_percpu *ptr)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++)
+		memset(rseq_percpu_ptr(ptr, cpu), 0xff, 8);
+}
+
+static void reference_zero_item(char __rseq_percpu *ptr, size_t item_len)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++)
+		memset(rseq_percpu_ptr(ptr, cpu), 0, item_len);
+}
+
+static void benchmark_zmalloc(size_t item_len)
+{
+	int64_t zmalloc_ns = 0, zmalloc_reload_ns = 0, ref_ns = 0, ref_reload_ns = 0;
+	struct rseq_mempool_attr *attr;
+	struct rseq_mempool *mempool;
+	uint64_t sum = 0;
+	int i;
+
+	attr = rseq_mempool_attr_create();
+	if (!attr)
+		abort();
+	if (rseq_mempool_attr_set_percpu(attr, RSEQ_MEMPOOL_STRIDE, NR_CPUS))
+		abort();
+	if (rseq_mempool_attr_set_populate_policy(attr, RSEQ_MEMPOOL_POPULATE_COW_ZERO))
+		abort();
+	mempool = rseq_mempool_create("benchmark", item_len, attr);
+	if (!mempool)
+		abort();
+	rseq_mempool_attr_destroy(attr);
+
+	for (i = 0; i < NR_LOOPS; i++) {
+		struct timespec t1, t2, t3;
+		char __rseq_percpu *ptr;
+
+		/* Leave a dirty item at the head of the free list. */
+		ptr = (char __rseq_percpu *) rseq_mempool_percpu_malloc(mempool);
+		dirty_item(ptr);
+		rseq_mempool_percpu_free(ptr);
+
+		sum += read_working_set();
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ptr = (char __rseq_percpu *) rseq_mempool_percpu_zmalloc(mempool);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		sum += read_working_set();
+		clock_gettime(CLOCK_MONOTONIC, &t3);
+		zmalloc_ns += difftimespec_ns(t2, t1);
+		zmalloc_reload_ns += difftimespec_ns(t3, t2);
+
+		dirty_item(ptr);
+		sum += read_working_set();
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		reference_zero_item(ptr, item_len);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		sum += read_working_set();
+		clock_gettime(CLOCK_MONOTONIC, &t3);
+		ref_ns += difftimespec_ns(t2, t1);
+		ref_reload_ns += difftimespec_ns(t3, t2);
+
+		rseq_mempool_percpu_free(ptr);
+	}
+	if (rseq_mempool_destroy(mempool))
+		abort();
+
+	ok(sum == 0, "Benchmark zmalloc of %zu bytes items over %d CPUs", item_len, NR_CPUS);
+	diag("zmalloc: %" PRId64 "ns, working set reload: %" PRId64 "ns "
+		"(memset reference: %" PRId64 "ns, working set reload: %" PRId64 "ns)",
+		zmalloc_ns / NR_LOOPS, zmalloc_reload_ns / NR_LOOPS,
+		ref_ns / NR_LOOPS, ref_reload_ns / NR_LOOPS);
+}
+
+int main(void)
+{
+	size_t i;
+
+	plan_tests(NR_TESTS);
+
+	for (i = 0; i < NR_TESTS; i++)
+		benchmark_zmalloc(item_lens[i]);
+
+	exit(exit_status());
+}
@@ -8,6 +8,7 @@
 #define _GNU_SOURCE
 #endif
 #include <assert.h>
+#include <errno.h>
 #include <sched.h>
 #include <signal.h>
 #include <stdio.h>
@@ -15,6 +16,7 @@
 #include <sys/time.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -136,6 +138,311 @@ static void test_mempool_fill(enum rseq_mempool_populate_policy policy,
 	ok(ret == 0, "Destroy mempool");
 }
 
+static void test_mempool_handle(enum rseq_mempool_populate_policy policy,
+		unsigned long max_nr_ranges, size_t stride)
+{
+	struct rseq_mempool_attr *attr;
+	struct rseq_mempool *mempool;
+	struct test_data __rseq_percpu **items;
+	size_t nr_items, i;
+	uint32_t pool_id;
+	rseq_percpu_handle_t handle;
+	bool valid = true;
+	int ret;
+
+	attr = rseq_mempool_attr_create();
+	ret = rseq_mempool_attr_set_percpu(attr, stride, CPU_SETSIZE);
+	ok(ret == 0, "Setting mempool percpu type");
+	ret = rseq_mempool_attr_set_max_nr_ranges(attr, max_nr_ranges);
+	ok(ret == 0, "Setting mempool max_nr_ranges=%lu", max_nr_ranges);
+	ret = rseq_mempool_attr_set_populate_policy(attr, policy);
+	ok(ret == 0, "Setting mempool populate policy");
+	ret = rseq_mempool_attr_set_handles(attr);
+	ok(ret == 0, "Setting mempool handles");
+	mempool = rseq_mempool_create("test_handle",
+			sizeof(struct test_data), attr);
+	ok(mempool, "Create mempool of size %zu", stride);
+	rseq_mempool_attr_destroy(attr);
+
+	pool_id = rseq_mempool_get_id(mempool);
+	ok(pool_id > 0, "Pool id is %" PRIu32, pool_id);
+
+	nr_items = (stride * max_nr_ranges) >>
+		rseq_get_count_order_ulong(sizeof(struct test_data));
+	items = (struct test_data __rseq_percpu **) calloc(nr_items, sizeof(*items));
+	if (!items)
+		abort();
+	for (i = 0; i < nr_items; i++) {
+		rseq_percpu_index_t index;
+		int cpu;
+
+		items[i] = (struct test_data __rseq_percpu *) rseq_mempool_percpu_zmalloc(mempool);
+		if (!items[i])
+			abort();
+		index = rseq_mempool_percpu_index(mempool, items[i]);
+		if (index == RSEQ_PERCPU_INDEX_NULL ||
+				rseq_mempool_index_to_percpu(mempool, index) !=
+					(void __rseq_percpu *) items[i] ||
+				rseq_mempool_index_ptr(mempool, index, 1) !=
+					(void *) rseq_percpu_ptr(items[i], 1, stride))
+			valid = false;
+		handle = rseq_mempool_percpu_handle(mempool, items[i]);
+		if (rseq_percpu_handle_pool_id(handle) != pool_id ||
+				rseq_percpu_handle_index(handle) != index ||
+				rseq_percpu_handle_to_percpu(handle) != (void __rseq_percpu *) items[i])
+			valid = false;
+		if (rseq_percpu_handle_make(pool_id, rseq_percpu_handle_index(handle)) != handle)
+			valid = false;
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu += 127) {
+			if (rseq_percpu_handle_ptr(handle, cpu) !=
+					(void *) rseq_percpu_ptr(items[i], cpu, stride))
+				valid = false;
+		}
+	}
+	ok(valid, "Encode and decode indexes and handles of %zu items", nr_items);
+	ok(rseq_percpu_handle_ptr(RSEQ_PERCPU_HANDLE_NULL, 0) == NULL &&
+		rseq_mempool_index_ptr(mempool, RSEQ_PERCPU_INDEX_NULL, 0) == NULL,
+		"NULL index and handle decode to NULL");
+	errno = 0;
+	ok(rseq_mempool_index_to_percpu(mempool, UINT32_MAX) == NULL && errno == EINVAL &&
+		rseq_percpu_handle_to_percpu(rseq_percpu_handle_make(UINT32_MAX, 1)) == NULL &&
+			errno == EINVAL,
+		"Out of range index and handle decode to NULL");
+	handle = rseq_mempool_percpu_handle(mempool, items[0]);
+
+	for (i = 0; i < nr_items; i++)
+		rseq_mempool_percpu_free(items[i], stride);
+	free(items);
+
+	ret = rseq_mempool_destroy(mempool);
+	ok(ret == 0, "Destroy mempool");
+	errno = 0;
+	ok(rseq_percpu_handle_to_percpu(handle) == NULL && errno == EINVAL,
+		"Handle of a destroyed pool decodes to NULL");
+}
+
+static void test_mempool_no_handles(void)
+{
+	struct rseq_mempool_attr *attr;
+	struct rseq_mempool *mempool;
+	void __rseq_percpu *ptr;
+
+	attr = rseq_mempool_attr_create();
+	if (!attr)
+		abort();
+	mempool = rseq_mempool_create("test_no_handles", sizeof(struct test_data), attr);
+	rseq_mempool_attr_destroy(attr);
+	if (!mempool)
+		abort();
+	ptr = rseq_mempool_percpu_malloc(mempool);
+	if (!ptr)
+		abort();
+	errno = 0;
+	ok(rseq_mempool_get_id(mempool) == 0 && errno == EINVAL &&
+		rseq_mempool_percpu_index(mempool, ptr) == RSEQ_PERCPU_INDEX_NULL &&
+			errno == EINVAL,
+		"Pool without handles has no id nor indexes");
+	rseq_mempool_percpu_free(ptr);
+	ok(rseq_mempool_destroy(mempool) == 0, "Destroy mempool without handles");
+}
+
+struct pressure_state {
+	int nr_high;
+	int nr_normal;
+	size_t used_bytes;
+};
+
+static void pressure_cb(void *priv, struct rseq_mempool *pool __attribute__((unused)),
+		enum rseq_mempool_pressure pressure, size_t used_bytes)
+{
+	struct pressure_state *state = (struct pressure_state *) priv;
+
+	if (pressure == RSEQ_MEMPOOL_PRESSURE_HIGH)
+		state->nr_high++;
+	else
+		state->nr_normal++;
+	state->used_bytes = used_bytes;
+}
+
+static void test_mempool_quota(void)
+{
+	const size_t item_len = 64, nr_cpus = 4, max_items = 10;
+	const size_t item_bytes = item_len * nr_cpus;
+	struct test_data __rseq_percpu *items[max_items];
+	struct pressure_state state = {};
+	struct rseq_mempool_attr *attr;
+	struct rseq_mempool *mempool;
+	size_t nr_items, i;
+	int ret;
+
+	attr = rseq_mempool_attr_create();
+	ret = rseq_mempool_attr_set_percpu(attr, rseq_get_page_len(), nr_cpus);
+	ok(ret == 0, "Setting mempool percpu type");
+	ret = rseq_mempool_attr_set_max_bytes(attr, max_items * item_bytes);
+	ok(ret == 0, "Setting mempool max_bytes");
+	ret = rseq_mempool_attr_set_pressure(attr, 8 * item_bytes, 4 * item_bytes,
+			pressure_cb, &state);
+	ok(ret == -1 && errno == EINVAL, "Reject inverted watermarks");
+	ret = rseq_mempool_attr_set_pressure(attr, 4 * item_bytes, 8 * item_bytes,
+			pressure_cb, &state);
+	ok(ret == 0, "Setting mempool pressure watermarks");
+	mempool = rseq_mempool_create("test_quota", item_len, attr);
+	ok(mempool, "Create mempool with quota");
+	rseq_mempool_attr_destroy(attr);
+
+	for (nr_items = 0; nr_items < max_items; nr_items++) {
+		items[nr_items] = (struct test_data __rseq_percpu *) rseq_mempool_percpu_zmalloc(mempool);
+		if (!items[nr_items])
+			break;
+		if (nr_items == 6)
+			ok(state.nr_high == 0, "No pressure below high watermark");
+	}
+	ok(nr_items == max_items, "Allocate up to the quota (%zu items)", nr_items);
+	ok(state.nr_high == 1 && state.used_bytes == 8 * item_bytes,
+		"High pressure reported at high watermark");
+	errno = 0;
+	ok(!rseq_mempool_percpu_zmalloc(mempool) && errno == ENOMEM,
+		"Allocation beyond quota fails with ENOMEM");
+
+	for (i = 0; i < 5; i++)
+		rseq_mempool_percpu_free(items[--nr_items], rseq_get_page_len());
+	ok(state.nr_normal == 0, "Pressure stays high above low watermark");
+	rseq_mempool_percpu_free(items[--nr_items], rseq_get_page_len());
+	ok(state.nr_normal == 1 && state.used_bytes == 4 * item_bytes,
+		"Normal pressure reported at low watermark");
+	while (nr_items)
+		rseq_mempool_percpu_free(items[--nr_items], rseq_get_page_len());
+	ok(state.nr_high == 1 && state.nr_normal == 1, "No spurious pressure transitions");
+
+	ret = rseq_mempool_destroy(mempool);
+	ok(ret == 0, "Destroy mempool");
+}
+
+static void test_mempool_set_realloc(void)
+{
+	const size_t stride = rseq_get_page_len();
+	const int nr_cpus = 8;
+	struct rseq_mempool_set *pool_set;
+	struct rseq_mempool_attr *attr;
+	struct rseq_mempool *other_pool;
+	uint32_t __rseq_percpu *ptr, __rseq_percpu *new_ptr;
+	size_t len;
+	bool valid = true;
+	int cpu, i, ret = 0;
+
+	pool_set = rseq_mempool_set_create();
+	ok(pool_set, "Create pool set");
+	attr = rseq_mempool_attr_create();
+	rseq_mempool_attr_set_percpu(attr, stride, nr_cpus);
+	rseq_mempool_attr_set_populate_policy(attr, RSEQ_MEMPOOL_POPULATE_COW_ZERO);
+	for (len = 16; len <= 256; len <<= 2) {
+		struct rseq_mempool *pool = rseq_mempool_create("test_realloc", len, attr);
+
+		if (!pool || rseq_mempool_set_add_pool(pool_set, pool))
+			ret = -1;
+	}
+	ok(ret == 0, "Add pools to pool set");
+	other_pool = rseq_mempool_create("test_realloc_other", 16, attr);
+	rseq_mempool_attr_destroy(attr);
+
+	ptr = (uint32_t __rseq_percpu *) rseq_mempool_set_percpu_zmalloc(pool_set, 16);
+	for (cpu = 0; cpu < nr_cpus; cpu += 2) {
+		for (i = 0; i < 4; i++)
+			rseq_percpu_ptr(ptr, cpu, stride)[i] = cpu * 4 + i + 1;
+	}
+	new_ptr = (uint32_t __rseq_percpu *) rseq_mempool_set_percpu_realloc(pool_set,
+			(void __rseq_percpu *) ptr, 12, stride);
+	ok(new_ptr == ptr, "Realloc within the same size class keeps the item");
+
+	{
+		void __rseq_percpu *other_ptr = rseq_mempool_percpu_zmalloc(other_pool);
+
+		errno = 0;
+		new_ptr = (uint32_t __rseq_percpu *) rseq_mempool_set_percpu_realloc(pool_set,
+				other_ptr, 200, stride);
+		ok(!new_ptr && errno == EINVAL,
+			"Realloc of an item from another pool fails with EINVAL");
+		rseq_mempool_percpu_free(other_ptr, stride);
+		ok(rseq_mempool_destroy(other_pool) == 0, "Destroy other pool");
+	}
+
+	new_ptr = (uint32_t __rseq_percpu *) rseq_mempool_set_percpu_realloc(pool_set,
+			(void __rseq_percpu *) ptr, 200, stride);
+	if (!new_ptr && errno == ENOSYS) {
+		skip(2, "membarrier rseq fencing unavailable");
+		rseq_mempool_percpu_free(ptr, stride);
+		goto end;
+	}
+	ok(new_ptr && new_ptr != ptr, "Realloc moves the item to a larger size class");
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		uint32_t *p = rseq_percpu_ptr(new_ptr, cpu, stride);
+
+		for (i = 0; i < 4; i++) {
+			if (p[i] != ((cpu & 1) ? 0 : (uint32_t) (cpu * 4 + i + 1)))
+				valid = false;
+		}
+		for (; i < 50; i++) {
+			if (p[i])
+				valid = false;
+		}
+	}
+	ok(valid, "Content of all CPUs is preserved and the tail is zeroed");
+	rseq_mempool_percpu_free(new_ptr, stride);
+end:
+	ret = rseq_mempool_set_destroy(pool_set);
+	ok(ret == 0, "Destroy pool set");
+}
+
+/*
+ * Count the per-CPU pages of @ptr which are resident in memory.
+ */
+static int count_resident_cpu_pages(char __rseq_percpu *ptr, int nr_cpus, size_t stride)
+{
+	size_t page_len = rseq_get_page_len();
+	int cpu, nr_resident = 0;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		uintptr_t addr = (uintptr_t) rseq_percpu_ptr(ptr, cpu, stride);
+		unsigned char vec;
+
+		if (mincore((void *) (addr & ~(page_len - 1)), page_len, &vec))
+			abort();
+		if (vec & 1)
+			nr_resident++;
+	}
+	return nr_resident;
+}
+
+static void test_mempool_zmalloc_untouched(void)
+{
+	const size_t stride = rseq_get_page_len();
+	const int nr_cpus = 64;
+	struct rseq_mempool_attr *attr;
+	struct rseq_mempool *mempool;
+	uint64_t __rseq_percpu *ptr;
+	int ret;
+
+	attr = rseq_mempool_attr_create();
+	rseq_mempool_attr_set_percpu(attr, stride, nr_cpus);
+	rseq_mempool_attr_set_populate_policy(attr, RSEQ_MEMPOOL_POPULATE_COW_ZERO);
+	mempool = rseq_mempool_create("test_untouched", sizeof(uint64_t), attr);
+	ok(mempool, "Create COW_ZERO mempool");
+	rseq_mempool_attr_destroy(attr);
+
+	ptr = (uint64_t __rseq_percpu *) rseq_mempool_percpu_zmalloc(mempool);
+	ok(ptr && count_resident_cpu_pages((char __rseq_percpu *) ptr, nr_cpus, stride) == 0,
+		"zmalloc of a never allocated item does not touch per-CPU pages");
+	*rseq_percpu_ptr(ptr, 1, stride) = 1;
+	rseq_mempool_percpu_free(ptr, stride);
+	ptr = (uint64_t __rseq_percpu *) rseq_mempool_percpu_zmalloc(mempool);
+	ok(ptr && *rseq_percpu_ptr(ptr, 1, stride) == 0,
+		"zmalloc of a reused item zeroes it");
+	rseq_mempool_percpu_free(ptr, stride);
+
+	ret = rseq_mempool_destroy(mempool);
+	ok(ret == 0, "Destroy mempool");
+}
+
 static void test_robust_double_free(struct rseq_mempool *pool,
 		enum rseq_mempool_populate_policy policy __attribute__((unused)))
 {
@@ -393,6 +700,15 @@ int main(void)
 		test_mempool_fill(RSEQ_MEMPOOL_POPULATE_COW_INIT, 1, len);
 	}
 
+	test_mempool_handle(RSEQ_MEMPOOL_POPULATE_COW_ZERO, 4, rseq_get_page_len());
+	test_mempool_handle(RSEQ_MEMPOOL_POPULATE_COW_INIT, 2, 65536);
+	/* Span several chunks of the range table. */
+	test_mempool_handle(RSEQ_MEMPOOL_POPULATE_COW_ZERO, 600, rseq_get_page_len());
+	test_mempool_no_handles();
+	test_mempool_quota();
+	test_mempool_set_realloc();
+	test_mempool_zmalloc_untouched();
+
 	run_robust_tests(RSEQ_MEMPOOL_POPULATE_COW_ZERO);
 	run_robust_tests(RSEQ_MEMPOOL_POPULATE_COW_INIT);
 	ok(run_fork_destroy_pool_test(fork_child, RSEQ_MEMPOOL_POPULATE_COW_ZERO),
@@ -4,8 +4,6 @@
 #define _GNU_SOURCE
 #endif
 #include <assert.h>
-#include <linux/version.h>
-#include <linux/membarrier.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdint.h>
@@ -22,17 +20,6 @@
 #include <stdbool.h>
 #include <rseq/mempool.h>
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5,10,0)
-enum {
-	MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ			= (1 << 7),
-	MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ		= (1 << 8),
-};
-
-enum {
-	MEMBARRIER_CMD_FLAG_CPU		= (1 << 0),
-};
-#endif
-
 #define NR_INJECT	9
 static int loop_cnt[NR_INJECT + 1];
 
@@ -313,11 +300,6 @@ int yield_mod_cnt, nr_abort;
 
 static enum rseq_mo opt_mo = RSEQ_MO_RELAXED;
 
-static int sys_membarrier(int cmd, int flags, int cpu_id)
-{
-	return syscall(__NR_membarrier, cmd, flags, cpu_id);
-}
-
 #ifdef rseq_arch_has_load_add_load_load_add_store
 #define TEST_MEMBARRIER
 #endif
@@ -342,8 +324,7 @@ bool rseq_validate_cpu_id(void)
 static
 int rseq_membarrier_expedited(__attribute__ ((unused)) int cpu)
 {
-	return sys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ,
-			      0, 0);
+	return rseq_fence_all();
 }
 # endif /* TEST_MEMBARRIER */
 #else
@@ -362,8 +343,7 @@ bool rseq_validate_cpu_id(void)
 static
 int rseq_membarrier_expedited(int cpu)
 {
-	return sys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ,
-			      MEMBARRIER_CMD_FLAG_CPU, cpu);
+	return rseq_fence_cpu(cpu);
 }
 # endif /* TEST_MEMBARRIER */
 #endif
@@ -1390,20 +1370,6 @@ static int set_signal_handler(void)
 	return ret;
 }
 
-static
-bool membarrier_private_expedited_rseq_available(void)
-{
-	int status = sys_membarrier(MEMBARRIER_CMD_QUERY, 0, 0);
-
-	if (status < 0) {
-		perror("membarrier");
-		return false;
-	}
-	if (!(status & MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ))
-		return false;
-	return true;
-}
-
 /* Test MEMBARRIER_CMD_PRIVATE_RESTART_RSEQ_ON_CPU membarrier command. */
 #ifdef TEST_MEMBARRIER
 struct test_membarrier_thread_args {
@@ -1568,9 +1534,8 @@ void *test_membarrier_manager_thread(void *arg)
 
 		/* Make list_b "active". */
 		RSEQ_WRITE_ONCE(args->percpu_list_ptr, list_b);
-		if (rseq_membarrier_expedited(cpu_a) &&
-				errno != ENXIO /* missing CPU */) {
-			perror("sys_membarrier");
+		if (rseq_membarrier_expedited(cpu_a)) {
+			perror("rseq_membarrier_expedited");
 			abort();
 		}
 		/*
@@ -1591,9 +1556,8 @@ void *test_membarrier_manager_thread(void *arg)
 
 		/* Make list_a "active". */
 		RSEQ_WRITE_ONCE(args->percpu_list_ptr, list_a);
-		if (rseq_membarrier_expedited(cpu_b) &&
-				errno != ENXIO /* missing CPU */) {
-			perror("sys_membarrier");
+		if (rseq_membarrier_expedited(cpu_b)) {
+			perror("rseq_membarrier_expedited");
 			abort();
 		}
 		/* Remember a value from list_b. */
@@ -1635,15 +1599,11 @@ void test_membarrier(void)
 	pthread_t manager_thread;
 	int i, ret;
 
-	if (!membarrier_private_expedited_rseq_available()) {
+	if (!rseq_fence_available()) {
 		fprintf(stderr, "Membarrier private expedited rseq not available. "
 				"Skipping membarrier test.\n");
 		return;
 	}
-	if (sys_membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0)) {
-		perror("sys_membarrier");
-		abort();
-	}
 
 	thread_args.percpu_list_ptr = NULL;
 	thread_args.stop = 0;
@@ -1687,7 +1647,7 @@ void test_membarrier(void)
 static
 void test_membarrier(void)
 {
-	if (!membarrier_private_expedited_rseq_available()) {
+	if (!rseq_fence_available()) {
 		fprintf(stderr, "Membarrier private expedited rseq not available. "
 				"Skipping membarrier test.\n");
 		return;
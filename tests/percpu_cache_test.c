@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/percpu-cache.h>
+
+#include "tap.h"
+
+#define NR_TESTS 7
+
+#define NR_THREADS	8
+#define NR_REPS		20000
+#define NR_HELD		40
+#define CAPACITY	32
+#define BATCH		8
+
+struct test_object {
+	int in_use;
+};
+
+static struct rseq_percpu_cache *cache;
+static long nr_allocs, nr_frees;
+static int thread_error;
+
+static
+void *test_alloc(void *priv)
+{
+	struct test_object *object;
+
+	if (priv != &cache)
+		thread_error = 1;
+	object = (struct test_object *) calloc(1, sizeof(*object));
+	if (object)
+		__atomic_add_fetch(&nr_allocs, 1, __ATOMIC_RELAXED);
+	return object;
+}
+
+static
+void test_free(void *object, void *priv)
+{
+	if (priv != &cache || ((struct test_object *) object)->in_use)
+		thread_error = 1;
+	__atomic_add_fetch(&nr_frees, 1, __ATOMIC_RELAXED);
+	free(object);
+}
+
+static
+struct test_object *cache_get(void)
+{
+	struct test_object *object;
+
+	object = (struct test_object *) rseq_percpu_cache_alloc(cache);
+	if (!object || object->in_use)
+		thread_error = 1;
+	else
+		object->in_use = 1;
+	return object;
+}
+
+static
+void cache_put(struct test_object *object)
+{
+	object->in_use = 0;
+	rseq_percpu_cache_free(cache, object);
+}
+
+/* Pin the thread on its current CPU to stay on the same magazine. */
+static
+void test_local(void)
+{
+	struct test_object *objects[CAPACITY + BATCH], *reused[CAPACITY + BATCH], *object;
+	cpu_set_t saved_mask, mask;
+	long allocs;
+	int i, ok = 1;
+
+	if (sched_getaffinity(0, sizeof(saved_mask), &saved_mask))
+		abort();
+	CPU_ZERO(&mask);
+	CPU_SET(rseq_current_cpu(), &mask);
+	if (sched_setaffinity(0, sizeof(mask), &mask))
+		abort();
+	/* The first allocation refills the empty magazine with a batch. */
+	object = cache_get();
+	if (nr_allocs != BATCH)
+		ok = 0;
+	cache_put(object);
+	if (cache_get() != object)
+		ok = 0;
+	cache_put(object);
+	/* Overflow the magazine: a batch is flushed into the depot. */
+	for (i = 0; i < CAPACITY + BATCH; i++)
+		objects[i] = cache_get();
+	for (i = 0; i < CAPACITY + BATCH; i++)
+		cache_put(objects[i]);
+	if (cache->depot.nr_objects != BATCH)
+		ok = 0;
+	/* Objects are reused, most recently freed first, without new allocations. */
+	allocs = nr_allocs;
+	for (i = 0; i < CAPACITY + BATCH; i++)
+		reused[i] = cache_get();
+	if (reused[0] != objects[CAPACITY + BATCH - 1])
+		ok = 0;
+	for (i = 0; i < CAPACITY + BATCH; i++)
+		cache_put(reused[i]);
+	if (nr_allocs != allocs || nr_frees || thread_error)
+		ok = 0;
+	if (sched_setaffinity(0, sizeof(saved_mask), &saved_mask))
+		abort();
+	ok(ok, "Allocated and freed on the current CPU through the magazine and the depot");
+}
+
+/*
+ * Allocate and free bursts of objects larger than a magazine, so the
+ * magazines exchange batches with the depot while threads migrate.
+ */
+static
+void *test_cache_thread(void *arg __attribute__((unused)))
+{
+	struct test_object *objects[NR_HELD];
+	int i, j;
+
+	if (rseq_register_current_thread())
+		abort();
+	for (i = 0; i < NR_REPS; i++) {
+		int nr = 1 + i % NR_HELD;
+
+		for (j = 0; j < nr; j++)
+			objects[j] = cache_get();
+		for (j = 0; j < nr; j++) {
+			if (objects[j])
+				cache_put(objects[j]);
+		}
+	}
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+static
+void test_concurrent(void)
+{
+	pthread_t threads[NR_THREADS];
+	int i, ret;
+
+	for (i = 0; i < NR_THREADS; i++) {
+		ret = pthread_create(&threads[i], NULL, test_cache_thread, NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			abort();
+		}
+	}
+	for (i = 0; i < NR_THREADS; i++) {
+		ret = pthread_join(threads[i], NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_join");
+			abort();
+		}
+	}
+	ok(!thread_error && nr_allocs < (long) NR_THREADS * NR_REPS,
+		"Concurrent allocations and frees reuse cached objects");
+	rseq_percpu_cache_trim(cache);
+	ok(cache->depot.nr_objects == 0 && nr_frees > 0 && !thread_error,
+		"Trimmed the depot");
+}
+
+static
+void test_errors(void)
+{
+	errno = 0;
+	ok(rseq_percpu_cache_create(CAPACITY, 0, test_alloc, test_free, NULL) == NULL &&
+			errno == EINVAL &&
+		rseq_percpu_cache_create(CAPACITY, CAPACITY + 1, test_alloc, test_free, NULL) == NULL &&
+			errno == EINVAL &&
+		rseq_percpu_cache_create(CAPACITY, BATCH, NULL, test_free, NULL) == NULL &&
+			errno == EINVAL,
+		"Invalid arguments fail with EINVAL");
+}
+
+static
+void test_percpu_cache(void)
+{
+	cache = rseq_percpu_cache_create(CAPACITY, BATCH, test_alloc, test_free, &cache);
+	if (!cache) {
+		fail("rseq_percpu_cache_create(...) failed(%d): %s", errno, strerror(errno));
+		skip(NR_TESTS - 2, "Per-CPU object cache unavailable");
+		return;
+	}
+	pass("Created a per-CPU object cache");
+	test_local();
+	test_concurrent();
+	test_errors();
+	ok(rseq_percpu_cache_destroy(cache) == 0 && nr_allocs == nr_frees && !thread_error,
+		"Destroyed the per-CPU object cache, freeing all objects");
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+	test_percpu_cache();
+end:
+	exit(exit_status());
+}
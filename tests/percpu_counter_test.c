@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <rseq/percpu-counter.h>
+
+#include "tap.h"
+
+#define NR_TESTS 6
+
+#define NR_THREADS	8
+#define NR_REPS		100000
+
+enum {
+	COUNTER_EVENTS,
+	COUNTER_BYTES,
+	COUNTER_FREE,
+	NR_COUNTERS,
+};
+
+static struct rseq_percpu_counter_group *group;
+
+static
+void *test_counter_thread(void *arg __attribute__((unused)))
+{
+	long i;
+
+	if (rseq_register_current_thread())
+		abort();
+	for (i = 0; i < NR_REPS; i++) {
+		rseq_percpu_counter_inc(group, COUNTER_EVENTS);
+		rseq_percpu_counter_add(group, COUNTER_BYTES, 64);
+		rseq_percpu_counter_add(group, COUNTER_FREE, -1);
+	}
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+static int64_t difftimespec_ns(const struct timespec after, const struct timespec before)
+{
+	return ((after.tv_sec - before.tv_sec) * 1000000000LL)
+		+ after.tv_nsec - before.tv_nsec;
+}
+
+static
+void test_concurrent(void)
+{
+	pthread_t threads[NR_THREADS];
+	struct timespec t1, t2;
+	int i, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < NR_THREADS; i++) {
+		ret = pthread_create(&threads[i], NULL, test_counter_thread, NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			abort();
+		}
+	}
+	for (i = 0; i < NR_THREADS; i++) {
+		ret = pthread_join(threads[i], NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_join");
+			abort();
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	ok(rseq_percpu_counter_read(group, COUNTER_EVENTS) == NR_THREADS * NR_REPS &&
+		rseq_percpu_counter_read(group, COUNTER_BYTES) == 64L * NR_THREADS * NR_REPS &&
+		rseq_percpu_counter_read(group, COUNTER_FREE) == -(intptr_t) NR_THREADS * NR_REPS,
+		"Concurrent updates are summed exactly (%.2f ns per update)",
+		(double) difftimespec_ns(t2, t1) / (3.0 * NR_THREADS * NR_REPS));
+}
+
+static
+void test_approx(void)
+{
+	struct rseq_percpu_counter_group *fresh;
+	intptr_t events = rseq_percpu_counter_read(group, COUNTER_EVENTS);
+	uint64_t now = 1000;
+	int ok = 1;
+
+	/* The first read refreshes the cached sums, which then go stale. */
+	if (rseq_percpu_counter_read_approx(group, COUNTER_EVENTS, now) != events)
+		ok = 0;
+	rseq_percpu_counter_inc(group, COUNTER_EVENTS);
+	if (rseq_percpu_counter_read_approx(group, COUNTER_EVENTS, now + 1) != events ||
+			rseq_percpu_counter_read(group, COUNTER_EVENTS) != events + 1)
+		ok = 0;
+	/* Past the refresh interval, the cached sums are refreshed. */
+	now += group->refresh_interval_ns;
+	if (rseq_percpu_counter_read_approx(group, COUNTER_EVENTS, now) != events + 1)
+		ok = 0;
+	/* Without refresh interval, the approximate read is exact. */
+	fresh = rseq_percpu_counter_group_create(1, 0);
+	if (!fresh)
+		abort();
+	rseq_percpu_counter_add(fresh, 0, 3);
+	if (rseq_percpu_counter_read_approx(fresh, 0, 0) != 3)
+		ok = 0;
+	rseq_percpu_counter_add(fresh, 0, 4);
+	if (rseq_percpu_counter_read_approx(fresh, 0, 0) != 7)
+		ok = 0;
+	if (rseq_percpu_counter_group_destroy(fresh))
+		abort();
+	ok(ok, "Approximate reads return the sums cached for the refresh interval");
+}
+
+static
+void test_errors(void)
+{
+	errno = 0;
+	ok(!rseq_percpu_counter_group_create(0, 0) && errno == EINVAL &&
+		!rseq_percpu_counter_group_create(RSEQ_PERCPU_COUNTER_GROUP_MAX + 1, 0) &&
+		errno == EINVAL,
+		"Invalid group sizes fail with EINVAL");
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+	/* Refresh the cached sums at most once per hour. */
+	group = rseq_percpu_counter_group_create(NR_COUNTERS, 3600000000000ULL);
+	if (!group) {
+		fail("rseq_percpu_counter_group_create(...) failed(%d): %s",
+			errno, strerror(errno));
+		goto end;
+	}
+	pass("Created a counter group");
+	test_concurrent();
+	test_approx();
+	test_errors();
+	ok(rseq_percpu_counter_group_destroy(group) == 0, "Destroyed the counter group");
+end:
+	exit(exit_status());
+}
@@ -0,0 +1,276 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/percpu-hash.h>
+
+#include "tap.h"
+
+#define NR_TESTS 9
+
+#define NR_THREADS		8
+#define NR_NODES_PER_THREAD	1000
+#define NR_NODES		(NR_THREADS * NR_NODES_PER_THREAD)
+
+static struct rseq_percpu_hash_node nodes[NR_NODES + 5];
+static struct rseq_percpu_hash *hash;
+static int node_cpus[NR_NODES];
+static int thread_error;
+
+struct count_priv {
+	long count;
+	uintptr_t key_sum;
+};
+
+static
+int count_node(struct rseq_percpu_hash_node *node, int cpu, void *priv)
+{
+	struct count_priv *count_priv = (struct count_priv *) priv;
+
+	node_cpus[node->key] = cpu;
+	count_priv->count++;
+	count_priv->key_sum += node->key;
+	return 0;
+}
+
+static
+void count_nodes(struct count_priv *priv)
+{
+	memset(priv, 0, sizeof(*priv));
+	if (rseq_percpu_hash_for_each(hash, count_node, priv))
+		abort();
+}
+
+/*
+ * Insert keys into the shard of the current CPU, look them up wherever
+ * the thread migrated, and delete every other key.
+ */
+static
+void *test_hash_thread(void *arg)
+{
+	uintptr_t first = (uintptr_t) arg, key;
+	struct rseq_percpu_hash_node *node;
+	int cpu;
+
+	if (rseq_register_current_thread())
+		abort();
+	for (key = first; key < first + NR_NODES_PER_THREAD; key++) {
+		if (rseq_percpu_hash_insert(hash, &nodes[key], key) < 0)
+			thread_error = 1;
+	}
+	for (key = first; key < first + NR_NODES_PER_THREAD; key++) {
+		if (rseq_percpu_hash_lookup_global(hash, key, &node, &cpu) || node != &nodes[key])
+			thread_error = 1;
+		if (key & 1) {
+			if (rseq_percpu_hash_delete_cpu(hash, cpu, key, &node) || node != &nodes[key])
+				thread_error = 1;
+		}
+	}
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+/* Pin the thread on its current CPU to stay on the same shard. */
+static
+void test_local(void)
+{
+	cpu_set_t saved_mask, mask;
+	int cpu, lookup_cpu = -1, ok = 1;
+
+	if (sched_getaffinity(0, sizeof(saved_mask), &saved_mask))
+		abort();
+	cpu = (int) rseq_current_cpu();
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	if (sched_setaffinity(0, sizeof(mask), &mask))
+		abort();
+	if (rseq_percpu_hash_insert(hash, &nodes[NR_NODES], 42) != cpu ||
+			rseq_percpu_hash_insert(hash, &nodes[NR_NODES + 1], 43) != cpu)
+		ok = 0;
+	errno = 0;
+	if (rseq_percpu_hash_insert(hash, &nodes[NR_NODES + 2], 42) != -1 || errno != EEXIST)
+		ok = 0;
+	if (rseq_percpu_hash_lookup(hash, 42, &lookup_cpu) != &nodes[NR_NODES] ||
+			lookup_cpu != cpu ||
+			rseq_percpu_hash_lookup(hash, 44, NULL) != NULL)
+		ok = 0;
+	if (rseq_percpu_hash_delete(hash, 42) != &nodes[NR_NODES] ||
+			rseq_percpu_hash_lookup(hash, 42, NULL) != NULL ||
+			rseq_percpu_hash_delete(hash, 42) != NULL)
+		ok = 0;
+	if (rseq_percpu_hash_delete(hash, 43) != &nodes[NR_NODES + 1])
+		ok = 0;
+	if (sched_setaffinity(0, sizeof(saved_mask), &saved_mask))
+		abort();
+	ok(ok, "Insert, lookup and delete on the current CPU");
+}
+
+static
+void test_concurrent(void)
+{
+	pthread_t threads[NR_THREADS];
+	struct count_priv priv;
+	uintptr_t expected_sum = 0, key;
+	int i, ret, ok = 1;
+
+	for (i = 0; i < NR_THREADS; i++) {
+		ret = pthread_create(&threads[i], NULL, test_hash_thread,
+				(void *) (uintptr_t) (i * NR_NODES_PER_THREAD));
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			abort();
+		}
+	}
+	for (i = 0; i < NR_THREADS; i++) {
+		ret = pthread_join(threads[i], NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_join");
+			abort();
+		}
+	}
+	for (key = 0; key < NR_NODES; key += 2)
+		expected_sum += key;
+	count_nodes(&priv);
+	ok(!thread_error && priv.count == NR_NODES / 2 && priv.key_sum == expected_sum,
+		"Concurrent local inserts, global lookups and remote deletes");
+
+	/* Delete the remaining keys from the shards they were found in. */
+	for (key = 0; key < NR_NODES; key += 2) {
+		struct rseq_percpu_hash_node *node;
+
+		if (rseq_percpu_hash_delete_cpu(hash, node_cpus[key], key, &node) ||
+				node != &nodes[key])
+			ok = 0;
+	}
+	count_nodes(&priv);
+	ok(ok && priv.count == 0, "Iterated over and deleted the nodes of all shards");
+}
+
+/* Pin the current thread on @cpu. */
+static
+void pin_cpu(int cpu)
+{
+	cpu_set_t mask;
+
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	if (sched_setaffinity(0, sizeof(mask), &mask))
+		abort();
+}
+
+/*
+ * Look up keys missing from all shards, then keys inserted in the
+ * shards of two other CPUs, which are searched under a single fence.
+ */
+static
+void test_global(void)
+{
+	struct rseq_percpu_hash_node *node = &nodes[0];
+	cpu_set_t saved_mask;
+	int cpus[3], nr_cpus = 0, cpu = -1, i, ok = 1;
+
+	ok(rseq_percpu_hash_lookup_global(hash, 45, &node, NULL) == 0 && node == NULL,
+		"Global lookup of a missing key");
+
+	if (sched_getaffinity(0, sizeof(saved_mask), &saved_mask))
+		abort();
+	for (i = 0; i < CPU_SETSIZE && nr_cpus < 3; i++) {
+		if (CPU_ISSET(i, &saved_mask))
+			cpus[nr_cpus++] = i;
+	}
+	if (nr_cpus < 3) {
+		skip(1, "Global lookup across shards requires 3 CPUs");
+		return;
+	}
+	pin_cpu(cpus[0]);
+	if (rseq_percpu_hash_insert(hash, &nodes[NR_NODES + 3], 46) != cpus[0])
+		ok = 0;
+	pin_cpu(cpus[1]);
+	if (rseq_percpu_hash_insert(hash, &nodes[NR_NODES + 4], 47) != cpus[1])
+		ok = 0;
+	pin_cpu(cpus[2]);
+	if (rseq_percpu_hash_lookup_global(hash, 46, &node, &cpu) ||
+			node != &nodes[NR_NODES + 3] || cpu != cpus[0])
+		ok = 0;
+	if (rseq_percpu_hash_lookup_global(hash, 47, &node, &cpu) ||
+			node != &nodes[NR_NODES + 4] || cpu != cpus[1])
+		ok = 0;
+	if (rseq_percpu_hash_lookup_global(hash, 48, &node, &cpu) || node != NULL)
+		ok = 0;
+	if (rseq_percpu_hash_delete_cpu(hash, cpus[0], 46, &node) ||
+			rseq_percpu_hash_delete_cpu(hash, cpus[1], 47, &node))
+		ok = 0;
+	if (sched_setaffinity(0, sizeof(saved_mask), &saved_mask))
+		abort();
+	ok(ok, "Global lookup across the shards of other CPUs");
+}
+
+static
+void test_errors(void)
+{
+	struct rseq_percpu_hash_node *node;
+
+	errno = 0;
+	ok(rseq_percpu_hash_create(0) == NULL && errno == EINVAL &&
+		rseq_percpu_hash_lookup_cpu(hash, -1, 0, &node) == -1 && errno == EINVAL &&
+		rseq_percpu_hash_delete_cpu(hash, hash->max_nr_cpus, 0, &node) == -1 &&
+			errno == EINVAL,
+		"Invalid arguments fail with EINVAL");
+}
+
+static
+void test_percpu_hash(void)
+{
+	struct rseq_percpu_hash_node *node;
+
+	hash = rseq_percpu_hash_create(1000);
+	if (!hash) {
+		fail("rseq_percpu_hash_create(...) failed(%d): %s", errno, strerror(errno));
+		skip(NR_TESTS - 2, "Per-CPU hash map unavailable");
+		return;
+	}
+	pass("Created a per-CPU hash map");
+	if (rseq_percpu_hash_lookup_cpu(hash, 0, 0, &node)) {
+		skip(NR_TESTS - 3, "Remote operations unavailable: %s", strerror(errno));
+		goto destroy;
+	}
+	test_local();
+	test_concurrent();
+	test_global();
+	test_errors();
+destroy:
+	ok(rseq_percpu_hash_destroy(hash) == 0, "Destroyed the per-CPU hash map");
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+	test_percpu_hash();
+end:
+	exit(exit_status());
+}
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/percpu-histogram.h>
+
+#include "tap.h"
+
+#define NR_TESTS 6
+
+#define NR_THREADS	8
+#define NR_VALUES	10000
+
+static struct rseq_percpu_histogram *histogram;
+static struct rseq_percpu_histogram_snapshot snapshot, merged;
+
+static
+void *test_record_thread(void *arg __attribute__((unused)))
+{
+	uint64_t i;
+
+	if (rseq_register_current_thread())
+		abort();
+	for (i = 1; i <= NR_VALUES; i++)
+		rseq_percpu_histogram_record(histogram, i);
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+static
+int check_bucket(uint64_t value, unsigned int *prev_index)
+{
+	unsigned int index = rseq_percpu_histogram_bucket_index(value);
+	uint64_t lowest = rseq_percpu_histogram_bucket_lowest(index),
+		highest = rseq_percpu_histogram_bucket_highest(index);
+
+	if (index >= RSEQ_PERCPU_HISTOGRAM_NR_BUCKETS || index < *prev_index)
+		return 0;
+	*prev_index = index;
+	if (value < lowest || value > highest)
+		return 0;
+	/* Bounded relative error. */
+	return (highest - lowest) <= lowest / RSEQ_PERCPU_HISTOGRAM_SUB_BUCKETS;
+}
+
+static
+void test_buckets(void)
+{
+	unsigned int prev_index = 0, order;
+	int ok = 1;
+	uint64_t v;
+
+	for (v = 0; v < 4096; v++)
+		ok &= check_bucket(v, &prev_index);
+	for (order = 12; order < 64; order++) {
+		ok &= check_bucket((1ULL << order) - 1, &prev_index);
+		ok &= check_bucket(1ULL << order, &prev_index);
+		ok &= check_bucket((1ULL << order) + 1, &prev_index);
+	}
+	ok &= check_bucket(UINT64_MAX, &prev_index);
+	ok &= prev_index == RSEQ_PERCPU_HISTOGRAM_NR_BUCKETS - 1;
+	ok(ok, "Log-linear buckets cover all values with bounded relative error");
+}
+
+static
+void test_record(void)
+{
+	pthread_t threads[NR_THREADS];
+	uint64_t p50, p99;
+	int i, ret;
+
+	for (i = 0; i < NR_THREADS; i++) {
+		ret = pthread_create(&threads[i], NULL, test_record_thread, NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			abort();
+		}
+	}
+	for (i = 0; i < NR_THREADS; i++) {
+		ret = pthread_join(threads[i], NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_join");
+			abort();
+		}
+	}
+	rseq_percpu_histogram_read(histogram, &snapshot);
+	p50 = rseq_percpu_histogram_snapshot_percentile(&snapshot, 50.0);
+	p99 = rseq_percpu_histogram_snapshot_percentile(&snapshot, 99.0);
+	ok(snapshot.count == (uint64_t) NR_THREADS * NR_VALUES &&
+		snapshot.sum == (uint64_t) NR_THREADS * NR_VALUES * (NR_VALUES + 1) / 2 &&
+		p50 >= NR_VALUES / 2 && p50 <= NR_VALUES / 2 + NR_VALUES / 2 / RSEQ_PERCPU_HISTOGRAM_SUB_BUCKETS &&
+		p99 >= NR_VALUES * 99 / 100 &&
+		rseq_percpu_histogram_snapshot_percentile(&snapshot, 100.0) >= NR_VALUES,
+		"Concurrent records are reduced exactly (p50 %" PRIu64 ", p99 %" PRIu64 ")",
+		p50, p99);
+}
+
+static
+void test_merge(void)
+{
+	unsigned int i;
+	int ok = 1;
+
+	memset(&merged, 0, sizeof(merged));
+	rseq_percpu_histogram_snapshot_merge(&merged, &snapshot);
+	rseq_percpu_histogram_snapshot_merge(&merged, &snapshot);
+	for (i = 0; i < RSEQ_PERCPU_HISTOGRAM_NR_BUCKETS; i++)
+		ok &= merged.buckets[i] == 2 * snapshot.buckets[i];
+	ok(ok && merged.count == 2 * snapshot.count && merged.sum == 2 * snapshot.sum &&
+		rseq_percpu_histogram_snapshot_percentile(&merged, 50.0) ==
+			rseq_percpu_histogram_snapshot_percentile(&snapshot, 50.0),
+		"Merged snapshots add their buckets");
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+	histogram = rseq_percpu_histogram_create();
+	if (!histogram) {
+		fail("rseq_percpu_histogram_create(...) failed(%d): %s",
+			errno, strerror(errno));
+		goto end;
+	}
+	pass("Created a per-CPU histogram");
+	test_buckets();
+	test_record();
+	test_merge();
+	ok(rseq_percpu_histogram_destroy(histogram) == 0, "Destroyed the per-CPU histogram");
+end:
+	exit(exit_status());
+}
@@ -0,0 +1,359 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+/*
+ * Per-CPU list scaling benchmark.
+ *
+ * Measure the throughput of pop/push pairs on a rseq per-CPU list, a
+ * mutex-protected stack and a lock-free compare-and-swap stack for an
+ * increasing number of threads. The throughput is measured without
+ * recording anything, and only the threads using the rseq per-CPU list
+ * register with rseq. A separate run then records the mean latency of
+ * the pairs of each batch into a per-CPU histogram.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <rseq/percpu-histogram.h>
+#include <rseq/percpu-list.h>
+#include "tap.h"
+
+#define NR_LOOPS		1000000
+#define NR_LATENCY_LOOPS	100000
+#define BATCH_LOOPS		1000
+#define NR_NODES_PER_THREAD	16
+#define MAX_THREADS		8
+
+static const int nr_threads[] = { 1, 2, 4, 8 };
+
+#define ARRAY_SIZE(arr)	(sizeof(arr) / sizeof((arr)[0]))
+
+#define NR_TESTS	(3 * ARRAY_SIZE(nr_threads))
+
+#define NR_NODES	(MAX_THREADS * NR_NODES_PER_THREAD)
+
+enum stack_type {
+	STACK_PERCPU_LIST,
+	STACK_MUTEX,
+	STACK_CAS,
+};
+
+/* Indexed by enum stack_type. */
+static const char *stack_names[] = {
+	"rseq per-cpu list",
+	"mutex stack",
+	"cas stack",
+};
+
+/*
+ * Nodes are shared by the three stacks. The CAS stack links nodes by
+ * index, and tags its head with a generation count to prevent ABA.
+ */
+struct node {
+	struct rseq_percpu_list_node list_node;
+	struct node *next;
+	uint32_t next_index;
+};
+
+#define CAS_NIL		UINT32_MAX
+
+struct thread_arg {
+	enum stack_type type;
+	int record;		/* Record batch latencies into the histogram. */
+};
+
+static struct node nodes[NR_NODES];
+
+static pthread_mutex_t mutex_stack_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct node *mutex_stack_head;
+
+/* Low 32 bits: index of the first node. High 32 bits: generation. */
+static uint64_t cas_stack_head;
+
+static
+void mutex_stack_push(struct node *node)
+{
+	pthread_mutex_lock(&mutex_stack_lock);
+	node->next = mutex_stack_head;
+	mutex_stack_head = node;
+	pthread_mutex_unlock(&mutex_stack_lock);
+}
+
+static
+struct node *mutex_stack_pop(void)
+{
+	struct node *node;
+
+	pthread_mutex_lock(&mutex_stack_lock);
+	node = mutex_stack_head;
+	if (node)
+		mutex_stack_head = node->next;
+	pthread_mutex_unlock(&mutex_stack_lock);
+	return node;
+}
+
+static
+void cas_stack_push(struct node *node)
+{
+	uint64_t old = __atomic_load_n(&cas_stack_head, __ATOMIC_RELAXED), new_head;
+
+	do {
+		node->next_index = (uint32_t) old;
+		new_head = ((old >> 32) + 1) << 32 | (uint32_t) (node - nodes);
+	} while (!__atomic_compare_exchange_n(&cas_stack_head, &old, new_head, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static
+struct node *cas_stack_pop(void)
+{
+	uint64_t old = __atomic_load_n(&cas_stack_head, __ATOMIC_ACQUIRE), new_head;
+	uint32_t index;
+
+	do {
+		index = (uint32_t) old;
+		if (index == CAS_NIL)
+			return NULL;
+		new_head = ((old >> 32) + 1) << 32 |
+			__atomic_load_n(&nodes[index].next_index, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&cas_stack_head, &old, new_head, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	return &nodes[index];
+}
+
+#ifdef rseq_arch_has_load_cbne_load_cbeq_store_add_load_store
+
+static struct rseq_percpu_list *list;
+static struct rseq_percpu_histogram *histogram;
+
+static int64_t difftimespec_ns(const struct timespec after, const struct timespec before)
+{
+	return ((after.tv_sec - before.tv_sec) * 1000000000LL)
+		+ after.tv_nsec - before.tv_nsec;
+}
+
+/* Pop and push a node once. */
+static
+void pop_push(enum stack_type type)
+{
+	switch (type) {
+	case STACK_PERCPU_LIST:
+	{
+		struct rseq_percpu_list_node *node;
+
+		node = rseq_percpu_list_pop(list, NULL);
+		if (node)
+			rseq_percpu_list_push(list, node);
+		break;
+	}
+	case STACK_MUTEX:
+	{
+		struct node *node = mutex_stack_pop();
+
+		if (node)
+			mutex_stack_push(node);
+		break;
+	}
+	case STACK_CAS:
+	{
+		struct node *node = cas_stack_pop();
+
+		if (node)
+			cas_stack_push(node);
+		break;
+	}
+	}
+}
+
+static
+void *benchmark_thread(void *arg)
+{
+	struct thread_arg *thread_arg = (struct thread_arg *) arg;
+	enum stack_type type = thread_arg->type;
+	struct timespec batch_start, now;
+	int registered;
+	long i;
+
+	/* The histogram and the per-CPU list need rseq, the baselines do not. */
+	registered = thread_arg->record || type == STACK_PERCPU_LIST;
+	if (registered && rseq_register_current_thread())
+		abort();
+	if (!thread_arg->record) {
+		for (i = 0; i < NR_LOOPS; i++)
+			pop_push(type);
+		goto end;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &batch_start);
+	for (i = 0; i < NR_LATENCY_LOOPS; i++) {
+		if (i && !(i % BATCH_LOOPS)) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			rseq_percpu_histogram_record(histogram,
+				(uint64_t) difftimespec_ns(now, batch_start));
+			batch_start = now;
+		}
+		pop_push(type);
+	}
+end:
+	if (registered && rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+static
+void run_threads(struct thread_arg *arg, int nr)
+{
+	pthread_t threads[MAX_THREADS];
+	int i, ret;
+
+	for (i = 0; i < nr; i++) {
+		ret = pthread_create(&threads[i], NULL, benchmark_thread, arg);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			abort();
+		}
+	}
+	for (i = 0; i < nr; i++) {
+		ret = pthread_join(threads[i], NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_join");
+			abort();
+		}
+	}
+}
+
+/* Count the nodes left in the stack, emptying it. */
+static
+int drain(enum stack_type type)
+{
+	struct rseq_percpu_list_node *first;
+	int count = 0, cpu;
+
+	switch (type) {
+	case STACK_PERCPU_LIST:
+		for (cpu = 0; cpu < list->max_nr_cpus; cpu++) {
+			if (rseq_percpu_list_pop_all(list, cpu, &first))
+				return -1;
+			for (; first; first = first->next)
+				count++;
+		}
+		break;
+	case STACK_MUTEX:
+		while (mutex_stack_pop())
+			count++;
+		break;
+	case STACK_CAS:
+		while (cas_stack_pop())
+			count++;
+		break;
+	}
+	return count;
+}
+
+static
+void benchmark(enum stack_type type, int nr)
+{
+	static struct rseq_percpu_histogram_snapshot snapshot;
+	struct thread_arg arg;
+	struct timespec t1, t2;
+	int64_t ns;
+	int i;
+
+	histogram = rseq_percpu_histogram_create();
+	if (!histogram)
+		abort();
+
+	/* Each thread pushes nodes on the list of its CPU. */
+	for (i = 0; i < nr * NR_NODES_PER_THREAD; i++) {
+		switch (type) {
+		case STACK_PERCPU_LIST:
+			rseq_percpu_list_push(list, &nodes[i].list_node);
+			break;
+		case STACK_MUTEX:
+			mutex_stack_push(&nodes[i]);
+			break;
+		case STACK_CAS:
+			cas_stack_push(&nodes[i]);
+			break;
+		}
+	}
+	arg.type = type;
+	arg.record = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	run_threads(&arg, nr);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	ns = difftimespec_ns(t2, t1);
+	arg.record = 1;
+	run_threads(&arg, nr);
+	rseq_percpu_histogram_read(histogram, &snapshot);
+	/* Batch latencies are in ns per BATCH_LOOPS pairs. */
+	ok(drain(type) == nr * NR_NODES_PER_THREAD,
+		"%-17s %d thread(s): %.2f ns per pop/push pair, %.2f Mpairs/s, "
+		"p50 %.2f ns, p99 %.2f ns of %d-pair batch means",
+		stack_names[type], nr, (double) ns / NR_LOOPS,
+		(double) nr * NR_LOOPS * 1000.0 / (double) ns,
+		(double) rseq_percpu_histogram_snapshot_percentile(&snapshot, 50.0) / BATCH_LOOPS,
+		(double) rseq_percpu_histogram_snapshot_percentile(&snapshot, 99.0) / BATCH_LOOPS,
+		BATCH_LOOPS);
+	if (rseq_percpu_histogram_destroy(histogram))
+		abort();
+}
+
+int main(void)
+{
+	size_t i;
+	struct rseq_percpu_list_node *first;
+
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+	if (rseq_register_current_thread()) {
+		skip(NR_TESTS, "rseq_register_current_thread(...) failed(%d): %s",
+			errno, strerror(errno));
+		goto end;
+	}
+	list = rseq_percpu_list_create();
+	if (!list)
+		abort();
+	if (rseq_percpu_list_pop_all(list, 0, &first)) {
+		skip(NR_TESTS, "Remote operations unavailable: %s", strerror(errno));
+		goto unregister;
+	}
+	cas_stack_head = CAS_NIL;
+	for (i = 0; i < ARRAY_SIZE(nr_threads); i++) {
+		benchmark(STACK_PERCPU_LIST, nr_threads[i]);
+		benchmark(STACK_MUTEX, nr_threads[i]);
+		benchmark(STACK_CAS, nr_threads[i]);
+	}
+unregister:
+	if (rseq_percpu_list_destroy(list))
+		abort();
+	if (rseq_unregister_current_thread())
+		abort();
+end:
+	exit(exit_status());
+}
+
+#else
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+	skip(NR_TESTS, "Per-CPU list unavailable on this architecture");
+	exit(exit_status());
+}
+
+#endif
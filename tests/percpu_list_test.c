@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <rseq/percpu-list.h>
+
+#include "tap.h"
+
+#define NR_TESTS 6
+
+#define NR_THREADS	8
+#define NR_NODES	(NR_THREADS * 16)
+#define NR_REPS		20000
+#define NR_DRAINS	200
+
+#ifdef rseq_arch_has_load_cbne_load_cbeq_store_add_load_store
+
+struct test_node {
+	struct rseq_percpu_list_node node;
+	intptr_t data;
+};
+
+static struct test_node nodes[NR_NODES];
+static struct rseq_percpu_list *list;
+static volatile int drain_stop;
+
+static
+struct test_node *to_test_node(struct rseq_percpu_list_node *node)
+{
+	return (struct test_node *) ((char *) node - offsetof(struct test_node, node));
+}
+
+/* Count the nodes of all CPU lists, detaching them with pop_all. */
+static
+int drain_all(struct rseq_percpu_list_node **chain, intptr_t *sum)
+{
+	int cpu, count = 0;
+
+	*chain = NULL;
+	*sum = 0;
+	for (cpu = 0; cpu < list->max_nr_cpus; cpu++) {
+		struct rseq_percpu_list_node *first, *node;
+
+		if (rseq_percpu_list_pop_all(list, cpu, &first))
+			return -1;
+		while ((node = first) != NULL) {
+			first = node->next;
+			node->next = *chain;
+			*chain = node;
+			*sum += to_test_node(node)->data;
+			count++;
+		}
+	}
+	return count;
+}
+
+static
+void *test_list_thread(void *arg __attribute__((unused)))
+{
+	long i;
+
+	if (rseq_register_current_thread())
+		abort();
+	for (i = 0; i < NR_REPS; i++) {
+		struct rseq_percpu_list_node *node;
+
+		node = rseq_percpu_list_pop(list, NULL);
+		if (node)
+			rseq_percpu_list_push(list, node);
+		rseq_barrier();
+	}
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+/*
+ * Move the nodes between CPU lists with remote pops while the other
+ * threads push and pop on their current CPU.
+ */
+static
+void *test_drain_thread(void *arg __attribute__((unused)))
+{
+	int cpu = 0;
+
+	if (rseq_register_current_thread())
+		abort();
+	while (!RSEQ_READ_ONCE(drain_stop)) {
+		struct rseq_percpu_list_node *first, *last;
+
+		if (rseq_percpu_list_pop_all(list, cpu, &first))
+			abort();
+		if (first) {
+			for (last = first; last->next; last = last->next)
+				;
+			rseq_percpu_list_splice(list, first, last);
+		}
+		if (rseq_percpu_list_pop_cpu(list, cpu, &first))
+			abort();
+		if (first)
+			rseq_percpu_list_push(list, first);
+		if (++cpu >= list->max_nr_cpus)
+			cpu = 0;
+		sched_yield();
+	}
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+/* Pin the thread on its current CPU to observe the LIFO order. */
+static
+void test_local(void)
+{
+	struct rseq_percpu_list_node *node, *chain;
+	cpu_set_t saved_mask, mask;
+	int cpu, popped_cpu, ok = 1;
+	intptr_t sum;
+
+	if (sched_getaffinity(0, sizeof(saved_mask), &saved_mask))
+		abort();
+	cpu = (int) rseq_current_cpu();
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	if (sched_setaffinity(0, sizeof(mask), &mask))
+		abort();
+	if (rseq_percpu_list_push(list, &nodes[0].node) != cpu)
+		ok = 0;
+	nodes[2].node.next = &nodes[1].node;
+	if (rseq_percpu_list_splice(list, &nodes[2].node, &nodes[1].node) != cpu)
+		ok = 0;
+	if (rseq_percpu_list_pop(list, &popped_cpu) != &nodes[2].node || popped_cpu != cpu)
+		ok = 0;
+	if (rseq_percpu_list_pop_cpu(list, cpu, &node) || node != &nodes[1].node)
+		ok = 0;
+	if (rseq_percpu_list_pop(list, NULL) != &nodes[0].node)
+		ok = 0;
+	if (rseq_percpu_list_pop(list, NULL) != NULL)
+		ok = 0;
+	rseq_percpu_list_push(list, &nodes[3].node);
+	if (drain_all(&chain, &sum) != 1 || chain != &nodes[3].node)
+		ok = 0;
+	if (rseq_percpu_list_pop(list, NULL) != NULL)
+		ok = 0;
+	if (sched_setaffinity(0, sizeof(saved_mask), &saved_mask))
+		abort();
+	ok(ok, "Push, splice and pop on the current CPU, pop from a given CPU");
+}
+
+static
+void test_concurrent(void)
+{
+	pthread_t test_threads[NR_THREADS], drain_thread;
+	struct rseq_percpu_list_node *chain;
+	intptr_t sum, expected_sum = 0;
+	int i, ret;
+
+	for (i = 0; i < NR_NODES; i++) {
+		nodes[i].data = i;
+		expected_sum += i;
+		rseq_percpu_list_push(list, &nodes[i].node);
+	}
+	drain_stop = 0;
+	for (i = 0; i < NR_THREADS; i++) {
+		ret = pthread_create(&test_threads[i], NULL, test_list_thread, NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			abort();
+		}
+	}
+	ret = pthread_create(&drain_thread, NULL, test_drain_thread, NULL);
+	if (ret) {
+		errno = ret;
+		perror("pthread_create");
+		abort();
+	}
+	for (i = 0; i < NR_THREADS; i++) {
+		ret = pthread_join(test_threads[i], NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_join");
+			abort();
+		}
+	}
+	RSEQ_WRITE_ONCE(drain_stop, 1);
+	ret = pthread_join(drain_thread, NULL);
+	if (ret) {
+		errno = ret;
+		perror("pthread_join");
+		abort();
+	}
+	ok(drain_all(&chain, &sum) == NR_NODES && sum == expected_sum,
+		"Concurrent local and remote operations preserve all nodes");
+}
+
+static
+void test_errors(void)
+{
+	struct rseq_percpu_list_node *node;
+
+	errno = 0;
+	ok(rseq_percpu_list_pop_cpu(list, -1, &node) == -1 && errno == EINVAL &&
+		rseq_percpu_list_pop_all(list, list->max_nr_cpus, &node) == -1 && errno == EINVAL,
+		"Remote operations on an invalid cpu fail with EINVAL");
+}
+
+static
+void test_percpu_list(void)
+{
+	struct rseq_percpu_list_node *node;
+
+	list = rseq_percpu_list_create();
+	if (!list) {
+		fail("rseq_percpu_list_create(...) failed(%d): %s", errno, strerror(errno));
+		skip(NR_TESTS - 2, "Per-CPU list unavailable");
+		return;
+	}
+	pass("Created a per-CPU list");
+	if (rseq_percpu_list_pop_all(list, 0, &node)) {
+		skip(NR_TESTS - 3, "Remote operations unavailable: %s", strerror(errno));
+		goto destroy;
+	}
+	test_local();
+	test_concurrent();
+	test_errors();
+destroy:
+	ok(rseq_percpu_list_destroy(list) == 0, "Destroyed the per-CPU list");
+}
+
+#else
+
+static
+void test_percpu_list(void)
+{
+	skip(NR_TESTS - 1, "Per-CPU list unavailable on this architecture");
+}
+
+#endif
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+	test_percpu_list();
+end:
+	exit(exit_status());
+}
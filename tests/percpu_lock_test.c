@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <rseq/percpu-lock.h>
+
+#include "tap.h"
+
+#define NR_TESTS 7
+
+#define NR_THREADS	8
+#define NR_REPS		20000
+#define NR_REMOTE_REPS	200
+#define NR_WRITES	200
+
+struct percpu_count {
+	intptr_t count;
+} __attribute__((aligned(128)));
+
+static struct percpu_count counts[CPU_SETSIZE];
+static struct rseq_percpu_mutex *mutex;
+
+/* Configuration protected by the big reader lock. */
+static struct rseq_percpu_brlock brlock;
+static intptr_t config_a, config_b;
+static volatile int writer_done;
+static int read_error;
+
+static
+void *test_mutex_thread(void *arg __attribute__((unused)))
+{
+	long i;
+
+	if (rseq_register_current_thread())
+		abort();
+	for (i = 0; i < NR_REPS; i++) {
+		int cpu = rseq_percpu_mutex_lock(mutex);
+
+		counts[cpu].count++;
+		rseq_percpu_mutex_unlock(mutex, cpu);
+	}
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+/* Increment the counts of all CPUs with remote lock operations. */
+static
+void *test_remote_thread(void *arg __attribute__((unused)))
+{
+	long i;
+
+	for (i = 0; i < NR_REMOTE_REPS; i++) {
+		int cpu = (int) (i % mutex->max_nr_cpus);
+
+		if (rseq_percpu_mutex_lock_cpu(mutex, cpu))
+			abort();
+		counts[cpu].count++;
+		rseq_percpu_mutex_unlock(mutex, cpu);
+		if (rseq_percpu_mutex_lock_all(mutex))
+			abort();
+		counts[0].count++;
+		rseq_percpu_mutex_unlock_all(mutex);
+	}
+	return NULL;
+}
+
+static
+void *test_reader_thread(void *arg __attribute__((unused)))
+{
+	if (rseq_register_current_thread())
+		abort();
+	while (!RSEQ_READ_ONCE(writer_done)) {
+		int cpu = rseq_percpu_brlock_read_lock(&brlock);
+
+		if (RSEQ_READ_ONCE(config_a) != RSEQ_READ_ONCE(config_b))
+			read_error = 1;
+		rseq_percpu_brlock_read_unlock(&brlock, cpu);
+	}
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+static
+void *test_writer_thread(void *arg __attribute__((unused)))
+{
+	long i;
+
+	for (i = 0; i < NR_WRITES; i++) {
+		if (rseq_percpu_brlock_write_lock(&brlock))
+			abort();
+		RSEQ_WRITE_ONCE(config_a, config_a + 1);
+		sched_yield();
+		RSEQ_WRITE_ONCE(config_b, config_b + 1);
+		rseq_percpu_brlock_write_unlock(&brlock);
+	}
+	RSEQ_WRITE_ONCE(writer_done, 1);
+	return NULL;
+}
+
+static
+void create_thread(pthread_t *thread, void *(*fct)(void *))
+{
+	int ret;
+
+	ret = pthread_create(thread, NULL, fct, NULL);
+	if (ret) {
+		errno = ret;
+		perror("pthread_create");
+		abort();
+	}
+}
+
+static
+void join_thread(pthread_t thread)
+{
+	int ret;
+
+	ret = pthread_join(thread, NULL);
+	if (ret) {
+		errno = ret;
+		perror("pthread_join");
+		abort();
+	}
+}
+
+static
+void test_mutex(void)
+{
+	pthread_t threads[NR_THREADS], remote_thread;
+	intptr_t sum = 0;
+	int i;
+
+	for (i = 0; i < NR_THREADS; i++)
+		create_thread(&threads[i], test_mutex_thread);
+	create_thread(&remote_thread, test_remote_thread);
+	for (i = 0; i < NR_THREADS; i++)
+		join_thread(threads[i]);
+	join_thread(remote_thread);
+	for (i = 0; i < CPU_SETSIZE; i++)
+		sum += counts[i].count;
+	ok(sum == (intptr_t) NR_THREADS * NR_REPS + 2 * NR_REMOTE_REPS,
+		"Local and remote mutex lock operations are mutually exclusive (%ld)",
+		(long) sum);
+}
+
+/* Readers on the same CPU do not exclude each other. */
+static
+void test_brlock_nested(void)
+{
+	int cpu1, cpu2, ret;
+
+	cpu1 = rseq_percpu_brlock_read_lock(&brlock);
+	cpu2 = rseq_percpu_brlock_read_lock(&brlock);
+	rseq_percpu_brlock_read_unlock(&brlock, cpu2);
+	rseq_percpu_brlock_read_unlock(&brlock, cpu1);
+	ret = rseq_percpu_brlock_write_lock(&brlock);
+	if (!ret)
+		rseq_percpu_brlock_write_unlock(&brlock);
+	ok(ret == 0, "Big reader lock readers nest, then a writer acquires it");
+}
+
+static
+void test_brlock(void)
+{
+	pthread_t threads[NR_THREADS], writer_thread;
+	int i;
+
+	if (rseq_percpu_brlock_create(&brlock)) {
+		fail("rseq_percpu_brlock_create(...) failed(%d): %s", errno, strerror(errno));
+		return;
+	}
+	test_brlock_nested();
+	writer_done = 0;
+	for (i = 0; i < NR_THREADS; i++)
+		create_thread(&threads[i], test_reader_thread);
+	create_thread(&writer_thread, test_writer_thread);
+	join_thread(writer_thread);
+	for (i = 0; i < NR_THREADS; i++)
+		join_thread(threads[i]);
+	ok(!read_error && config_a == NR_WRITES && config_b == NR_WRITES &&
+		!rseq_percpu_brlock_destroy(&brlock),
+		"Big reader lock readers observe consistent writes");
+}
+
+static
+void test_errors(void)
+{
+	errno = 0;
+	ok(rseq_percpu_mutex_lock_cpu(mutex, -1) == -1 && errno == EINVAL &&
+		rseq_percpu_mutex_lock_cpu(mutex, mutex->max_nr_cpus) == -1 && errno == EINVAL,
+		"Remote lock of an invalid cpu fails with EINVAL");
+}
+
+static
+void test_percpu_lock(void)
+{
+	mutex = rseq_percpu_mutex_create();
+	if (!mutex) {
+		fail("rseq_percpu_mutex_create(...) failed(%d): %s", errno, strerror(errno));
+		skip(NR_TESTS - 2, "Per-CPU mutex unavailable");
+		return;
+	}
+	pass("Created a per-CPU mutex");
+	if (rseq_percpu_mutex_lock_cpu(mutex, 0)) {
+		skip(NR_TESTS - 3, "Remote operations unavailable: %s", strerror(errno));
+		goto destroy;
+	}
+	rseq_percpu_mutex_unlock(mutex, 0);
+	test_mutex();
+	test_brlock();
+	test_errors();
+destroy:
+	ok(rseq_percpu_mutex_destroy(mutex) == 0, "Destroyed the per-CPU mutex");
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+	test_percpu_lock();
+end:
+	exit(exit_status());
+}
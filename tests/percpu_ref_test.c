@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/percpu-ref.h>
+
+#include "tap.h"
+
+#define NR_TESTS 6
+
+#define NR_THREADS	8
+#define NR_REPS		200000
+
+static struct rseq_percpu_ref ref;
+static int nr_released, release_error, nr_started;
+
+static
+void test_release(struct rseq_percpu_ref *released_ref)
+{
+	if (released_ref != &ref)
+		release_error = 1;
+	__atomic_add_fetch(&nr_released, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Get and put references across the switch to atomic mode, holding one
+ * reference for the whole run.
+ */
+static
+void *test_ref_thread(void *arg __attribute__((unused)))
+{
+	long i;
+
+	if (rseq_register_current_thread())
+		abort();
+	rseq_percpu_ref_get(&ref);
+	__atomic_add_fetch(&nr_started, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < NR_REPS; i++) {
+		if (!rseq_percpu_ref_tryget(&ref))
+			release_error = 1;
+		rseq_percpu_ref_get(&ref);
+		rseq_percpu_ref_put(&ref);
+		if (__atomic_load_n(&nr_released, __ATOMIC_RELAXED))
+			release_error = 1;
+		rseq_percpu_ref_put(&ref);
+	}
+	rseq_percpu_ref_put(&ref);
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+static
+void test_kill(void)
+{
+	pthread_t threads[NR_THREADS];
+	int i, ret, kill_ret;
+
+	for (i = 0; i < NR_THREADS; i++) {
+		ret = pthread_create(&threads[i], NULL, test_ref_thread, NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			abort();
+		}
+	}
+	while (__atomic_load_n(&nr_started, __ATOMIC_RELAXED) < NR_THREADS)
+		sched_yield();
+	kill_ret = rseq_percpu_ref_kill(&ref);
+	for (i = 0; i < NR_THREADS; i++) {
+		ret = pthread_join(threads[i], NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_join");
+			abort();
+		}
+	}
+	ok(kill_ret == 0 && !release_error && nr_released == 1,
+		"Killed while in use, released once after the last put");
+	ok(!rseq_percpu_ref_tryget(&ref), "Cannot get a reference after release");
+	errno = 0;
+	ok(rseq_percpu_ref_kill(&ref) == -1 && errno == EINVAL, "Cannot kill twice");
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+	if (rseq_percpu_ref_init(&ref, test_release)) {
+		fail("rseq_percpu_ref_init(...) failed(%d): %s", errno, strerror(errno));
+		goto end;
+	}
+	pass("Initialized a per-CPU reference counter");
+	test_kill();
+	ok(rseq_percpu_ref_exit(&ref) == 0, "Freed the per-CPU reference counter");
+end:
+	exit(exit_status());
+}
@@ -0,0 +1,307 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <rseq/percpu-ring.h>
+
+#include "tap.h"
+
+#define NR_TESTS 6
+
+#define NR_PRODUCERS	4
+#define NR_CONSUMERS	4
+#define NR_REPS		20000
+#define BATCH		7
+#define CAPACITY	64
+
+/* Entry size which is not a multiple of the word size. */
+struct test_entry {
+	uint32_t producer;
+	uint32_t seq;
+	uint32_t check;
+};
+
+static struct rseq_percpu_ring *ring;
+static volatile int producers_done;
+
+/* Sum of the sequence numbers dequeued, and number of entries. */
+static uint64_t consumed_sum, consumed_count;
+static int consume_error;
+
+static
+void consume(const struct test_entry *entries, size_t nr)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		if (entries[i].check != (entries[i].producer ^ entries[i].seq))
+			__atomic_store_n(&consume_error, 1, __ATOMIC_RELAXED);
+		sum += entries[i].seq;
+	}
+	__atomic_add_fetch(&consumed_sum, sum, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&consumed_count, nr, __ATOMIC_RELAXED);
+}
+
+static
+int drain_all(void)
+{
+	struct test_entry entries[CAPACITY];
+	ssize_t n;
+	int cpu;
+
+	for (cpu = 0; cpu < ring->max_nr_cpus; cpu++) {
+		n = rseq_percpu_ring_drain_cpu(ring, cpu, entries, CAPACITY);
+		if (n < 0)
+			return -1;
+		consume(entries, (size_t) n);
+	}
+	return 0;
+}
+
+static
+void *test_producer_thread(void *arg)
+{
+	uint32_t producer = (uint32_t) (uintptr_t) arg, seq = 0;
+	long i;
+
+	if (rseq_register_current_thread())
+		abort();
+	for (i = 0; i < NR_REPS; i++) {
+		struct test_entry entries[BATCH];
+		size_t j, done = 0;
+
+		for (j = 0; j < BATCH; j++) {
+			entries[j].producer = producer;
+			entries[j].seq = seq + (uint32_t) j;
+			entries[j].check = producer ^ entries[j].seq;
+		}
+		/* Wait for the consumers when the ring is full. */
+		while (done < BATCH) {
+			done += rseq_percpu_ring_enqueue(ring, &entries[done], BATCH - done, NULL);
+			if (done < BATCH)
+				sched_yield();
+		}
+		seq += BATCH;
+	}
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+static
+void *test_consumer_thread(void *arg __attribute__((unused)))
+{
+	if (rseq_register_current_thread())
+		abort();
+	while (!RSEQ_READ_ONCE(producers_done)) {
+		struct test_entry entries[BATCH];
+		size_t n;
+
+		n = rseq_percpu_ring_dequeue(ring, entries, BATCH, NULL);
+		consume(entries, n);
+		if (!n)
+			sched_yield();
+	}
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+/* External consumer draining the rings of all CPUs. */
+static
+void *test_drain_thread(void *arg __attribute__((unused)))
+{
+	while (!RSEQ_READ_ONCE(producers_done)) {
+		if (drain_all())
+			abort();
+		sched_yield();
+	}
+	return NULL;
+}
+
+/* Pin the thread on its current CPU to observe the FIFO order. */
+static
+void test_local(void)
+{
+	struct test_entry in[2 * CAPACITY], out[2 * CAPACITY];
+	cpu_set_t saved_mask, mask;
+	int cpu, op_cpu = -1, ok = 1;
+	uint32_t i;
+
+	for (i = 0; i < 2 * CAPACITY; i++) {
+		in[i].producer = 0;
+		in[i].seq = i;
+		in[i].check = i;
+	}
+	if (sched_getaffinity(0, sizeof(saved_mask), &saved_mask))
+		abort();
+	cpu = (int) rseq_current_cpu();
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	if (sched_setaffinity(0, sizeof(mask), &mask))
+		abort();
+	/* Move the head and tail close to the end of the ring. */
+	if (rseq_percpu_ring_enqueue(ring, in, CAPACITY - 3, &op_cpu) != CAPACITY - 3 ||
+			op_cpu != cpu)
+		ok = 0;
+	if (rseq_percpu_ring_dequeue(ring, out, CAPACITY - 3, &op_cpu) != CAPACITY - 3 ||
+			op_cpu != cpu || memcmp(in, out, (CAPACITY - 3) * sizeof(in[0])))
+		ok = 0;
+	/* Wrap around, fill the ring, then dequeue in FIFO order. */
+	if (rseq_percpu_ring_enqueue(ring, in, 5, NULL) != 5 ||
+			rseq_percpu_ring_enqueue(ring, &in[5], 2 * CAPACITY - 5, NULL) != CAPACITY - 5)
+		ok = 0;
+	if (rseq_percpu_ring_enqueue(ring, in, 1, NULL) != 0)
+		ok = 0;
+	memset(out, 0, sizeof(out));
+	if (rseq_percpu_ring_dequeue(ring, out, 2, NULL) != 2 ||
+			rseq_percpu_ring_dequeue(ring, &out[2], 2 * CAPACITY, NULL) != CAPACITY - 2 ||
+			memcmp(in, out, CAPACITY * sizeof(in[0])))
+		ok = 0;
+	if (rseq_percpu_ring_dequeue(ring, out, 1, NULL) != 0)
+		ok = 0;
+	/* Remote drain of the ring of the current CPU. */
+	memset(out, 0, sizeof(out));
+	if (rseq_percpu_ring_enqueue(ring, in, 3, NULL) != 3 ||
+			rseq_percpu_ring_drain_cpu(ring, cpu, out, 2) != 2 ||
+			rseq_percpu_ring_drain_cpu(ring, cpu, &out[2], CAPACITY) != 1 ||
+			memcmp(in, out, 3 * sizeof(in[0])))
+		ok = 0;
+	if (sched_setaffinity(0, sizeof(saved_mask), &saved_mask))
+		abort();
+	ok(ok, "Batch enqueue, dequeue and drain on the current CPU");
+}
+
+static
+void test_concurrent(void)
+{
+	pthread_t producers[NR_PRODUCERS], consumers[NR_CONSUMERS], drain_thread;
+	uint64_t expected_sum;
+	int i, ret;
+
+	consumed_sum = 0;
+	consumed_count = 0;
+	producers_done = 0;
+	for (i = 0; i < NR_PRODUCERS; i++) {
+		ret = pthread_create(&producers[i], NULL, test_producer_thread,
+				(void *) (uintptr_t) i);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			abort();
+		}
+	}
+	for (i = 0; i < NR_CONSUMERS; i++) {
+		ret = pthread_create(&consumers[i], NULL, test_consumer_thread, NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			abort();
+		}
+	}
+	ret = pthread_create(&drain_thread, NULL, test_drain_thread, NULL);
+	if (ret) {
+		errno = ret;
+		perror("pthread_create");
+		abort();
+	}
+	for (i = 0; i < NR_PRODUCERS; i++) {
+		ret = pthread_join(producers[i], NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_join");
+			abort();
+		}
+	}
+	RSEQ_WRITE_ONCE(producers_done, 1);
+	for (i = 0; i < NR_CONSUMERS; i++) {
+		ret = pthread_join(consumers[i], NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_join");
+			abort();
+		}
+	}
+	ret = pthread_join(drain_thread, NULL);
+	if (ret) {
+		errno = ret;
+		perror("pthread_join");
+		abort();
+	}
+	if (drain_all())
+		abort();
+	expected_sum = (uint64_t) NR_PRODUCERS * ((uint64_t) NR_REPS * BATCH) *
+		((uint64_t) NR_REPS * BATCH - 1) / 2;
+	ok(!consume_error && consumed_count == (uint64_t) NR_PRODUCERS * NR_REPS * BATCH &&
+		consumed_sum == expected_sum,
+		"Concurrent producers, consumers and drain preserve all entries");
+}
+
+static
+void test_errors(void)
+{
+	struct test_entry entry;
+
+	errno = 0;
+	ok(rseq_percpu_ring_drain_cpu(ring, -1, &entry, 1) == -1 && errno == EINVAL &&
+		rseq_percpu_ring_drain_cpu(ring, ring->max_nr_cpus, &entry, 1) == -1 &&
+		errno == EINVAL &&
+		!rseq_percpu_ring_create(0, CAPACITY) && errno == EINVAL &&
+		!rseq_percpu_ring_create(sizeof(entry), 0) && errno == EINVAL,
+		"Invalid arguments fail with EINVAL");
+}
+
+static
+void test_percpu_ring(void)
+{
+	struct test_entry entry;
+
+	ring = rseq_percpu_ring_create(sizeof(struct test_entry), CAPACITY - 1);
+	if (!ring) {
+		fail("rseq_percpu_ring_create(...) failed(%d): %s", errno, strerror(errno));
+		skip(NR_TESTS - 2, "Per-CPU ring unavailable");
+		return;
+	}
+	ok(ring->capacity == CAPACITY, "Created a per-CPU ring");
+	if (rseq_percpu_ring_drain_cpu(ring, 0, &entry, 1)) {
+		skip(NR_TESTS - 3, "Remote operations unavailable: %s", strerror(errno));
+		goto destroy;
+	}
+	test_local();
+	test_concurrent();
+	test_errors();
+destroy:
+	ok(rseq_percpu_ring_destroy(ring) == 0, "Destroyed the per-CPU ring");
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+	test_percpu_ring();
+end:
+	exit(exit_status());
+}
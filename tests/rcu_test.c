@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rseq/rseq.h>
+#include <rseq/rcu.h>
+
+#include "tap.h"
+
+#define NR_TESTS 6
+
+#define NR_READERS	4
+#define NR_UPDATES	2000
+
+/*
+ * Readers increment the counter of their CPU in the published object,
+ * within a rseq critical section. Reclaiming an object sums its
+ * counters, then poisons them: an increment after the reclamation is
+ * lost from the total.
+ */
+struct test_object {
+	struct rseq_rcu_head rcu;
+	intptr_t *counts;
+	intptr_t slots[];	/* Address of the counter of each CPU. */
+};
+
+static struct test_object *published;
+static long nr_cpus;
+static intptr_t reclaimed_total, nr_reclaimed;
+static volatile int test_stop;
+static int nr_started;
+
+static
+struct test_object *test_object_create(void)
+{
+	struct test_object *object;
+	long cpu;
+
+	object = (struct test_object *) calloc(1, sizeof(*object) + nr_cpus * sizeof(intptr_t));
+	if (!object)
+		abort();
+	object->counts = (intptr_t *) calloc(nr_cpus, sizeof(*object->counts));
+	if (!object->counts)
+		abort();
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		object->slots[cpu] = (intptr_t) &object->counts[cpu];
+	return object;
+}
+
+static
+void test_object_reclaim(struct rseq_rcu_head *head)
+{
+	struct test_object *object = (struct test_object *)
+		((char *) head - offsetof(struct test_object, rcu));
+	long cpu;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		reclaimed_total += object->counts[cpu];
+		object->counts[cpu] = INTPTR_MIN / 2;
+	}
+	nr_reclaimed++;
+}
+
+#ifdef rseq_arch_has_load_add_load_load_add_store
+
+static
+void *test_reader_thread(void *arg)
+{
+	intptr_t *nr_reads = (intptr_t *) arg;
+
+	if (rseq_register_current_thread())
+		abort();
+	__atomic_add_fetch(&nr_started, 1, __ATOMIC_RELAXED);
+	while (!RSEQ_READ_ONCE(test_stop)) {
+		int cpu = (int) rseq_current_cpu();
+
+		/* Load the published object and increment its counter. */
+		if (!rseq_load_add_load_load_add_store__ptr(RSEQ_MO_RELAXED,
+				RSEQ_PERCPU_CPU_ID, (intptr_t *) &published,
+				(long) (offsetof(struct test_object, slots) + cpu * sizeof(intptr_t)),
+				1, cpu))
+			(*nr_reads)++;
+	}
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+#endif
+
+static
+void test_rcu_call(void)
+{
+#ifdef rseq_arch_has_load_add_load_load_add_store
+	pthread_t readers[NR_READERS];
+	intptr_t nr_reads[NR_READERS] = { 0 }, total = 0;
+	struct test_object *object;
+	int i, ret, failed = 0;
+
+	published = test_object_create();
+	test_stop = 0;
+	for (i = 0; i < NR_READERS; i++) {
+		ret = pthread_create(&readers[i], NULL, test_reader_thread, &nr_reads[i]);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			abort();
+		}
+	}
+	/* Update while all the readers are running. */
+	while (__atomic_load_n(&nr_started, __ATOMIC_RELAXED) < NR_READERS)
+		sched_yield();
+	for (i = 0; i < NR_UPDATES; i++) {
+		object = published;
+		__atomic_store_n(&published, test_object_create(), __ATOMIC_RELEASE);
+		if (rseq_rcu_call(&object->rcu, test_object_reclaim))
+			failed = 1;
+	}
+	RSEQ_WRITE_ONCE(test_stop, 1);
+	for (i = 0; i < NR_READERS; i++) {
+		ret = pthread_join(readers[i], NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_join");
+			abort();
+		}
+		total += nr_reads[i];
+	}
+	object = published;
+	published = NULL;
+	if (rseq_rcu_call(&object->rcu, test_object_reclaim) || rseq_rcu_barrier())
+		failed = 1;
+	ok(!failed && nr_reclaimed == NR_UPDATES + 1 && reclaimed_total == total,
+		"Deferred reclamation waits for the readers (%ld reads)", (long) total);
+#else
+	skip(1, "rseq_load_add_load_load_add_store unavailable on this architecture");
+#endif
+}
+
+int main(void)
+{
+	struct test_object *object;
+
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+	nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (rseq_rcu_synchronize()) {
+		skip(NR_TESTS - 1, "rseq_rcu_synchronize() failed(%d): %s",
+			errno, strerror(errno));
+		goto end;
+	}
+	pass("Waited for a grace period");
+
+	object = test_object_create();
+	ok(rseq_rcu_call(&object->rcu, test_object_reclaim) == 0 && nr_reclaimed == 0,
+		"Queued a deferred callback");
+	ok(rseq_rcu_barrier() == 0 && nr_reclaimed == 1 && rseq_rcu_barrier() == 0,
+		"Invoked the queued callbacks after a grace period");
+
+	/* A callback queued after the delay flushes the batch. */
+	object = test_object_create();
+	ok(rseq_rcu_call(&object->rcu, test_object_reclaim) == 0 && nr_reclaimed == 1 &&
+		!usleep(RSEQ_RCU_DELAY_NS / 1000 + 10000) &&
+		rseq_rcu_call(&test_object_create()->rcu, test_object_reclaim) == 0 &&
+		nr_reclaimed == 3,
+		"Queued callbacks older than the delay are invoked");
+	nr_reclaimed = 0;
+	reclaimed_total = 0;
+	test_rcu_call();
+end:
+	exit(exit_status());
+}
@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: 2024 Mathieu Desnoyers <mathieu.desnoyers@efficios.com>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/retry.h>
+
+#include "tap.h"
+
+#define NR_TESTS 5
+
+#define NR_THREADS	16
+#define NR_REPS		10000
+
+struct test_data_entry {
+	intptr_t count;
+} __attribute__((aligned(128)));
+
+static struct test_data_entry counters[CPU_SETSIZE];
+static pthread_mutex_t fallback_lock = PTHREAD_MUTEX_INITIALIZER;
+static intptr_t fallback_count;
+
+static int fallback_add(intptr_t *v, intptr_t count)
+{
+	pthread_mutex_lock(&fallback_lock);
+	*v += count;
+	pthread_mutex_unlock(&fallback_lock);
+	return 0;
+}
+
+static void *test_counter_thread(void *arg __attribute__((unused)))
+{
+	const struct rseq_retry_policy policy = RSEQ_RETRY_POLICY_DEFAULT;
+	int i, cpu;
+
+	if (rseq_register_current_thread())
+		abort();
+	for (i = 0; i < NR_REPS; i++) {
+		if (rseq_retry(&policy, cpu = rseq_cpu_start(),
+				rseq_load_add_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID,
+					&counters[cpu].count, 1, cpu),
+				fallback_add(&fallback_count, 1)))
+			abort();
+	}
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+static void test_counter(void)
+{
+	pthread_t test_threads[NR_THREADS];
+	uint64_t sum;
+	int i;
+
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_create(&test_threads[i], NULL, test_counter_thread, NULL);
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_join(test_threads[i], NULL);
+	sum = fallback_count;
+	for (i = 0; i < CPU_SETSIZE; i++)
+		sum += counters[i].count;
+	ok(sum == (uint64_t) NR_THREADS * NR_REPS,
+		"Retried per-CPU counter sum (%" PRIu64 " == %" PRIu64 ", %ld from fallback)",
+		sum, (uint64_t) NR_THREADS * NR_REPS, (long) fallback_count);
+}
+
+/*
+ * Passing a CPU number which never matches the current CPU makes every
+ * attempt abort.
+ */
+static void test_escalation(void)
+{
+	const struct rseq_retry_policy policy = { 8, 2, 16, 6 };
+	intptr_t v = 0;
+	int attempts = 0, ret;
+
+	ret = rseq_retry(&policy, attempts++,
+			rseq_load_add_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID, &v, 1, -1),
+			fallback_add(&v, 2));
+	ok(ret == 0 && v == 2, "Fallback invoked after repeated aborts");
+	ok(attempts == 8, "Fallback invoked after max_aborts attempts (%d)", attempts);
+}
+
+static void test_ne(void)
+{
+	const struct rseq_retry_policy policy = RSEQ_RETRY_POLICY_DEFAULT;
+	intptr_t v = 1;
+	int attempts = 0, ret, cpu;
+
+	ret = rseq_retry(&policy, (attempts++, cpu = rseq_cpu_start()),
+			rseq_load_cbne_store__ptr(RSEQ_MO_RELAXED, RSEQ_PERCPU_CPU_ID, &v, 0, 2, cpu),
+			fallback_add(&v, 2));
+	ok(ret == 1 && v == 1 && attempts == 1, "Comparison failure is returned without retry");
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available(RSEQ_AVAILABLE_QUERY_KERNEL)) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+
+	test_ne();
+	test_escalation();
+	test_counter();
+end:
+	exit(exit_status());
+}